@@ -0,0 +1,78 @@
+
+// laccをライブラリとして使うためのAPI (liblacc.h)。
+// エラーから戻るためにsetjmpを使うので、extention.cと同じくホストのコンパイラでビルドする。
+// ライブラリではコンパイラの大域変数がスレッドごとにあり (Makefileを参照)、1回のコンパイルの状態は
+// 呼び出したスレッドのものになる。コンパイルの最後にすべて解放するので、次の呼び出しには何も残らない。
+// そのため別々のスレッドからのlacc_compileは、ロックを取らずに並列に実行できる。
+
+#define _DEFAULT_SOURCE
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "liblacc.h"
+
+// SIMDで先読みしても確保した領域に収まるように、ソースの後ろに0を詰める量
+enum { SOURCE_PADDING = 64 };
+
+struct LaccContext {
+  char *error; // 直前のコンパイルのエラーメッセージ
+};
+
+extern __thread jmp_buf *error_jmp;
+extern __thread char error_message[];
+
+char *compile_source(char *name, char *src, int *len);
+void free_global_variables(void);
+
+LaccContext *lacc_new(void) { return calloc(1, sizeof(LaccContext)); }
+
+void lacc_free(LaccContext *ctx) {
+  if (!ctx)
+    return;
+  free(ctx->error);
+  free(ctx);
+}
+
+const char *lacc_error(LaccContext *ctx) { return ctx->error; }
+
+int lacc_compile(LaccContext *ctx, const char *src, int len, char **out_buf) {
+  free(ctx->error);
+  ctx->error = NULL;
+  *out_buf = NULL;
+
+  // トークナイザは入力が32バイト境界単位で読めることを前提にしている
+  size_t size = ((size_t)len + SOURCE_PADDING + 63) / 64 * 64;
+  char *buf;
+  if (posix_memalign((void **)&buf, 64, size)) {
+    ctx->error = strdup("out of memory");
+    return -1;
+  }
+  memcpy(buf, src, len);
+  memset(buf + len, 0, size - len);
+
+  jmp_buf jmp;
+  char *volatile out = NULL;
+  int out_len = 0;
+  if (setjmp(jmp) == 0) {
+    error_jmp = &jmp;
+    out = compile_source("<input>", buf, &out_len);
+  } else {
+    ctx->error = strdup(error_message);
+  }
+  error_jmp = NULL;
+  free_global_variables();
+  free(buf);
+
+  if (!out)
+    return -1;
+  char *result = realloc(out, out_len + 1);
+  if (!result) {
+    free(out);
+    ctx->error = strdup("out of memory");
+    return -1;
+  }
+  result[out_len] = '\0';
+  *out_buf = result;
+  return 0;
+}
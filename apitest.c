@@ -0,0 +1,100 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "liblacc.h"
+
+int failures = 0;
+
+void check(int cond, char *msg) {
+  if (!cond) {
+    printf("FAILED: %s\n", msg);
+    failures++;
+  }
+}
+
+char *good = "int add(int a, int b) { return a + b; }\n"
+             "int main() { return add(2, 3); }\n";
+char *bad = "int main() {\n"
+            "  return 1 +;\n"
+            "}\n";
+
+enum { THREADS = 4 };
+
+// スレッドごとに違うソースをコンパイルし、1つのスレッドでコンパイルした結果と比べる
+char sources[THREADS][512];
+char *expected[THREADS];
+int thread_failures[THREADS];
+
+void *worker(void *arg) {
+  int id = (int)(long)arg;
+  LaccContext *ctx = lacc_new();
+  char *out;
+  for (int i = 0; i < 50; i++) {
+    // 途中でエラーになるコンパイルを混ぜても、ほかのスレッドに影響しない
+    if (i % 10 == id) {
+      if (lacc_compile(ctx, bad, strlen(bad), &out) != -1 || !strstr(lacc_error(ctx), "<input>:2:"))
+        thread_failures[id]++;
+      continue;
+    }
+    if (lacc_compile(ctx, sources[id], strlen(sources[id]), &out) || strcmp(out, expected[id]))
+      thread_failures[id]++;
+    free(out);
+  }
+  lacc_free(ctx);
+  return arg;
+}
+
+int main() {
+  LaccContext *ctx = lacc_new();
+  char *out;
+
+  check(lacc_compile(ctx, good, strlen(good), &out) == 0, "compile");
+  check(out && strstr(out, "main:") != NULL, "main in output");
+  check(lacc_error(ctx) == NULL, "no error");
+  char *first = strdup(out);
+  free(out);
+
+  // エラーがあっても終了せずに戻り、次のコンパイルに影響しない
+  check(lacc_compile(ctx, bad, strlen(bad), &out) == -1, "error is returned");
+  check(out == NULL, "no output on error");
+  check(lacc_error(ctx) && strstr(lacc_error(ctx), "<input>:2:"), "error location");
+
+  check(lacc_compile(ctx, good, strlen(good), &out) == 0, "compile after error");
+  check(out && !strcmp(out, first), "same output after error");
+  free(out);
+  free(first);
+  lacc_free(ctx);
+
+  ctx = lacc_new();
+  for (int i = 0; i < THREADS; i++) {
+    snprintf(sources[i], sizeof(sources[i]),
+             "typedef struct S S;\n"
+             "struct S { int a; char b[%d]; };\n"
+             "int f%d(S *s, int n) {\n"
+             "  int sum = 0;\n"
+             "  for (int i = 0; i < n; i++)\n"
+             "    sum += s[i].a * %d + s[i].b[i %% %d];\n"
+             "  return sum / %d;\n"
+             "}\n"
+             "char *name%d() { return \"thread %d\"; }\n",
+             i + 1, i, i + 3, i + 1, i + 5, i, i);
+    check(lacc_compile(ctx, sources[i], strlen(sources[i]), &expected[i]) == 0, "compile thread source");
+  }
+  lacc_free(ctx);
+
+  pthread_t threads[THREADS];
+  for (int i = 0; i < THREADS; i++)
+    pthread_create(&threads[i], NULL, worker, (void *)(long)i);
+  for (int i = 0; i < THREADS; i++) {
+    pthread_join(threads[i], NULL);
+    check(!thread_failures[i], "parallel compile matches");
+    free(expected[i]);
+  }
+
+  if (failures)
+    return 1;
+  printf("All tests passed\n");
+  return 0;
+}
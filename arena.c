@@ -0,0 +1,72 @@
+
+#include "lacc.h"
+
+extern int TRUE;
+extern int FALSE;
+extern void *NULL;
+
+// 一つのチャンクの標準的な大きさ
+int ARENA_CHUNK_SIZE = 1048576;
+
+Arena *new_arena() {
+  Arena *arena = calloc(1, sizeof(Arena));
+  arena->chunk = NULL;
+  arena->ptr = NULL;
+  arena->end = NULL;
+  return arena;
+}
+
+// 新しいチャンクを確保して現在のチャンクにする
+void arena_grow(Arena *arena, int size) {
+  if (size < ARENA_CHUNK_SIZE)
+    size = ARENA_CHUNK_SIZE;
+  ArenaChunk *chunk = malloc(sizeof(ArenaChunk));
+  chunk->data = calloc(1, size);
+  if (!chunk->data)
+    error("out of memory [in arena_grow]");
+  chunk->prev = arena->chunk;
+  arena->chunk = chunk;
+  arena->ptr = chunk->data;
+  arena->end = chunk->data + size;
+}
+
+// 0で初期化された領域を確保する。
+// 個別に解放することはできず、arena_resetでまとめて解放する。
+void *arena_alloc(Arena *arena, int size) {
+  // 8バイト境界に揃える
+  size = (size + 7) / 8 * 8;
+  if (arena->ptr + size > arena->end)
+    arena_grow(arena, size);
+  char *p = arena->ptr;
+  arena->ptr = arena->ptr + size;
+  return p;
+}
+
+// アリーナから確保した領域をすべて解放する
+void arena_reset(Arena *arena) {
+  ArenaChunk *chunk = arena->chunk;
+  while (chunk) {
+    ArenaChunk *prev = chunk->prev;
+    free(chunk->data);
+    free(chunk);
+    chunk = prev;
+  }
+  arena->chunk = NULL;
+  arena->ptr = NULL;
+  arena->end = NULL;
+}
+
+// 先頭のチャンクだけを残して空にする。残したチャンクの使用済みの部分は0で埋め直す。
+// 関数ごとに使い捨てる領域を、確保し直さずに再利用するためのもの。
+void arena_rewind(Arena *arena) {
+  ArenaChunk *chunk = arena->chunk;
+  if (!chunk)
+    return;
+  // チャンクが2つ以上あれば使用済みの範囲が分からないので、すべて解放する
+  if (chunk->prev) {
+    arena_reset(arena);
+    return;
+  }
+  memset(chunk->data, 0, arena->ptr - chunk->data);
+  arena->ptr = chunk->data;
+}
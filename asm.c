@@ -0,0 +1,751 @@
+
+#include "lacc.h"
+
+extern Arena *symbol_arena;
+
+extern int TRUE;
+extern int FALSE;
+extern void *NULL;
+
+// 再配置の種類 (ELFの定義と同じ値)
+int R_X86_64_64 = 1;
+int R_X86_64_PC32 = 2;
+int R_X86_64_PLT32 = 4;
+
+// アセンブルの結果。セクションの番号はSectionKindで引く。
+ByteBuf *asm_sections[4];
+int asm_align[4];
+AsmSymbol *asm_symbols;
+AsmReloc *asm_relocs;
+
+HashMap *asm_symbol_table;
+HashMap *insn_table;
+int asm_section;
+ByteBuf *asm_buf;
+AsmSymbol *asm_last_func;
+AsmOperand *asm_operands[3];
+int asm_operand_cnt;
+// TRUEならコード生成はアセンブリを書かずに、命令を直接機械語にする
+int asm_direct;
+
+ByteBuf *new_byte_buf() {
+  ByteBuf *buf = calloc(1, sizeof(ByteBuf));
+  buf->cap = 256;
+  buf->len = 0;
+  buf->data = malloc(buf->cap);
+  return buf;
+}
+
+void buf_reserve(ByteBuf *buf, int len) {
+  if (buf->len + len > buf->cap) {
+    buf->cap = (buf->len + len) * 2;
+    buf->data = realloc(buf->data, buf->cap);
+    if (!buf->data)
+      error("out of memory [in buf_reserve]");
+  }
+}
+
+void buf_byte(ByteBuf *buf, int val) {
+  buf_reserve(buf, 1);
+  buf->data[buf->len++] = val & 255;
+}
+
+// 整数はリトルエンディアンで書く
+void buf_int16(ByteBuf *buf, int val) {
+  buf_byte(buf, val);
+  buf_byte(buf, val >> 8);
+}
+
+void buf_int32(ByteBuf *buf, int val) {
+  buf_byte(buf, val);
+  buf_byte(buf, val >> 8);
+  buf_byte(buf, val >> 16);
+  buf_byte(buf, val >> 24);
+}
+
+// 32bitの値を符号拡張して64bitで書く
+void buf_int64(ByteBuf *buf, int val) {
+  buf_int32(buf, val);
+  if (val < 0) {
+    buf_int32(buf, -1);
+  } else {
+    buf_int32(buf, 0);
+  }
+}
+
+void buf_mem(ByteBuf *buf, char *s, int len) {
+  buf_reserve(buf, len);
+  memcpy(buf->data + buf->len, s, len);
+  buf->len += len;
+}
+
+void buf_align(ByteBuf *buf, int align, int fill) {
+  while (buf->len % align)
+    buf_byte(buf, fill);
+}
+
+// 指定位置の32bit値を書き換える
+void buf_patch32(ByteBuf *buf, int offset, int val) {
+  buf->data[offset] = val & 255;
+  buf->data[offset + 1] = (val >> 8) & 255;
+  buf->data[offset + 2] = (val >> 16) & 255;
+  buf->data[offset + 3] = (val >> 24) & 255;
+}
+
+void add_insn(char *name, InsnKind kind, int code, int code2) {
+  AsmInsn *insn = arena_alloc(symbol_arena, sizeof(AsmInsn));
+  insn->kind = kind;
+  insn->code = code;
+  insn->code2 = code2;
+  hashmap_put(insn_table, intern(name, strlen(name)), insn);
+}
+
+// 条件コードを使う命令 (jcc, setcc, cmovcc) をまとめて登録する
+void add_cc_insns(char *cc, int code) {
+  char name[16];
+  int len = strlen(cc);
+  char *prefixes = "j\0\0\0\0set\0\0cmov\0";
+  InsnKind kinds[3] = {0, 0, 0};
+  kinds[0] = INSN_JCC;
+  kinds[1] = INSN_SETCC;
+  kinds[2] = INSN_CMOVCC;
+  for (int i = 0; i < 3; i++) {
+    char *prefix = prefixes + i * 5;
+    int plen = strlen(prefix);
+    // 命令名は表に残るので、アリーナに作る
+    char *buf = arena_alloc(symbol_arena, plen + len + 1);
+    memcpy(buf, prefix, plen);
+    memcpy(buf + plen, cc, len + 1);
+    add_insn(buf, kinds[i], code, 0);
+  }
+}
+
+void init_asm() {
+  insn_table = new_hashmap(256);
+
+  // オペランドを取らない命令 (2バイト目がなければ-1)
+  add_insn("ret", INSN_FIXED, 195, -1);
+  add_insn("leave", INSN_FIXED, 201, -1);
+  add_insn("nop", INSN_FIXED, 144, -1);
+  add_insn("cdq", INSN_FIXED, 153, -1);
+  add_insn("cqo", INSN_FIXED, 72, 153);
+  add_insn("cdqe", INSN_FIXED, 72, 152);
+
+  add_insn("mov", INSN_MOV, 0, 0);
+  add_insn("movzx", INSN_MOVX, 182, 0);
+  add_insn("movsx", INSN_MOVX, 190, 0);
+  add_insn("movsxd", INSN_MOVSXD, 99, 0);
+  add_insn("lea", INSN_LEA, 141, 0);
+  add_insn("push", INSN_PUSH, 80, 0);
+  add_insn("pop", INSN_POP, 88, 0);
+
+  // 算術演算は /digit で区別する
+  add_insn("add", INSN_ALU, 0, 0);
+  add_insn("or", INSN_ALU, 1, 0);
+  add_insn("adc", INSN_ALU, 2, 0);
+  add_insn("sbb", INSN_ALU, 3, 0);
+  add_insn("and", INSN_ALU, 4, 0);
+  add_insn("sub", INSN_ALU, 5, 0);
+  add_insn("xor", INSN_ALU, 6, 0);
+  add_insn("cmp", INSN_ALU, 7, 0);
+  add_insn("test", INSN_TEST, 0, 0);
+  add_insn("imul", INSN_IMUL, 5, 0);
+  add_insn("not", INSN_UNARY, 2, 0);
+  add_insn("neg", INSN_UNARY, 3, 0);
+  add_insn("mul", INSN_UNARY, 4, 0);
+  add_insn("div", INSN_UNARY, 6, 0);
+  add_insn("idiv", INSN_UNARY, 7, 0);
+  add_insn("rol", INSN_SHIFT, 0, 0);
+  add_insn("ror", INSN_SHIFT, 1, 0);
+  add_insn("shl", INSN_SHIFT, 4, 0);
+  add_insn("sal", INSN_SHIFT, 4, 0);
+  add_insn("shr", INSN_SHIFT, 5, 0);
+  add_insn("sar", INSN_SHIFT, 7, 0);
+  add_insn("jmp", INSN_JMP, 233, 0);
+  add_insn("call", INSN_CALL, 232, 0);
+
+  add_cc_insns("o", 0);
+  add_cc_insns("no", 1);
+  add_cc_insns("b", 2);
+  add_cc_insns("c", 2);
+  add_cc_insns("nae", 2);
+  add_cc_insns("ae", 3);
+  add_cc_insns("nb", 3);
+  add_cc_insns("nc", 3);
+  add_cc_insns("e", 4);
+  add_cc_insns("z", 4);
+  add_cc_insns("ne", 5);
+  add_cc_insns("nz", 5);
+  add_cc_insns("be", 6);
+  add_cc_insns("na", 6);
+  add_cc_insns("a", 7);
+  add_cc_insns("nbe", 7);
+  add_cc_insns("s", 8);
+  add_cc_insns("ns", 9);
+  add_cc_insns("p", 10);
+  add_cc_insns("np", 11);
+  add_cc_insns("l", 12);
+  add_cc_insns("nge", 12);
+  add_cc_insns("ge", 13);
+  add_cc_insns("nl", 13);
+  add_cc_insns("le", 14);
+  add_cc_insns("ng", 14);
+  add_cc_insns("g", 15);
+  add_cc_insns("nle", 15);
+
+  for (int i = 0; i < 3; i++)
+    asm_operands[i] = calloc(1, sizeof(AsmOperand));
+}
+
+AsmSymbol *get_symbol(char *name, int len) {
+  Ident *ident = intern_copy(name, len);
+  AsmSymbol *sym = hashmap_get(asm_symbol_table, ident);
+  if (!sym) {
+    sym = arena_alloc(symbol_arena, sizeof(AsmSymbol));
+    sym->ident = ident;
+    sym->section = SEC_NONE;
+    sym->offset = 0;
+    sym->global = FALSE;
+    sym->size = 0;
+    sym->index = 0;
+    sym->next = asm_symbols;
+    asm_symbols = sym;
+    hashmap_put(asm_symbol_table, ident, sym);
+  }
+  return sym;
+}
+
+// 名前のない局所的なラベルを作る (基本ブロックの先頭など)。
+// シンボルテーブルには出力しないので、asm_symbolsには加えない。
+AsmSymbol *new_label() {
+  AsmSymbol *sym = arena_alloc(symbol_arena, sizeof(AsmSymbol));
+  sym->section = SEC_NONE;
+  return sym;
+}
+
+// 現在の位置にsymへの参照を記録する
+void add_reloc(AsmSymbol *sym, int type, int addend) {
+  AsmReloc *rel = arena_alloc(symbol_arena, sizeof(AsmReloc));
+  rel->section = asm_section;
+  rel->offset = asm_buf->len;
+  rel->sym = sym;
+  rel->type = type;
+  rel->addend = addend;
+  rel->next = asm_relocs;
+  asm_relocs = rel;
+}
+
+//
+// 命令の符号化
+//
+
+// 8bitレジスタのspl, bpl, sil, dilはREXプレフィックスがないと指定できない
+int needs_rex8(AsmOperand *op) { return op->kind == OPD_REG && op->size == 1 && op->reg >= 4 && op->reg < 8; }
+
+int fits_int8(int val) { return -128 <= val && val <= 127; }
+
+// [66] [REX] opcode ModRM [SIB] [disp] の順に出力する。
+// opcodeが255より大きければ0Fから始まる2バイトのオペコード。
+// regはModRMのregフィールド (レジスタ番号か /digit)。
+// imm_sizeはこの後に続く即値のバイト数で、RIP相対の変位の計算に使う。
+void encode_modrm(int opcode, int reg, AsmOperand *rm, int size, int imm_size, int force_rex) {
+  int rex = 0;
+  if (size == 2)
+    buf_byte(asm_buf, 102);
+  if (size == 8)
+    rex = rex + 8;
+  if (reg >= 8)
+    rex = rex + 4;
+  if (rm->kind == OPD_MEM && rm->index >= 8)
+    rex = rex + 2;
+  if (rm->kind == OPD_REG && rm->reg >= 8)
+    rex = rex + 1;
+  if (rm->kind == OPD_MEM && rm->base >= 8)
+    rex = rex + 1;
+  if (rex || force_rex || needs_rex8(rm))
+    buf_byte(asm_buf, 64 + rex);
+  if (opcode > 255)
+    buf_byte(asm_buf, 15);
+  buf_byte(asm_buf, opcode & 255);
+
+  reg = reg & 7;
+  if (rm->kind == OPD_REG) {
+    buf_byte(asm_buf, 192 + reg * 8 + (rm->reg & 7));
+    return;
+  }
+  if (rm->kind != OPD_MEM)
+    error("invalid operand [in encode_modrm]");
+
+  if (rm->rip) {
+    buf_byte(asm_buf, reg * 8 + 5);
+    if (rm->sym) {
+      add_reloc(rm->sym, R_X86_64_PC32, rm->disp - 4 - imm_size);
+      buf_int32(asm_buf, 0);
+    } else {
+      buf_int32(asm_buf, rm->disp);
+    }
+    return;
+  }
+
+  int mod;
+  if (rm->base < 0) {
+    // ベースレジスタがない場合は disp32 を使う
+    mod = 0;
+  } else if (rm->disp == 0 && (rm->base & 7) != 5) {
+    mod = 0;
+  } else if (fits_int8(rm->disp)) {
+    mod = 1;
+  } else {
+    mod = 2;
+  }
+
+  if (rm->index < 0 && rm->base >= 0 && (rm->base & 7) != 4) {
+    buf_byte(asm_buf, mod * 64 + reg * 8 + (rm->base & 7));
+  } else {
+    // SIBバイトを使う
+    buf_byte(asm_buf, mod * 64 + reg * 8 + 4);
+    int scale = 0;
+    if (rm->scale == 2) {
+      scale = 1;
+    } else if (rm->scale == 4) {
+      scale = 2;
+    } else if (rm->scale == 8) {
+      scale = 3;
+    }
+    int index = 4;
+    if (rm->index >= 0)
+      index = rm->index & 7;
+    int base = 5;
+    if (rm->base >= 0)
+      base = rm->base & 7;
+    buf_byte(asm_buf, scale * 64 + index * 8 + base);
+  }
+
+  if (rm->base < 0 || mod == 2) {
+    buf_int32(asm_buf, rm->disp);
+  } else if (mod == 1) {
+    buf_byte(asm_buf, rm->disp);
+  }
+}
+
+void encode_imm(int val, int size) {
+  if (size == 1) {
+    buf_byte(asm_buf, val);
+  } else if (size == 2) {
+    buf_int16(asm_buf, val);
+  } else {
+    buf_int32(asm_buf, val);
+  }
+}
+
+// 即値の大きさ (64bitの演算でも即値は32bit)
+int imm_size_of(int size) {
+  if (size == 8)
+    return 4;
+  return size;
+}
+
+// オペランドの大きさを決める。レジスタがあればその大きさ、なければPTRの指定に従う。
+int operand_size(AsmOperand *dst, AsmOperand *src) {
+  if (dst->kind == OPD_REG)
+    return dst->size;
+  if (src && src->kind == OPD_REG)
+    return src->size;
+  if (dst->size)
+    return dst->size;
+  error("operand size is not specified [in assemble]");
+  return 0;
+}
+
+// ジャンプ命令の飛び先を書く。飛び先は後で解決する。
+void encode_rel32(AsmOperand *target, int type) {
+  if (target->kind != OPD_LABEL)
+    error("expected a label [in assemble]");
+  add_reloc(target->sym, type, -4);
+  buf_int32(asm_buf, 0);
+}
+
+void encode_insn(AsmInsn *insn, char *name) {
+  InsnKind kind = insn->kind;
+  int n = asm_operand_cnt;
+  AsmOperand *a = asm_operands[0];
+  AsmOperand *b = asm_operands[1];
+  AsmOperand *c = asm_operands[2];
+  int size;
+
+  if (kind == INSN_FIXED) {
+    buf_byte(asm_buf, insn->code);
+    if (insn->code2 >= 0)
+      buf_byte(asm_buf, insn->code2);
+    return;
+  }
+
+  if (kind == INSN_JMP || kind == INSN_CALL) {
+    if (n != 1)
+      error("invalid operands: %s [in assemble]", name);
+    if (a->kind == OPD_LABEL) {
+      buf_byte(asm_buf, insn->code);
+      if (kind == INSN_CALL) {
+        encode_rel32(a, R_X86_64_PLT32);
+      } else {
+        encode_rel32(a, R_X86_64_PC32);
+      }
+    } else if (kind == INSN_CALL) {
+      encode_modrm(255, 2, a, 4, 0, FALSE);
+    } else {
+      encode_modrm(255, 4, a, 4, 0, FALSE);
+    }
+    return;
+  }
+
+  if (kind == INSN_JCC) {
+    buf_byte(asm_buf, 15);
+    buf_byte(asm_buf, 128 + insn->code);
+    encode_rel32(a, R_X86_64_PC32);
+    return;
+  }
+
+  if (kind == INSN_PUSH || kind == INSN_POP) {
+    if (a->kind == OPD_REG) {
+      if (a->reg >= 8)
+        buf_byte(asm_buf, 65);
+      buf_byte(asm_buf, insn->code + (a->reg & 7));
+    } else if (a->kind == OPD_IMM && kind == INSN_PUSH) {
+      if (fits_int8(a->imm)) {
+        buf_byte(asm_buf, 106);
+        buf_byte(asm_buf, a->imm);
+      } else {
+        buf_byte(asm_buf, 104);
+        buf_int32(asm_buf, a->imm);
+      }
+    } else if (kind == INSN_PUSH) {
+      encode_modrm(255, 6, a, 4, 0, FALSE);
+    } else {
+      encode_modrm(143, 0, a, 4, 0, FALSE);
+    }
+    return;
+  }
+
+  if (kind == INSN_SETCC) {
+    encode_modrm(3984 + insn->code, 0, a, 1, 0, FALSE);
+    return;
+  }
+
+  if (kind == INSN_UNARY) {
+    size = operand_size(a, NULL);
+    if (size == 1) {
+      encode_modrm(246, insn->code, a, size, 0, FALSE);
+    } else {
+      encode_modrm(247, insn->code, a, size, 0, FALSE);
+    }
+    return;
+  }
+
+  if (n != 2 && !(kind == INSN_IMUL && (n == 1 || n == 3)))
+    error("invalid operands: %s [in assemble]", name);
+
+  if (kind == INSN_MOV) {
+    size = operand_size(a, b);
+    if (b->kind == OPD_IMM) {
+      if (size == 1) {
+        encode_modrm(198, 0, a, size, 1, FALSE);
+      } else {
+        encode_modrm(199, 0, a, size, imm_size_of(size), FALSE);
+      }
+      encode_imm(b->imm, imm_size_of(size));
+    } else if (b->kind == OPD_REG) {
+      if (size == 1) {
+        encode_modrm(136, b->reg, a, size, 0, needs_rex8(b));
+      } else {
+        encode_modrm(137, b->reg, a, size, 0, FALSE);
+      }
+    } else if (a->kind == OPD_REG) {
+      if (size == 1) {
+        encode_modrm(138, a->reg, b, size, 0, needs_rex8(a));
+      } else {
+        encode_modrm(139, a->reg, b, size, 0, FALSE);
+      }
+    } else {
+      error("invalid operands: %s [in assemble]", name);
+    }
+    return;
+  }
+
+  if (kind == INSN_MOVX) {
+    // 読み込む側の大きさで8bit版と16bit版を選ぶ
+    int src_size = b->size;
+    if (src_size == 1) {
+      encode_modrm(3840 + insn->code, a->reg, b, a->size, 0, FALSE);
+    } else if (src_size == 2) {
+      encode_modrm(3840 + insn->code + 1, a->reg, b, a->size, 0, FALSE);
+    } else {
+      error("invalid operands: %s [in assemble]", name);
+    }
+    return;
+  }
+
+  if (kind == INSN_MOVSXD || kind == INSN_LEA) {
+    encode_modrm(insn->code, a->reg, b, a->size, 0, FALSE);
+    return;
+  }
+
+  if (kind == INSN_CMOVCC) {
+    encode_modrm(3904 + insn->code, a->reg, b, a->size, 0, FALSE);
+    return;
+  }
+
+  if (kind == INSN_IMUL) {
+    if (n == 1) {
+      size = operand_size(a, NULL);
+      encode_modrm(247, 5, a, size, 0, FALSE);
+    } else if (n == 2 && b->kind == OPD_IMM) {
+      // imul r, imm は imul r, r, imm と同じ
+      if (fits_int8(b->imm)) {
+        encode_modrm(107, a->reg, a, a->size, 1, FALSE);
+        buf_byte(asm_buf, b->imm);
+      } else {
+        encode_modrm(105, a->reg, a, a->size, imm_size_of(a->size), FALSE);
+        encode_imm(b->imm, imm_size_of(a->size));
+      }
+    } else if (n == 2) {
+      encode_modrm(4015, a->reg, b, a->size, 0, FALSE);
+    } else if (fits_int8(c->imm)) {
+      encode_modrm(107, a->reg, b, a->size, 1, FALSE);
+      buf_byte(asm_buf, c->imm);
+    } else {
+      encode_modrm(105, a->reg, b, a->size, imm_size_of(a->size), FALSE);
+      encode_imm(c->imm, imm_size_of(a->size));
+    }
+    return;
+  }
+
+  if (kind == INSN_SHIFT) {
+    size = operand_size(a, NULL);
+    int base = 211;
+    if (b->kind == OPD_IMM)
+      base = 193;
+    if (size == 1)
+      base = base - 1;
+    if (b->kind == OPD_IMM) {
+      encode_modrm(base, insn->code, a, size, 1, FALSE);
+      buf_byte(asm_buf, b->imm);
+    } else if (b->kind == OPD_REG && b->reg == 1 && b->size == 1) {
+      encode_modrm(base, insn->code, a, size, 0, FALSE);
+    } else {
+      error("invalid operands: %s [in assemble]", name);
+    }
+    return;
+  }
+
+  if (kind == INSN_TEST) {
+    size = operand_size(a, b);
+    if (b->kind == OPD_IMM) {
+      if (size == 1) {
+        encode_modrm(246, 0, a, size, 1, FALSE);
+      } else {
+        encode_modrm(247, 0, a, size, imm_size_of(size), FALSE);
+      }
+      encode_imm(b->imm, imm_size_of(size));
+    } else if (b->kind == OPD_REG) {
+      if (size == 1) {
+        encode_modrm(132, b->reg, a, size, 0, needs_rex8(b));
+      } else {
+        encode_modrm(133, b->reg, a, size, 0, FALSE);
+      }
+    } else {
+      error("invalid operands: %s [in assemble]", name);
+    }
+    return;
+  }
+
+  if (kind == INSN_ALU) {
+    int digit = insn->code;
+    size = operand_size(a, b);
+    if (b->kind == OPD_IMM) {
+      if (size == 1) {
+        encode_modrm(128, digit, a, size, 1, FALSE);
+        buf_byte(asm_buf, b->imm);
+      } else if (fits_int8(b->imm)) {
+        encode_modrm(131, digit, a, size, 1, FALSE);
+        buf_byte(asm_buf, b->imm);
+      } else {
+        encode_modrm(129, digit, a, size, imm_size_of(size), FALSE);
+        encode_imm(b->imm, imm_size_of(size));
+      }
+    } else if (b->kind == OPD_REG) {
+      if (size == 1) {
+        encode_modrm(digit * 8, b->reg, a, size, 0, needs_rex8(b));
+      } else {
+        encode_modrm(digit * 8 + 1, b->reg, a, size, 0, FALSE);
+      }
+    } else if (a->kind == OPD_REG) {
+      if (size == 1) {
+        encode_modrm(digit * 8 + 2, a->reg, b, size, 0, needs_rex8(a));
+      } else {
+        encode_modrm(digit * 8 + 3, a->reg, b, size, 0, FALSE);
+      }
+    } else {
+      error("invalid operands: %s [in assemble]", name);
+    }
+    return;
+  }
+
+  error("unsupported instruction: %s [in assemble]", name);
+}
+
+//
+// コード生成から直接呼び出すアセンブラ
+//
+
+// 名前から命令を引く
+AsmInsn *find_insn(char *name, int len) {
+  Ident *ident = find_ident(name, len);
+  AsmInsn *insn = NULL;
+  if (ident)
+    insn = hashmap_get(insn_table, ident);
+  if (!insn)
+    error("unknown instruction: %.*s [in assemble]", len, name);
+  return insn;
+}
+
+// オペランドを何も指定していない状態に戻す
+void clear_operand(AsmOperand *op) {
+  op->kind = OPD_IMM;
+  op->reg = 0;
+  op->size = 0;
+  op->imm = 0;
+  op->base = -1;
+  op->index = -1;
+  op->scale = 1;
+  op->disp = 0;
+  op->rip = FALSE;
+  op->sym = NULL;
+}
+
+void set_section(int section) {
+  asm_section = section;
+  asm_buf = asm_sections[section];
+}
+
+// 関数の先頭で直前の関数の大きさを確定させる。symがNULLなら最後の関数を閉じる。
+void begin_function(AsmSymbol *sym) {
+  if (asm_last_func)
+    asm_last_func->size = asm_sections[SEC_TEXT]->len - asm_last_func->offset;
+  asm_last_func = sym;
+}
+
+// 現在の位置にラベルを置く
+void define_label(AsmSymbol *sym) {
+  if (sym->section != SEC_NONE)
+    error("duplicated label: %.*s [in assemble]", sym->ident->len, sym->ident->name);
+  sym->section = asm_section;
+  sym->offset = asm_buf->len;
+  if (asm_section == SEC_TEXT && sym->global)
+    begin_function(sym);
+}
+
+// 2のval乗の境界に揃える。.textの隙間はnopで埋める。
+void align_section(int val) {
+  int align = 1 << val;
+  if (asm_align[asm_section] < align)
+    asm_align[asm_section] = align;
+  if (asm_section == SEC_TEXT) {
+    buf_align(asm_buf, align, 144);
+  } else {
+    buf_align(asm_buf, align, 0);
+  }
+}
+
+// ソースに書かれたままの文字列リテラルの中身 (長さlen) を、エスケープを解釈して書き出す
+void encode_string(char *p, int len) {
+  char *end = p + len;
+  while (p < end) {
+    if (*p != '\\') {
+      buf_byte(asm_buf, *p++);
+      continue;
+    }
+    p++;
+    char c = *p++;
+    if (c == 'n') {
+      buf_byte(asm_buf, 10);
+    } else if (c == 't') {
+      buf_byte(asm_buf, 9);
+    } else if (c == 'r') {
+      buf_byte(asm_buf, 13);
+    } else if (c == 'b') {
+      buf_byte(asm_buf, 8);
+    } else if (c == 'f') {
+      buf_byte(asm_buf, 12);
+    } else if (c == 'v') {
+      buf_byte(asm_buf, 11);
+    } else if (c == 'x') {
+      int val = 0;
+      while (p < end && (('0' <= *p && *p <= '9') || ('a' <= *p && *p <= 'f') || ('A' <= *p && *p <= 'F'))) {
+        if (*p <= '9') {
+          val = val * 16 + *p - '0';
+        } else if (*p <= 'F') {
+          val = val * 16 + *p - 'A' + 10;
+        } else {
+          val = val * 16 + *p - 'a' + 10;
+        }
+        p++;
+      }
+      buf_byte(asm_buf, val);
+    } else if ('0' <= c && c <= '7') {
+      // 8進数は3桁まで
+      int val = c - '0';
+      for (int i = 0; i < 2 && p < end && '0' <= *p && *p <= '7'; i++)
+        val = val * 8 + *p++ - '0';
+      buf_byte(asm_buf, val);
+    } else {
+      buf_byte(asm_buf, c);
+    }
+  }
+  buf_byte(asm_buf, 0);
+}
+
+// 同じセクション内の局所的なラベルへの参照は、ここで埋めてしまう。
+// 残った再配置はELFの再配置エントリとして出力する。
+void resolve_relocs() {
+  AsmReloc *rest = NULL;
+  AsmReloc *rel = asm_relocs;
+  while (rel) {
+    AsmReloc *next = rel->next;
+    AsmSymbol *sym = rel->sym;
+    if (sym->section == rel->section && !sym->global && rel->type != R_X86_64_64) {
+      buf_patch32(asm_sections[rel->section], rel->offset, sym->offset + rel->addend - rel->offset);
+    } else {
+      rel->next = rest;
+      rest = rel;
+    }
+    rel = next;
+  }
+  asm_relocs = rest;
+}
+
+// 以降のコード生成で、命令を直接機械語にする (-c, --run, --vm)。
+// 結果はend_assembleの後にasm_sections, asm_symbols, asm_relocsに入る。
+void begin_assemble() { asm_direct = TRUE; }
+
+// セクションと記号表を空にする。記号は識別子表とsymbol_arenaに置くので、
+// コード生成がそれらを初期化した後 (gen_start) に呼ぶ。
+void reset_asm() {
+  if (!insn_table)
+    init_asm();
+  asm_symbol_table = new_hashmap(256);
+  asm_symbols = NULL;
+  asm_relocs = NULL;
+  asm_last_func = NULL;
+  for (int i = 0; i < 4; i++) {
+    asm_sections[i] = new_byte_buf();
+    asm_align[i] = 1;
+  }
+  asm_align[SEC_TEXT] = 16;
+  set_section(SEC_TEXT);
+}
+
+void end_assemble() {
+  begin_function(NULL);
+  resolve_relocs();
+  asm_direct = FALSE;
+}
@@ -0,0 +1,496 @@
+
+#include "lacc.h"
+
+extern int code;
+extern Function *functions;
+extern HashMap *function_table;
+extern Ident *main_ident;
+extern ByteBuf *asm_sections[4];
+
+extern int TRUE;
+extern int FALSE;
+extern void *NULL;
+
+// バイトコード列
+int *bc_code;
+int bc_len;
+int bc_cap;
+
+// OP_GADDRで参照するアドレスの表。シンボルのindexに番号+1を入れておく。
+char **bc_globals;
+int bc_global_cnt;
+int bc_global_cap;
+
+// OP_CALLXで呼び出す外部関数の表
+char **bc_externs;
+int bc_extern_cnt;
+int bc_extern_cap;
+
+// 関数呼び出しの位置。全関数を変換してから飛び先を埋める。
+int *bc_calls;
+Function **bc_call_fns;
+int bc_call_cnt;
+int bc_call_cap;
+
+// データセクションの配置先
+char *bc_sections[4];
+
+// 変換中のループ。breakとcontinueの飛び先はループの終わりまで分からないので、
+// 未解決のジャンプをオペランドを使ったリストにつないでおく。
+typedef struct BcLoop BcLoop;
+struct BcLoop {
+  BcLoop *next;
+  int val;            // ループのラベル番号
+  int break_chain;    // 未解決のbreakのオペランドの位置 (0なら空)
+  int continue_chain; // 未解決のcontinueのオペランドの位置 (0なら空)
+};
+
+BcLoop *bc_loop;
+
+void bc_emit(int val) {
+  if (bc_len == bc_cap) {
+    bc_cap = bc_cap * 2;
+    bc_code = realloc(bc_code, sizeof(int) * bc_cap);
+    if (!bc_code)
+      error("out of memory [in bc_emit]");
+  }
+  bc_code[bc_len++] = val;
+}
+
+void bc_op(OpCode op) { bc_emit(op); }
+
+void bc_op1(OpCode op, int a) {
+  bc_emit(op);
+  bc_emit(a);
+}
+
+// 飛び先が未定のジャンプを出力し、オペランドの位置を返す
+int bc_jump(OpCode op) {
+  bc_emit(op);
+  bc_emit(0);
+  return bc_len - 1;
+}
+
+// posのオペランドを現在の位置にする
+void bc_patch(int pos) { bc_code[pos] = bc_len; }
+
+// リストにつながったジャンプをすべてtargetに向ける
+void bc_patch_chain(int pos, int target) {
+  while (pos) {
+    int next = bc_code[pos];
+    bc_code[pos] = target;
+    pos = next;
+  }
+}
+
+// アドレス表にaddrを追加して番号を返す
+int bc_add_global(char *addr) {
+  if (bc_global_cnt == bc_global_cap) {
+    bc_global_cap = bc_global_cap * 2;
+    bc_globals = realloc(bc_globals, 8 * bc_global_cap);
+  }
+  bc_globals[bc_global_cnt] = addr;
+  return bc_global_cnt++;
+}
+
+// 大域変数やリテラルのアドレスを積む
+void bc_symbol_addr(char *name, int len) {
+  AsmSymbol *sym = get_symbol(name, len);
+  if (!sym->index) {
+    char *addr;
+    if (sym->section == SEC_NONE) {
+      addr = jit_lookup(name, len);
+      if (!addr)
+        error("undefined symbol: %.*s", len, name);
+    } else {
+      addr = bc_sections[sym->section] + sym->offset;
+    }
+    sym->index = bc_add_global(addr) + 1;
+  }
+  bc_op1(OP_GADDR, sym->index - 1);
+}
+
+// ".L.str12" のようなラベルのアドレスを積む
+void bc_label_addr(char *prefix, int id) {
+  char buf[32];
+  int len = strlen(prefix);
+  memcpy(buf, prefix, len);
+  char digits[16];
+  int n = 0;
+  do {
+    digits[n++] = '0' + id % 10;
+    id /= 10;
+  } while (id);
+  while (n > 0)
+    buf[len++] = digits[--n];
+  bc_symbol_addr(buf, len);
+}
+
+void bc_load(Type *type, char *where) {
+  if (type->ty == TY_INT) {
+    bc_op(OP_LOAD4);
+  } else if (type->ty == TY_CHAR) {
+    bc_op(OP_LOAD1);
+  } else if (type->ty == TY_PTR || type->ty == TY_ARGARR) {
+    bc_op(OP_LOAD8);
+  } else if (type->ty != TY_ARR) {
+    error("invalid type [in %s]", where);
+  }
+}
+
+void bc_store(Type *type, char *where) {
+  if (type->ty == TY_INT) {
+    bc_op(OP_STORE4);
+  } else if (type->ty == TY_CHAR) {
+    bc_op(OP_STORE1);
+  } else if (type->ty == TY_PTR) {
+    bc_op(OP_STORE8);
+  } else {
+    error("invalid type [in %s]", where);
+  }
+}
+
+// 式の値を使わない文では、積んだ値を捨てる
+void bc_result(Node *node) {
+  if (node->endline)
+    bc_op(OP_POP);
+}
+
+void bc_gen(Node *node);
+
+void bc_gen_lval(Node *node) {
+  LVar *var = node->sym;
+  if (node->kind == ND_LVAR || node->kind == ND_VARDEC) {
+    bc_op1(OP_LADDR, var->offset);
+  } else if (node->kind == ND_GVAR) {
+    bc_symbol_addr(var->name, var->len);
+  } else if (node->kind == ND_DEREF) {
+    bc_gen(node_at(node->lhs));
+  } else {
+    error("invalid lvalue, node->kind: %d\n", node->kind);
+  }
+}
+
+void bc_enter_loop(BcLoop *loop, int val) {
+  loop->val = val;
+  loop->break_chain = 0;
+  loop->continue_chain = 0;
+  loop->next = bc_loop;
+  bc_loop = loop;
+}
+
+void bc_leave_loop(int step, int end) {
+  bc_patch_chain(bc_loop->continue_chain, step);
+  bc_patch_chain(bc_loop->break_chain, end);
+  bc_loop = bc_loop->next;
+}
+
+// break, continueの対象のループ (do-whileの中のbreakは外側のループを指す)
+BcLoop *bc_find_loop(int val) {
+  for (BcLoop *loop = bc_loop; loop; loop = loop->next)
+    if (loop->val == val)
+      return loop;
+  error("stray break or continue [in bcgen]");
+  return NULL;
+}
+
+// 条件式を評価し、偽ならendに飛ぶループの共通部分
+void bc_gen_loop(Node *node, int cond_first) {
+  BcLoop loop;
+  bc_enter_loop(&loop, node->val);
+  int begin = bc_len;
+  int end_jump = 0;
+  if (cond_first) {
+    bc_gen(node_at(node->lhs));
+    end_jump = bc_jump(OP_JZ);
+  }
+  bc_gen(node_at(node->rhs));
+  if (!cond_first) {
+    bc_gen(node_at(node->lhs));
+    end_jump = bc_jump(OP_JZ);
+  }
+  int step = bc_len;
+  if (node->kind == ND_FOR)
+    bc_gen(node_at(node->extra));
+  bc_op1(OP_JMP, begin);
+  bc_patch(end_jump);
+  bc_leave_loop(step, bc_len);
+}
+
+void bc_gen_call(Node *node) {
+  Function *fn = node->sym;
+  int nargs = list_len(node->extra);
+  for (int i = 0; i < nargs; i++) {
+    Node *arg = list_at(node->extra, i);
+    bc_gen(arg);
+    // レジスタ渡しと同じく、intとcharは下位ビットだけを渡す
+    if (arg->type->ty == TY_INT) {
+      bc_op(OP_ZEXT4);
+    } else if (arg->type->ty == TY_CHAR) {
+      bc_op(OP_ZEXT1);
+    } else if (!is_ptr_or_arr(arg->type)) {
+      error("invalid type [in ND_FUNCALL]");
+    }
+  }
+  if (bc_call_cnt == bc_call_cap) {
+    bc_call_cap = bc_call_cap * 2;
+    bc_calls = realloc(bc_calls, sizeof(int) * bc_call_cap);
+    bc_call_fns = realloc(bc_call_fns, 8 * bc_call_cap);
+  }
+  bc_calls[bc_call_cnt] = bc_len;
+  bc_call_fns[bc_call_cnt++] = fn;
+  bc_op(OP_CALL);
+  bc_emit(0);
+  bc_emit(nargs);
+  if (!node->endline)
+    bc_op(OP_PUSHRET);
+}
+
+void bc_gen_funcdef(Node *node) {
+  Function *fn = node->sym;
+  fn->pc = bc_len;
+  int offset = fn->offset;
+  if (offset % 8)
+    offset = (offset / 8 + 1) * 8;
+  bc_op1(OP_ENTER, offset);
+  for (int i = 0; i < list_len(node->extra); i++) {
+    Node *param = list_at(node->extra, i);
+    bc_gen_lval(param);
+    bc_op1(OP_ARG, i);
+    if (param->type->ty == TY_ARGARR) {
+      bc_op(OP_STORE8);
+    } else {
+      bc_store(param->type, "ND_FUNCDEF");
+    }
+    bc_op(OP_POP);
+  }
+  bc_gen(node_at(node->lhs));
+  bc_op(OP_RETV);
+}
+
+// gen()と同じ意味のバイトコードを出力する
+void bc_gen(Node *node) {
+  NodeKind kind = node->kind;
+  Node *lhs = node_at(node->lhs);
+  Node *rhs = node_at(node->rhs);
+  if (kind == ND_NUM) {
+    if (!node->endline)
+      bc_op1(OP_PUSH, node->val);
+  } else if (kind == ND_STRING) {
+    bc_label_addr(".L.str", node->val);
+    bc_result(node);
+  } else if (kind == ND_ARRAY) {
+    bc_label_addr(".L.arr", node->val);
+    bc_result(node);
+  } else if (kind == ND_LVAR || kind == ND_GVAR) {
+    bc_gen_lval(node);
+    bc_load(node->type, "ND_LVAR");
+    bc_result(node);
+  } else if (kind == ND_ADDR) {
+    bc_gen_lval(lhs);
+    bc_result(node);
+  } else if (kind == ND_DEREF) {
+    bc_gen(lhs);
+    bc_load(node->type, "ND_DEREF");
+    bc_result(node);
+  } else if (kind == ND_NOT) {
+    bc_gen(lhs);
+    bc_op(OP_NOT);
+    bc_result(node);
+  } else if (kind == ND_BITNOT) {
+    bc_gen(lhs);
+    bc_op(OP_BITNOT);
+    bc_result(node);
+  } else if (kind == ND_ASSIGN) {
+    if (node->val) {
+      // 配列の初期化
+      bc_gen_lval(lhs);
+      bc_gen(rhs);
+      bc_op1(OP_COPY, get_sizeof(rhs->type));
+    } else if (lhs->type->ty == TY_STRUCT) {
+      bc_gen_lval(lhs);
+      bc_gen_lval(rhs);
+      bc_op1(OP_COPY, get_sizeof(rhs->type));
+    } else {
+      bc_gen_lval(lhs);
+      bc_gen(rhs);
+      bc_store(lhs->type, "ND_ASSIGN");
+    }
+    bc_result(node);
+  } else if (kind == ND_POSTINC) {
+    // 値を使う場合は、更新前の値をアドレスの下に置いておく
+    bc_gen_lval(lhs);
+    if (!node->endline) {
+      bc_op(OP_DUP);
+      bc_load(node->type, "ND_POSTINC");
+      bc_op(OP_SWAP);
+    }
+    bc_gen(rhs);
+    bc_store(lhs->type, "ND_POSTINC");
+    bc_op(OP_POP);
+  } else if (kind == ND_RETURN) {
+    bc_gen(rhs);
+    bc_op(OP_RET);
+  } else if (kind == ND_BLOCK) {
+    for (int i = 0; i < list_len(node->extra); i++)
+      bc_gen(list_at(node->extra, i));
+  } else if (kind == ND_IF) {
+    bc_gen(lhs);
+    int else_jump = bc_jump(OP_JZ);
+    bc_gen(rhs);
+    if (node->extra) {
+      int end_jump = bc_jump(OP_JMP);
+      bc_patch(else_jump);
+      bc_gen(node_at(node->extra));
+      bc_patch(end_jump);
+    } else {
+      bc_patch(else_jump);
+    }
+  } else if (kind == ND_WHILE || kind == ND_FOR) {
+    bc_gen_loop(node, TRUE);
+  } else if (kind == ND_DOWHILE) {
+    bc_gen_loop(node, FALSE);
+  } else if (kind == ND_BREAK) {
+    BcLoop *loop = bc_find_loop(node->val);
+    bc_op1(OP_JMP, loop->break_chain);
+    loop->break_chain = bc_len - 1;
+  } else if (kind == ND_CONTINUE) {
+    BcLoop *loop = bc_find_loop(node->val);
+    bc_op1(OP_JMP, loop->continue_chain);
+    loop->continue_chain = bc_len - 1;
+  } else if (kind == ND_FUNCDEF) {
+    bc_gen_funcdef(node);
+  } else if (kind == ND_FUNCALL) {
+    bc_gen_call(node);
+  } else if (kind == ND_AND || kind == ND_OR) {
+    // &&は偽, ||は真になった時点で結果が決まる
+    OpCode skip = OP_JZ;
+    if (kind == ND_OR)
+      skip = OP_JNZ;
+    bc_gen(lhs);
+    int first = bc_jump(skip);
+    bc_gen(rhs);
+    int second = bc_jump(skip);
+    bc_op1(OP_PUSH, kind == ND_AND);
+    int end_jump = bc_jump(OP_JMP);
+    bc_patch(first);
+    bc_patch(second);
+    bc_op1(OP_PUSH, kind == ND_OR);
+    bc_patch(end_jump);
+    bc_result(node);
+  } else if (kind == ND_GLBDEC || kind == ND_VARDEC || kind == ND_EXTERN || kind == ND_TYPEDEF || kind == ND_ENUM ||
+             kind == ND_STRUCT || kind == ND_TYPE || kind == ND_NONE) {
+  } else {
+    bc_gen(lhs);
+    bc_gen(rhs);
+    if (kind == ND_ADD) {
+      bc_op(OP_ADD);
+    } else if (kind == ND_SUB) {
+      bc_op(OP_SUB);
+    } else if (kind == ND_MUL) {
+      bc_op(OP_MUL);
+    } else if (kind == ND_DIV) {
+      bc_op(OP_DIV);
+    } else if (kind == ND_MOD) {
+      bc_op(OP_MOD);
+    } else if (kind == ND_EQ) {
+      bc_op(OP_EQ);
+    } else if (kind == ND_NE) {
+      bc_op(OP_NE);
+    } else if (kind == ND_LT) {
+      bc_op(OP_LT);
+    } else if (kind == ND_LE) {
+      bc_op(OP_LE);
+    } else if (kind == ND_BITAND) {
+      bc_op(OP_AND);
+    } else if (kind == ND_BITOR) {
+      bc_op(OP_OR);
+    } else if (kind == ND_BITXOR) {
+      bc_op(OP_XOR);
+    } else if (kind == ND_SHL) {
+      bc_op(OP_SHL);
+    } else if (kind == ND_SHR) {
+      bc_op(OP_SAR);
+    } else {
+      error("invalid node kind");
+    }
+    bc_result(node);
+  }
+}
+
+// 呼び出し先を埋める。定義のない関数は外部関数として実行中のプロセスから探す。
+// 外部関数のpcには -(外部関数表の番号 + 2) を入れておく。
+void bc_link_calls() {
+  for (int i = 0; i < bc_call_cnt; i++) {
+    Function *fn = bc_call_fns[i];
+    int pos = bc_calls[i];
+    if (fn->pc == -1) {
+      char *addr = jit_lookup(fn->name, fn->len);
+      if (!addr)
+        error("undefined function: %.*s", fn->len, fn->name);
+      if (bc_extern_cnt == bc_extern_cap) {
+        bc_extern_cap = bc_extern_cap * 2;
+        bc_externs = realloc(bc_externs, 8 * bc_extern_cap);
+      }
+      bc_externs[bc_extern_cnt] = addr;
+      fn->pc = -2 - bc_extern_cnt++;
+    }
+    if (fn->pc >= 0) {
+      bc_code[pos + 1] = fn->pc;
+    } else {
+      bc_code[pos] = OP_CALLX;
+      bc_code[pos + 1] = -2 - fn->pc;
+    }
+  }
+}
+
+// 構文木をバイトコードに変換して実行し、mainの戻り値を返す。
+// 大域変数とリテラルの配置は内蔵のアセンブラでデータセクションを作ることで決める。
+int run_vm(int argc, char **argv) {
+  begin_assemble();
+  gen_start();
+  gen_data();
+  end_assemble();
+  bc_sections[SEC_NONE] = NULL;
+  bc_sections[SEC_TEXT] = NULL;
+  for (int i = SEC_DATA; i <= SEC_RODATA; i++) {
+    bc_sections[i] = malloc(asm_sections[i]->len + 1);
+    memcpy(bc_sections[i], asm_sections[i]->data, asm_sections[i]->len);
+  }
+
+  bc_cap = 1024;
+  bc_len = 0;
+  bc_code = malloc(sizeof(int) * bc_cap);
+  bc_global_cap = 64;
+  bc_global_cnt = 0;
+  bc_globals = malloc(8 * bc_global_cap);
+  bc_extern_cap = 16;
+  bc_extern_cnt = 0;
+  bc_externs = malloc(8 * bc_extern_cap);
+  bc_call_cap = 64;
+  bc_call_cnt = 0;
+  bc_calls = malloc(sizeof(int) * bc_call_cap);
+  bc_call_fns = malloc(8 * bc_call_cap);
+  bc_loop = NULL;
+  for (Function *fn = functions; fn; fn = fn->next)
+    fn->pc = -1;
+
+  // 番地0からmainを呼び出し、戻ったら止まる
+  Function *entry = hashmap_get(function_table, main_ident);
+  if (!entry)
+    error("main is not defined");
+  bc_calls[bc_call_cnt] = 0;
+  bc_call_fns[bc_call_cnt++] = entry;
+  bc_op(OP_CALL);
+  bc_emit(0);
+  bc_emit(2);
+  bc_op(OP_HALT);
+
+  for (int i = 0; i < list_len(code); i++)
+    bc_gen(list_at(code, i));
+  if (entry->pc == -1)
+    error("main is not defined");
+  bc_link_calls();
+
+  return vm_run(bc_code, bc_len, bc_globals, bc_externs, argc, argv);
+}
@@ -0,0 +1,365 @@
+
+// コンパイル結果のキャッシュ (--cache)。
+// 入力ファイルと#includeで読み込むすべてのファイルの内容, コンパイラ自身, オプションから
+// SHA-256でキーを作り、キャッシュディレクトリにキーを名前として出力を保存する。
+// 書き込みは一時ファイルを作ってからrenameするので、並列に動くlacc同士でも壊れない。
+// 取り出すたびに更新時刻を新しくし、大きさの上限を超えたら更新時刻の古いものから消す。
+// 64bitの整数演算とディレクトリ操作を使うので、extention.cと同じくホストのコンパイラでビルドする。
+
+#define _DEFAULT_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+void error(char *fmt, ...);
+int create_file(char *path);
+
+//
+// SHA-256
+//
+
+typedef struct {
+  uint32_t state[8];
+  uint64_t len;       // これまでに加えたバイト数
+  unsigned char buf[64];
+} Sha256;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+static void sha256_init(Sha256 *s) {
+  static const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  memcpy(s->state, init, sizeof(init));
+  s->len = 0;
+}
+
+static void sha256_block(Sha256 *s, const unsigned char *p) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++)
+    w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 | (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  uint32_t a = s->state[0], b = s->state[1], c = s->state[2], d = s->state[3];
+  uint32_t e = s->state[4], f = s->state[5], g = s->state[6], h = s->state[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+    uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  s->state[0] += a;
+  s->state[1] += b;
+  s->state[2] += c;
+  s->state[3] += d;
+  s->state[4] += e;
+  s->state[5] += f;
+  s->state[6] += g;
+  s->state[7] += h;
+}
+
+static void sha256_update(Sha256 *s, const void *data, size_t len) {
+  const unsigned char *p = data;
+  size_t used = s->len % 64;
+  s->len += len;
+  if (used) {
+    size_t n = 64 - used < len ? 64 - used : len;
+    memcpy(s->buf + used, p, n);
+    p += n;
+    len -= n;
+    if (used + n < 64)
+      return;
+    sha256_block(s, s->buf);
+  }
+  for (; len >= 64; p += 64, len -= 64)
+    sha256_block(s, p);
+  memcpy(s->buf, p, len);
+}
+
+// 64文字の16進数にしてhexに書き込む
+static void sha256_final(Sha256 *s, char *hex) {
+  uint64_t bits = s->len * 8;
+  unsigned char pad[72] = {0x80};
+  size_t used = s->len % 64;
+  size_t n = used < 56 ? 56 - used : 120 - used;
+  for (int i = 0; i < 8; i++)
+    pad[n + i] = bits >> (56 - i * 8);
+  sha256_update(s, pad, n + 8);
+  for (int i = 0; i < 8; i++)
+    sprintf(hex + i * 8, "%08x", s->state[i]);
+}
+
+//
+// キーの計算
+//
+
+// ファイルの内容をすべて読み込む。読めなければNULLを返す。
+static char *slurp(char *path, size_t *len) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return NULL;
+  }
+  char *buf = malloc(st.st_size + 1);
+  size_t off = 0;
+  while (off < (size_t)st.st_size) {
+    ssize_t n = read(fd, buf + off, st.st_size - off);
+    if (n <= 0)
+      break;
+    off += n;
+  }
+  close(fd);
+  buf[off] = '\0';
+  *len = off;
+  return buf;
+}
+
+typedef struct Visited Visited;
+struct Visited {
+  Visited *next;
+  char *name;
+};
+
+// ファイルの名前と内容を加え、#include "名前" で読み込むファイルも順に加える。
+// コメントや文字列の中の#includeも拾うが、余分に加える分には結果を取り違えない。
+static void hash_file(Sha256 *s, char *path, Visited **visited) {
+  for (Visited *v = *visited; v; v = v->next)
+    if (!strcmp(v->name, path))
+      return;
+  Visited *v = malloc(sizeof(Visited));
+  v->name = strdup(path);
+  v->next = *visited;
+  *visited = v;
+
+  size_t len;
+  char *buf = slurp(path, &len);
+  sha256_update(s, path, strlen(path) + 1);
+  if (!buf) {
+    sha256_update(s, "\1missing", 8);
+    return;
+  }
+  uint64_t n = len;
+  sha256_update(s, &n, sizeof(n));
+  sha256_update(s, buf, len);
+
+  for (char *p = strstr(buf, "include"); p; p = strstr(p, "include")) {
+    p += 7;
+    while (*p == ' ' || *p == '\t')
+      p++;
+    if (*p != '"')
+      continue;
+    char *q = ++p;
+    while (*p && *p != '"' && *p != '\n')
+      p++;
+    if (*p != '"')
+      continue;
+    char *name = strndup(q, p - q);
+    hash_file(s, name, visited);
+    free(name);
+  }
+  free(buf);
+}
+
+// inputをoptionsでコンパイルした結果のキーを返す。呼び出し側がfreeで解放する。
+char *cache_key(char *input, char *options) {
+  static char exe_hash[65];
+  Sha256 s;
+
+  // コンパイラ自身が変われば出力も変わる
+  if (!exe_hash[0]) {
+    size_t len;
+    char *exe = slurp("/proc/self/exe", &len);
+    if (!exe)
+      return NULL;
+    sha256_init(&s);
+    sha256_update(&s, exe, len);
+    sha256_final(&s, exe_hash);
+    free(exe);
+  }
+
+  sha256_init(&s);
+  sha256_update(&s, exe_hash, 64);
+  sha256_update(&s, options, strlen(options) + 1);
+  Visited *visited = NULL;
+  hash_file(&s, input, &visited);
+  while (visited) {
+    Visited *next = visited->next;
+    free(visited->name);
+    free(visited);
+    visited = next;
+  }
+  char *key = malloc(65);
+  sha256_final(&s, key);
+  return key;
+}
+
+//
+// キャッシュディレクトリ
+//
+
+static char *entry_path(char *dir, char *name) {
+  char *path = malloc(strlen(dir) + strlen(name) + 2);
+  sprintf(path, "%s/%s", dir, name);
+  return path;
+}
+
+static int write_full(int fd, char *p, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// キャッシュにkeyがあれば、その内容をoutput (NULLなら標準出力) に書き出して1を返す
+int cache_get(char *dir, char *key, char *output) {
+  char *path = entry_path(dir, key);
+  size_t len;
+  char *buf = slurp(path, &len);
+  if (!buf) {
+    free(path);
+    return 0;
+  }
+  // 最近使ったものとして更新時刻を新しくする
+  utimensat(AT_FDCWD, path, NULL, 0);
+  free(path);
+
+  int fd = 1;
+  if (output)
+    fd = create_file(output);
+  if (write_full(fd, buf, len))
+    error("cannot write output [in cache_get]");
+  if (output)
+    close(fd);
+  free(buf);
+  return 1;
+}
+
+typedef struct {
+  char *name;
+  off_t size;
+  struct timespec mtime;
+} CacheEntry;
+
+static int older(const void *a, const void *b) {
+  const CacheEntry *x = a, *y = b;
+  if (x->mtime.tv_sec != y->mtime.tv_sec)
+    return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+  if (x->mtime.tv_nsec != y->mtime.tv_nsec)
+    return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : 1;
+  return 0;
+}
+
+static int is_key(char *name) {
+  if (strlen(name) != 64)
+    return 0;
+  for (char *p = name; *p; p++)
+    if (!((*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'f')))
+      return 0;
+  return 1;
+}
+
+// 合計の大きさがmax_bytesを超えていれば、更新時刻の古いものから消す
+static void cache_evict(char *dir, long long max_bytes) {
+  DIR *d = opendir(dir);
+  if (!d)
+    return;
+  CacheEntry *entries = NULL;
+  int cnt = 0, cap = 0;
+  long long total = 0;
+  struct dirent *ent;
+  while ((ent = readdir(d))) {
+    if (!is_key(ent->d_name))
+      continue;
+    char *path = entry_path(dir, ent->d_name);
+    struct stat st;
+    if (stat(path, &st) == -1) {
+      free(path);
+      continue;
+    }
+    if (cnt == cap) {
+      cap = cap * 2 + 64;
+      entries = realloc(entries, sizeof(CacheEntry) * cap);
+    }
+    entries[cnt].name = path;
+    entries[cnt].size = st.st_size;
+    entries[cnt].mtime = st.st_mtim;
+    cnt++;
+    total += st.st_size;
+  }
+  closedir(d);
+
+  if (total > max_bytes) {
+    qsort(entries, cnt, sizeof(CacheEntry), older);
+    for (int i = 0; i < cnt && total > max_bytes; i++) {
+      if (unlink(entries[i].name) == 0)
+        total -= entries[i].size;
+    }
+  }
+  for (int i = 0; i < cnt; i++)
+    free(entries[i].name);
+  free(entries);
+}
+
+// 出力をkeyとしてキャッシュに入れる。
+// pathがNULLでなければそのファイルの内容を、NULLならbufのlenバイトを入れる。
+// 入れた後で合計がmax_mbメガバイトに収まるように古いものを消す。
+void cache_put(char *dir, char *key, char *path, char *buf, int len, int max_mb) {
+  char *data = buf;
+  size_t size = len;
+  if (path) {
+    data = slurp(path, &size);
+    if (!data)
+      return;
+  }
+
+  // 一時ファイルに書き終えてからrenameするので、読む側が書きかけの内容を見ることはない
+  mkdir(dir, 0755);
+  char tmp_name[96];
+  snprintf(tmp_name, sizeof(tmp_name), "tmp.%d.%s", (int)getpid(), key);
+  char *tmp = entry_path(dir, tmp_name);
+  char *dest = entry_path(dir, key);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd != -1) {
+    int failed = write_full(fd, data, size);
+    close(fd);
+    if (failed || rename(tmp, dest) == -1)
+      unlink(tmp);
+  }
+  free(tmp);
+  free(dest);
+  if (path)
+    free(data);
+
+  cache_evict(dir, (long long)max_mb << 20);
+}
@@ -1,466 +1,1151 @@
 
 #include "lacc.h"
 
+extern Arena *local_arena;
+extern LVar *globals;
+extern String *strings;
+extern Array *arrays;
+extern int opt_level;
+extern AsmOperand *asm_operands[3];
+extern int asm_operand_cnt;
+extern int asm_direct;
+extern ByteBuf *asm_buf;
+
 extern int TRUE;
 extern int FALSE;
 extern void *NULL;
 
-char *regs1(int i) {
-  if (i == 0)
-    return "dil";
-  else if (i == 1)
-    return "sil";
-  else if (i == 2)
-    return "dl";
-  else if (i == 3)
-    return "cl";
-  else if (i == 4)
-    return "r8b";
-  else if (i == 5)
-    return "r9b";
-  else
-    return NULL;
+// 低水準IRにレジスタを割り付けた関数をアセンブリにする。
+// rax, rcx, rdx, r10, r11は命令の中で一時的に使う。
+// -cと--runではテキストを書かずに、同じ命令をasm.cで直接機械語にする。
+
+int REG_RAX = 0;
+int REG_RCX = 1;
+int REG_RDX = 2;
+int REG_RSP = 4;
+int REG_RBP = 5;
+int REG_R10 = 10;
+int REG_R11 = 11;
+
+// 出力中の関数と、次に出力するブロック
+IrFunc *cg_fn;
+Block *cg_next;
+
+// 出力中の命令とそのオペランドの数
+AsmInsn *cg_insn;
+char *cg_insn_name;
+int cg_opd_cnt;
+char cg_cc_name[8]; // 条件コードを付けた命令の名前
+
+// 物理レジスタの名前
+char *reg_name(int reg, int size) {
+  char *p;
+  if (size == 8) {
+    p = "rax\0rcx\0rdx\0rbx\0rsp\0rbp\0rsi\0rdi\0r8\0r9\0r10\0r11\0r12\0r13\0r14\0r15\0";
+  } else if (size == 4) {
+    p = "eax\0ecx\0edx\0ebx\0esp\0ebp\0esi\0edi\0r8d\0r9d\0r10d\0r11d\0r12d\0r13d\0r14d\0r15d\0";
+  } else if (size == 2) {
+    p = "ax\0cx\0dx\0bx\0sp\0bp\0si\0di\0r8w\0r9w\0r10w\0r11w\0r12w\0r13w\0r14w\0r15w\0";
+  } else {
+    p = "al\0cl\0dl\0bl\0spl\0bpl\0sil\0dil\0r8b\0r9b\0r10b\0r11b\0r12b\0r13b\0r14b\0r15b\0";
+  }
+  for (int i = 0; i < reg; i++)
+    p = p + strlen(p) + 1;
+  return p;
 }
 
-char *regs4(int i) {
+// i番目の引数を渡すレジスタ (rdi, rsi, rdx, rcx, r8, r9)
+int arg_reg(int i) {
   if (i == 0)
-    return "edi";
+    return 7;
   else if (i == 1)
-    return "esi";
+    return 6;
   else if (i == 2)
-    return "edx";
+    return 2;
   else if (i == 3)
-    return "ecx";
-  else if (i == 4)
-    return "r8d";
-  else if (i == 5)
-    return "r9d";
-  else
-    return NULL;
+    return 1;
+  return i + 4;
 }
 
-char *regs8(int i) {
-  if (i == 0)
-    return "rdi";
-  else if (i == 1)
-    return "rsi";
-  else if (i == 2)
-    return "rdx";
-  else if (i == 3)
-    return "rcx";
-  else if (i == 4)
-    return "r8";
-  else if (i == 5)
-    return "r9";
-  else
-    return NULL;
-}
-
-void gen_lval(Node *node) {
-  if (node->kind == ND_LVAR || node->kind == ND_VARDEC) {
-    printf("  mov rax, rbp\n");
-    printf("  sub rax, %d\n", node->var->offset);
-    printf("  push rax\n");
-  } else if (node->kind == ND_GVAR) {
-    printf("  lea rax, %.*s[rip]\n", node->var->len, node->var->name);
-    printf("  push rax\n");
-  } else if (node->kind == ND_DEREF) {
-    gen(node->lhs);
+char *ptr_size(int size) {
+  if (size == 8)
+    return "QWORD PTR ";
+  else if (size == 4)
+    return "DWORD PTR ";
+  else if (size == 2)
+    return "WORD PTR ";
+  return "BYTE PTR ";
+}
+
+//
+// 命令の出力。begin_insで命令を始め、opd_*でオペランドを並べ、end_insで1つの命令にする。
+// アセンブリを書くときはテキストにし、直接機械語にするときはasm_operandsに並べて符号化する。
+//
+
+void begin_ins(char *name) {
+  cg_opd_cnt = 0;
+  if (asm_direct) {
+    cg_insn_name = name;
+    cg_insn = find_insn(name, strlen(name));
   } else {
-    error("invalid lvalue, node->kind: %d\n", node->kind);
+    emits("  ", name, "");
   }
 }
 
-void asm_memcpy(Node *lhs, Node *rhs) {
-  printf("  pop rdi\n");
-  printf("  pop rsi\n");
-  int size = get_sizeof(rhs->type);
-  int offset = 0;
-  while (size > 0) {
-    if (size >= 8) {
-      printf("  mov rax, QWORD PTR [rdi + %d]\n", offset);
-      printf("  mov QWORD PTR [rsi + %d], rax\n", offset);
-      size -= 8;
-      offset += 8;
-    } else if (size >= 4) {
-      printf("  mov eax, DWORD PTR [rdi + %d]\n", offset);
-      printf("  mov DWORD PTR [rsi + %d], eax\n", offset);
-      size -= 4;
-      offset += 4;
-    } else if (size >= 2) {
-      printf("  mov ax, WORD PTR [rdi + %d]\n", offset);
-      printf("  mov WORD PTR [rsi + %d], ax\n", offset);
-      size -= 2;
-      offset += 2;
-    } else {
-      printf("  mov al, BYTE PTR [rdi + %d]\n", offset);
-      printf("  mov BYTE PTR [rsi + %d], al\n", offset);
-      size -= 1;
-      offset += 1;
+// 条件コードを付けた命令 (prefixはjかset)
+void begin_ins_cc(char *prefix, char *cc) {
+  int len = strlen(prefix);
+  memcpy(cg_cc_name, prefix, len);
+  memcpy(cg_cc_name + len, cc, strlen(cc) + 1);
+  begin_ins(cg_cc_name);
+}
+
+// 次のオペランドを返す。アセンブリを書くときは区切りを書いてNULLを返す。
+AsmOperand *next_operand() {
+  if (asm_direct) {
+    AsmOperand *op = asm_operands[cg_opd_cnt++];
+    clear_operand(op);
+    return op;
+  }
+  if (cg_opd_cnt++) {
+    emit(", ");
+  } else {
+    emit(" ");
+  }
+  return NULL;
+}
+
+void opd_reg(int reg, int size) {
+  AsmOperand *op = next_operand();
+  if (!op) {
+    emit(reg_name(reg, size));
+    return;
+  }
+  op->kind = OPD_REG;
+  op->reg = reg;
+  op->size = size;
+}
+
+void opd_imm(int val) {
+  AsmOperand *op = next_operand();
+  if (!op) {
+    emit_int(val);
+    return;
+  }
+  op->kind = OPD_IMM;
+  op->imm = val;
+}
+
+// [base + disp]。sizeが0ならPTRを付けない (leaのアドレス)。
+void opd_mem(int size, int base, int disp) {
+  AsmOperand *op = next_operand();
+  if (!op) {
+    if (size)
+      emit(ptr_size(size));
+    emits("[", reg_name(base, 8), "");
+    if (disp < 0) {
+      emitn(" - ", -disp, "");
+    } else if (disp > 0) {
+      emitn(" + ", disp, "");
     }
+    emit("]");
+    return;
   }
-  printf("  push rdi\n");
+  op->kind = OPD_MEM;
+  op->size = size;
+  op->base = base;
+  op->disp = disp;
 }
 
-void gen(Node *node) {
-  if (node->kind == ND_NUM) {
-    if (!node->endline)
-      printf("  push %d\n", node->val);
+// [base + index*scale] (leaのアドレス)
+void opd_index(int base, int index, int scale) {
+  AsmOperand *op = next_operand();
+  if (!op) {
+    emits("[", reg_name(base, 8), " + ");
+    emits("", reg_name(index, 8), "");
+    emitn("*", scale, "]");
     return;
-  } else if (node->kind == ND_STRING) {
-    printf("  lea rax, [rip + .L.str%d]\n", node->id);
-    if (!node->endline)
-      printf("  push rax\n");
+  }
+  op->kind = OPD_MEM;
+  op->base = base;
+  op->index = index;
+  op->scale = scale;
+}
+
+// prefixに番号を付けた名前のシンボル (.L.str<id> など)
+AsmSymbol *numbered_symbol(char *prefix, int id) {
+  char name[32];
+  char digits[16];
+  int len = strlen(prefix);
+  memcpy(name, prefix, len);
+  int n = 0;
+  do {
+    digits[n++] = '0' + id % 10;
+    id /= 10;
+  } while (id);
+  while (n)
+    name[len++] = digits[--n];
+  return get_symbol(name, len);
+}
+
+// ブロックの先頭のラベル
+AsmSymbol *block_symbol(Block *blk) {
+  if (!blk->sym)
+    blk->sym = new_label();
+  return blk->sym;
+}
+
+// RIP相対で大域変数を指す (name[rip])
+void opd_global(char *name, int len) {
+  AsmOperand *op = next_operand();
+  if (!op) {
+    emit_name("", name, len, "[rip]");
     return;
-  } else if (node->kind == ND_ARRAY) {
-    printf("  lea rax, [rip + .L.arr%d]\n", node->id);
-    if (!node->endline)
-      printf("  push rax\n");
+  }
+  op->kind = OPD_MEM;
+  op->rip = TRUE;
+  op->sym = get_symbol(name, len);
+}
+
+// RIP相対でリテラルを指す ([rip + .L.str<id>] など)
+void opd_literal(char *prefix, int id) {
+  AsmOperand *op = next_operand();
+  if (!op) {
+    emits("[rip + ", prefix, "");
+    emitn("", id, "]");
     return;
-  } else if ((node->kind == ND_LVAR) || (node->kind == ND_GVAR)) {
-    gen_lval(node);
-    printf("  pop rax\n");
-    if (node->type->ty == TY_INT) {
-      printf("  movsxd rax, DWORD PTR [rax]\n");
-    } else if (node->type->ty == TY_CHAR) {
-      printf("  movzx rax, BYTE PTR [rax]\n");
-    } else if (node->type->ty == TY_PTR || node->type->ty == TY_ARGARR) {
-      printf("  mov rax, QWORD PTR [rax]\n");
-    } else if (node->type->ty == TY_ARR) {
-    } else {
-      error("invalid type [in ND_LVAR]");
-    }
-    if (!node->endline)
-      printf("  push rax\n");
+  }
+  op->kind = OPD_MEM;
+  op->rip = TRUE;
+  op->sym = numbered_symbol(prefix, id);
+}
+
+// ジャンプ先のブロック
+void opd_block(Block *blk) {
+  AsmOperand *op = next_operand();
+  if (!op) {
+    emitn(".LB", blk->label, "");
     return;
-  } else if (node->kind == ND_ADDR) {
-    gen_lval(node->lhs);
+  }
+  op->kind = OPD_LABEL;
+  op->sym = block_symbol(blk);
+}
+
+// 呼び出す関数
+void opd_func(char *name, int len) {
+  AsmOperand *op = next_operand();
+  if (!op) {
+    emit_mem(name, len);
     return;
-  } else if (node->kind == ND_DEREF) {
-    gen(node->lhs);
-    printf("  pop rax\n");
-    if (node->type->ty == TY_INT) {
-      printf("  movsxd rax, DWORD PTR [rax]\n");
-    } else if (node->type->ty == TY_CHAR) {
-      printf("  movzx rax, BYTE PTR [rax]\n");
-    } else if (node->type->ty == TY_PTR || node->type->ty == TY_ARGARR) {
-      printf("  mov rax, QWORD PTR [rax]\n");
-    } else if (node->type->ty == TY_ARR) {
-    } else {
-      error("invalid type [in ND_DEREF]");
-    }
-    if (!node->endline)
-      printf("  push rax\n");
+  }
+  op->kind = OPD_LABEL;
+  op->sym = get_symbol(name, len);
+}
+
+void end_ins() {
+  if (!asm_direct) {
+    emit("\n");
     return;
-  } else if (node->kind == ND_NOT) {
-    gen(node->lhs);
-    printf("  pop rax\n");
-    printf("  cmp rax, 0\n");
-    printf("  sete al\n");
-    printf("  movzx rax, al\n");
-    if (!node->endline)
-      printf("  push rax\n");
+  }
+  asm_operand_cnt = cg_opd_cnt;
+  encode_insn(cg_insn, cg_insn_name);
+}
+
+// オペランドのない命令
+void ins0(char *name) {
+  begin_ins(name);
+  end_ins();
+}
+
+// 64bitのレジスタを1つ取る命令
+void ins_r(char *name, int reg) {
+  begin_ins(name);
+  opd_reg(reg, 8);
+  end_ins();
+}
+
+// 64bitのレジスタを2つ取る命令
+void ins_rr(char *name, int dst, int src) {
+  begin_ins(name);
+  opd_reg(dst, 8);
+  opd_reg(src, 8);
+  end_ins();
+}
+
+// 64bitのレジスタと即値を取る命令
+void ins_ri(char *name, int reg, int val) {
+  begin_ins(name);
+  opd_reg(reg, 8);
+  opd_imm(val);
+  end_ins();
+}
+
+//
+// ラベルとデータの出力
+//
+
+void gen_section(SectionKind section) {
+  if (asm_direct) {
+    set_section(section);
+  } else if (section == SEC_TEXT) {
+    emit("  .text\n");
+  } else if (section == SEC_DATA) {
+    emit("  .data\n");
+  } else {
+    emit("  .section .rodata\n");
+  }
+}
+
+// 大域シンボルにする (.globl)
+void gen_globl(char *name, int len) {
+  if (asm_direct) {
+    get_symbol(name, len)->global = TRUE;
+  } else {
+    emit_name("  .globl ", name, len, "\n");
+  }
+}
+
+// 2のval乗の境界に揃える (.p2align)
+void gen_align(int val) {
+  if (asm_direct) {
+    align_section(val);
+  } else {
+    emitn("  .p2align ", val, "\n");
+  }
+}
+
+void gen_label(char *name, int len) {
+  if (asm_direct) {
+    define_label(get_symbol(name, len));
+  } else {
+    emit_name("", name, len, ":\n");
+  }
+}
+
+void gen_literal_label(char *prefix, int id) {
+  if (asm_direct) {
+    define_label(numbered_symbol(prefix, id));
+  } else {
+    emitn(prefix, id, ":\n");
+  }
+}
+
+void gen_block_label(Block *blk) {
+  if (asm_direct) {
+    define_label(block_symbol(blk));
+  } else {
+    emitn(".LB", blk->label, ":\n");
+  }
+}
+
+void gen_long(int val) {
+  if (asm_direct) {
+    buf_int32(asm_buf, val);
+  } else {
+    emitn("  .long ", val, "\n");
+  }
+}
+
+void gen_byte(int val) {
+  if (asm_direct) {
+    buf_byte(asm_buf, val);
+  } else {
+    emitn("  .byte ", val, "\n");
+  }
+}
+
+void gen_zero(int size) {
+  if (!asm_direct) {
+    emitn("  .zero ", size, "\n");
     return;
-  } else if (node->kind == ND_BITNOT) {
-    gen(node->lhs);
-    printf("  pop rax\n");
-    printf("  not rax\n");
-    if (!node->endline)
-      printf("  push rax\n");
+  }
+  for (int i = 0; i < size; i++)
+    buf_byte(asm_buf, 0);
+}
+
+// ソースに書かれたままの文字列リテラルを'\0'で終わる文字列として出力する
+void gen_string(char *text, int len) {
+  if (asm_direct) {
+    encode_string(text, len);
+  } else {
+    emit_name("  .string \"", text, len, "\"\n");
+  }
+}
+
+// アセンブリの先頭。直接機械語にするときはアセンブラを空の状態にする
+void gen_start() {
+  if (asm_direct) {
+    reset_asm();
+  } else {
+    emit(".intel_syntax noprefix\n");
+  }
+  gen_section(SEC_TEXT);
+}
+
+int is_const(int v) { return cg_fn->const_def[v] != NULL; }
+
+int const_val(int v) { return cg_fn->const_def[v]->imm; }
+
+// 仮想レジスタが物理レジスタregにあればTRUE
+int in_reg(int v, int reg) { return !is_const(v) && cg_fn->reg[v] == reg; }
+
+// 仮想レジスタの値をオペランドとして出力する (即値, レジスタ, スピル先のどれか)
+void opd_vreg(int v, int size) {
+  if (is_const(v)) {
+    opd_imm(const_val(v));
+  } else if (cg_fn->reg[v] >= 0) {
+    opd_reg(cg_fn->reg[v], size);
+  } else {
+    opd_mem(size, REG_RBP, -cg_fn->slot[v]);
+  }
+}
+
+// op reg, v
+void emit_op(char *op, int reg, int v) {
+  begin_ins(op);
+  opd_reg(reg, 8);
+  opd_vreg(v, 8);
+  end_ins();
+}
+
+// 物理レジスタregに仮想レジスタvの値を入れる
+void move_to(int reg, int v) {
+  if (!in_reg(v, reg))
+    emit_op("mov", reg, v);
+}
+
+// 仮想レジスタの値が入った物理レジスタを返す。レジスタになければscratchに読み込む。
+int use_reg(int v, int scratch) {
+  if (!is_const(v) && cg_fn->reg[v] >= 0)
+    return cg_fn->reg[v];
+  emit_op("mov", scratch, v);
+  return scratch;
+}
+
+// 結果を計算するレジスタ。スピルした仮想レジスタならraxで計算する。
+int def_reg(int v) {
+  if (cg_fn->reg[v] >= 0)
+    return cg_fn->reg[v];
+  return REG_RAX;
+}
+
+// regに計算した結果を仮想レジスタvに書き戻す
+void set_vreg(int v, int reg) {
+  if (cg_fn->reg[v] == reg)
     return;
-  } else if (node->kind == ND_ASSIGN) {
-    if (node->val) {
-      gen_lval(node->lhs);
-      gen(node->rhs);
-      asm_memcpy(node->lhs, node->rhs);
-      printf("  pop rax\n");
-      if (!node->endline)
-        printf("  push rax\n");
-      return;
-    } else if (node->lhs->type->ty == TY_STRUCT) {
-      gen_lval(node->lhs);
-      gen_lval(node->rhs);
-      asm_memcpy(node->lhs, node->rhs);
-      printf("  pop rax\n");
-      if (!node->endline)
-        printf("  push rax\n");
-      return;
-    } else {
-      gen_lval(node->lhs);
-      gen(node->rhs);
-      printf("  pop rdi\n");
-      printf("  pop rax\n");
-      if (node->lhs->type->ty == TY_INT) {
-        printf("  mov DWORD PTR [rax], edi\n");
-      } else if (node->lhs->type->ty == TY_CHAR) {
-        printf("  mov BYTE PTR [rax], dil\n");
-      } else if (node->lhs->type->ty == TY_PTR) {
-        printf("  mov QWORD PTR [rax], rdi\n");
+  begin_ins("mov");
+  opd_vreg(v, 8);
+  opd_reg(reg, 8);
+  end_ins();
+}
+
+void emit_jmp(char *cc, Block *blk) {
+  begin_ins_cc("j", cc);
+  opd_block(blk);
+  end_ins();
+}
+
+// 条件コードの否定
+char *negate_cc(char *cc) {
+  if (!strcmp(cc, "e"))
+    return "ne";
+  else if (!strcmp(cc, "ne"))
+    return "e";
+  else if (!strcmp(cc, "l"))
+    return "ge";
+  return "g";
+}
+
+// 比較の結果が分岐だけで使われるならTRUE。比較は分岐と一緒に出力する。
+int is_fused(Ins *ins) {
+  IrOp op = ins->op;
+  if (op != IR_EQ && op != IR_NE && op != IR_LT && op != IR_LE && op != IR_NOT)
+    return FALSE;
+  Ins *next = ins->next;
+  return next->op == IR_BR && next->a == ins->dst && cg_fn->use_cnt[ins->dst] == 1;
+}
+
+// 比較してフラグを設定し、成り立つときの条件コードを返す
+char *gen_compare(Ins *ins) {
+  int a = use_reg(ins->a, REG_RAX);
+  if (ins->op == IR_NOT) {
+    ins_rr("test", a, a);
+    return "e";
+  }
+  emit_op("cmp", a, ins->b);
+  if (ins->op == IR_EQ)
+    return "e";
+  else if (ins->op == IR_NE)
+    return "ne";
+  else if (ins->op == IR_LT)
+    return "l";
+  return "le";
+}
+
+void gen_branch(Ins *ins, Ins *prev) {
+  if (is_const(ins->a)) {
+    Block *target = ins->else_blk;
+    if (const_val(ins->a))
+      target = ins->then_blk;
+    if (target != cg_next)
+      emit_jmp("mp", target);
+    return;
+  }
+  char *cc;
+  if (prev && is_fused(prev)) {
+    cc = gen_compare(prev);
+  } else {
+    int a = use_reg(ins->a, REG_RAX);
+    ins_rr("test", a, a);
+    cc = "ne";
+  }
+  if (ins->then_blk == cg_next) {
+    emit_jmp(negate_cc(cc), ins->else_blk);
+  } else {
+    emit_jmp(cc, ins->then_blk);
+    if (ins->else_blk != cg_next)
+      emit_jmp("mp", ins->else_blk);
+  }
+}
+
+// 関数呼び出し。引数を渡すレジスタに後の引数が入っていれば、スタックを経由して並べ替える。
+void gen_call(Ins *ins) {
+  Function *fn = ins->sym;
+  int conflict = FALSE;
+  for (int i = 0; i < ins->nargs; i++)
+    for (int j = i + 1; j < ins->nargs; j++)
+      if (in_reg(ins->args[j], arg_reg(i)))
+        conflict = TRUE;
+
+  for (int i = 0; i < ins->nargs; i++) {
+    int v = ins->args[i];
+    if (conflict) {
+      ins_r("push", use_reg(v, REG_RAX));
+    } else if (ins->arg_sizes[i] == 8 || is_const(v)) {
+      // 即値は大きさに合わせて切り詰める
+      int reg = arg_reg(i);
+      if (is_const(v) && ins->arg_sizes[i] != 8) {
+        int val = const_val(v);
+        if (ins->arg_sizes[i] == 1)
+          val = val & 255;
+        begin_ins("mov");
+        opd_reg(reg, 4);
+        opd_imm(val);
+        end_ins();
       } else {
-        error("invalid type [in ND_ASSIGN]");
+        move_to(reg, v);
       }
-      if (!node->endline)
-        printf("  push rdi\n");
-      return;
-    }
-  } else if (node->kind == ND_POSTINC) {
-    gen_lval(node->lhs);
-    if (!node->endline) {
-      printf("  pop rax\n");
-      if (node->type->ty == TY_INT) {
-        printf("  movsxd rdi, DWORD PTR [rax]\n");
-      } else if (node->type->ty == TY_CHAR) {
-        printf("  movzx rdi, BYTE PTR [rax]\n");
-      } else if (node->type->ty == TY_PTR) {
-        printf("  mov rdi, QWORD PTR [rax]\n");
+    } else {
+      if (ins->arg_sizes[i] == 4) {
+        begin_ins("mov");
       } else {
-        error("invalid type [in ND_POSTINC]");
+        begin_ins("movzx");
       }
-      printf("  push rdi\n");
-      printf("  push rax\n");
+      opd_reg(arg_reg(i), 4);
+      opd_vreg(v, ins->arg_sizes[i]);
+      end_ins();
     }
-    gen(node->rhs);
-
-    printf("  pop rdi\n");
-    printf("  pop rax\n");
-    if (node->lhs->type->ty == TY_INT) {
-      printf("  mov DWORD PTR [rax], edi\n");
-    } else if (node->lhs->type->ty == TY_CHAR) {
-      printf("  mov BYTE PTR [rax], dil\n");
-    } else if (node->lhs->type->ty == TY_PTR) {
-      printf("  mov QWORD PTR [rax], rdi\n");
-    } else {
-      error("invalid type [in ND_POSTINC]");
+  }
+  if (conflict) {
+    for (int i = ins->nargs - 1; i >= 0; i--) {
+      int reg = arg_reg(i);
+      ins_r("pop", reg);
+      if (ins->arg_sizes[i] == 4) {
+        begin_ins("mov");
+        opd_reg(reg, 4);
+        opd_reg(reg, 4);
+        end_ins();
+      } else if (ins->arg_sizes[i] == 1) {
+        begin_ins("movzx");
+        opd_reg(reg, 4);
+        opd_reg(reg, 1);
+        end_ins();
+      }
     }
+  }
+  begin_ins("mov");
+  opd_reg(REG_RAX, 4);
+  opd_imm(0);
+  end_ins();
+  begin_ins("call");
+  opd_func(fn->name, fn->len);
+  end_ins();
+  if (cg_fn->use_cnt[ins->dst])
+    set_vreg(ins->dst, REG_RAX);
+}
+
+// [a]にimmバイトを[b]からコピーする
+void gen_copy(Ins *ins) {
+  int dst = use_reg(ins->a, REG_R11);
+  int src = use_reg(ins->b, REG_R10);
+  int size = ins->imm;
+  int offset = 0;
+  while (size > 0) {
+    int n = 1;
+    if (size >= 8)
+      n = 8;
+    else if (size >= 4)
+      n = 4;
+    else if (size >= 2)
+      n = 2;
+    begin_ins("mov");
+    opd_reg(REG_RAX, n);
+    opd_mem(n, src, offset);
+    end_ins();
+    begin_ins("mov");
+    opd_mem(n, dst, offset);
+    opd_reg(REG_RAX, n);
+    end_ins();
+    size -= n;
+    offset += n;
+  }
+}
+
+// sizeバイトの値を読み込む命令を始める。intは符号拡張し、charはゼロ拡張する。
+void begin_load(int size) {
+  if (size == 4) {
+    begin_ins("movsxd");
+  } else if (size == 1) {
+    begin_ins("movzx");
+  } else {
+    begin_ins("mov");
+  }
+}
+
+// [base + disp]からregに読み込む
+void emit_load(int reg, int size, int base, int disp) {
+  begin_load(size);
+  opd_reg(reg, 8);
+  opd_mem(size, base, disp);
+  end_ins();
+}
+
+// 物理レジスタsrcの値を、sizeバイトの変数から読んだときと同じようにdに拡張する
+void emit_extend(int d, int src, int size) {
+  if (size == 8 && d == src)
     return;
-  } else if (node->kind == ND_RETURN) {
-    gen(node->rhs);
-    printf("  pop rax\n");
-    printf("  mov rsp, rbp\n");
-    printf("  pop rbp\n");
-    printf("  ret\n");
+  begin_load(size);
+  opd_reg(d, 8);
+  opd_reg(src, size);
+  end_ins();
+}
+
+// 物理レジスタsrcで渡された引数を受け取る。dstがなければフレーム上の変数に書き込む。
+void receive_param(Ins *ins, int src) {
+  if (!ins->dst) {
+    begin_ins("mov");
+    opd_mem(ins->size, REG_RBP, -ins->imm);
+    opd_reg(src, ins->size);
+    end_ins();
     return;
-  } else if (node->kind == ND_BLOCK) {
-    for (int i = 0; node->body[i]->kind != ND_NONE; i++) {
-      gen(node->body[i]);
-    }
+  }
+  if (!cg_fn->use_cnt[ins->dst])
     return;
-  } else if (node->kind == ND_IF) {
-    gen(node->cond);
-    printf("  pop rax\n");
-    printf("  cmp rax, 0\n");
-    if (node->els) {
-      printf("  je .Lelse%d\n", node->id);
-      gen(node->then);
-      printf("  jmp .Lend%d\n", node->id);
-      printf(".Lelse%d:\n", node->id);
-      gen(node->els);
-      printf(".Lend%d:\n", node->id);
+  int d = def_reg(ins->dst);
+  emit_extend(d, src, ins->size);
+  set_vreg(ins->dst, d);
+}
+
+// 関数の先頭に並ぶIR_PARAMをまとめて出力する。
+// まだ読んでいない引数のレジスタに別の引数を受け取るなら、いったんすべてスタックに積む。
+void gen_params(Ins *first) {
+  int cnt = 0;
+  int conflict = FALSE;
+  for (Ins *ins = first; ins && ins->op == IR_PARAM; ins = ins->next) {
+    cnt++;
+    if (!ins->dst || !cg_fn->use_cnt[ins->dst])
+      continue;
+    for (Ins *later = ins->next; later && later->op == IR_PARAM; later = later->next)
+      if (in_reg(ins->dst, arg_reg(later->imm2)))
+        conflict = TRUE;
+  }
+
+  Ins **params = arena_alloc(local_arena, sizeof(Ins *) * cnt);
+  int i = 0;
+  for (Ins *ins = first; i < cnt; ins = ins->next)
+    params[i++] = ins;
+  if (!conflict) {
+    for (i = 0; i < cnt; i++)
+      receive_param(params[i], arg_reg(params[i]->imm2));
+    return;
+  }
+  for (i = 0; i < cnt; i++)
+    ins_r("push", arg_reg(params[i]->imm2));
+  for (i = cnt - 1; i >= 0; i--) {
+    ins_r("pop", REG_RAX);
+    receive_param(params[i], REG_RAX);
+  }
+}
+
+// 関数から戻る。callee-savedレジスタを元に戻す。
+void gen_return(Ins *ins) {
+  if (ins->a)
+    move_to(REG_RAX, ins->a);
+  int offset = cg_fn->frame_size + cg_fn->spill_size;
+  for (int reg = 0; reg < 16; reg++) {
+    if ((cg_fn->saved_regs >> reg) & 1) {
+      offset += 8;
+      emit_load(reg, 8, REG_RBP, -offset);
+    }
+  }
+  ins_rr("mov", REG_RSP, REG_RBP);
+  ins_r("pop", REG_RBP);
+  ins0("ret");
+}
+
+// kが2の累乗ならその指数を、そうでなければ-1を返す
+int log2_of(int k) {
+  if (k <= 0)
+    return -1;
+  int s = 0;
+  while (k % 2 == 0) {
+    k = k / 2;
+    s++;
+  }
+  if (k != 1)
+    return -1;
+  return s;
+}
+
+// 定数kを掛ける。2の累乗はシフト, 3, 5, 9とその2の累乗倍はleaで計算する。
+void gen_mul_const(Ins *ins, int v, int k) {
+  int d = def_reg(ins->dst);
+  int shift = 0;
+  int base = k;
+  while (base > 0 && base % 2 == 0) {
+    base = base / 2;
+    shift++;
+  }
+  if (k == 0) {
+    ins_ri("mov", d, 0);
+    shift = 0;
+  } else if (k == -1) {
+    move_to(d, v);
+    ins_r("neg", d);
+  } else if (base == 1) {
+    move_to(d, v);
+  } else if (base == 3 || base == 5 || base == 9) {
+    int r = use_reg(v, REG_RAX);
+    begin_ins("lea");
+    opd_reg(d, 8);
+    opd_index(r, r, base - 1);
+    end_ins();
+  } else {
+    begin_ins("imul");
+    opd_reg(d, 8);
+    opd_vreg(v, 8);
+    opd_imm(k);
+    end_ins();
+    shift = 0;
+  }
+  if (shift)
+    ins_ri("shl", d, shift);
+  set_vreg(ins->dst, d);
+}
+
+// (2 * r) mod d を求める (0 <= r < d)。2 * rがintからあふれないように引き算で求める。
+int double_mod(int r, int d) {
+  if (r >= d - r)
+    return r - (d - r);
+  return r + r;
+}
+
+// 3以上で2の累乗でない定数dで割るための掛け算の定数を求める。
+// m = ceil(2^p / d) として、|n| <= 2^31 のすべてのnについて floor(n * m / 2^p) が
+// n / d の商 (nが負なら商 - 1) になる最小のp (32以上) を選ぶ。その条件は
+// e = m * d - 2^p について e * 2^31 < 2^p となること。
+// mは2^32未満になるので、intとして読んだ値 (2^31以上ならm - 2^32) を*magicに,
+// p - 32を*shiftに入れる。求められなければFALSEを返す。
+int div_magic(int d, int *magic, int *shift) {
+  int r = 1;
+  int p = 0;
+  while (p < 32) {
+    r = double_mod(r, d);
+    p++;
+  }
+  while (p - 31 < 31 && d - r >= (1 << (p - 31))) {
+    r = double_mod(r, d);
+    p++;
+  }
+
+  // floor(2^p / d) を16ビットずつに分けて筆算で求める
+  int rem = 0;
+  int hi = 0;
+  int lo = 0;
+  for (int i = 0; i <= p; i++) {
+    int bit = i == 0;
+    int q = 0;
+    if (rem >= d - rem - bit) {
+      rem = rem - (d - rem - bit);
+      q = 1;
     } else {
-      printf("  je .Lend%d\n", node->id);
-      gen(node->then);
-      printf(".Lend%d:\n", node->id);
+      rem = rem + rem + bit;
     }
+    lo = lo * 2 + q;
+    hi = hi * 2 + lo / 65536;
+    lo = lo % 65536;
+  }
+  lo++;
+  hi = hi + lo / 65536;
+  lo = lo % 65536;
+  if (hi >= 65536)
+    return FALSE;
+  if (hi >= 32768)
+    hi = hi - 65536;
+  *magic = hi * 65536 + lo;
+  *shift = p - 32;
+  return TRUE;
+}
+
+// 定数dで割った商か余りを求める。2の累乗は負の数を丸める補正を足してからシフトし、
+// それ以外は掛け算の上位の桁から商を求める。掛け算は被除数がintに収まるときだけ使い、
+// ポインタの差のような64bitの被除数 (ins->sizeが8) ではFALSEを返す。
+// 作れない定数ならFALSEを返し、呼び出し側がidivを使う。
+int gen_div_const(Ins *ins, int d) {
+  int is_div = ins->op == IR_DIV;
+  int abs_d = d;
+  if (d < 0)
+    abs_d = -d;
+  int k = log2_of(abs_d);
+  int magic;
+  int shift;
+  if (d == -2147483647 - 1 || d == 0)
+    return FALSE;
+  if (k < 0 && (ins->size == 8 || !div_magic(abs_d, &magic, &shift)))
+    return FALSE;
+
+  if (k == 0) {
+    // 1か-1で割る
+    if (is_div) {
+      move_to(REG_RAX, ins->a);
+      if (d < 0)
+        ins_r("neg", REG_RAX);
+    } else {
+      ins_ri("mov", REG_RAX, 0);
+    }
+    set_vreg(ins->dst, REG_RAX);
+    return TRUE;
+  }
+
+  if (k > 0) {
+    move_to(REG_RAX, ins->a);
+    ins_rr("mov", REG_RDX, REG_RAX);
+    if (k == 1) {
+      ins_ri("shr", REG_RDX, 63);
+    } else {
+      ins_ri("sar", REG_RDX, 63);
+      ins_ri("shr", REG_RDX, 64 - k);
+    }
+    ins_rr("add", REG_RDX, REG_RAX);
+    if (is_div) {
+      ins_ri("sar", REG_RDX, k);
+    } else {
+      ins_ri("and", REG_RDX, -abs_d);
+    }
+  } else {
+    int src = REG_RAX;
+    if (is_const(ins->a) || cg_fn->reg[ins->a] < 0) {
+      move_to(REG_RAX, ins->a);
+    } else {
+      src = cg_fn->reg[ins->a];
+    }
+    begin_ins("movsxd");
+    opd_reg(REG_RAX, 8);
+    opd_reg(src, 4);
+    end_ins();
+    begin_ins("imul");
+    opd_reg(REG_RDX, 8);
+    opd_reg(REG_RAX, 8);
+    opd_imm(magic);
+    end_ins();
+    ins_ri("sar", REG_RDX, 32);
+    if (magic < 0)
+      ins_rr("add", REG_RDX, REG_RAX);
+    if (shift)
+      ins_ri("sar", REG_RDX, shift);
+    ins_rr("mov", REG_RCX, REG_RAX);
+    ins_ri("shr", REG_RCX, 63);
+    ins_rr("add", REG_RDX, REG_RCX);
+    if (!is_div) {
+      begin_ins("imul");
+      opd_reg(REG_RDX, 8);
+      opd_reg(REG_RDX, 8);
+      opd_imm(abs_d);
+      end_ins();
+    }
+  }
+
+  if (is_div) {
+    if (d < 0)
+      ins_r("neg", REG_RDX);
+    set_vreg(ins->dst, REG_RDX);
+  } else {
+    ins_rr("sub", REG_RAX, REG_RDX);
+    set_vreg(ins->dst, REG_RAX);
+  }
+  return TRUE;
+}
+
+void gen_ins(Ins *ins, Ins *prev) {
+  IrOp op = ins->op;
+  if (op == IR_PARAM) {
+    if (!prev || prev->op != IR_PARAM)
+      gen_params(ins);
     return;
-  } else if (node->kind == ND_WHILE) {
-    printf(".Lbegin%d:\n", node->id);
-    gen(node->cond);
-    printf("  pop rax\n");
-    printf("  cmp rax, 0\n");
-    printf("  je .Lend%d\n", node->id);
-    gen(node->then);
-    printf(".Lstep%d:\n", node->id);
-    printf("  jmp .Lbegin%d\n", node->id);
-    printf(".Lend%d:\n", node->id);
-    return;
-  } else if (node->kind == ND_DOWHILE) {
-    printf(".Lbegin%d:\n", node->id);
-    gen(node->then);
-    gen(node->cond);
-    printf("  pop rax\n");
-    printf("  cmp rax, 0\n");
-    printf("  je .Lend%d\n", node->id);
-    printf(".Lstep%d:\n", node->id);
-    printf("  jmp .Lbegin%d\n", node->id);
-    printf(".Lend%d:\n", node->id);
-    return;
-  } else if (node->kind == ND_FOR) {
-    gen(node->init);
-    printf(".Lbegin%d:\n", node->id);
-    gen(node->cond);
-    printf("  pop rax\n");
-    printf("  cmp rax, 0\n");
-    printf("  je .Lend%d\n", node->id);
-    gen(node->then);
-    printf(".Lstep%d:\n", node->id);
-    gen(node->step);
-    printf("  jmp .Lbegin%d\n", node->id);
-    printf(".Lend%d:\n", node->id);
-    return;
-  } else if (node->kind == ND_BREAK) {
-    printf("  jmp .Lend%d\n", node->id);
-    return;
-  } else if (node->kind == ND_CONTINUE) {
-    printf("  jmp .Lstep%d\n", node->id);
+  }
+  // 値を読まれない計算は出力しない
+  if (ins->dst && !cg_fn->use_cnt[ins->dst] && op != IR_CALL)
     return;
-  } else if (node->kind == ND_FUNCDEF) {
-    printf("  .globl %.*s\n", node->fn->len, node->fn->name);
-    printf("  .p2align 4\n");
-    printf("%.*s:\n", node->fn->len, node->fn->name);
-    printf("  push rbp\n");
-    printf("  mov rbp, rsp\n");
-    int offset;
-    if (node->fn->offset % 8) {
-      offset = (node->fn->offset / 8 + 1) * 8;
+
+  if (op == IR_IMM) {
+    if (is_const(ins->dst))
+      return;
+    int d = def_reg(ins->dst);
+    ins_ri("mov", d, ins->imm);
+    set_vreg(ins->dst, d);
+  } else if (op == IR_MOV) {
+    int d = def_reg(ins->dst);
+    move_to(d, ins->a);
+    set_vreg(ins->dst, d);
+  } else if (op == IR_LOCAL || op == IR_GLOBAL || op == IR_STR || op == IR_ARR) {
+    int d = def_reg(ins->dst);
+    begin_ins("lea");
+    opd_reg(d, 8);
+    if (op == IR_LOCAL) {
+      opd_mem(0, REG_RBP, -ins->imm);
+    } else if (op == IR_GLOBAL) {
+      LVar *var = ins->sym;
+      opd_global(var->name, var->len);
+    } else if (op == IR_STR) {
+      opd_literal(".L.str", ins->imm);
     } else {
-      offset = node->fn->offset;
+      opd_literal(".L.arr", ins->imm);
     }
-    printf("  sub rsp, %d\n", offset);
-    for (int i = 0; i < node->val; i++) {
-      gen_lval(node->args[i]);
-      printf("  pop rax\n");
-      if (node->args[i]->type->ty == TY_INT) {
-        printf("  mov DWORD PTR [rax], %s\n", regs4(i));
-      } else if (node->args[i]->type->ty == TY_CHAR) {
-        printf("  mov BYTE PTR [rax], %s\n", regs1(i));
-      } else if (node->args[i]->type->ty == TY_PTR || node->args[i]->type->ty == TY_ARGARR) {
-        printf("  mov QWORD PTR [rax], %s\n", regs8(i));
-      } else {
-        error("invalid type [in ND_FUNCDEF]");
-      }
+    end_ins();
+    set_vreg(ins->dst, d);
+  } else if (op == IR_LOAD || op == IR_LLOAD) {
+    int base = REG_RBP;
+    if (op == IR_LOAD)
+      base = use_reg(ins->a, REG_RAX);
+    int d = def_reg(ins->dst);
+    if (op == IR_LOAD) {
+      emit_load(d, ins->size, base, 0);
+    } else {
+      emit_load(d, ins->size, REG_RBP, -ins->imm);
     }
-    gen(node->lhs);
-    if (node->fn->type->ty == TY_VOID || startswith(node->fn->name, "main") && node->fn->len == 4) {
-      printf("  mov rsp, rbp\n");
-      printf("  pop rbp\n");
-      printf("  ret\n");
+    set_vreg(ins->dst, d);
+  } else if (op == IR_STORE || op == IR_LSTORE) {
+    int val;
+    if (op == IR_STORE) {
+      int base = use_reg(ins->a, REG_RAX);
+      val = use_reg(ins->b, REG_RCX);
+      begin_ins("mov");
+      opd_mem(ins->size, base, 0);
+    } else {
+      val = use_reg(ins->b, REG_RAX);
+      begin_ins("mov");
+      opd_mem(ins->size, REG_RBP, -ins->imm);
     }
-    return;
-  } else if (node->kind == ND_FUNCALL) {
-    for (int i = 0; i < node->val; i++) {
-      gen(node->args[i]);
+    opd_reg(val, ins->size);
+    end_ins();
+  } else if (op == IR_COPY) {
+    gen_copy(ins);
+  } else if (op == IR_CALL) {
+    gen_call(ins);
+  } else if (op == IR_JMP) {
+    if (ins->then_blk != cg_next)
+      emit_jmp("mp", ins->then_blk);
+  } else if (op == IR_BR) {
+    gen_branch(ins, prev);
+  } else if (op == IR_RET) {
+    gen_return(ins);
+  } else if (op == IR_EQ || op == IR_NE || op == IR_LT || op == IR_LE || op == IR_NOT) {
+    if (is_fused(ins))
+      return;
+    char *cc = gen_compare(ins);
+    begin_ins_cc("set", cc);
+    opd_reg(REG_RAX, 1);
+    end_ins();
+    begin_ins("movzx");
+    opd_reg(REG_RAX, 8);
+    opd_reg(REG_RAX, 1);
+    end_ins();
+    set_vreg(ins->dst, REG_RAX);
+  } else if (op == IR_DIV || op == IR_MOD) {
+    if (opt_level && is_const(ins->b) && gen_div_const(ins, const_val(ins->b)))
+      return;
+    move_to(REG_RAX, ins->a);
+    ins0("cqo");
+    if (is_const(ins->b)) {
+      move_to(REG_RCX, ins->b);
+      ins_r("idiv", REG_RCX);
+    } else {
+      begin_ins("idiv");
+      opd_vreg(ins->b, 8);
+      end_ins();
     }
-    for (int i = node->val - 1; i >= 0; i--) {
-      printf("  pop rax\n");
-      if (node->args[i]->type->ty == TY_INT) {
-        printf("  mov %s, eax\n", regs4(i));
-      } else if (node->args[i]->type->ty == TY_CHAR) {
-        printf("  movzx %s, al\n", regs4(i));
-      } else if (is_ptr_or_arr(node->args[i]->type)) {
-        printf("  mov %s, rax\n", regs8(i));
+    if (op == IR_DIV) {
+      set_vreg(ins->dst, REG_RAX);
+    } else {
+      set_vreg(ins->dst, REG_RDX);
+    }
+  } else if (op == IR_SHL || op == IR_SAR) {
+    char *name = "shl";
+    if (op == IR_SAR)
+      name = "sar";
+    // シフト量はCLレジスタか即値で指定する
+    if (!is_const(ins->b))
+      move_to(REG_RCX, ins->b);
+    int d = def_reg(ins->dst);
+    move_to(d, ins->a);
+    begin_ins(name);
+    opd_reg(d, 8);
+    if (is_const(ins->b)) {
+      opd_imm(const_val(ins->b));
+    } else {
+      opd_reg(REG_RCX, 1);
+    }
+    end_ins();
+    set_vreg(ins->dst, d);
+  } else if (op == IR_EXT) {
+    int d = def_reg(ins->dst);
+    if (is_const(ins->a)) {
+      int val = const_val(ins->a);
+      if (ins->size == 1)
+        val = val & 255;
+      ins_ri("mov", d, val);
+    } else {
+      if (ins->size == 4) {
+        begin_ins("movsxd");
       } else {
-        error("invalid type [in ND_FUNCALL]");
+        begin_ins("movzx");
       }
+      opd_reg(d, 8);
+      opd_vreg(ins->a, ins->size);
+      end_ins();
     }
-    // Align stack
-    printf("  mov rax, rsp\n");
-    printf("  and rax, 0xF\n");
-    printf("  cmp rax, 0\n");
-    printf("  je .Laligned%d\n", node->id);
-    printf("  sub rsp, 8\n");
-    printf("  jmp .Lfixup%d\n", node->id);
-    printf(".Laligned%d:\n", node->id);
-    printf("  mov rax, 0\n");
-    printf("  call %.*s\n", node->fn->len, node->fn->name);
-    printf("  jmp .Lend%d\n", node->id);
-    printf(".Lfixup%d:\n", node->id);
-    printf("  call %.*s\n", node->fn->len, node->fn->name);
-    printf("  add rsp, 8\n");
-    printf(".Lend%d:\n", node->id);
-    if (!node->endline)
-      printf("  push rax\n");
-    return;
-  } else if (node->kind == ND_AND) {
-    gen(node->lhs);
-    printf("  pop rdi\n");
-    printf("  cmp rdi, 0\n");
-    printf("  mov rax, 0\n");
-    printf("  je .Llogical%d\n", node->id);
-    gen(node->rhs);
-    printf("  pop rdi\n");
-    printf("  cmp rdi, 0\n");
-    printf("  mov rax, 0\n");
-    printf("  je .Llogical%d\n", node->id);
-    printf("  mov rax, 1\n");
-    printf(".Llogical%d:\n", node->id);
-    if (!node->endline)
-      printf("  push rax\n");
-    return;
-  } else if (node->kind == ND_OR) {
-    gen(node->lhs);
-    printf("  pop rdi\n");
-    printf("  cmp rdi, 0\n");
-    printf("  mov rax, 1\n");
-    printf("  jne .Llogical%d\n", node->id);
-    gen(node->rhs);
-    printf("  pop rdi\n");
-    printf("  cmp rdi, 0\n");
-    printf("  mov rax, 1\n");
-    printf("  jne .Llogical%d\n", node->id);
-    printf("  mov rax, 0\n");
-    printf(".Llogical%d:\n", node->id);
-    if (!node->endline)
-      printf("  push rax\n");
-    return;
-  } else if ((node->kind == ND_GLBDEC) || (node->kind == ND_VARDEC) || (node->kind == ND_EXTERN) ||
-             (node->kind == ND_TYPEDEF) || (node->kind == ND_ENUM) || (node->kind == ND_STRUCT) ||
-             (node->kind == ND_TYPE || node->kind == ND_NONE)) {
-    return;
+    set_vreg(ins->dst, d);
+  } else if (op == IR_BITNOT) {
+    int d = def_reg(ins->dst);
+    move_to(d, ins->a);
+    ins_r("not", d);
+    set_vreg(ins->dst, d);
+  } else if (op == IR_MUL && opt_level && is_const(ins->b) && !is_const(ins->a)) {
+    gen_mul_const(ins, ins->a, const_val(ins->b));
+  } else if (op == IR_MUL && opt_level && is_const(ins->a) && !is_const(ins->b)) {
+    gen_mul_const(ins, ins->b, const_val(ins->a));
+  } else {
+    char *name;
+    if (op == IR_ADD)
+      name = "add";
+    else if (op == IR_SUB)
+      name = "sub";
+    else if (op == IR_MUL)
+      name = "imul";
+    else if (op == IR_AND)
+      name = "and";
+    else if (op == IR_OR)
+      name = "or";
+    else if (op == IR_XOR)
+      name = "xor";
+    else
+      error("invalid IR op: %d", op);
+    // 右辺と同じレジスタに結果を入れるときは、右辺を壊さないようにraxで計算する
+    int d = def_reg(ins->dst);
+    if (ins->a != ins->b && in_reg(ins->b, d))
+      d = REG_RAX;
+    move_to(d, ins->a);
+    emit_op(name, d, ins->b);
+    set_vreg(ins->dst, d);
   }
+}
 
-  gen(node->lhs);
-  gen(node->rhs);
-
-  printf("  pop rdi\n");
-  printf("  pop rax\n");
-
-  if (node->kind == ND_ADD) {
-    printf("  add rax, rdi\n");
-  } else if (node->kind == ND_SUB) {
-    printf("  sub rax, rdi\n");
-  } else if (node->kind == ND_MUL) {
-    printf("  imul rax, rdi\n");
-  } else if (node->kind == ND_DIV) {
-    printf("  cqo\n");
-    printf("  idiv rdi\n");
-  } else if (node->kind == ND_MOD) {
-    printf("  cqo\n");
-    printf("  idiv rdi\n");
-    printf("  mov rax, rdx\n");
-  } else if (node->kind == ND_EQ) {
-    printf("  cmp rax, rdi\n");
-    printf("  sete al\n");
-    printf("  movzx rax, al\n");
-  } else if (node->kind == ND_NE) {
-    printf("  cmp rax, rdi\n");
-    printf("  setne al\n");
-    printf("  movzx rax, al\n");
-  } else if (node->kind == ND_LT) {
-    printf("  cmp rax, rdi\n");
-    printf("  setl al\n");
-    printf("  movzx rax, al\n");
-  } else if (node->kind == ND_LE) {
-    printf("  cmp rax, rdi\n");
-    printf("  setle al\n");
-    printf("  movzx rax, al\n");
-  } else if (node->kind == ND_BITAND) {
-    printf("  and rax, rdi\n");
-  } else if (node->kind == ND_BITOR) {
-    printf("  or rax, rdi\n");
-  } else if (node->kind == ND_BITXOR) {
-    printf("  xor rax, rdi\n");
-  } else if (node->kind == ND_SHL) {
-    // シフト量は CL レジスタで指定する
-    printf("  mov rcx, rdi\n");
-    printf("  shl rax, cl\n");
-  } else if (node->kind == ND_SHR) {
-    // シフト量は CL レジスタで指定する
-    printf("  mov rcx, rdi\n");
-    printf("  sar rax, cl\n");
-  } else {
-    error("invalid node kind");
+void gen_function(IrFunc *f) {
+  Function *fn = f->fn;
+  cg_fn = f;
+  int saved_cnt = 0;
+  for (int reg = 0; reg < 16; reg++)
+    if ((f->saved_regs >> reg) & 1)
+      saved_cnt++;
+  int frame = (f->frame_size + f->spill_size + saved_cnt * 8 + 15) / 16 * 16;
+
+  gen_globl(fn->name, fn->len);
+  gen_align(4);
+  gen_label(fn->name, fn->len);
+  ins_r("push", REG_RBP);
+  ins_rr("mov", REG_RBP, REG_RSP);
+  ins_ri("sub", REG_RSP, frame);
+  int offset = f->frame_size + f->spill_size;
+  for (int reg = 0; reg < 16; reg++) {
+    if ((f->saved_regs >> reg) & 1) {
+      offset += 8;
+      begin_ins("mov");
+      opd_mem(8, REG_RBP, -offset);
+      opd_reg(reg, 8);
+      end_ins();
+    }
+  }
+
+  for (Block *blk = f->entry; blk; blk = blk->next) {
+    if (blk != f->entry)
+      gen_block_label(blk);
+    cg_next = blk->next;
+    Ins *prev = NULL;
+    for (Ins *ins = blk->first; ins; ins = ins->next) {
+      gen_ins(ins, prev);
+      prev = ins;
+    }
+  }
+}
+
+// 大域変数, 文字列リテラル, 配列リテラルを出力する
+void gen_data() {
+  // グローバル変数の定義
+  gen_section(SEC_DATA);
+  for (LVar *var = globals; var->next; var = var->next) {
+    if (var->ext) {
+      continue;
+    }
+    gen_globl(var->name, var->len);
+    gen_align(3);
+    gen_label(var->name, var->len);
+    if (var->offset) {
+      gen_long(var->offset);
+    } else {
+      gen_zero(get_sizeof(var->type));
+    }
+  }
+
+  // 文字列リテラルと配列リテラルは書き換えないので読み込み専用にする
+  gen_section(SEC_RODATA);
+  for (String *str = strings; str->next; str = str->next) {
+    gen_literal_label(".L.str", str->id);
+    gen_string(str->text, str->len);
   }
 
-  if (!node->endline)
-    printf("  push rax\n");
+  // 配列リテラル
+  for (Array *arr = arrays; arr->next; arr = arr->next) {
+    gen_literal_label(".L.arr", arr->id);
+    for (int i = 0; i < arr->len; i++) {
+      if (arr->byte == 1) {
+        gen_byte(arr->val[i]);
+      } else if (arr->byte == 4) {
+        gen_long(arr->val[i]);
+      } else {
+        error("invalid array type [INIT]");
+      }
+    }
+  }
+}
+
+// 最上位の宣言を出力する。関数定義は構文木の定数を畳み込み、低水準IRに変換して最適化し、レジスタを割り付けてから出力する。
+void gen(Node *node) {
+  if (node->kind != ND_FUNCDEF)
+    return;
+  if (opt_level)
+    node->lhs = fold(node->lhs);
+  IrFunc *f = lower_function(node);
+  optimize(f);
+  alloc_registers(f);
+  gen_function(f);
 }
@@ -0,0 +1,366 @@
+
+#include "lacc.h"
+
+char *user_input;
+TokenBuf *tokens;
+int token;
+int code;
+int label_cnt = 0;
+int array_cnt = 0;
+int loop_cnt = 0;
+int variable_cnt = 0;
+int logical_cnt = 0;
+int block_label_cnt = 0; // 低水準IRのブロックのラベル番号
+int loop_id = -1;
+Function *functions;
+Function *current_fn;
+LVar *globals;
+Struct *structs;
+StructTag *struct_tags;
+Enum *enums;
+LVar *enum_members;
+String *strings;
+Array *arrays;
+String *filenames;
+HashMap *function_table;
+HashMap *global_table;
+HashMap *local_table;
+HashMap *struct_table;
+HashMap *struct_tag_table;
+HashMap *enum_table;
+HashMap *enum_member_table;
+Scope *scope;
+HashMap *ident_table;
+HashMap *string_table;
+Ident *main_ident;
+int typedef_gen = 1;
+Arena *node_arena;
+Arena *type_arena;
+Arena *symbol_arena;
+Arena *local_arena;
+HashEntry *free_entries;
+Scope *free_scopes;
+Type *basic_types[8];
+Type **type_table;
+int type_table_cap;
+int type_cnt = 0;
+Node **node_pages;
+int node_page_cnt = 0;
+int node_cnt = 0;
+int *node_list;
+int node_list_len = 0;
+int node_list_cap = 0;
+int *node_scratch;
+int scratch_len = 0;
+int scratch_cap = 0;
+char *filename;
+char *consumed_ptr;
+
+// 常駐しているときに読み込み済みのヘッダ (warm_header)
+char *warm_name; // #includeに書かれた名前
+char *warm_key;  // ファイルの識別子と更新時刻 (NULLなら読み込み済みのヘッダはない)
+int warm_code;   // ヘッダの文の子ノード列
+
+int TRUE = 1;
+int FALSE = 0;
+void *NULL = 0;
+
+// コンパイルの状態をすべて初期状態に戻す。
+// 直前のコンパイルの領域はfree_global_variablesで解放しておくこと。
+void init_global_variables() {
+  label_cnt = 0;
+  array_cnt = 0;
+  loop_cnt = 0;
+  variable_cnt = 0;
+  logical_cnt = 0;
+  block_label_cnt = 0;
+  loop_id = -1;
+  typedef_gen = 1;
+  token = 0;
+  code = 0;
+
+  // アリーナの初期化
+  node_arena = new_arena();
+  type_arena = new_arena();
+  symbol_arena = new_arena();
+  local_arena = new_arena();
+  free_entries = NULL;
+  free_scopes = NULL;
+
+  // 型表の初期化
+  for (int i = 0; i < 8; i++)
+    basic_types[i] = NULL;
+  type_table = NULL;
+  type_table_cap = 0;
+  type_cnt = 0;
+
+  // ノード番号0は子ノードなしを表すので予約しておく
+  node_pages = NULL;
+  node_list = NULL;
+  node_scratch = NULL;
+  node_page_cnt = 0;
+  node_cnt = 0;
+  node_list_len = 0;
+  node_list_cap = 0;
+  scratch_len = 0;
+  scratch_cap = 0;
+  new_node(ND_NONE);
+
+  // 識別子表の初期化
+  ident_table = new_hashmap(1024);
+  main_ident = intern("main", 4);
+
+  // functionの初期化
+  functions = arena_alloc(symbol_arena, sizeof(Function));
+  functions->next = NULL;
+  current_fn = functions;
+  function_table = new_hashmap(256);
+  local_table = new_hashmap(64);
+  scope = NULL;
+
+  // enumの初期化
+  enums = arena_alloc(symbol_arena, sizeof(Enum));
+  enums->next = NULL;
+  enum_members = arena_alloc(symbol_arena, sizeof(LVar));
+  enum_members->next = NULL;
+  enum_members->type = new_type(TY_NONE);
+  enum_table = new_hashmap(64);
+  enum_member_table = new_hashmap(256);
+
+  // 構造体の初期化
+  structs = arena_alloc(symbol_arena, sizeof(Struct));
+  structs->next = NULL;
+  struct_tags = arena_alloc(symbol_arena, sizeof(StructTag));
+  struct_tags->next = NULL;
+  struct_table = new_hashmap(64);
+  struct_tag_table = new_hashmap(64);
+
+  // グローバル変数の初期化
+  globals = arena_alloc(symbol_arena, sizeof(LVar));
+  globals->next = NULL;
+  globals->type = new_type(TY_NONE);
+  global_table = new_hashmap(256);
+
+  // 文字列リテラルの初期化
+  strings = arena_alloc(symbol_arena, sizeof(String));
+  strings->next = NULL;
+  string_table = new_hashmap(64);
+  arrays = arena_alloc(symbol_arena, sizeof(Array));
+  arrays->next = NULL;
+
+  // トークンの初期化
+  init_lexer();
+  new_token_buf();
+}
+
+// コンパイルで確保した領域をすべて解放する
+void free_global_variables() {
+  if (tokens)
+    free_token_buf(tokens);
+  tokens = NULL;
+  free(node_pages);
+  free(node_list);
+  free(node_scratch);
+  free(type_table);
+  node_pages = NULL;
+  node_page_cnt = 0;
+  node_list = NULL;
+  node_scratch = NULL;
+  type_table = NULL;
+  arena_reset(node_arena);
+  arena_reset(type_arena);
+  arena_reset(symbol_arena);
+  arena_reset(local_arena);
+  free(node_arena);
+  free(type_arena);
+  free(symbol_arena);
+  free(local_arena);
+  node_arena = NULL;
+  type_arena = NULL;
+  symbol_arena = NULL;
+  local_arena = NULL;
+  // エラーで中断したときは出力が溜まったままになっている
+  free(detach_output());
+}
+
+// srcの先頭が #include "名前" ならその名前を返す (空白と//のコメントは読み飛ばす)
+char *first_include(char *src) {
+  char *p = src;
+  for (;;) {
+    while (isspace(*p))
+      p++;
+    if (!startswith(p, "//"))
+      break;
+    while (*p && *p != '\n')
+      p++;
+  }
+  if (!startswith(p, "#include"))
+    return NULL;
+  p += 8;
+  while (*p == ' ' || *p == '\t')
+    p++;
+  if (*p != '"')
+    return NULL;
+  char *q = ++p;
+  while (*p && *p != '"' && *p != '\n')
+    p++;
+  if (*p != '"')
+    return NULL;
+  char *name = malloc(p - q + 1);
+  memcpy(name, q, p - q);
+  name[p - q] = '\0';
+  return name;
+}
+
+// srcが先頭で読み込むヘッダを、変更されないまま読み込み済みならTRUEを返す
+int is_warm(char *src) {
+  if (!warm_key)
+    return FALSE;
+  char *name = first_include(src);
+  if (!name)
+    return FALSE;
+  int warm = FALSE;
+  if (!strcmp(name, warm_name)) {
+    char *key = file_key(name);
+    warm = key && !strcmp(key, warm_key);
+    free(key);
+  }
+  free(name);
+  return warm;
+}
+
+// 常駐しているときに、inputが先頭で読み込むヘッダをパースしておく。
+// 以降にparse_sourceでコンパイルするファイルは、ヘッダの続きからパースできる。
+// ヘッダがすでに読み込み済みで変更されていなければ何もしない。
+void warm_header(char *input) {
+  // 先頭の#includeを探すだけなので、マップせずに先頭の4KBだけを読む。
+  // read_fileでマップすると、常駐しているプロセスにコンパイルしたファイルがすべて残ってしまう。
+  char *src = read_head(input, 4096);
+  char *name = NULL;
+  if (!is_warm(src))
+    name = first_include(src);
+  free(src);
+  if (!name)
+    return;
+  char *key = file_key(name);
+  if (!key) {
+    free(name);
+    return;
+  }
+  drop_warm_header();
+  parse_source(name, read_file(name));
+  warm_name = name;
+  warm_key = key;
+  warm_code = code;
+}
+
+// 読み込み済みのヘッダを捨てる (パースの途中でエラーになったときも呼ぶ)
+void drop_warm_header() {
+  if (node_arena)
+    free_global_variables();
+  free(warm_name);
+  free(warm_key);
+  warm_name = NULL;
+  warm_key = NULL;
+}
+
+// srcをnameという名前のファイルの内容として読み始め、最初のトークンを読む。
+// srcの直後は'\0'で終わっていなければならない。
+// 先頭で読み込むヘッダがパース済みなら、その続きから読んでTRUEを返す。
+int start_source(char *name, char *src) {
+  int warm = is_warm(src);
+  if (warm) {
+    new_token_buf();
+  } else {
+    init_global_variables();
+  }
+
+  filename = name;
+  filenames = arena_alloc(symbol_arena, sizeof(String));
+  filenames->text = filename;
+  filenames->len = strlen(filename);
+  filenames->next = NULL;
+  if (warm) {
+    // ヘッダの#includeは読み込み済みとして読み飛ばす
+    filenames->next = arena_alloc(symbol_arena, sizeof(String));
+    filenames->next->text = warm_name;
+    filenames->next->len = strlen(warm_name);
+    filenames->next->next = NULL;
+  }
+  user_input = src;
+
+  // パーサーがトークンを読み進めるたびに字句解析する
+  start_lexer();
+  token = 1;
+  return warm;
+}
+
+// 読み終えたらトークンは不要なので解放する
+void end_source() {
+  free_token_buf(tokens);
+  tokens = NULL;
+  token = 0;
+}
+
+// srcをnameという名前のファイルの内容としてトークナイズしてパースする。
+// 結果はcodeに保存される
+void parse_source(char *name, char *src) {
+  int warm = start_source(name, src);
+  program();
+
+  // ヘッダの文を前に付け足して、ヘッダごとパースしたときと同じ並びにする
+  if (warm) {
+    int mark = scratch_len;
+    for (int i = 0; i < list_len(warm_code); i++)
+      push_scratch(node_list[warm_code + 1 + i]);
+    for (int i = 0; i < list_len(code); i++)
+      push_scratch(node_list[code + 1 + i]);
+    code = make_list(mark);
+  }
+  end_source();
+}
+
+// ファイルを読み込んでトークナイズしてパースする
+void parse_file(char *input) { parse_source(input, read_file(input)); }
+
+// トップレベルの宣言のコードを出力し終えたら、そのノードとローカル変数の領域を再利用する
+void release_nodes() {
+  node_cnt = 1;
+  node_list_len = 0;
+  arena_rewind(local_arena);
+}
+
+// srcをnameという名前のファイルの内容としてコンパイルし、アセンブリを出力先に書き出す。
+// begin_assemble()の後なら、アセンブリの代わりに機械語をasm.cのセクションに書き込む。
+// トップレベルの宣言を1つ読むたびにそのコードを出力するので、
+// 構文木はコンパイル中の宣言の分しか持たない。
+// グローバル変数とリテラルのデータは最後にまとめて出力する。
+void gen_source(char *name, char *src) {
+  int warm = start_source(name, src);
+  gen_start();
+  if (warm) {
+    for (int i = 0; i < list_len(warm_code); i++)
+      gen(list_at(warm_code, i));
+  }
+  release_nodes();
+
+  while (tokens->kind[token] != TK_EOF) {
+    gen(node_at(stmt()));
+    release_nodes();
+    recycle_tokens();
+  }
+  gen_data();
+  end_source();
+}
+
+// ファイルを読み込んでコンパイルし、アセンブリを出力先に書き出す
+void gen_file(char *input) { gen_source(input, read_file(input)); }
+
+// srcをアセンブリに変換してメモリ上に出力する。
+// 出力は呼び出し側が解放し、その長さは*lenに入れる。
+char *compile_source(char *name, char *src, int *len) {
+  open_output_memory();
+  gen_source(name, src);
+  *len = output_len();
+  return detach_output();
+}
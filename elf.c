@@ -0,0 +1,193 @@
+
+#include "lacc.h"
+
+extern ByteBuf *asm_sections[4];
+extern int asm_align[4];
+extern AsmSymbol *asm_symbols;
+extern AsmReloc *asm_relocs;
+
+extern int TRUE;
+extern int FALSE;
+extern void *NULL;
+
+// セクション番号。SectionKindの値と.text, .data, .rodataの番号は一致させる。
+int SHN_TEXT = 1;
+int SHN_RELA = 4;
+int SHN_SYMTAB = 5;
+int SHN_STRTAB = 6;
+int SHN_SHSTRTAB = 7;
+int SHN_NOTE = 8;
+int SHN_COUNT = 9;
+
+// ELFのセクションとシンボルの属性
+int SHT_PROGBITS = 1;
+int SHT_SYMTAB = 2;
+int SHT_STRTAB = 3;
+int SHT_RELA = 4;
+int SHF_WRITE = 1;
+int SHF_ALLOC = 2;
+int SHF_EXECINSTR = 4;
+int SHF_INFO_LINK = 64;
+int STB_GLOBAL = 1;
+int STT_OBJECT = 1;
+int STT_FUNC = 2;
+int STT_SECTION = 3;
+
+// セクションヘッダの前半 (名前, 種類, 属性, ファイル上の位置と大きさ)
+void section_header(ByteBuf *buf, int name, int type, int flags, int offset, int size) {
+  buf_int32(buf, name);
+  buf_int32(buf, type);
+  buf_int64(buf, flags);
+  buf_int64(buf, 0); // sh_addr
+  buf_int64(buf, offset);
+  buf_int64(buf, size);
+}
+
+// セクションヘッダの後半 (関連するセクション, 境界, 要素の大きさ)
+void section_link(ByteBuf *buf, int link, int info, int align, int entsize) {
+  buf_int32(buf, link);
+  buf_int32(buf, info);
+  buf_int64(buf, align);
+  buf_int64(buf, entsize);
+}
+
+void elf_symbol(ByteBuf *buf, int name, int info, int shndx, int value, int size) {
+  buf_int32(buf, name);
+  buf_byte(buf, info);
+  buf_byte(buf, 0); // st_other
+  buf_int16(buf, shndx);
+  buf_int64(buf, value);
+  buf_int64(buf, size);
+}
+
+// セクションの中身を境界に揃えて書き、その位置を返す
+int append_section(ByteBuf *out, ByteBuf *sec, int align) {
+  buf_align(out, align, 0);
+  int offset = out->len;
+  buf_mem(out, sec->data, sec->len);
+  return offset;
+}
+
+// begin_assemble()からend_assemble()までに作った機械語を再配置可能なELF64のオブジェクトファイルとして書き出す
+void write_object(char *path) {
+  ByteBuf *symtab = new_byte_buf();
+  ByteBuf *strtab = new_byte_buf();
+  ByteBuf *rela = new_byte_buf();
+  ByteBuf *shstrtab = new_byte_buf();
+
+  // シンボルテーブル: 空のシンボル, セクションシンボル, 大域シンボルの順
+  buf_byte(strtab, 0);
+  elf_symbol(symtab, 0, 0, 0, 0, 0);
+  for (int i = SEC_TEXT; i <= SEC_RODATA; i++)
+    elf_symbol(symtab, 0, STT_SECTION, i, 0, 0);
+  int first_global = SEC_RODATA + 1;
+  int sym_cnt = first_global;
+
+  // 局所的なラベルはセクションシンボルからの位置で参照するので出力しない。
+  // 未定義のシンボルは他のオブジェクトで定義される大域シンボルとして扱う。
+  for (AsmSymbol *sym = asm_symbols; sym; sym = sym->next) {
+    if (sym->section != SEC_NONE && !sym->global) {
+      sym->index = 0;
+      continue;
+    }
+    int type = 0;
+    if (sym->section == SEC_TEXT) {
+      type = STT_FUNC;
+    } else if (sym->section != SEC_NONE) {
+      type = STT_OBJECT;
+    }
+    elf_symbol(symtab, strtab->len, STB_GLOBAL * 16 + type, sym->section, sym->offset, sym->size);
+    buf_mem(strtab, sym->ident->name, sym->ident->len);
+    buf_byte(strtab, 0);
+    sym->index = sym_cnt++;
+  }
+
+  for (AsmReloc *rel = asm_relocs; rel; rel = rel->next) {
+    if (rel->section != SEC_TEXT)
+      error("relocation outside .text is not supported [in write_object]");
+    AsmSymbol *sym = rel->sym;
+    int index = sym->index;
+    int addend = rel->addend;
+    if (!index) {
+      index = sym->section;
+      addend = addend + sym->offset;
+    }
+    buf_int64(rela, rel->offset);
+    buf_int32(rela, rel->type);
+    buf_int32(rela, index);
+    buf_int64(rela, addend);
+  }
+
+  int names[9] = {0, 0, 0, 0, 0, 0, 0, 0, 0};
+  char *shnames = "\0.text\0.data\0.rodata\0.rela.text\0.symtab\0.strtab\0.shstrtab\0.note.GNU-stack\0";
+  int pos = 1;
+  for (int i = 1; i < SHN_COUNT; i++) {
+    names[i] = pos;
+    pos = pos + strlen(shnames + pos) + 1;
+  }
+  buf_mem(shstrtab, shnames, pos);
+
+  // ELFヘッダ。セクションヘッダの位置は最後に埋める。
+  ByteBuf *out = new_byte_buf();
+  char *ident = "\177ELF\2\1\1";
+  buf_mem(out, ident, 7);
+  for (int i = 7; i < 16; i++)
+    buf_byte(out, 0);
+  buf_int16(out, 1);  // e_type: ET_REL
+  buf_int16(out, 62); // e_machine: EM_X86_64
+  buf_int32(out, 1);  // e_version
+  buf_int64(out, 0);  // e_entry
+  buf_int64(out, 0);  // e_phoff
+  buf_int64(out, 0);  // e_shoff
+  buf_int32(out, 0);  // e_flags
+  buf_int16(out, 64); // e_ehsize
+  buf_int16(out, 0);  // e_phentsize
+  buf_int16(out, 0);  // e_phnum
+  buf_int16(out, 64); // e_shentsize
+  buf_int16(out, SHN_COUNT);
+  buf_int16(out, SHN_SHSTRTAB);
+
+  int offsets[9] = {0, 0, 0, 0, 0, 0, 0, 0, 0};
+  int sizes[9] = {0, 0, 0, 0, 0, 0, 0, 0, 0};
+  for (int i = SEC_TEXT; i <= SEC_RODATA; i++) {
+    offsets[i] = append_section(out, asm_sections[i], asm_align[i]);
+    sizes[i] = asm_sections[i]->len;
+  }
+  offsets[SHN_RELA] = append_section(out, rela, 8);
+  sizes[SHN_RELA] = rela->len;
+  offsets[SHN_SYMTAB] = append_section(out, symtab, 8);
+  sizes[SHN_SYMTAB] = symtab->len;
+  offsets[SHN_STRTAB] = append_section(out, strtab, 1);
+  sizes[SHN_STRTAB] = strtab->len;
+  offsets[SHN_SHSTRTAB] = append_section(out, shstrtab, 1);
+  sizes[SHN_SHSTRTAB] = shstrtab->len;
+  offsets[SHN_NOTE] = out->len;
+
+  buf_align(out, 8, 0);
+  buf_patch32(out, 40, out->len);
+
+  // セクションヘッダ
+  section_header(out, 0, 0, 0, 0, 0);
+  section_link(out, 0, 0, 0, 0);
+  section_header(out, names[1], SHT_PROGBITS, SHF_ALLOC + SHF_EXECINSTR, offsets[1], sizes[1]);
+  section_link(out, 0, 0, asm_align[SEC_TEXT], 0);
+  section_header(out, names[2], SHT_PROGBITS, SHF_ALLOC + SHF_WRITE, offsets[2], sizes[2]);
+  section_link(out, 0, 0, asm_align[SEC_DATA], 0);
+  section_header(out, names[3], SHT_PROGBITS, SHF_ALLOC, offsets[3], sizes[3]);
+  section_link(out, 0, 0, asm_align[SEC_RODATA], 0);
+  section_header(out, names[4], SHT_RELA, SHF_INFO_LINK, offsets[4], sizes[4]);
+  section_link(out, SHN_SYMTAB, SHN_TEXT, 8, 24);
+  section_header(out, names[5], SHT_SYMTAB, 0, offsets[5], sizes[5]);
+  section_link(out, SHN_STRTAB, first_global, 8, 24);
+  section_header(out, names[6], SHT_STRTAB, 0, offsets[6], sizes[6]);
+  section_link(out, 0, 0, 1, 0);
+  section_header(out, names[7], SHT_STRTAB, 0, offsets[7], sizes[7]);
+  section_link(out, 0, 0, 1, 0);
+  // 実行可能なスタックを要求しないことを示す空のセクション
+  section_header(out, names[8], SHT_PROGBITS, 0, offsets[8], 0);
+  section_link(out, 0, 0, 1, 0);
+
+  open_output(path);
+  emit_mem(out->data, out->len);
+  close_output();
+}
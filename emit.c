@@ -0,0 +1,155 @@
+
+#include "lacc.h"
+
+extern int TRUE;
+extern int FALSE;
+extern void *NULL;
+
+// 出力するアセンブリはいったんこの領域に溜め、大きな塊でwriteする
+int OUT_BUF_SIZE = 1048576;
+
+char *out_buf;
+int out_len = 0;
+int out_cap = 0;
+int out_fd = 1; // -1ならメモリに溜める
+// ファイルに書き出すときは、書き終えるまでout_tempに書き、close_outputでout_pathに名前を変える。
+// コンパイルが途中で失敗しても、中途半端な出力ファイルは残らない。
+char *out_path;
+char *out_temp;
+
+// 出力先を設定する。pathがNULLなら標準出力に書き出す。
+void open_output(char *path) {
+  if (!out_buf) {
+    out_buf = malloc(OUT_BUF_SIZE);
+    out_cap = OUT_BUF_SIZE;
+  }
+  out_len = 0;
+  if (path) {
+    int len = strlen(path);
+    out_path = path;
+    out_temp = malloc(len + 5);
+    memcpy(out_temp, path, len);
+    memcpy(out_temp + len, ".tmp", 5);
+    out_fd = create_file(out_temp);
+  } else {
+    out_fd = 1;
+  }
+}
+
+// 出力をファイルに書き出さず、メモリに溜めるようにする (-c でアセンブルするとき)
+void open_output_memory() {
+  open_output(NULL);
+  out_fd = -1;
+}
+
+// メモリに溜めた出力を取り出す。取り出した領域は呼び出し側が解放する。
+char *detach_output() {
+  char *buf = out_buf;
+  out_buf = NULL;
+  out_len = 0;
+  out_cap = 0;
+  out_fd = 1;
+  return buf;
+}
+
+int output_len() { return out_len; }
+
+void write_all(char *p, int len) {
+  while (len > 0) {
+    int n = write(out_fd, p, len);
+    if (n <= 0)
+      error("cannot write output [in write_all]");
+    p = p + n;
+    len -= n;
+  }
+}
+
+// 溜めた出力をすべて書き出す
+void flush_output() {
+  write_all(out_buf, out_len);
+  out_len = 0;
+}
+
+// 出力を書き出して出力先を閉じる
+void close_output() {
+  flush_output();
+  if (out_fd != 1)
+    close(out_fd);
+  out_fd = 1;
+  if (out_temp) {
+    char *temp = out_temp;
+    out_temp = NULL;
+    if (rename(temp, out_path))
+      error("cannot rename %s to %s", temp, out_path);
+    free(temp);
+  }
+}
+
+// エラーで終了するときに、書きかけの出力ファイルを消す
+void discard_output() {
+  if (!out_temp)
+    return;
+  close(out_fd);
+  out_fd = 1;
+  unlink(out_temp);
+  free(out_temp);
+  out_temp = NULL;
+}
+
+void emit_mem(char *s, int len) {
+  if (out_fd == -1 && out_len + len > out_cap) {
+    out_cap = (out_len + len) * 2;
+    out_buf = realloc(out_buf, out_cap);
+    if (!out_buf)
+      error("out of memory [in emit_mem]");
+  } else if (out_len + len > out_cap) {
+    flush_output();
+    // バッファより大きいものは溜めずにそのまま書き出す
+    if (len > out_cap) {
+      write_all(s, len);
+      return;
+    }
+  }
+  memcpy(out_buf + out_len, s, len);
+  out_len += len;
+}
+
+void emit(char *s) { emit_mem(s, strlen(s)); }
+
+// 整数を10進数で出力する。
+// INT_MINでもあふれないように負の数のまま桁を取り出す。
+void emit_int(int val) {
+  char buf[16];
+  int i = 16;
+  int neg = val < 0;
+  if (!neg)
+    val = -val;
+  do {
+    buf[--i] = '0' - val % 10;
+    val /= 10;
+  } while (val);
+  if (neg)
+    buf[--i] = '-';
+  emit_mem(buf + i, 16 - i);
+}
+
+// pre, 整数, post の順に出力する (".Lend12:\n" など)
+void emitn(char *pre, int val, char *post) {
+  emit(pre);
+  emit_int(val);
+  emit(post);
+}
+
+// pre, 文字列, post の順に出力する (レジスタ名など)
+void emits(char *pre, char *s, char *post) {
+  emit(pre);
+  emit(s);
+  emit(post);
+}
+
+// pre, 長さ付きの名前, post の順に出力する (関数名や変数名など)
+void emit_name(char *pre, char *name, int len, char *post) {
+  emit(pre);
+  emit_mem(name, len);
+  emit(post);
+}
@@ -0,0 +1,83 @@
+
+// --run で使う実行時の処理。
+// 実行可能な領域の確保, 共有ライブラリのシンボル解決, 関数ポインタ経由の呼び出しは
+// lacc自身ではコンパイルできないので、extention.cと同じくホストのコンパイラでビルドする。
+// lacc側とは構造体を共有せず、ポインタと整数だけをやり取りする。
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+void error(char *fmt, ...);
+
+static FILE *perf_map;
+
+// 読み書き可能な領域を確保する。sizeはページの大きさの倍数でなければならない。
+char *jit_alloc(int size) {
+  char *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    error("cannot allocate memory for --run");
+  return p;
+}
+
+// 機械語を書き終えた領域を読み込み・実行専用にする
+void jit_protect(char *p, int size) {
+  if (mprotect(p, size, PROT_READ | PROT_EXEC) == -1)
+    error("cannot make the code executable");
+}
+
+int jit_page_size(void) { return sysconf(_SC_PAGESIZE); }
+
+// 実行中のプロセスに読み込まれているライブラリからシンボルを探す
+char *jit_lookup(char *name, int len) {
+  char buf[256];
+  if (len >= (int)sizeof(buf))
+    return NULL;
+  memcpy(buf, name, len);
+  buf[len] = '\0';
+  return dlsym(RTLD_DEFAULT, buf);
+}
+
+// placeにtarget + addend - placeを32bitで書き込む。届かなければ0を返す。
+int jit_patch_pc32(char *place, char *target, int addend) {
+  int64_t val = (int64_t)(intptr_t)target + addend - (int64_t)(intptr_t)place;
+  if (val != (int32_t)val)
+    return 0;
+  int32_t v = val;
+  memcpy(place, &v, 4);
+  return 1;
+}
+
+// 遠くの関数へ飛ぶための16バイトの中継コード (jmp [rip + 0] の直後に飛び先を置く)
+void jit_write_stub(char *stub, char *target) {
+  static const unsigned char jmp[6] = {0xff, 0x25, 0, 0, 0, 0};
+  memcpy(stub, jmp, 6);
+  memcpy(stub + 6, &target, 8);
+  memset(stub + 14, 0xcc, 2);
+}
+
+// perfがJITした関数を表示できるように /tmp/perf-<pid>.map に書き出す
+void jit_perf_symbol(char *addr, int size, char *name, int len) {
+  if (!perf_map) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    perf_map = fopen(path, "w");
+    if (!perf_map)
+      return;
+  }
+  fprintf(perf_map, "%lx %x %.*s\n", (unsigned long)addr, size, len, name);
+}
+
+// mainを呼び出す。呼び出す前にperfのマップを書き出しておく。
+int jit_call_main(char *entry, int argc, char **argv) {
+  if (perf_map) {
+    fclose(perf_map);
+    perf_map = NULL;
+  }
+  int (*fn)(int, char **) = (int (*)(int, char **))entry;
+  return fn(argc, argv);
+}
@@ -1,19 +1,46 @@
 
 
+#define _DEFAULT_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
-extern char *user_input;
-extern char *filename;
+// ライブラリでは__threadになり、コンパイラの大域変数をスレッドごとに持つ (Makefileを参照)
+#ifndef LACC_THREAD
+#define LACC_THREAD
+#endif
+
+extern LACC_THREAD char *user_input;
+extern LACC_THREAD char *filename;
+
+void discard_output(void);
+
+// NULLでなければ、エラーのときに終了せずここへ戻る (lacc_compileの中)
+LACC_THREAD jmp_buf *error_jmp;
+// error_jmpへ戻ったときのエラーメッセージ
+LACC_THREAD char error_message[1024];
 
 // Reports an error and exit.
 void error(char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
+  if (error_jmp) {
+    vsnprintf(error_message, sizeof(error_message), fmt, ap);
+    va_end(ap);
+    longjmp(*error_jmp, 1);
+  }
   fprintf(stderr, "\033[31m");
   vfprintf(stderr, fmt, ap);
   fprintf(stderr, "\033[0m\n");
+  discard_output();
   exit(1);
 }
 
@@ -41,6 +68,18 @@ void error_at(char *loc, char *fmt, ...) {
     if (*p == '\n')
       line_num++;
 
+  // 戻り先があれば、色を付けずにメッセージに書き込んで戻る
+  if (error_jmp) {
+    int n = snprintf(error_message, sizeof(error_message), "%s:%d: ", filename, line_num);
+    if (n < (int)sizeof(error_message))
+      n += vsnprintf(error_message + n, sizeof(error_message) - n, fmt, ap);
+    if (n < (int)sizeof(error_message) && loc <= end)
+      snprintf(error_message + n, sizeof(error_message) - n, "\n%.*s\n%*s^", (int)(end - line), line,
+               (int)(loc - line), "");
+    va_end(ap);
+    longjmp(*error_jmp, 1);
+  }
+
   // 見つかった行を、ファイル名と行番号と一緒に表示
   int indent = fprintf(stderr, "\033[1m\033[32m %s:%d\033[0m: ", filename, line_num) - 13;
   fprintf(stderr, "%.*s\n", (int)(end - line), line);
@@ -51,31 +90,169 @@ void error_at(char *loc, char *fmt, ...) {
   sprintf(fmt2, "\033[1m\033[31m^\033[0m %s\n", fmt);
   fprintf(stderr, "%*s", pos, ""); // pos個の空白を出力
   vfprintf(stderr, fmt2, ap);
+  discard_output();
   exit(1);
 }
 
-// 指定されたファイルの内容を返す
+// マップ済みのファイル。同じファイルを何度読み込んでも同じ領域を返す。
+// 常駐しているときはファイルが書き換えられることがあるので、大きさと更新時刻も覚えておく。
+typedef struct MappedFile MappedFile;
+struct MappedFile {
+  MappedFile *next;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  char *buf;
+  size_t mapped; // マップした領域の大きさ
+};
+
+static LACC_THREAD MappedFile *mapped_files;
+
+// 指定されたファイルの内容を返す。
+// ファイルは読み込み専用でマップするので、返した領域に書き込んではならない。
+// 内容の直後には必ず'\0'が続く。
 char *read_file(char *path) {
-  // ファイルを開く
-  FILE *fp = fopen(path, "r");
-  if (!fp)
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
     error("cannot open %s", path);
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+    error("%s: fstat", path);
+
+  MappedFile *mf = mapped_files;
+  for (; mf; mf = mf->next)
+    if (mf->dev == st.st_dev && mf->ino == st.st_ino)
+      break;
+  if (mf && mf->size == st.st_size && mf->mtime.tv_sec == st.st_mtim.tv_sec &&
+      mf->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+    close(fd);
+    return mf->buf;
+  }
+  // 書き換えられていれば古い領域は捨ててマップし直す
+  if (mf)
+    munmap(mf->buf, mf->mapped);
+
+  // ファイルの大きさをページ単位に切り上げ、さらに1ページ余分に0で埋めた領域を確保する。
+  // その先頭にファイルを重ねてマップすれば、内容の直後は必ず'\0'になる。
+  // SIMDでの先読みも確保した領域の中に収まる。
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t size = st.st_size;
+  size_t mapped = (size + page - 1) / page * page;
+  char *buf = mmap(NULL, mapped + page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED)
+    error("%s: mmap", path);
+  if (size && mmap(buf, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    error("%s: mmap", path);
+  close(fd);
 
-  // ファイルの長さを調べる
-  if (fseek(fp, 0, SEEK_END) == -1)
-    error("%s: fseek", path);
-  size_t size = ftell(fp);
-  if (fseek(fp, 0, SEEK_SET) == -1)
-    error("%s: fseek", path);
-
-  // ファイル内容を読み込む
-  char *buf = calloc(1, size + 2);
-  fread(buf, size, 1, fp);
-
-  // ファイルが必ず"\n\0"で終わっているようにする
-  if (size == 0 || buf[size - 1] != '\n')
-    buf[size++] = '\n';
-  buf[size] = '\0';
-  fclose(fp);
+  if (!mf) {
+    mf = calloc(1, sizeof(MappedFile));
+    mf->dev = st.st_dev;
+    mf->ino = st.st_ino;
+    mf->next = mapped_files;
+    mapped_files = mf;
+  }
+  mf->size = st.st_size;
+  mf->mtime = st.st_mtim;
+  mf->buf = buf;
+  mf->mapped = mapped + page;
+  return buf;
+}
+
+// ファイルの先頭から最大max-1バイトを読み、'\0'で終わる文字列を返す (呼び出し側がfreeで解放する)。
+// read_fileと違ってマップしないので、常駐しているプロセスに領域が残らない。
+char *read_head(char *path, int max) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    error("cannot open %s", path);
+  char *buf = malloc(max);
+  int len = 0;
+  while (len < max - 1) {
+    ssize_t n = read(fd, buf + len, max - 1 - len);
+    if (n <= 0)
+      break;
+    len += n;
+  }
+  close(fd);
+  buf[len] = '\0';
   return buf;
 }
+
+// ファイルの識別子 (デバイス番号とiノード番号) と大きさ, 更新時刻を並べた文字列を返す。
+// 同じ文字列ならファイルは変わっていない。ファイルがなければNULLを返す。
+char *file_key(char *path) {
+  struct stat st;
+  if (stat(path, &st) == -1)
+    return NULL;
+  char *key = malloc(96);
+  snprintf(key, 96, "%lx:%lx:%lx:%lx.%lx", (unsigned long)st.st_dev, (unsigned long)st.st_ino,
+           (unsigned long)st.st_size, (unsigned long)st.st_mtim.tv_sec, (unsigned long)st.st_mtim.tv_nsec);
+  return key;
+}
+
+// ファイルの大きさを返す。ファイルがないか、大きさがintに収まらなければ-1を返す。
+int file_size(char *path) {
+  struct stat st;
+  if (stat(path, &st) == -1 || st.st_size > INT_MAX)
+    return -1;
+  return st.st_size;
+}
+
+// 出力用のファイルを作って書き込み用に開く
+int create_file(char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    error("cannot open %s", path);
+  return fd;
+}
+
+// 一時ファイルを置くディレクトリを作り、その名前を返す
+char *make_temp_dir() {
+  char *dir = malloc(32);
+  strcpy(dir, "/tmp/lacc-XXXXXX");
+  if (!mkdtemp(dir))
+    error("cannot create a temporary directory");
+  return dir;
+}
+
+// 一時ディレクトリの中のi番目のオブジェクトファイルの名前を返す
+char *temp_object_path(char *dir, int i) {
+  int len = strlen(dir) + 32;
+  char *path = malloc(len);
+  snprintf(path, len, "%s/%d.o", dir, i);
+  return path;
+}
+
+// 子プロセスの終了を待ち、終了コードを*statusに入れてpidを返す。
+// シグナルで終了した場合は128 + シグナル番号を終了コードとする。
+int wait_child(int *status) {
+  int st;
+  pid_t pid = wait(&st);
+  if (pid < 0)
+    return -1;
+  if (WIFEXITED(st)) {
+    *status = WEXITSTATUS(st);
+  } else {
+    *status = 128 + WTERMSIG(st);
+  }
+  return pid;
+}
+
+// argvのコマンドを子プロセスで実行し、終了を待ってその終了コードを返す
+int run_command(char **argv) {
+  pid_t pid = fork();
+  if (pid < 0)
+    error("cannot fork");
+  if (pid == 0) {
+    execvp(argv[0], argv);
+    fprintf(stderr, "cannot execute %s\n", argv[0]);
+    _exit(127);
+  }
+  int st;
+  if (waitpid(pid, &st, 0) < 0)
+    error("cannot wait for %s", argv[0]);
+  if (WIFEXITED(st))
+    return WEXITSTATUS(st);
+  return 128 + WTERMSIG(st);
+}
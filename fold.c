@@ -0,0 +1,299 @@
+#include "lacc.h"
+
+extern int *node_list;
+
+extern int TRUE;
+extern int FALSE;
+
+// 低水準IRに変換する前に、構文木の上で定数式を畳み込み、式を簡単にする。
+// 構文解析はポインタの加減算の ND_MUL(整数, 型のサイズ), 単項マイナスの ND_SUB(0, x),
+// メンバ参照の ND_ADD(ND_ADDR(x), オフセット) をそのまま作るので、ここで定数にまとめる。
+// 条件が定数になったif, while, forは実行されない側を取り除く。
+//
+// ++や+=は左辺値のノードを2か所から指すので、同じノードを2回たどることがある。
+// ノードをその場で書き換えるときは、意味を変えずに、2回目には何も変えない形にする。
+
+int FOLD_INT_MAX = 2147483647;
+
+// a * bがintに収まればTRUE
+int mul_fits(int a, int b) {
+  int max = FOLD_INT_MAX;
+  int min = -FOLD_INT_MAX - 1;
+  if (!a || !b)
+    return TRUE;
+  if (a > 0) {
+    if (b > 0)
+      return a <= max / b;
+    return b >= min / a;
+  }
+  if (b > 0)
+    return a >= min / b;
+  return a >= max / b;
+}
+
+// 定数どうしの二項演算を計算して*valに入れる。
+// intからあふれる演算とゼロ除算は、実行したときと結果が変わりうるので畳み込まずにFALSEを返す。
+int eval_binary(NodeKind kind, int a, int b, int *val) {
+  int max = FOLD_INT_MAX;
+  int min = -FOLD_INT_MAX - 1;
+  if (kind == ND_ADD) {
+    if ((b > 0 && a > max - b) || (b < 0 && a < min - b))
+      return FALSE;
+    *val = a + b;
+  } else if (kind == ND_SUB) {
+    if ((b < 0 && a > max + b) || (b > 0 && a < min + b))
+      return FALSE;
+    *val = a - b;
+  } else if (kind == ND_MUL) {
+    if (!mul_fits(a, b))
+      return FALSE;
+    *val = a * b;
+  } else if (kind == ND_DIV || kind == ND_MOD) {
+    if (!b || (b == -1 && a == min))
+      return FALSE;
+    if (kind == ND_DIV) {
+      *val = a / b;
+    } else {
+      *val = a % b;
+    }
+  } else if (kind == ND_EQ) {
+    *val = a == b;
+  } else if (kind == ND_NE) {
+    *val = a != b;
+  } else if (kind == ND_LT) {
+    *val = a < b;
+  } else if (kind == ND_LE) {
+    *val = a <= b;
+  } else if (kind == ND_BITAND) {
+    *val = a & b;
+  } else if (kind == ND_BITOR) {
+    *val = a | b;
+  } else if (kind == ND_BITXOR) {
+    *val = a ^ b;
+  } else if (kind == ND_SHL) {
+    if (b < 0 || b > 30 || a < 0 || a > (max >> b))
+      return FALSE;
+    *val = a << b;
+  } else if (kind == ND_SHR) {
+    if (b < 0 || b > 31)
+      return FALSE;
+    *val = a >> b;
+  } else {
+    return FALSE;
+  }
+  return TRUE;
+}
+
+int is_num(int idx) { return node_at(idx)->kind == ND_NUM; }
+
+int is_num_of(int idx, int val) { return is_num(idx) && node_at(idx)->val == val; }
+
+// ノードをその場で整数にする
+void set_num(Node *node, int val) {
+  node->kind = ND_NUM;
+  node->val = val;
+  node->lhs = 0;
+  node->rhs = 0;
+  node->extra = 0;
+}
+
+// nodeの代わりにchildを使ってよければTRUE。値の読み書きや引数の大きさが型で決まるので、
+// 同じ種類の型の場合だけ置き換える。
+int can_replace(Node *node, int child) {
+  Type *type = node_at(child)->type;
+  if (is_ptr_or_arr(node->type))
+    return is_ptr_or_arr(type);
+  return type->ty == node->type->ty;
+}
+
+// 右辺が定数のND_ADDならTRUE
+int is_add_const(int idx) {
+  Node *node = node_at(idx);
+  return node->kind == ND_ADD && is_num(node->rhs);
+}
+
+// 配列型のND_DEREFは値としては配列のアドレスなので、アドレスの式をそのまま使う
+int array_addr(int idx) {
+  Node *node = node_at(idx);
+  if (node->kind == ND_DEREF && node->type->ty == TY_ARR)
+    return node->lhs;
+  return idx;
+}
+
+// 読んでも副作用のない式ならTRUE
+int is_pure(int idx) {
+  NodeKind kind = node_at(idx)->kind;
+  return kind == ND_NUM || kind == ND_LVAR || kind == ND_GVAR;
+}
+
+int simplify(int idx);
+
+// ND_ADDの定数を外側に集めて ((x + y) + c) の形にし、定数どうしを足し合わせる。
+// 配列の添字の計算とメンバのオフセットの足し算がまとまる。
+int simplify_add(int idx) {
+  Node *node = node_at(idx);
+  node->lhs = array_addr(node->lhs);
+  node->rhs = array_addr(node->rhs);
+  if (is_add_const(node->rhs) && !is_num(node->lhs)) {
+    // y + (z + c) => (y + z) + c
+    int rhs = node->rhs;
+    Node *inner = node_at(rhs);
+    node->rhs = inner->rhs;
+    inner->rhs = inner->lhs;
+    inner->lhs = node->lhs;
+    node->lhs = simplify(rhs);
+  }
+  if (is_add_const(node->lhs)) {
+    Node *inner = node_at(node->lhs);
+    if (is_num(node->rhs)) {
+      // (y + c1) + c2 => y + (c1 + c2)
+      int val;
+      if (eval_binary(ND_ADD, node_at(inner->rhs)->val, node_at(node->rhs)->val, &val)) {
+        node_at(node->rhs)->val = val;
+        node->lhs = inner->lhs;
+      }
+    } else {
+      // (y + c) + z => (y + z) + c
+      int c = inner->rhs;
+      inner->rhs = node->rhs;
+      node->rhs = c;
+      node->lhs = simplify(node->lhs);
+    }
+  }
+  if (is_num_of(node->rhs, 0) && can_replace(node, node->lhs))
+    return node->lhs;
+  if (is_num_of(node->lhs, 0) && can_replace(node, node->rhs))
+    return node->rhs;
+  return idx;
+}
+
+// 子ノードを畳み込み済みのノードを簡単にし、代わりに使うノードを返す
+int simplify(int idx) {
+  Node *node = node_at(idx);
+  NodeKind kind = node->kind;
+  if (kind == ND_NOT || kind == ND_BITNOT) {
+    if (is_num(node->lhs)) {
+      int val = node_at(node->lhs)->val;
+      if (kind == ND_NOT) {
+        set_num(node, !val);
+      } else {
+        set_num(node, ~val);
+      }
+    }
+    return idx;
+  } else if (kind == ND_ADDR) {
+    // &*x => x
+    Node *lhs = node_at(node->lhs);
+    if (lhs->kind == ND_DEREF && can_replace(node, lhs->lhs))
+      return lhs->lhs;
+    return idx;
+  } else if (kind == ND_AND || kind == ND_OR) {
+    // 左辺だけで値が決まれば右辺は評価されない
+    if (is_num(node->lhs)) {
+      int lhs = node_at(node->lhs)->val != 0;
+      if (kind == ND_AND && !lhs) {
+        set_num(node, 0);
+      } else if (kind == ND_OR && lhs) {
+        set_num(node, 1);
+      } else if (is_num(node->rhs)) {
+        set_num(node, node_at(node->rhs)->val != 0);
+      }
+    }
+    return idx;
+  }
+
+  if (!node->lhs || !node->rhs)
+    return idx;
+  int val;
+  if (is_num(node->lhs) && is_num(node->rhs)) {
+    if (eval_binary(kind, node_at(node->lhs)->val, node_at(node->rhs)->val, &val))
+      set_num(node, val);
+    return idx;
+  }
+
+  if (kind == ND_SUB && is_num(node->rhs)) {
+    // x - c => x + (-c)
+    Node *rhs = node_at(node->rhs);
+    if (eval_binary(ND_SUB, 0, rhs->val, &val)) {
+      node->kind = ND_ADD;
+      rhs->val = val;
+      kind = ND_ADD;
+    }
+  }
+  if (kind == ND_ADD) {
+    return simplify_add(idx);
+  } else if (kind == ND_MUL) {
+    if (is_num_of(node->rhs, 1) && can_replace(node, node->lhs))
+      return node->lhs;
+    if (is_num_of(node->lhs, 1) && can_replace(node, node->rhs))
+      return node->rhs;
+    if ((is_num_of(node->lhs, 0) && is_pure(node->rhs)) || (is_num_of(node->rhs, 0) && is_pure(node->lhs))) {
+      set_num(node, 0);
+      return idx;
+    }
+    if (is_add_const(node->lhs) && is_num(node->rhs)) {
+      // (x + c) * k => x * k + c * k
+      int add = node->lhs;
+      Node *inner = node_at(add);
+      Node *c = node_at(inner->rhs);
+      if (eval_binary(ND_MUL, c->val, node_at(node->rhs)->val, &val)) {
+        c->val = val;
+        node->kind = ND_ADD;
+        node->lhs = add;
+        inner->kind = ND_MUL;
+        int k = node->rhs;
+        node->rhs = inner->rhs;
+        inner->rhs = k;
+        node->lhs = simplify(add);
+        return simplify_add(idx);
+      }
+    }
+  } else if (kind == ND_DIV) {
+    if (is_num_of(node->rhs, 1) && can_replace(node, node->lhs))
+      return node->lhs;
+  }
+  return idx;
+}
+
+void fold_list(int list) {
+  for (int i = 0; i < list_len(list); i++)
+    node_list[list + 1 + i] = fold(node_list[list + 1 + i]);
+}
+
+// 子ノードを畳み込んでから自身を簡単にし、代わりに使うノードを返す
+int fold(int idx) {
+  if (!idx)
+    return idx;
+  Node *node = node_at(idx);
+  NodeKind kind = node->kind;
+  if (kind == ND_BLOCK || kind == ND_FUNCALL) {
+    fold_list(node->extra);
+    return idx;
+  }
+  if (kind == ND_IF || kind == ND_WHILE || kind == ND_FOR || kind == ND_DOWHILE || kind == ND_RETURN) {
+    node->lhs = fold(node->lhs);
+    node->rhs = fold(node->rhs);
+    if (kind == ND_IF || kind == ND_FOR)
+      node->extra = fold(node->extra);
+    if (kind == ND_RETURN || kind == ND_DOWHILE || !is_num(node->lhs))
+      return idx;
+    int cond = node_at(node->lhs)->val;
+    if (kind == ND_IF) {
+      if (cond && node->rhs)
+        return node->rhs;
+      if (!cond && node->extra)
+        return node->extra;
+    } else if (cond) {
+      return idx;
+    }
+    // 実行されない文
+    node->kind = ND_NONE;
+    return idx;
+  }
+  if ((kind >= ND_ADD && kind <= ND_POSTINC) || kind == ND_ADDR || kind == ND_DEREF) {
+    node->lhs = fold(node->lhs);
+    node->rhs = fold(node->rhs);
+    return simplify(idx);
+  }
+  return idx;
+}
@@ -0,0 +1,89 @@
+
+#include "lacc.h"
+
+extern ByteBuf *asm_sections[4];
+extern int asm_align[4];
+extern AsmSymbol *asm_symbols;
+extern AsmReloc *asm_relocs;
+extern int R_X86_64_PLT32;
+extern Ident *main_ident;
+
+extern int TRUE;
+extern int FALSE;
+extern void *NULL;
+
+int STUB_SIZE = 16;
+
+int align_to(int n, int align) { return (n + align - 1) / align * align; }
+
+// 未定義のシンボルを実行中のプロセスから探す
+char *resolve_external(AsmSymbol *sym) {
+  char *addr = jit_lookup(sym->ident->name, sym->ident->len);
+  if (!addr)
+    error("undefined symbol: %.*s", sym->ident->len, sym->ident->name);
+  return addr;
+}
+
+// begin_assemble()からend_assemble()までに作った機械語をメモリ上に配置し、mainを呼び出してその戻り値を返す。
+// 領域は .text, 中継コード, .rodata, .data の順に並べ、.textと中継コードだけを実行可能にする。
+int run_jit(int argc, char **argv) {
+  // 外部の関数への呼び出しは届かないことがあるので、中継コードを経由させる。
+  // 中継コードの番号はシンボルのindexに入れておく (0は中継コードなし)。
+  int stub_cnt = 0;
+  for (AsmSymbol *sym = asm_symbols; sym; sym = sym->next)
+    sym->index = 0;
+  for (AsmReloc *rel = asm_relocs; rel; rel = rel->next) {
+    AsmSymbol *sym = rel->sym;
+    if (sym->section == SEC_NONE && rel->type == R_X86_64_PLT32 && !sym->index)
+      sym->index = ++stub_cnt;
+  }
+
+  int page = jit_page_size();
+  int stub_offset = align_to(asm_sections[SEC_TEXT]->len, STUB_SIZE);
+  int code_size = align_to(stub_offset + stub_cnt * STUB_SIZE, page);
+  int rodata_offset = code_size;
+  int data_offset = align_to(rodata_offset + asm_sections[SEC_RODATA]->len, 8);
+  int size = align_to(data_offset + asm_sections[SEC_DATA]->len + 1, page);
+
+  char *base = jit_alloc(size);
+  char *bases[4];
+  bases[SEC_NONE] = NULL;
+  bases[SEC_TEXT] = base;
+  bases[SEC_RODATA] = base + rodata_offset;
+  bases[SEC_DATA] = base + data_offset;
+  for (int i = SEC_TEXT; i <= SEC_RODATA; i++)
+    memcpy(bases[i], asm_sections[i]->data, asm_sections[i]->len);
+
+  for (AsmSymbol *sym = asm_symbols; sym; sym = sym->next) {
+    if (sym->index)
+      jit_write_stub(base + stub_offset + (sym->index - 1) * STUB_SIZE, resolve_external(sym));
+  }
+
+  for (AsmReloc *rel = asm_relocs; rel; rel = rel->next) {
+    AsmSymbol *sym = rel->sym;
+    char *target;
+    if (sym->index) {
+      target = base + stub_offset + (sym->index - 1) * STUB_SIZE;
+    } else if (sym->section == SEC_NONE) {
+      target = resolve_external(sym);
+    } else {
+      target = bases[sym->section] + sym->offset;
+    }
+    if (!jit_patch_pc32(bases[rel->section] + rel->offset, target, rel->addend))
+      error("symbol is out of range for --run: %.*s", sym->ident->len, sym->ident->name);
+  }
+
+  char *entry = NULL;
+  for (AsmSymbol *sym = asm_symbols; sym; sym = sym->next) {
+    if (sym->section != SEC_TEXT || !sym->global)
+      continue;
+    jit_perf_symbol(base + sym->offset, sym->size, sym->ident->name, sym->ident->len);
+    if (sym->ident == main_ident)
+      entry = base + sym->offset;
+  }
+  if (!entry)
+    error("main is not defined");
+
+  jit_protect(base, code_size);
+  return jit_call_main(entry, argc, argv);
+}
@@ -1,4 +1,25 @@
 
+#include "opcode.h"
+
+//
+// Arena
+//
+
+// アリーナを構成するチャンク
+typedef struct ArenaChunk ArenaChunk;
+struct ArenaChunk {
+  ArenaChunk *prev; // 前に確保したチャンクかNULL
+  char *data;       // 領域の先頭
+};
+
+// バンプポインタ方式の領域確保器
+typedef struct Arena Arena;
+struct Arena {
+  ArenaChunk *chunk; // 現在のチャンク
+  char *ptr;         // 次に割り当てる位置
+  char *end;         // 現在のチャンクの終わり
+};
+
 //
 // Tokenizer
 //
@@ -22,9 +43,22 @@ typedef enum {
   TK_STRING,  // 文字列
   TK_TYPEDEF, // typedef
   TK_ENUM,    // enum
-  TK_STRUCT   // struct
+  TK_STRUCT,  // struct
+  TK_PCH,     // プリコンパイル済みヘッダの#include (strにその内容)
+  TK_INCLUDE  // include (字句解析の中だけで使い、トークンにはならない)
 } TokenKind;
 
+// 字句解析で使う文字の種類
+typedef enum {
+  CH_OTHER,  // その他
+  CH_SPACE,  // 空白
+  CH_ALPHA,  // 識別子の先頭に使える文字
+  CH_DIGIT,  // 数字
+  CH_PUNCT,  // 記号
+  CH_QUOTE,  // '
+  CH_DQUOTE  // "
+} CharClass;
+
 // ローカル変数の型
 
 typedef struct String String;
@@ -46,36 +80,77 @@ struct Array {
 
 typedef enum { TY_NONE, TY_INT, TY_CHAR, TY_PTR, TY_ARR, TY_ARGARR, TY_VOID, TY_STRUCT } TypeKind;
 
-// Token type
-typedef struct Token Token;
-struct Token {
-  TokenKind kind; // Token kind
-  Token *next;    // Next token
-  int val;        // If kind is TK_NUM, its value
-  char *str;      // Token string
-  int len;        // Token length
-  TypeKind ty;    // Token type
+typedef struct Struct Struct;
+
+// 識別子のアトム (同じ綴りの名前は同じアトムを共有する)
+typedef struct Ident Ident;
+struct Ident {
+  char *name;      // 名前
+  int len;         // 名前の長さ
+  int hash;        // 名前のハッシュ値
+  TypeKind ty;     // 型名としての解決結果
+  Struct *struct_; // 型名として解決したtypedef済みの構造体
+  int type_gen;    // 型名の解決結果を記録したときのtypedef世代 (0は未解決)
+};
+
+// トークン列。トークンごとの構造体ではなく、フィールドごとの連続した配列に並べる。
+// トークンは番号で参照し、0番は「トークンなし」を表す。
+typedef struct TokenBuf TokenBuf;
+struct TokenBuf {
+  TokenKind *kind; // トークンの種類
+  int *len;        // トークンの長さ
+  int *val;        // TK_NUMの場合はその数値, TK_TYPEの場合は型の種類
+  char **str;      // ソース上の位置
+  Ident **ident;   // TK_IDENTの場合のアトム
+  int cnt;         // トークンの数
+  int cap;         // 確保済みの要素数
 };
 
 typedef struct Type Type;
 
 typedef struct LVar LVar;
 struct LVar {
-  LVar *next; // 次の変数かNULL
-  char *name; // 変数の名前
-  int len;    // 名前の長さ
-  int offset; // RBPからのオフセット
-  int ext;    // externかどうか
-  Type *type; // 変数の型
+  LVar *next;   // 次の変数かNULL
+  Ident *ident; // 変数名のアトム
+  char *name;   // 変数の名前
+  int len;      // 名前の長さ
+  int offset;   // RBPからのオフセット
+  int ext;      // externかどうか
+  Type *type;   // 変数の型
+};
+
+typedef struct HashEntry HashEntry;
+struct HashEntry {
+  HashEntry *next; // 同じバケットの次のエントリかNULL
+  Ident *key;      // キーのアトム
+  void *value;     // 値
+};
+
+// アトムをキーとするハッシュ表 (チェイン法)
+typedef struct HashMap HashMap;
+struct HashMap {
+  HashEntry **buckets; // バケット (要素数は2の冪)
+  int capacity;        // バケット数
+  int count;           // エントリ数
+};
+
+// ブロックスコープ
+typedef struct Scope Scope;
+struct Scope {
+  Scope *parent; // 外側のスコープかNULL
+  LVar *vars;    // このスコープで宣言された変数
+  int base;      // スコープ開始時のスタック使用量
+  int offset;    // 現在のスタック使用量
 };
 
-typedef struct Struct Struct;
 struct Struct {
-  Struct *next; // 次の構造体かNULL
-  LVar *var;    // 次の変数かNULL
-  char *name;   // 変数の名前
-  int len;      // 名前の長さ
-  int size;     // 構造体のサイズ
+  Struct *next;     // 次の構造体かNULL
+  LVar *var;        // 次の変数かNULL
+  HashMap *members; // メンバーの索引
+  Type *type;       // この構造体の型
+  char *name;       // 変数の名前
+  int len;          // 名前の長さ
+  int size;         // 構造体のサイズ
 };
 
 typedef struct Enum Enum;
@@ -98,17 +173,20 @@ struct Type {
   Type *ptr_to;
   int array_size;
   Struct *struct_;
+  int id;     // 型ごとに一意な番号
+  Type *next; // 型表の同じバケットの次の型
 };
 
 // 関数の型
 typedef struct Function Function;
 struct Function {
   Function *next; // 次の関数かNULL
-  LVar *locals;   // ローカル変数
+  Ident *ident;   // 関数名のアトム
   char *name;     // 変数の名前
   int len;        // 名前の長さ
   int offset;     // RBPからのオフセット
   Type *type;     // 関数の型
+  int pc;         // バイトコードでの先頭位置 (bcgen.c)
 };
 
 //
@@ -165,77 +243,435 @@ typedef enum {
 } NodeKind;
 
 // 抽象構文木のノード
+// 子ノードはポインタではなく32bitのノード番号で持つ (0は子ノードなし)。
+// 子ノードの並び (ブロックの文, 関数の引数) は子ノード列の番号で持つ。
 typedef struct Node Node;
 struct Node {
   NodeKind kind; // ノードの型
-  Node *lhs;     // 左辺
-  Node *rhs;     // 右辺
-  int val;       // kindがND_NUMの場合はその数値
-  int id;        // kindがND_IF, ND_WHILE, ND_FORの場合のみ使う
   int endline;
-  Node *cond;    // kindがND_IF, ND_WHILE, ND_FORの場合のみ使う
-  Node *then;    // kindがND_IFの場合のみ使う
-  Node *els;     // kindがND_IFの場合のみ使う
-  Node *init;    // kindがND_FORの場合のみ使う
-  Node *step;    // kindがND_FORの場合のみ使う
-  Node **body;   // kindがND_BLOCKの場合のみ使う
-  Node *args[6]; // kindがND_FUNCALLの場合のみ使う
-  Function *fn;  // kindがND_FUNCDEF, ND_FUNCALLの場合のみ使う
-  LVar *var;     // kindがND_LVAR, ND_GVARの場合のみ使う
+  int lhs;       // 左辺, ND_IF/ND_WHILE/ND_FORでは条件式, ND_FUNCDEFでは本体
+  int rhs;       // 右辺, ND_IF/ND_WHILE/ND_FORではループ本体
+  int extra;     // ND_IFのelse節, ND_FORの更新式, ND_BLOCK/ND_FUNCALL/ND_FUNCDEFの子ノード列
+  int val;       // ND_NUMの数値, 制御構文や文字列, 配列のラベル番号
   Type *type;
+  void *sym;     // ND_LVAR, ND_GVARなどではLVar, ND_FUNCALL, ND_FUNCDEFではFunction
 };
 
-Node *stmt();
-Node *assign();
-Node *expr();
-Node *equality();
-Node *relational();
-Node *new_add(Node *lhs, Node *rhs, char *consumed_ptr);
-Node *new_sub(Node *lhs, Node *rhs, char *consumed_ptr);
-Node *add();
-Node *mul();
-Node *logical_and();
-Node *logical_or();
-Node *bit_or();
-Node *bit_and();
-Node *bit_xor();
-Node *bit_shift();
-Node *increment_decrement();
-Node *access_member();
-Node *unary();
-Node *primary();
+Node *node_at(int idx);
+int new_node(NodeKind kind);
+int list_len(int list);
+Node *list_at(int list, int i);
+void push_scratch(int idx);
+int make_list(int mark);
+int stmt();
+int assign();
+int expr();
+int equality();
+int relational();
+int new_add(int lhs, int rhs, char *consumed_ptr);
+int new_sub(int lhs, int rhs, char *consumed_ptr);
+int add();
+int mul();
+int logical_and();
+int logical_or();
+int bit_or();
+int bit_and();
+int bit_xor();
+int bit_shift();
+int increment_decrement();
+int access_member();
+int unary();
+int primary();
 int get_type_size(Type *type);
 int get_sizeof(Type *type);
 
 Type *new_type(TypeKind ty);
 Type *new_type_ptr(Type *ptr_to);
+Type *new_type_arr(Type *ptr_to, int array_size);
+Type *new_type_argarr(Type *ptr_to, int array_size);
+Type *new_type_struct(Struct *struct_);
 int is_ptr_or_arr(Type *type);
 
 int startswith(char *p, char *q);
 
-void tokenize();
+void init_lexer();
+void start_lexer();
+void lex_token();
+void next_token();
+void recycle_tokens();
+TokenBuf *new_token_buf();
+void free_token_buf(TokenBuf *buf);
 void new_token(TokenKind kind, char *str, int len);
 
 void program();
 
+//
+// Low-level IR
+//
+
+// 低水準IRの命令。値はすべて64bitの仮想レジスタ (1から始まる番号, 0はなし) に入る。
+// ローカル変数はフレーム上のスロットに置き、IR_LLOAD/IR_LSTOREで明示的に読み書きする。
+typedef enum {
+  IR_IMM,    // dst = imm
+  IR_MOV,    // dst = a
+  IR_ADD,    // dst = a + b
+  IR_SUB,    // dst = a - b
+  IR_MUL,    // dst = a * b
+  IR_DIV,    // dst = a / b
+  IR_MOD,    // dst = a % b
+  IR_AND,    // dst = a & b
+  IR_OR,     // dst = a | b
+  IR_XOR,    // dst = a ^ b
+  IR_SHL,    // dst = a << b
+  IR_SAR,    // dst = a >> b
+  IR_EQ,     // dst = a == b
+  IR_NE,     // dst = a != b
+  IR_LT,     // dst = a < b
+  IR_LE,     // dst = a <= b
+  IR_NOT,    // dst = !a
+  IR_BITNOT, // dst = ~a
+  IR_EXT,    // dst = aをsizeバイトに切り詰めて拡張した値 (4は符号拡張, 1はゼロ拡張)
+  IR_LOCAL,  // dst = ローカル変数のアドレス (rbp - imm)
+  IR_GLOBAL, // dst = 大域変数symのアドレス
+  IR_STR,    // dst = 文字列リテラル.L.str<imm>のアドレス
+  IR_ARR,    // dst = 配列リテラル.L.arr<imm>のアドレス
+  IR_LOAD,   // dst = [a] (sizeバイト, 4は符号拡張, 1はゼロ拡張)
+  IR_STORE,  // [a] = b (sizeバイト)
+  IR_LLOAD,  // dst = [rbp - imm] (sizeバイト)
+  IR_LSTORE, // [rbp - imm] = b (sizeバイト)
+  IR_COPY,   // [a]にimmバイトを[b]からコピーする
+  IR_PARAM,  // [rbp - imm] = imm2番目の引数レジスタ (sizeバイト), dstがあればdstに受け取る
+  IR_CALL,   // dst = sym(args...)
+  IR_PHI,    // dst = phi_blks[i]から来たときはargs[i] (SSA形式の間だけ使う, immは元の仮想レジスタ)
+  IR_JMP,    // then_blkへ飛ぶ
+  IR_BR,     // aが0でなければthen_blkへ, 0ならelse_blkへ飛ぶ
+  IR_RET     // aを返す (0なら値なし)
+} IrOp;
+
+typedef struct Block Block;
+
+typedef struct Ins Ins;
+struct Ins {
+  Ins *next;        // ブロック内の次の命令かNULL
+  IrOp op;          // 命令の種類
+  int dst;          // 結果の仮想レジスタ
+  int a;            // 1つめのオペランド
+  int b;            // 2つめのオペランド
+  int imm;          // 即値, フレーム上のオフセット, ラベル番号, コピーするバイト数
+  int imm2;         // IR_PARAMの引数の番号
+  int size;         // メモリを読み書きする大きさ, IR_DIVとIR_MODでは割られる数の大きさ
+  void *sym;        // IR_GLOBALではLVar, IR_CALLではFunction
+  int *args;        // IR_CALLの引数, IR_PHIの各先行ブロックから来る値の仮想レジスタ
+  int *arg_sizes;   // IR_CALLの引数の大きさ (4ならint, 1ならchar, 8ならポインタ)
+  int nargs;        // IR_CALLの引数, IR_PHIの先行ブロックの数
+  Block **phi_blks; // IR_PHIのargsに対応する先行ブロック
+  Block *then_blk;  // IR_JMP, IR_BRの飛び先
+  Block *else_blk;  // IR_BRの条件が0のときの飛び先
+  int pos;          // レジスタ割り付けで使う命令の位置
+};
+
+typedef struct BlockList BlockList;
+struct BlockList {
+  BlockList *next;
+  Block *blk;
+};
+
+// 基本ブロック。最後の命令は必ずIR_JMP, IR_BR, IR_RETのどれか。
+// IR_PHIがあればブロックの先頭に並ぶ。
+struct Block {
+  Block *next;   // 出力する順で次のブロックかNULL
+  int id;        // 関数内での番号 (出力する順)
+  int label;     // アセンブリのラベル番号 (.LB<label>)
+  void *sym;     // 命令を直接機械語にするときのラベル (AsmSymbol)
+  Ins *first;    // 最初の命令
+  Ins *last;     // 最後の命令
+  int *live_in;  // 入口で生きている仮想レジスタの集合 (ビット列)
+  int *live_out; // 出口で生きている仮想レジスタの集合 (ビット列)
+
+  // 制御フローグラフ (build_cfgで求める)
+  Block **preds; // 先行ブロック
+  int pred_cnt;  // 先行ブロックの数
+  int rpo;       // 逆後順での番号
+
+  // 支配木 (build_domで求める)
+  Block *idom;        // 直接の支配ブロック (入口ブロックでは自分自身)
+  Block *dom_child;   // 支配木での最初の子
+  Block *dom_sibling; // 支配木での次の兄弟
+  BlockList *df;      // 支配辺境
+};
+
+// 低水準IRに変換した関数
+typedef struct IrFunc IrFunc;
+struct IrFunc {
+  Function *fn;    // 元の関数
+  int frame_size;  // ローカル変数の領域の大きさ
+  Block *entry;    // 最初のブロック
+  Block *last;     // 最後のブロック
+  int block_cnt;   // ブロックの数
+  int vreg_cnt;    // 仮想レジスタの数 (番号は1からvreg_cntまで)
+  int *reg;        // 仮想レジスタに割り付けた物理レジスタの番号 (-1ならスピル)
+  int *slot;       // スピルした仮想レジスタのフレーム上のオフセット
+  int *use_cnt;    // 仮想レジスタが読まれる回数
+  Ins **const_def; // 即値を1度だけ代入される仮想レジスタならその命令
+  int spill_size;  // スピル用の領域の大きさ
+  int saved_regs;  // 使ったcallee-savedレジスタのビット集合
+
+  // パスの間で使い回す解析の結果。ブロックや辺を変えたパスの後は作り直す。
+  Block **rpo;     // 逆後順に並べたブロック
+  int cfg_valid;   // 先行ブロックと逆後順が正しければTRUE
+  int dom_valid;   // 支配木と支配辺境が正しければTRUE
+};
+
+// lir.c
+IrFunc *lower_function(Node *node);
+Block *new_block();
+
+// fold.c
+int fold(int idx);
+
+// mem2reg.c
+int promote_locals(IrFunc *f);
+
+// ssa.c
+int succ_cnt(Block *blk);
+Block *succ_at(Block *blk, int i);
+void build_cfg(IrFunc *f);
+void build_dom(IrFunc *f);
+int build_ssa(IrFunc *f);
+int leave_ssa(IrFunc *f);
+
+// opt.c
+void optimize(IrFunc *f);
+void dump_ir(IrFunc *f, char *stage);
+
+// regalloc.c
+void alloc_registers(IrFunc *f);
+
+//
+// Assembler
+//
+
+// 可変長のバイト列
+typedef struct ByteBuf ByteBuf;
+struct ByteBuf {
+  char *data;
+  int len;
+  int cap;
+};
+
+// 出力先のセクション
+typedef enum { SEC_NONE, SEC_TEXT, SEC_DATA, SEC_RODATA } SectionKind;
+
+// アセンブラのシンボル (ラベル)
+typedef struct AsmSymbol AsmSymbol;
+struct AsmSymbol {
+  AsmSymbol *next; // 登録順のリスト
+  Ident *ident;    // 名前
+  int section;     // 定義されたセクション (SEC_NONEなら未定義)
+  int offset;      // セクション内の位置
+  int global;      // .globlされていればTRUE
+  int index;       // ELFのシンボルテーブル上の番号, --runでは中継コードの番号
+  int size;        // 関数の大きさ (.textの大域シンボルのみ)
+};
+
+// 再配置。アセンブル後に解決できなかったものだけが残る。
+typedef struct AsmReloc AsmReloc;
+struct AsmReloc {
+  AsmReloc *next;
+  int section;    // 書き換える位置のセクション
+  int offset;     // 書き換える位置
+  AsmSymbol *sym; // 参照するシンボル
+  int type;       // R_X86_64_PC32など
+  int addend;
+};
+
+// 命令の種類
+typedef enum {
+  INSN_FIXED, // オペランドを取らない命令 (ret, cqo など)
+  INSN_MOV,
+  INSN_MOVX,   // movzx, movsx
+  INSN_MOVSXD,
+  INSN_LEA,
+  INSN_PUSH,
+  INSN_POP,
+  INSN_ALU,   // add, sub, cmp など
+  INSN_TEST,
+  INSN_IMUL,
+  INSN_UNARY, // not, neg, idiv など
+  INSN_SHIFT,
+  INSN_SETCC,
+  INSN_CMOVCC,
+  INSN_JCC,
+  INSN_JMP,
+  INSN_CALL
+} InsnKind;
+
+// 命令表の要素
+typedef struct AsmInsn AsmInsn;
+struct AsmInsn {
+  InsnKind kind;
+  int code;  // オペコード, 条件コード, /digit など種類ごとの値
+  int code2; // 固定命令の2バイト目 (なければ-1) や8bit版のオペコード
+};
+
+// オペランドの種類
+typedef enum { OPD_REG, OPD_IMM, OPD_MEM, OPD_LABEL } OperandKind;
+
+// 命令のオペランド
+typedef struct AsmOperand AsmOperand;
+struct AsmOperand {
+  OperandKind kind;
+  int reg;        // OPD_REGのレジスタ番号
+  int size;       // レジスタの大きさ, メモリのPTR指定 (なければ0)
+  int imm;        // OPD_IMMの値
+  int base;       // OPD_MEMのベースレジスタ (なければ-1)
+  int index;      // OPD_MEMのインデックスレジスタ (なければ-1)
+  int scale;      // インデックスの倍率
+  int disp;       // 変位
+  int rip;        // RIP相対ならTRUE
+  AsmSymbol *sym; // RIP相対やジャンプ先のシンボル
+};
+
+// context.c
+void init_global_variables();
+void free_global_variables();
+void parse_source(char *name, char *src);
+void parse_file(char *input);
+void gen_source(char *name, char *src);
+void gen_file(char *input);
+char *compile_source(char *name, char *src, int *len);
+char *first_include(char *src);
+void warm_header(char *input);
+void drop_warm_header();
+
+// arena.c
+Arena *new_arena();
+void *arena_alloc(Arena *arena, int size);
+void arena_reset(Arena *arena);
+void arena_rewind(Arena *arena);
+
+// symtab.c
+HashMap *new_hashmap(int capacity);
+void *hashmap_get(HashMap *map, Ident *key);
+void hashmap_put(HashMap *map, Ident *key, void *value);
+void hashmap_pop(HashMap *map, Ident *key);
+Ident *find_ident(char *name, int len);
+Ident *intern(char *name, int len);
+Ident *intern_copy(char *name, int len);
+void enter_scope();
+void leave_scope();
+void declare_lvar(LVar *lvar);
+
+void gen_start();
+void gen_data();
 void gen(Node *node);
 
 // extention.c
 void error();
 void error_at();
 char *read_file();
+char *read_head(char *path, int max);
+char *file_key(char *path);
+int file_size(char *path);
+int create_file(char *path);
+char *make_temp_dir();
+char *temp_object_path(char *dir, int i);
+int run_command(char **argv);
+int wait_child(int *status);
 void init();
 
-// stdio.h
-void printf();
+// emit.c
+void open_output(char *path);
+void flush_output();
+void close_output();
+void emit_mem(char *s, int len);
+void emit(char *s);
+void emit_int(int val);
+void emitn(char *pre, int val, char *post);
+void emits(char *pre, char *s, char *post);
+void emit_name(char *pre, char *name, int len, char *post);
+char *detach_output();
+int output_len();
+void open_output_memory();
+void discard_output();
+
+// asm.c
+ByteBuf *new_byte_buf();
+void buf_byte(ByteBuf *buf, int val);
+void buf_int16(ByteBuf *buf, int val);
+void buf_int32(ByteBuf *buf, int val);
+void buf_int64(ByteBuf *buf, int val);
+void buf_mem(ByteBuf *buf, char *s, int len);
+void buf_align(ByteBuf *buf, int align, int fill);
+void buf_patch32(ByteBuf *buf, int offset, int val);
+AsmSymbol *get_symbol(char *name, int len);
+AsmSymbol *new_label();
+AsmInsn *find_insn(char *name, int len);
+void clear_operand(AsmOperand *op);
+void encode_insn(AsmInsn *insn, char *name);
+void set_section(int section);
+void define_label(AsmSymbol *sym);
+void align_section(int val);
+void encode_string(char *p, int len);
+void begin_assemble();
+void reset_asm();
+void end_assemble();
+
+// elf.c
+void write_object(char *path);
+
+// jit.c
+int run_jit(int argc, char **argv);
+
+// bcgen.c
+int run_vm(int argc, char **argv);
+
+// vm.c
+int vm_run(int *code, int len, char **globals, char **externs, int argc, char **argv);
+
+// exec.c
+char *jit_alloc(int size);
+void jit_protect(char *p, int size);
+int jit_page_size();
+char *jit_lookup(char *name, int len);
+int jit_patch_pc32(char *place, char *target, int addend);
+void jit_write_stub(char *stub, char *target);
+void jit_perf_symbol(char *addr, int size, char *name, int len);
+int jit_call_main(char *entry, int argc, char **argv);
+
+// pch.c
+void emit_pch(char *header, char *output);
+char *find_pch(char *name);
+void load_pch(char *data);
+
+// server.c
+int run_server(char *path);
+int run_client(char *path, int argc, char **argv);
+
+// cache.c
+char *cache_key(char *input, char *options);
+int cache_get(char *dir, char *key, char *output);
+void cache_put(char *dir, char *key, char *path, char *buf, int len, int max_mb);
+
+// scan.c
+char *skip_space(char *p);
+char *skip_line(char *p);
+char *scan_string(char *p);
+char *find_comment_end(char *p);
 
 // ctype.h
 int isspace();
 int isdigit();
 
+// stdio.h
+int dprintf();
+int rename();
+
 // string.h
 int memcmp();
+int strcmp();
 int memcpy();
+int memset();
 int strlen();
 int strtol();
 char *strstr();
@@ -243,5 +679,14 @@ char *strchr();
 
 // stdlib.h
 void *malloc();
+void *calloc();
 void *realloc();
 void free();
+void exit();
+
+// unistd.h
+int write();
+int fork();
+int unlink();
+int rmdir();
+int close();
@@ -0,0 +1,20 @@
+
+// laccをライブラリとして使うためのAPI。ホストのコンパイラでビルドしたプログラムから読み込む。
+// リンクするには liblacc.a と -ldl が必要。
+
+typedef struct LaccContext LaccContext;
+
+// コンパイルに使うコンテキストを作る
+LaccContext *lacc_new(void);
+
+// コンテキストを解放する
+void lacc_free(LaccContext *ctx);
+
+// 長さlenのソースコードsrcをアセンブリに変換する。
+// 成功すれば0を返し、'\0'で終わるアセンブリを*out_bufに入れる (呼び出し側がfreeで解放する)。
+// エラーがあれば-1を返し、*out_bufはNULLになる。メッセージはlacc_errorで取り出せる。
+// 別々のスレッドから同時に呼び出すと並列にコンパイルする。1つのコンテキストは1つのスレッドずつ使う。
+int lacc_compile(LaccContext *ctx, const char *src, int len, char **out_buf);
+
+// 直前のlacc_compileのエラーメッセージを返す (エラーがなければNULL)
+const char *lacc_error(LaccContext *ctx);
@@ -0,0 +1,487 @@
+#include "lacc.h"
+
+extern Arena *local_arena;
+extern Ident *main_ident;
+extern int block_label_cnt;
+
+extern int TRUE;
+extern int FALSE;
+extern void *NULL;
+
+// 構文木を関数ごとに低水準IRに変換する。
+// IRは関数のコードを出力し終えるまでしか使わないので、ローカル変数と同じ領域に確保する。
+
+// 変換中の関数と、命令を追加しているブロック
+IrFunc *ir_fn;
+Block *ir_block;
+
+// 変換中のループ。breakとcontinueはループのラベル番号で飛び先を探す。
+typedef struct IrLoop IrLoop;
+struct IrLoop {
+  IrLoop *next;
+  int val;             // ループのラベル番号
+  Block *break_blk;    // breakの飛び先
+  Block *continue_blk; // continueの飛び先
+};
+
+IrLoop *ir_loop;
+
+int new_vreg() { return ++ir_fn->vreg_cnt; }
+
+// ブロックを作る。ブロックはstart_blockで命令を追加し始めた順に並ぶ。
+Block *new_block() {
+  Block *blk = arena_alloc(local_arena, sizeof(Block));
+  blk->label = block_label_cnt++;
+  return blk;
+}
+
+int is_terminated(Block *blk) {
+  if (!blk->last)
+    return FALSE;
+  IrOp op = blk->last->op;
+  return op == IR_JMP || op == IR_BR || op == IR_RET;
+}
+
+Ins *new_ins(IrOp op) {
+  Ins *ins = arena_alloc(local_arena, sizeof(Ins));
+  ins->op = op;
+  if (ir_block->last) {
+    ir_block->last->next = ins;
+  } else {
+    ir_block->first = ins;
+  }
+  ir_block->last = ins;
+  return ins;
+}
+
+void ir_jmp(Block *target) {
+  Ins *ins = new_ins(IR_JMP);
+  ins->then_blk = target;
+}
+
+void ir_br(int cond, Block *then_blk, Block *else_blk) {
+  Ins *ins = new_ins(IR_BR);
+  ins->a = cond;
+  ins->then_blk = then_blk;
+  ins->else_blk = else_blk;
+}
+
+// blkに命令を追加し始める。直前のブロックが飛び先で終わっていなければblkへ落ちる。
+void start_block(Block *blk) {
+  if (ir_block && !is_terminated(ir_block))
+    ir_jmp(blk);
+  blk->id = ir_fn->block_cnt++;
+  if (ir_fn->last) {
+    ir_fn->last->next = blk;
+  } else {
+    ir_fn->entry = blk;
+  }
+  ir_fn->last = blk;
+  ir_block = blk;
+}
+
+int ir_imm(int val) {
+  Ins *ins = new_ins(IR_IMM);
+  ins->dst = new_vreg();
+  ins->imm = val;
+  return ins->dst;
+}
+
+int ir_binop(IrOp op, int a, int b) {
+  Ins *ins = new_ins(op);
+  ins->dst = new_vreg();
+  ins->a = a;
+  ins->b = b;
+  return ins->dst;
+}
+
+// 型の値を読み書きするバイト数。whereはエラーメッセージに使う。
+int load_size(Type *type, char *where) {
+  if (type->ty == TY_INT) {
+    return 4;
+  } else if (type->ty == TY_CHAR) {
+    return 1;
+  } else if (type->ty == TY_PTR || type->ty == TY_ARGARR) {
+    return 8;
+  }
+  error("invalid type [in %s]", where);
+  return 0;
+}
+
+int store_size(Type *type, char *where) {
+  if (type->ty == TY_INT) {
+    return 4;
+  } else if (type->ty == TY_CHAR) {
+    return 1;
+  } else if (type->ty == TY_PTR) {
+    return 8;
+  }
+  error("invalid type [in %s]", where);
+  return 0;
+}
+
+int lower(Node *node);
+
+// 左辺値のアドレスを計算する
+int lower_addr(Node *node) {
+  LVar *var = node->sym;
+  if (node->kind == ND_LVAR || node->kind == ND_VARDEC) {
+    Ins *ins = new_ins(IR_LOCAL);
+    ins->dst = new_vreg();
+    ins->imm = var->offset;
+    return ins->dst;
+  } else if (node->kind == ND_GVAR) {
+    Ins *ins = new_ins(IR_GLOBAL);
+    ins->dst = new_vreg();
+    ins->sym = var;
+    return ins->dst;
+  } else if (node->kind == ND_DEREF) {
+    return lower(node_at(node->lhs));
+  }
+  error("invalid lvalue, node->kind: %d\n", node->kind);
+  return 0;
+}
+
+// 変数の値を読む。配列はアドレスのまま使う。ローカル変数はフレームから直接読む。
+int lower_load(Node *node, char *where) {
+  if (node->type->ty == TY_ARR)
+    return lower_addr(node);
+  int size = load_size(node->type, where);
+  Ins *ins;
+  if (node->kind == ND_LVAR) {
+    LVar *var = node->sym;
+    ins = new_ins(IR_LLOAD);
+    ins->imm = var->offset;
+  } else {
+    int addr = lower_addr(node);
+    ins = new_ins(IR_LOAD);
+    ins->a = addr;
+  }
+  ins->dst = new_vreg();
+  ins->size = size;
+  return ins->dst;
+}
+
+// lhsの指す場所にvalを書き込む。addrが0でなければそれを書き込む先のアドレスとする。
+void lower_store(Node *lhs, int addr, int val, char *where) {
+  int size = store_size(lhs->type, where);
+  Ins *ins;
+  if (!addr) {
+    LVar *var = lhs->sym;
+    ins = new_ins(IR_LSTORE);
+    ins->imm = var->offset;
+  } else {
+    ins = new_ins(IR_STORE);
+    ins->a = addr;
+  }
+  ins->b = val;
+  ins->size = size;
+}
+
+// 左辺値を書き込むためのアドレスを計算する。ローカル変数ならフレームに直接書くので0を返す。
+int lower_store_addr(Node *lhs) {
+  if (lhs->kind == ND_LVAR || lhs->kind == ND_VARDEC)
+    return 0;
+  return lower_addr(lhs);
+}
+
+// && と || は結果を入れる仮想レジスタを両方の枝で書き換える
+int lower_logical(Node *node) {
+  int is_and = node->kind == ND_AND;
+  Block *rhs_blk = new_block();
+  Block *end_blk = new_block();
+  int result = new_vreg();
+  int zero = ir_imm(0);
+
+  int cond = lower(node_at(node->lhs));
+  Ins *ins = new_ins(IR_IMM);
+  ins->dst = result;
+  ins->imm = !is_and;
+  if (is_and) {
+    ir_br(cond, rhs_blk, end_blk);
+  } else {
+    ir_br(cond, end_blk, rhs_blk);
+  }
+
+  start_block(rhs_blk);
+  cond = lower(node_at(node->rhs));
+  ins = new_ins(IR_NE);
+  ins->dst = result;
+  ins->a = cond;
+  ins->b = zero;
+  start_block(end_blk);
+  return result;
+}
+
+int lower_funcall(Node *node) {
+  int nargs = list_len(node->extra);
+  Ins *ins;
+  int *args = arena_alloc(local_arena, sizeof(int) * (nargs + 1));
+  int *sizes = arena_alloc(local_arena, sizeof(int) * (nargs + 1));
+  for (int i = 0; i < nargs; i++) {
+    Node *arg = list_at(node->extra, i);
+    args[i] = lower(arg);
+    if (arg->type->ty == TY_INT) {
+      sizes[i] = 4;
+    } else if (arg->type->ty == TY_CHAR) {
+      sizes[i] = 1;
+    } else if (is_ptr_or_arr(arg->type)) {
+      sizes[i] = 8;
+    } else {
+      error("invalid type [in ND_FUNCALL]");
+    }
+  }
+  ins = new_ins(IR_CALL);
+  ins->dst = new_vreg();
+  ins->sym = node->sym;
+  ins->args = args;
+  ins->arg_sizes = sizes;
+  ins->nargs = nargs;
+  return ins->dst;
+}
+
+void push_loop(int val, Block *break_blk, Block *continue_blk) {
+  IrLoop *loop = arena_alloc(local_arena, sizeof(IrLoop));
+  loop->val = val;
+  loop->break_blk = break_blk;
+  loop->continue_blk = continue_blk;
+  loop->next = ir_loop;
+  ir_loop = loop;
+}
+
+IrLoop *find_loop(int val) {
+  for (IrLoop *loop = ir_loop; loop; loop = loop->next)
+    if (loop->val == val)
+      return loop;
+  error("invalid loop label: %d", val);
+  return NULL;
+}
+
+// ノードを変換し、値があればその仮想レジスタを返す。値がなければ0を返す。
+int lower(Node *node) {
+  Node *lhs = node_at(node->lhs);
+  Node *rhs = node_at(node->rhs);
+  NodeKind kind = node->kind;
+  Ins *ins;
+  if (kind == ND_NUM) {
+    return ir_imm(node->val);
+  } else if (kind == ND_STRING || kind == ND_ARRAY) {
+    if (kind == ND_STRING) {
+      ins = new_ins(IR_STR);
+    } else {
+      ins = new_ins(IR_ARR);
+    }
+    ins->dst = new_vreg();
+    ins->imm = node->val;
+    return ins->dst;
+  } else if (kind == ND_LVAR || kind == ND_GVAR) {
+    return lower_load(node, "ND_LVAR");
+  } else if (kind == ND_ADDR) {
+    return lower_addr(lhs);
+  } else if (kind == ND_DEREF) {
+    int addr = lower(lhs);
+    if (node->type->ty == TY_ARR)
+      return addr;
+    ins = new_ins(IR_LOAD);
+    ins->dst = new_vreg();
+    ins->a = addr;
+    ins->size = load_size(node->type, "ND_DEREF");
+    return ins->dst;
+  } else if (kind == ND_NOT || kind == ND_BITNOT) {
+    int val = lower(lhs);
+    if (kind == ND_NOT) {
+      ins = new_ins(IR_NOT);
+    } else {
+      ins = new_ins(IR_BITNOT);
+    }
+    ins->dst = new_vreg();
+    ins->a = val;
+    return ins->dst;
+  } else if (kind == ND_ASSIGN) {
+    if (node->val || lhs->type->ty == TY_STRUCT) {
+      // 配列の初期化と構造体の代入はメモリをコピーする。値はコピー元のアドレス。
+      int dst = lower_addr(lhs);
+      int src;
+      if (node->val) {
+        src = lower(rhs);
+      } else {
+        src = lower_addr(rhs);
+      }
+      ins = new_ins(IR_COPY);
+      ins->a = dst;
+      ins->b = src;
+      ins->imm = get_sizeof(rhs->type);
+      return src;
+    }
+    int addr = lower_store_addr(lhs);
+    int val = lower(rhs);
+    lower_store(lhs, addr, val, "ND_ASSIGN");
+    return val;
+  } else if (kind == ND_POSTINC) {
+    // 値は書き換える前の値。rhsは書き換えた後の値を計算する式。
+    int addr = lower_store_addr(lhs);
+    int old = 0;
+    if (!node->endline) {
+      int size = load_size(node->type, "ND_POSTINC");
+      if (addr) {
+        ins = new_ins(IR_LOAD);
+        ins->a = addr;
+      } else {
+        LVar *var = lhs->sym;
+        ins = new_ins(IR_LLOAD);
+        ins->imm = var->offset;
+      }
+      ins->dst = new_vreg();
+      ins->size = size;
+      old = ins->dst;
+    }
+    lower_store(lhs, addr, lower(rhs), "ND_POSTINC");
+    return old;
+  } else if (kind == ND_RETURN) {
+    int val = lower(rhs);
+    ins = new_ins(IR_RET);
+    ins->a = val;
+    start_block(new_block());
+    return 0;
+  } else if (kind == ND_BLOCK) {
+    for (int i = 0; i < list_len(node->extra); i++)
+      lower(list_at(node->extra, i));
+    return 0;
+  } else if (kind == ND_IF) {
+    Block *then_blk = new_block();
+    Block *end_blk = new_block();
+    Block *else_blk = end_blk;
+    if (node->extra)
+      else_blk = new_block();
+    ir_br(lower(lhs), then_blk, else_blk);
+    start_block(then_blk);
+    lower(rhs);
+    if (node->extra) {
+      ir_jmp(end_blk);
+      start_block(else_blk);
+      lower(node_at(node->extra));
+    }
+    start_block(end_blk);
+    return 0;
+  } else if (kind == ND_WHILE || kind == ND_FOR) {
+    Block *begin_blk = new_block();
+    Block *body_blk = new_block();
+    Block *step_blk = new_block();
+    Block *end_blk = new_block();
+    start_block(begin_blk);
+    ir_br(lower(lhs), body_blk, end_blk);
+    start_block(body_blk);
+    push_loop(node->val, end_blk, step_blk);
+    lower(rhs);
+    ir_loop = ir_loop->next;
+    start_block(step_blk);
+    if (kind == ND_FOR)
+      lower(node_at(node->extra));
+    ir_jmp(begin_blk);
+    start_block(end_blk);
+    return 0;
+  } else if (kind == ND_DOWHILE) {
+    // continueは条件を評価せずにループの先頭へ戻る
+    Block *begin_blk = new_block();
+    Block *step_blk = new_block();
+    Block *end_blk = new_block();
+    start_block(begin_blk);
+    push_loop(node->val, end_blk, step_blk);
+    lower(rhs);
+    ir_loop = ir_loop->next;
+    ir_br(lower(lhs), step_blk, end_blk);
+    start_block(step_blk);
+    ir_jmp(begin_blk);
+    start_block(end_blk);
+    return 0;
+  } else if (kind == ND_BREAK || kind == ND_CONTINUE) {
+    IrLoop *loop = find_loop(node->val);
+    if (kind == ND_BREAK) {
+      ir_jmp(loop->break_blk);
+    } else {
+      ir_jmp(loop->continue_blk);
+    }
+    start_block(new_block());
+    return 0;
+  } else if (kind == ND_FUNCALL) {
+    return lower_funcall(node);
+  } else if (kind == ND_AND || kind == ND_OR) {
+    return lower_logical(node);
+  } else if (kind == ND_GLBDEC || kind == ND_VARDEC || kind == ND_EXTERN || kind == ND_TYPEDEF || kind == ND_ENUM ||
+             kind == ND_STRUCT || kind == ND_TYPE || kind == ND_NONE) {
+    return 0;
+  }
+
+  IrOp op;
+  if (kind == ND_ADD) {
+    op = IR_ADD;
+  } else if (kind == ND_SUB) {
+    op = IR_SUB;
+  } else if (kind == ND_MUL) {
+    op = IR_MUL;
+  } else if (kind == ND_DIV) {
+    op = IR_DIV;
+  } else if (kind == ND_MOD) {
+    op = IR_MOD;
+  } else if (kind == ND_EQ) {
+    op = IR_EQ;
+  } else if (kind == ND_NE) {
+    op = IR_NE;
+  } else if (kind == ND_LT) {
+    op = IR_LT;
+  } else if (kind == ND_LE) {
+    op = IR_LE;
+  } else if (kind == ND_BITAND) {
+    op = IR_AND;
+  } else if (kind == ND_BITOR) {
+    op = IR_OR;
+  } else if (kind == ND_BITXOR) {
+    op = IR_XOR;
+  } else if (kind == ND_SHL) {
+    op = IR_SHL;
+  } else if (kind == ND_SHR) {
+    op = IR_SAR;
+  } else {
+    error("invalid node kind");
+  }
+  int a = lower(lhs);
+  int b = lower(rhs);
+  int dst = ir_binop(op, a, b);
+  // ポインタの差を要素の大きさで割るときは、割られる数が64bitになる
+  if (op == IR_DIV || op == IR_MOD) {
+    ir_block->last->size = 4;
+    if (is_ptr_or_arr(lhs->type))
+      ir_block->last->size = 8;
+  }
+  return dst;
+}
+
+// 関数定義を低水準IRに変換する
+IrFunc *lower_function(Node *node) {
+  Function *fn = node->sym;
+  ir_fn = arena_alloc(local_arena, sizeof(IrFunc));
+  ir_fn->fn = fn;
+  ir_fn->frame_size = (fn->offset + 7) / 8 * 8;
+  ir_block = NULL;
+  ir_loop = NULL;
+  start_block(new_block());
+
+  // 引数はレジスタからフレーム上の変数に移す
+  for (int i = 0; i < list_len(node->extra); i++) {
+    Node *param = list_at(node->extra, i);
+    LVar *var = param->sym;
+    Ins *ins = new_ins(IR_PARAM);
+    ins->imm = var->offset;
+    ins->imm2 = i;
+    ins->size = load_size(param->type, "ND_FUNCDEF");
+  }
+  lower(node_at(node->lhs));
+
+  // 最後まで実行したときは、mainなら0を返し、それ以外は値を決めずに戻る
+  if (!is_terminated(ir_block)) {
+    Ins *ret = new_ins(IR_RET);
+    if (fn->ident == main_ident)
+      ret->a = ir_imm(0);
+  }
+  return ir_fn;
+}
@@ -1,136 +1,351 @@
-
 #include "lacc.h"
 
-char *user_input;
-Token *token;
-Node **code;
-int label_cnt = 0;
-int array_cnt = 0;
-int loop_cnt = 0;
-int variable_cnt = 0;
-int logical_cnt = 0;
-int loop_id = -1;
-Function *functions;
-Function *current_fn;
-LVar *globals;
-Struct *structs;
-StructTag *struct_tags;
-Enum *enums;
-LVar *enum_members;
-String *strings;
-Array *arrays;
-String *filenames;
-char *filename;
-char *consumed_ptr;
-
-int TRUE = 1;
-int FALSE = 0;
-void *NULL = 0;
-
-void init_global_variables() {
-  // functionの初期化
-  functions = malloc(sizeof(Function));
-  functions->next = NULL;
-  current_fn = functions;
-
-  // enumの初期化
-  enums = malloc(sizeof(Enum));
-  enums->next = NULL;
-  enum_members = malloc(sizeof(LVar));
-  enum_members->next = NULL;
-  enum_members->type = new_type(TY_NONE);
-
-  // 構造体の初期化
-  structs = malloc(sizeof(Struct));
-  structs->next = NULL;
-  struct_tags = malloc(sizeof(StructTag));
-  struct_tags->next = NULL;
-
-  // グローバル変数の初期化
-  globals = malloc(sizeof(LVar));
-  globals->next = NULL;
-  globals->type = new_type(TY_NONE);
-
-  // 文字列リテラルの初期化
-  strings = malloc(sizeof(String));
-  strings->next = NULL;
-  arrays = malloc(sizeof(Array));
-  arrays->next = NULL;
-
-  // トークンの初期化
-  token = malloc(sizeof(Token));
-  token->next = NULL;
-  token->str = NULL;
-  token->len = 0;
+extern int TRUE;
+extern int FALSE;
+extern void *NULL;
+
+// コンパイル結果の出力方法
+typedef enum {
+  MODE_ASM,    // アセンブリを出力する
+  MODE_OBJECT, // 内蔵のアセンブラでオブジェクトファイルを出力する
+  MODE_AS,     // アセンブリを出力し、システムのアセンブラでオブジェクトファイルにする
+  MODE_RUN,    // メモリ上の機械語を実行する
+  MODE_VM      // バイトコードに変換して実行する
+} CompileMode;
+
+// NULLでなければコンパイル結果をこのディレクトリにキャッシュする (--cache)
+char *cache_dir;
+// キャッシュの大きさの上限 (メガバイト)
+int cache_size = 256;
+
+extern int opt_level;
+extern int ir_dump;
+
+// パスの末尾の.cか.oをextに変えたものを返す
+char *change_ext(char *path, char *ext) {
+  int len = strlen(path);
+  if (len >= 2 && path[len - 2] == '.' && (path[len - 1] == 'c' || path[len - 1] == 'o'))
+    len -= 2;
+  int ext_len = strlen(ext);
+  char *result = malloc(len + ext_len + 1);
+  memcpy(result, path, len);
+  memcpy(result + len, ext, ext_len + 1);
+  return result;
 }
 
-int main(int argc, char **argv) {
-  if (argc != 2) {
-    error("引数の個数が正しくありません");
-    return 1;
-  }
+// 入力ファイル名の拡張子をextに変えたものを返す (ディレクトリは取り除く)
+char *replace_ext(char *input, char *ext) {
+  char *base = input;
+  for (char *p = input; *p; p++)
+    if (*p == '/')
+      base = p + 1;
+  return change_ext(base, ext);
+}
 
-  init_global_variables();
+int is_c_file(char *path) {
+  int len = strlen(path);
+  return len >= 2 && path[len - 2] == '.' && path[len - 1] == 'c';
+}
 
-  // トークナイズしてパースする
-  // 結果はcodeに保存される
-  Token *token_cpy = token;
-  filename = argv[1];
-  filenames = malloc(sizeof(String));
-  filenames->text = filename;
-  filenames->len = strlen(filename);
-  filenames->next = NULL;
-  user_input = read_file(filename);
+// argvのコマンドを実行し、失敗すればエラーにする
+void run_tool(char **cmd) {
+  int status = run_command(cmd);
+  if (status)
+    error("%s が終了コード %d で失敗しました", cmd[0], status);
+}
 
-  tokenize();
-  new_token(TK_EOF, NULL, 0);
-  token = token_cpy->next;
+// 1つのファイルをコンパイルする。
+// MODE_ASMでoutputがNULLなら標準出力に書き出す。
+void compile_file(char *input, char *output, CompileMode mode) {
+  // キャッシュにあれば、字句解析も構文解析もせずにその内容を出力する
+  char *key = NULL;
+  if (cache_dir) {
+    // 最適化のレベルが違えば別のエントリにする
+    char *options = "-O0 -c";
+    if (mode == MODE_ASM) {
+      options = "-O0 -S";
+    } else if (mode == MODE_AS) {
+      options = "-O0 --use-as";
+    }
+    char *buf = malloc(strlen(options) + 1);
+    memcpy(buf, options, strlen(options) + 1);
+    buf[2] = '0' + opt_level;
+    key = cache_key(input, buf);
+    free(buf);
+    if (key && cache_get(cache_dir, key, output))
+      return;
+  }
 
-  program();
+  if (mode == MODE_ASM && key) {
+    // 標準出力に書く場合もあるので、メモリに溜めてから出力とキャッシュの両方に書く
+    open_output_memory();
+    gen_file(input);
+    int len = output_len();
+    char *buf = detach_output();
+    open_output(output);
+    emit_mem(buf, len);
+    close_output();
+    cache_put(cache_dir, key, NULL, buf, len, cache_size);
+    free(buf);
+    return;
+  }
 
-  // アセンブリの前半部分を出力
-  printf(".intel_syntax noprefix\n");
+  if (mode == MODE_ASM) {
+    open_output(output);
+    gen_file(input);
+    close_output();
+  } else if (mode == MODE_AS) {
+    // アセンブリはオブジェクトファイルと同じディレクトリに置く
+    char *asm_path = change_ext(output, ".s");
+    open_output(asm_path);
+    gen_file(input);
+    close_output();
+    char *cmd[5];
+    cmd[0] = "as";
+    cmd[1] = "-o";
+    cmd[2] = output;
+    cmd[3] = asm_path;
+    cmd[4] = NULL;
+    run_tool(cmd);
+    unlink(asm_path);
+  } else {
+    // アセンブリを書かずに、コード生成から直接機械語にする
+    begin_assemble();
+    gen_file(input);
+    end_assemble();
+    write_object(output);
+  }
+  if (key)
+    cache_put(cache_dir, key, output, NULL, 0, cache_size);
+}
 
-  // グローバル変数の定義
-  printf("  .data\n");
-  for (LVar *var = globals; var->next; var = var->next) {
-    if (var->ext) {
+// 複数のファイルを最大jobs個の子プロセスで並列にコンパイルする。
+// 失敗したファイルがあれば、実行中のものを待ってから失敗した数を返す。
+int compile_all(char **inputs, char **outputs, int n, CompileMode mode, int jobs) {
+  int running = 0;
+  int failed = 0;
+  int next = 0;
+  while (next < n || running > 0) {
+    if (next < n && running < jobs && !failed) {
+      int pid = fork();
+      if (pid < 0)
+        error("子プロセスを作れません");
+      if (pid == 0) {
+        compile_file(inputs[next], outputs[next], mode);
+        exit(0);
+      }
+      next++;
+      running++;
       continue;
     }
-    printf("  .globl %.*s\n", var->len, var->name);
-    printf("  .p2align 3\n");
-    printf("%.*s:\n", var->len, var->name);
-    if (var->offset) {
-      printf("  .long %d\n", var->offset);
+    if (running == 0)
+      break;
+    int status;
+    if (wait_child(&status) < 0)
+      error("子プロセスを待てません");
+    running--;
+    if (status)
+      failed++;
+  }
+  return failed;
+}
+
+// --linkで作った一時オブジェクトファイルとそのディレクトリを消す
+void remove_temp_objects(char *dir, char **paths, int n) {
+  for (int i = 0; i < n; i++)
+    unlink(paths[i]);
+  rmdir(dir);
+}
+
+int main(int argc, char **argv) {
+  // 使い方: lacc [-S | -c | --use-as] [--link] [-j 並列数] [-o 出力ファイル] 入力ファイル...
+  //         lacc --run 入力ファイル [プログラムへの引数...]
+  //         lacc --vm 入力ファイル [プログラムへの引数...]
+  //         lacc --server ソケット
+  //         lacc --client ソケット [通常の引数...]
+  //         lacc --emit-pch ヘッダ [-o 出力ファイル]
+  // --cache ディレクトリ [--cache-size メガバイト] を付けるとコンパイル結果をキャッシュする。
+  // -O0, -O1 (既定), -O2 で最適化のレベルを選び、--dump-ir で各パスの後の低水準IRを出力する。
+  // -O2 は今のところ -O1 の別名で、同じパスを実行する。
+  // 入力ファイルが複数あれば dir/foo.c は カレントディレクトリの foo.s (-cなら foo.o) に出力する。
+  // 出力の名前が重なる入力はエラーにする。
+  // --linkなら全ファイルを一時ディレクトリのオブジェクトファイルにしてから cc でリンクする。
+  // .c以外の入力 (.o, -lなど) はリンカにそのまま渡す。
+  // --serverなら常駐してコンパイルの要求を待ち、--clientならその要求を送って結果を待つ
+  if (argc >= 3 && !strcmp(argv[1], "--server"))
+    return run_server(argv[2]);
+  if (argc >= 3 && !strcmp(argv[1], "--client"))
+    return run_client(argv[2], argc - 3, argv + 3);
+
+  char **inputs = malloc(sizeof(char *) * argc);
+  char **linker_args = malloc(sizeof(char *) * argc);
+  int input_cnt = 0;
+  int linker_arg_cnt = 0;
+  char *output = NULL;
+  CompileMode mode = MODE_ASM;
+  int link = FALSE;
+  int jobs = 1;
+  int run_argc = 0;
+  char **run_argv = NULL;
+  char *pch_header = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-S")) {
+      mode = MODE_ASM;
+    } else if (!strcmp(argv[i], "-c")) {
+      mode = MODE_OBJECT;
+    } else if (!strcmp(argv[i], "--use-as")) {
+      mode = MODE_AS;
+    } else if (!strcmp(argv[i], "--link")) {
+      link = TRUE;
+    } else if (!memcmp(argv[i], "-O", 2)) {
+      char *level = argv[i] + 2;
+      if (!*level) {
+        opt_level = 1;
+      } else if (level[0] >= '0' && level[0] <= '2' && !level[1]) {
+        opt_level = level[0] - '0';
+      } else {
+        error("最適化のレベルが正しくありません: %s", argv[i]);
+      }
+    } else if (!strcmp(argv[i], "--dump-ir")) {
+      ir_dump = TRUE;
+    } else if (!strcmp(argv[i], "--emit-pch")) {
+      if (i + 1 >= argc)
+        error("--emit-pch の後にヘッダ名がありません");
+      pch_header = argv[++i];
+    } else if (!strcmp(argv[i], "--cache")) {
+      if (i + 1 >= argc)
+        error("--cache の後にディレクトリ名がありません");
+      cache_dir = argv[++i];
+    } else if (!strcmp(argv[i], "--cache-size")) {
+      if (i + 1 >= argc)
+        error("--cache-size の後に大きさがありません");
+      cache_size = strtol(argv[++i], NULL, 10);
+      if (cache_size < 1)
+        error("キャッシュの大きさが正しくありません: %s", argv[i]);
+    } else if (!strcmp(argv[i], "--run") || !strcmp(argv[i], "--vm")) {
+      if (i + 1 >= argc)
+        error("%s の後に入力ファイル名がありません", argv[i]);
+      mode = MODE_RUN;
+      if (!strcmp(argv[i], "--vm"))
+        mode = MODE_VM;
+      inputs[input_cnt++] = argv[i + 1];
+      // 入力ファイル名から後ろはそのままプログラムのargvになる
+      run_argc = argc - i - 1;
+      run_argv = argv + i + 1;
+      break;
+    } else if (!memcmp(argv[i], "-j", 2)) {
+      char *n = argv[i] + 2;
+      if (!*n) {
+        if (i + 1 >= argc)
+          error("-j の後に並列数がありません");
+        n = argv[++i];
+      }
+      jobs = strtol(n, NULL, 10);
+      if (jobs < 1)
+        error("並列数が正しくありません: %s", n);
+    } else if (!strcmp(argv[i], "-o")) {
+      if (i + 1 >= argc)
+        error("-o の後に出力ファイル名がありません");
+      output = argv[++i];
+    } else if (is_c_file(argv[i])) {
+      inputs[input_cnt++] = argv[i];
     } else {
-      printf("  .zero %d\n", get_sizeof(var->type));
+      linker_args[linker_arg_cnt++] = argv[i];
     }
   }
+  // プリコンパイル済みヘッダはヘッダと同じ場所に名前.pchとして置く
+  if (pch_header) {
+    if (input_cnt || linker_arg_cnt)
+      error("--emit-pch にはヘッダを1つだけ指定してください");
+    if (!output) {
+      int len = strlen(pch_header);
+      output = malloc(len + 5);
+      memcpy(output, pch_header, len);
+      memcpy(output + len, ".pch", 5);
+    }
+    emit_pch(pch_header, output);
+    return 0;
+  }
 
-  // 文字列リテラル
-  for (String *str = strings; str->next; str = str->next) {
-    printf(".L.str%d:\n", str->id);
-    printf("  .string \"%.*s\"\n", str->len, str->text);
+  if (!input_cnt) {
+    error("引数の個数が正しくありません");
+  }
+  if (linker_arg_cnt && !link) {
+    error("不明な引数です: %s", linker_args[0]);
   }
 
-  // 配列リテラル
-  for (Array *arr = arrays; arr->next; arr = arr->next) {
-    printf(".L.arr%d:\n", arr->id);
-    for (int i = 0; i < arr->len; i++) {
-      if (arr->byte == 1) {
-        printf("  .byte %d\n", arr->val[i]);
-      } else if (arr->byte == 4) {
-        printf("  .long %d\n", arr->val[i]);
-      } else {
-        error("invalid array type [INIT]");
-      }
+  if (mode == MODE_RUN || mode == MODE_VM) {
+    if (link || input_cnt != 1)
+      error("%s には入力ファイルを1つだけ指定してください", "--run, --vm");
+    // --vmならバイトコードに変換してその場で実行する
+    if (mode == MODE_VM) {
+      parse_file(inputs[0]);
+      return run_vm(run_argc, run_argv);
     }
+    begin_assemble();
+    gen_file(inputs[0]);
+    end_assemble();
+    return run_jit(run_argc, run_argv);
   }
 
-  // 先頭の式から順にコード生成
-  printf("  .text\n");
-  for (int i = 0; code[i]->kind != ND_NONE; i++) {
-    gen(code[i]);
+  // リンクする場合はオブジェクトファイルを作る
+  if (link && mode == MODE_ASM)
+    mode = MODE_OBJECT;
+
+  // 入力が1つでリンクしなければ、子プロセスを作らずにその場でコンパイルする
+  if (input_cnt == 1 && !link) {
+    // オブジェクトファイルの名前が指定されなければ、入力ファイルの拡張子を.oにした名前にする
+    if (mode != MODE_ASM && !output)
+      output = replace_ext(inputs[0], ".o");
+    compile_file(inputs[0], output, mode);
+    return 0;
+  }
+
+  if (output && !link)
+    error("入力ファイルが複数あるときは -o は --link と一緒にしか使えません");
+  char **outputs = malloc(sizeof(char *) * input_cnt);
+  char *temp_dir = NULL;
+  if (link)
+    temp_dir = make_temp_dir();
+  for (int i = 0; i < input_cnt; i++) {
+    if (link) {
+      outputs[i] = temp_object_path(temp_dir, i);
+    } else if (mode == MODE_ASM) {
+      outputs[i] = replace_ext(inputs[i], ".s");
+    } else {
+      outputs[i] = replace_ext(inputs[i], ".o");
+    }
+    // 別のディレクトリの同じ名前のファイルは同じ出力先になるので、並列に書き込む前に止める
+    for (int j = 0; j < i; j++)
+      if (!strcmp(outputs[i], outputs[j]))
+        error("%s と %s の出力先がどちらも %s になります", inputs[j], inputs[i], outputs[i]);
+  }
+  int failed = compile_all(inputs, outputs, input_cnt, mode, jobs);
+  if (failed) {
+    if (link)
+      remove_temp_objects(temp_dir, outputs, input_cnt);
+    error("%d 個のファイルのコンパイルに失敗しました", failed);
+  }
+
+  if (link) {
+    char **cmd = malloc(sizeof(char *) * (input_cnt + linker_arg_cnt + 4));
+    int n = 0;
+    cmd[n++] = "cc";
+    cmd[n++] = "-o";
+    if (output) {
+      cmd[n++] = output;
+    } else {
+      cmd[n++] = "a.out";
+    }
+    for (int i = 0; i < input_cnt; i++)
+      cmd[n++] = outputs[i];
+    for (int i = 0; i < linker_arg_cnt; i++)
+      cmd[n++] = linker_args[i];
+    cmd[n] = NULL;
+    int status = run_command(cmd);
+    remove_temp_objects(temp_dir, outputs, input_cnt);
+    if (status)
+      error("%s が終了コード %d で失敗しました", cmd[0], status);
   }
   return 0;
 }
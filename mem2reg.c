@@ -0,0 +1,97 @@
+#include "lacc.h"
+
+extern Arena *local_arena;
+
+extern int TRUE;
+extern int FALSE;
+extern void *NULL;
+
+// アドレスを取られないint, char, ポインタのローカル変数と引数を仮想レジスタに置き換える。
+// 変数はフレーム上のオフセットで区別する。IR_LOCALでアドレスを取られる変数 (&を付けた変数,
+// 配列, 構造体) と、大きさの違う読み書きがある変数はフレームに残す。
+// 置き換えた変数は複数回代入される仮想レジスタになるので、この後のSSA形式への変換でphiを置く。
+
+// 仮想レジスタの値が、大きさsizeの変数から読んだときと同じ範囲に収まっていればTRUE。
+// range[v]は1なら0から255, 4ならintの範囲に収まることを表す。
+int fits_in(int *range, int v, int size) { return range[v] && range[v] <= size; }
+
+int promote_locals(IrFunc *f) {
+  int slot_cnt = f->frame_size + 1;
+  int *size = arena_alloc(local_arena, sizeof(int) * slot_cnt);
+  for (Block *blk = f->entry; blk; blk = blk->next) {
+    for (Ins *ins = blk->first; ins; ins = ins->next) {
+      IrOp op = ins->op;
+      if (op == IR_LOCAL) {
+        size[ins->imm] = -1;
+      } else if (op == IR_LLOAD || op == IR_LSTORE || op == IR_PARAM) {
+        if (!size[ins->imm]) {
+          size[ins->imm] = ins->size;
+        } else if (size[ins->imm] != ins->size) {
+          size[ins->imm] = -1;
+        }
+      }
+    }
+  }
+
+  int *var = arena_alloc(local_arena, sizeof(int) * slot_cnt);
+  int promoted = 0;
+  for (int i = 1; i < slot_cnt; i++) {
+    if (size[i] > 0) {
+      var[i] = ++f->vreg_cnt;
+      promoted++;
+    }
+  }
+  if (!promoted)
+    return FALSE;
+
+  // 書き込む値が変数の範囲に収まっていれば、切り詰めずにそのまま代入する
+  int *range = arena_alloc(local_arena, sizeof(int) * (f->vreg_cnt + 1));
+  int *def_cnt = arena_alloc(local_arena, sizeof(int) * (f->vreg_cnt + 1));
+  for (Block *blk = f->entry; blk; blk = blk->next) {
+    for (Ins *ins = blk->first; ins; ins = ins->next) {
+      IrOp op = ins->op;
+      int v = ins->dst;
+      if (!v)
+        continue;
+      def_cnt[v]++;
+      if (op == IR_IMM) {
+        range[v] = 4;
+        if (ins->imm >= 0 && ins->imm <= 255)
+          range[v] = 1;
+      } else if (op == IR_EQ || op == IR_NE || op == IR_LT || op == IR_LE || op == IR_NOT) {
+        range[v] = 1;
+      } else if ((op == IR_LOAD || op == IR_LLOAD) && ins->size < 8) {
+        range[v] = ins->size;
+      }
+    }
+  }
+  for (int v = 1; v <= f->vreg_cnt; v++)
+    if (def_cnt[v] > 1)
+      range[v] = 0;
+
+  for (Block *blk = f->entry; blk; blk = blk->next) {
+    for (Ins *ins = blk->first; ins; ins = ins->next) {
+      IrOp op = ins->op;
+      if (op != IR_LLOAD && op != IR_LSTORE && op != IR_PARAM)
+        continue;
+      if (size[ins->imm] <= 0)
+        continue;
+      int v = var[ins->imm];
+      if (op == IR_LLOAD) {
+        ins->op = IR_MOV;
+        ins->a = v;
+      } else if (op == IR_LSTORE) {
+        ins->op = IR_EXT;
+        if (ins->size == 8 || fits_in(range, ins->b, ins->size))
+          ins->op = IR_MOV;
+        ins->dst = v;
+        ins->a = ins->b;
+        ins->b = 0;
+      } else {
+        // 引数のレジスタから直接受け取る
+        ins->dst = v;
+      }
+    }
+  }
+  return FALSE;
+}
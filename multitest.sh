@@ -1,10 +1,11 @@
 #!/bin/bash
+# 使い方: multitest.sh コンパイラ [コンパイラへの引数...]
 
 echo \[unitests.c\]
-./rf.sh $1 ./unitests.c
+./rf.sh $1 ./unitests.c "${@:2}"
 
 echo \[prime.c\]
-./rf.sh $1 ./prime.c
+./rf.sh $1 ./prime.c "${@:2}"
 
 echo \[fizzbuzz.c\]
-./rf.sh $1 ./fizzbuzz.c
+./rf.sh $1 ./fizzbuzz.c "${@:2}"
@@ -0,0 +1,48 @@
+
+// バイトコードの命令。bcgen.c (lacc) と vm.c (ホストのコンパイラ) の両方から読み込む。
+// 値はすべて64bitのスタックに積む。オペランドは命令の直後に32bitで並べる。
+typedef enum {
+  OP_HALT,    // 実行を終える (番地0に置き、未定義の関数を表す)
+  OP_PUSH,    // imm: 即値を積む
+  OP_POP,     // 値を捨てる
+  OP_DUP,     // 先頭を複製する
+  OP_SWAP,    // 先頭の2つを入れ替える
+  OP_LADDR,   // off: フレームポインタ - off を積む
+  OP_GADDR,   // idx: 大域シンボル表のidx番目のアドレスを積む
+  OP_LOAD1,   // アドレスを取り出し、1バイトをゼロ拡張して積む
+  OP_LOAD4,   // アドレスを取り出し、4バイトを符号拡張して積む
+  OP_LOAD8,   // アドレスを取り出し、8バイトを積む
+  OP_STORE1,  // 値とアドレスを取り出して書き込み、値を積む
+  OP_STORE4,
+  OP_STORE8,
+  OP_COPY,    // size: コピー元とコピー先を取り出してコピーし、コピー元を積む
+  OP_ZEXT1,   // 下位8bitにする
+  OP_ZEXT4,   // 下位32bitにする
+  OP_NOT,
+  OP_BITNOT,
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_DIV,
+  OP_MOD,
+  OP_EQ,
+  OP_NE,
+  OP_LT,
+  OP_LE,
+  OP_AND,
+  OP_OR,
+  OP_XOR,
+  OP_SHL,
+  OP_SAR,
+  OP_JMP,     // pc: 無条件に飛ぶ
+  OP_JZ,      // pc: 取り出した値が0なら飛ぶ
+  OP_JNZ,     // pc: 取り出した値が0でなければ飛ぶ
+  OP_CALL,    // pc, n: 引数をn個取り出してバイトコードの関数を呼ぶ
+  OP_CALLX,   // idx, n: 引数をn個取り出して外部関数表のidx番目の関数を呼ぶ
+  OP_ENTER,   // size: ローカル変数の領域を確保する
+  OP_ARG,     // i: i番目の引数を積む
+  OP_RET,     // 値を取り出して戻り値とし、呼び出し元に戻る
+  OP_RETV,    // 戻り値なしで呼び出し元に戻る
+  OP_PUSHRET, // 直前の呼び出しの戻り値を積む
+  OP_COUNT
+} OpCode;
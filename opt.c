@@ -0,0 +1,230 @@
+#include "lacc.h"
+
+extern Arena *local_arena;
+
+extern int TRUE;
+extern int FALSE;
+extern void *NULL;
+
+// 最適化のレベル (-O0, -O1, -O2)
+int opt_level = 1;
+// TRUEなら低水準IRを変換の後と各パスの後に標準エラー出力に書き出す (--dump-ir)
+int ir_dump;
+
+// 低水準IRに対するパス。パスは関数ごとにpipelineの順に実行する。
+typedef enum {
+  PASS_MEM2REG,   // ローカル変数を仮想レジスタに置き換える
+  PASS_SSA,       // SSA形式にする
+  PASS_COPYPROP,  // コピーした値を使う場所をコピー元に置き換える
+  PASS_DCE,       // 使われない値を計算する命令を取り除く
+  PASS_LEAVE_SSA  // phiをコピーに置き換えてSSA形式から戻す
+} PassKind;
+
+char *pass_name(PassKind pass) {
+  if (pass == PASS_MEM2REG)
+    return "mem2reg";
+  else if (pass == PASS_SSA)
+    return "ssa";
+  else if (pass == PASS_COPYPROP)
+    return "copyprop";
+  else if (pass == PASS_DCE)
+    return "dce";
+  return "leave-ssa";
+}
+
+// SSA形式で、IR_MOVの結果を使う場所をコピー元の仮想レジスタに置き換える。
+// 使われなくなったIR_MOVはこの後のDCEで取り除く。
+int propagate_copies(IrFunc *f) {
+  int *copy_of = arena_alloc(local_arena, sizeof(int) * (f->vreg_cnt + 1));
+  for (Block *blk = f->entry; blk; blk = blk->next)
+    for (Ins *ins = blk->first; ins; ins = ins->next)
+      if (ins->op == IR_MOV && ins->a != ins->dst)
+        copy_of[ins->dst] = ins->a;
+
+  for (Block *blk = f->entry; blk; blk = blk->next) {
+    for (Ins *ins = blk->first; ins; ins = ins->next) {
+      while (copy_of[ins->a])
+        ins->a = copy_of[ins->a];
+      while (copy_of[ins->b])
+        ins->b = copy_of[ins->b];
+      for (int i = 0; i < ins->nargs; i++)
+        while (copy_of[ins->args[i]])
+          ins->args[i] = copy_of[ins->args[i]];
+    }
+  }
+  return FALSE;
+}
+
+// DCEで生きていると分かった仮想レジスタと、まだ定義を辿っていないもの
+int *dce_live;
+int *dce_work;
+int dce_work_len;
+
+void mark_live(int v) {
+  if (!v || dce_live[v])
+    return;
+  dce_live[v] = TRUE;
+  dce_work[dce_work_len++] = v;
+}
+
+void mark_operands(Ins *ins) {
+  mark_live(ins->a);
+  mark_live(ins->b);
+  for (int i = 0; i < ins->nargs; i++)
+    mark_live(ins->args[i]);
+}
+
+// 副作用のある命令から使う値を辿り、辿り着かない命令を取り除く。
+// 互いに使い合うだけのphi (使われない変数のループ) もまとめて取り除ける。
+int eliminate_dead_code(IrFunc *f) {
+  int n = f->vreg_cnt + 1;
+  int ins_cnt = 0;
+  for (Block *blk = f->entry; blk; blk = blk->next)
+    for (Ins *ins = blk->first; ins; ins = ins->next)
+      ins_cnt++;
+
+  // 仮想レジスタごとに、それを定義する命令のリストを作る (番号は1から)
+  Ins **all = arena_alloc(local_arena, sizeof(Ins *) * (ins_cnt + 1));
+  int *first_def = arena_alloc(local_arena, sizeof(int) * n);
+  int *next_def = arena_alloc(local_arena, sizeof(int) * (ins_cnt + 1));
+  int k = 0;
+  for (Block *blk = f->entry; blk; blk = blk->next) {
+    for (Ins *ins = blk->first; ins; ins = ins->next) {
+      all[++k] = ins;
+      if (ins->dst) {
+        next_def[k] = first_def[ins->dst];
+        first_def[ins->dst] = k;
+      }
+    }
+  }
+
+  // 値を定義しない命令と関数呼び出しが使う値から辿る
+  dce_live = arena_alloc(local_arena, sizeof(int) * n);
+  dce_work = arena_alloc(local_arena, sizeof(int) * n);
+  dce_work_len = 0;
+  for (int i = 1; i <= ins_cnt; i++)
+    if (!all[i]->dst || all[i]->op == IR_CALL)
+      mark_operands(all[i]);
+  while (dce_work_len) {
+    int v = dce_work[--dce_work_len];
+    for (int d = first_def[v]; d; d = next_def[d])
+      mark_operands(all[d]);
+  }
+
+  for (Block *blk = f->entry; blk; blk = blk->next) {
+    Ins *prev = NULL;
+    for (Ins *ins = blk->first; ins; ins = ins->next) {
+      if (ins->dst && !dce_live[ins->dst] && ins->op != IR_CALL) {
+        if (prev) {
+          prev->next = ins->next;
+        } else {
+          blk->first = ins->next;
+        }
+      } else {
+        prev = ins;
+      }
+    }
+  }
+  return FALSE;
+}
+
+// パスを実行する。ブロックや辺を変えたらTRUEを返す。
+int run_pass(IrFunc *f, PassKind pass) {
+  if (pass == PASS_MEM2REG)
+    return promote_locals(f);
+  else if (pass == PASS_SSA)
+    return build_ssa(f);
+  else if (pass == PASS_COPYPROP)
+    return propagate_copies(f);
+  else if (pass == PASS_DCE)
+    return eliminate_dead_code(f);
+  return leave_ssa(f);
+}
+
+// 最適化のレベルに応じたパスの並びをpassesに書き、パスの数を返す。
+// -O2だけで実行するパスはまだないので、-O1と-O2は同じ並びになる。
+int pipeline(int *passes) {
+  int n = 0;
+  if (opt_level == 0)
+    return n;
+  passes[n++] = PASS_MEM2REG;
+  passes[n++] = PASS_SSA;
+  passes[n++] = PASS_COPYPROP;
+  passes[n++] = PASS_DCE;
+  passes[n++] = PASS_LEAVE_SSA;
+  return n;
+}
+
+// パスを順に実行する。制御フローグラフや支配木は、変わらない限りパスの間で使い回す。
+void optimize(IrFunc *f) {
+  if (ir_dump)
+    dump_ir(f, "lower");
+  int *passes = arena_alloc(local_arena, sizeof(int) * 16);
+  int n = pipeline(passes);
+  for (int i = 0; i < n; i++) {
+    if (run_pass(f, passes[i])) {
+      f->cfg_valid = FALSE;
+      f->dom_valid = FALSE;
+    }
+    if (ir_dump)
+      dump_ir(f, pass_name(passes[i]));
+  }
+}
+
+// 命令の名前。IrOpと同じ順に並べる。
+char *ir_op_name(IrOp op) {
+  char *p = "imm\0mov\0add\0sub\0mul\0div\0mod\0and\0or\0xor\0shl\0sar\0eq\0ne\0lt\0le\0not\0bitnot\0ext\0"
+            "local\0global\0str\0arr\0load\0store\0lload\0lstore\0copy\0param\0call\0phi\0jmp\0br\0ret\0";
+  for (int i = 0; i < op; i++)
+    p = p + strlen(p) + 1;
+  return p;
+}
+
+void dump_vreg(int v) {
+  if (v)
+    dprintf(2, " v%d", v);
+}
+
+// 低水準IRを読める形で標準エラー出力に書き出す
+void dump_ir(IrFunc *f, char *stage) {
+  Function *fn = f->fn;
+  dprintf(2, "; %.*s after %s\n", fn->len, fn->name, stage);
+  for (Block *blk = f->entry; blk; blk = blk->next) {
+    dprintf(2, ".LB%d:\n", blk->label);
+    for (Ins *ins = blk->first; ins; ins = ins->next) {
+      IrOp op = ins->op;
+      dprintf(2, "  ");
+      if (ins->dst)
+        dprintf(2, "v%d = ", ins->dst);
+      dprintf(2, "%s", ir_op_name(op));
+      if (op == IR_LOAD || op == IR_STORE || op == IR_LLOAD || op == IR_LSTORE || op == IR_PARAM || op == IR_EXT)
+        dprintf(2, "%d", ins->size);
+      dump_vreg(ins->a);
+      dump_vreg(ins->b);
+      if (op == IR_IMM || op == IR_LOCAL || op == IR_LLOAD || op == IR_LSTORE || op == IR_COPY || op == IR_PARAM ||
+          op == IR_STR || op == IR_ARR)
+        dprintf(2, " #%d", ins->imm);
+      if (op == IR_PARAM)
+        dprintf(2, " arg%d", ins->imm2);
+      if (op == IR_GLOBAL) {
+        LVar *var = ins->sym;
+        dprintf(2, " %.*s", var->len, var->name);
+      } else if (op == IR_CALL) {
+        Function *callee = ins->sym;
+        dprintf(2, " %.*s", callee->len, callee->name);
+      }
+      if (op == IR_PHI) {
+        for (int i = 0; i < ins->nargs; i++)
+          dprintf(2, " [v%d, .LB%d]", ins->args[i], ins->phi_blks[i]->label);
+      } else {
+        for (int i = 0; i < ins->nargs; i++)
+          dump_vreg(ins->args[i]);
+      }
+      if (ins->then_blk)
+        dprintf(2, " .LB%d", ins->then_blk->label);
+      if (ins->else_blk)
+        dprintf(2, " .LB%d", ins->else_blk->label);
+      dprintf(2, "\n");
+    }
+  }
+}
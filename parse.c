@@ -2,8 +2,9 @@
 #include "lacc.h"
 
 extern char *user_input;
-extern Token *token;
-extern Node **code;
+extern TokenBuf *tokens;
+extern int token;
+extern int code;
 extern int label_cnt;
 extern int array_cnt;
 extern int loop_cnt;
@@ -20,173 +21,160 @@ extern LVar *enum_members;
 extern String *strings;
 extern Array *arrays;
 extern char *consumed_ptr;
+extern HashMap *function_table;
+extern HashMap *global_table;
+extern HashMap *local_table;
+extern HashMap *struct_table;
+extern HashMap *struct_tag_table;
+extern HashMap *enum_table;
+extern HashMap *enum_member_table;
+extern Scope *scope;
+extern HashMap *string_table;
+extern int typedef_gen;
+extern Arena *node_arena;
+extern Arena *type_arena;
+extern Arena *symbol_arena;
+extern Arena *local_arena;
+extern Type *basic_types[8];
+extern Type **type_table;
+extern int type_table_cap;
+extern int type_cnt;
+extern Node **node_pages;
+extern int node_page_cnt;
+extern int node_cnt;
+extern int *node_list;
+extern int node_list_len;
+extern int node_list_cap;
+extern int *node_scratch;
+extern int scratch_len;
+extern int scratch_cap;
 
 extern int TRUE;
 extern int FALSE;
 extern void *NULL;
 
 // 変数を名前で検索する。見つからなかった場合はNULLを返す。
-LVar *find_lvar(Token *tok) {
-  for (LVar *var = current_fn->locals; var->next; var = var->next)
-    if (var->len == tok->len && !memcmp(tok->str, var->name, var->len))
-      return var;
-  return NULL;
-}
+LVar *find_lvar(int tok) { return hashmap_get(local_table, tokens->ident[tok]); }
 
 // 変数を名前で検索する。見つからなかった場合はNULLを返す。
-LVar *find_gver(Token *tok) {
-  for (LVar *var = globals; var->next; var = var->next)
-    if (var->len == tok->len && !memcmp(tok->str, var->name, var->len))
-      return var;
-  return NULL;
-}
+LVar *find_gver(int tok) { return hashmap_get(global_table, tokens->ident[tok]); }
 
 // structを名前で検索する。見つからなかった場合はNULLを返す。
-Struct *find_struct(Token *tok) {
-  for (Struct *var = structs; var->next; var = var->next)
-    if (var->len == tok->len && !memcmp(tok->str, var->name, var->len))
-      return var;
-  return NULL;
-}
+Struct *find_struct(int tok) { return hashmap_get(struct_table, tokens->ident[tok]); }
 
 // enumを名前で検索する。見つからなかった場合はNULLを返す。
-Enum *find_enum(Token *tok) {
-  for (Enum *var = enums; var->next; var = var->next)
-    if (var->len == tok->len && !memcmp(tok->str, var->name, var->len))
-      return var;
-  return NULL;
-}
+Enum *find_enum(int tok) { return hashmap_get(enum_table, tokens->ident[tok]); }
 
 // enumのメンバーを名前で検索する。見つからなかった場合はNULLを返す。
-LVar *find_enum_member(Token *tok) {
-  for (LVar *var = enum_members; var->next; var = var->next)
-    if (var->len == tok->len && !memcmp(tok->str, var->name, var->len))
-      return var;
-  return NULL;
-}
+LVar *find_enum_member(int tok) { return hashmap_get(enum_member_table, tokens->ident[tok]); }
 
 // structのメンバーを名前で検索する。見つからなかった場合はNULLを返す。
-LVar *find_struct_member(Struct *struct_, Token *tok) {
-  for (LVar *var = struct_->var; var->next; var = var->next)
-    if (var->len == tok->len && !memcmp(tok->str, var->name, var->len))
-      return var;
-  return NULL;
-}
+LVar *find_struct_member(Struct *struct_, int tok) { return hashmap_get(struct_->members, tokens->ident[tok]); }
 
 // struct_tagを名前で検索する。見つからなかった場合はNULLを返す。
-StructTag *find_struct_tag(Token *tok) {
-  for (StructTag *var = struct_tags; var->next; var = var->next)
-    if (var->len == tok->len && !memcmp(tok->str, var->name, var->len))
-      return var;
-  return NULL;
-}
+StructTag *find_struct_tag(int tok) { return hashmap_get(struct_tag_table, tokens->ident[tok]); }
 
 // 関数を名前で検索する。見つからなかった場合はNULLを返す。
-Function *find_fn(Token *tok) {
-  for (Function *fn = functions; fn->next; fn = fn->next)
-    if (fn->len == tok->len && !memcmp(tok->str, fn->name, fn->len))
-      return fn;
-  return NULL;
+Function *find_fn(int tok) { return hashmap_get(function_table, tokens->ident[tok]); }
+
+// トークンが記号`op`かどうかを調べる。記号は1文字か2文字なので直接比較する。
+int equal_op(int tok, char *op) {
+  if (tokens->kind[tok] != TK_RESERVED || tokens->str[tok][0] != op[0])
+    return FALSE;
+  if (tokens->len[tok] == 1)
+    return op[1] == '\0';
+  return tokens->str[tok][1] == op[1] && op[2] == '\0';
 }
 
 // Consumes the current token if it matches `op`.
 int consume(char *op) {
-  if (token->kind != TK_RESERVED || strlen(op) != token->len || memcmp(token->str, op, token->len))
+  if (!equal_op(token, op))
     return FALSE;
-  consumed_ptr = token->str;
-  token = token->next;
+  consumed_ptr = tokens->str[token];
+  next_token();
   return TRUE;
 }
 
-Token *consume_ident() {
-  if (token->kind != TK_IDENT)
-    return NULL;
-  Token *tok = token;
-  consumed_ptr = token->str;
-  token = token->next;
+// 識別子なら読み進めてそのトークン番号を返す。識別子でなければ0を返す。
+int consume_ident() {
+  if (tokens->kind[token] != TK_IDENT)
+    return 0;
+  consumed_ptr = tokens->str[token];
+  int tok = token;
+  next_token();
   return tok;
 }
 
-Type *check_type() {
-  Token *tok = token;
-  Type *type = malloc(sizeof(Type));
-  if (tok->kind == TK_IDENT) {
+// 識別子が型名 (typedefした構造体か列挙型) かどうかを解決する。
+// 結果はアトムにキャッシュし、新しいtypedefが登録されるまで再利用する。
+TypeKind resolve_type_name(int tok) {
+  Ident *ident = tokens->ident[tok];
+  if (ident->type_gen != typedef_gen) {
     Struct *struct_ = find_struct(tok);
-    Enum *enum_ = find_enum(tok);
     if (struct_) {
-      type->ty = TY_STRUCT;
-      type->struct_ = struct_;
-    } else if (enum_) {
-      type->ty = TY_INT;
+      ident->ty = TY_STRUCT;
+      ident->struct_ = struct_;
+    } else if (find_enum(tok)) {
+      ident->ty = TY_INT;
     } else {
+      ident->ty = TY_NONE;
+    }
+    ident->type_gen = typedef_gen;
+  }
+  return ident->ty;
+}
+
+// 現在のトークンが表す基本型を返す。型名でなければNULLを返す。
+Type *check_type() {
+  TokenKind kind = tokens->kind[token];
+  if (kind == TK_IDENT) {
+    TypeKind ty = resolve_type_name(token);
+    if (ty == TY_STRUCT) {
+      return new_type_struct(tokens->ident[token]->struct_);
+    } else if (ty == TY_NONE) {
       return NULL;
     }
-  } else if (tok->kind != TK_TYPE) {
+    return new_type(ty);
+  } else if (kind != TK_TYPE) {
     return NULL;
-  } else {
-    type->ty = tok->ty;
   }
-  token = tok;
-  return type;
+  return new_type(tokens->val[token]);
 }
 
 Type *consume_type() {
-  Token *tok = token;
-  Type *type = malloc(sizeof(Type));
-  if (tok->kind == TK_IDENT) {
-    Struct *struct_ = find_struct(tok);
-    Enum *enum_ = find_enum(tok);
-    if (struct_) {
-      type->ty = TY_STRUCT;
-      type->struct_ = struct_;
-    } else if (enum_) {
-      type->ty = TY_INT;
-    } else {
-      return NULL;
-    }
-  } else if (tok->kind != TK_TYPE) {
+  Type *type = check_type();
+  if (!type) {
     return NULL;
-  } else {
-    type->ty = tok->ty;
   }
-  consumed_ptr = token->str;
-  token = token->next;
+  consumed_ptr = tokens->str[token];
+  next_token();
   while (consume("*")) {
-    Type *ptr = malloc(sizeof(Type));
-    ptr->ty = TY_PTR;
-    ptr->ptr_to = type;
-    type = ptr;
+    type = new_type_ptr(type);
   }
   return type;
 }
 
-int is_type(Token *tok) {
-  if (tok->kind == TK_TYPE)
+int is_type(int tok) {
+  if (tokens->kind[tok] == TK_TYPE)
     return TRUE;
-  if (tok->kind == TK_IDENT) {
-    Struct *struct_ = find_struct(tok);
-    if (struct_)
-      return TRUE;
-    Enum *enum_ = find_enum(tok);
-    if (enum_)
-      return TRUE;
-  }
+  if (tokens->kind[tok] == TK_IDENT)
+    return resolve_type_name(tok) != TY_NONE;
   return FALSE;
 }
 
 // Ensure that the current token is `op`.
 void expect(char *op, char *err, char *st) {
-  if (token->kind != TK_RESERVED || strlen(op) != token->len || memcmp(token->str, op, token->len))
-    error_at(token->str, "expected \"%s\":\n  %s  [in %s statement]", op, err, st);
-  token = token->next;
+  if (!equal_op(token, op))
+    error_at(tokens->str[token], "expected \"%s\":\n  %s  [in %s statement]", op, err, st);
+  next_token();
 }
 
 // Ensure that the current token is TK_NUM.
 int expect_number() {
-  if (token->kind != TK_NUM)
-    error_at(token->str, "expected a number but got \"%.*s\" [in expect_number]", token->len, token->str);
-  int val = token->val;
-  token = token->next;
+  if (tokens->kind[token] != TK_NUM)
+    error_at(tokens->str[token], "expected a number but got \"%.*s\" [in expect_number]", tokens->len[token], tokens->str[token]);
+  int val = tokens->val[token];
+  next_token();
   return val;
 }
 
@@ -205,97 +193,205 @@ int get_sizeof(Type *type) {
     return get_sizeof(type->ptr_to) * type->array_size;
   } else if (type->ty == TY_STRUCT) {
     return type->struct_->size;
+  } else if (token) {
+    error_at(tokens->str[token], "invalid type [in get_sizeof]");
+    return 0;
   } else {
-    error_at(token->str, "invalid type [in get_sizeof]");
+    error("invalid type [in get_sizeof]");
     return 0;
   }
 }
 
-Type *new_type(TypeKind ty) {
-  Type *type = malloc(sizeof(Type));
+// 型は同じ構造なら同じオブジェクトを共有する (ハッシュコンシング)。
+// そのため型の比較はポインタ比較で済むが、作った型を書き換えてはならない。
+Type *alloc_type(TypeKind ty, Type *ptr_to, int array_size) {
+  Type *type = arena_alloc(type_arena, sizeof(Type));
   type->ty = ty;
+  type->ptr_to = ptr_to;
+  type->array_size = array_size;
+  type->id = type_cnt++;
   return type;
 }
 
-Type *new_type_ptr(Type *ptr_to) {
-  Type *type = malloc(sizeof(Type));
-  type->ty = TY_PTR;
-  type->ptr_to = ptr_to;
-  type->array_size = 1;
-  return type;
+int type_hash(TypeKind ty, Type *ptr_to, int array_size) {
+  return (ptr_to->id & 16777215) * 8 + ty + (array_size & 65535) * 31;
 }
 
-Type *new_type_arr(Type *ptr_to, int array_size) {
-  Type *type = malloc(sizeof(Type));
-  type->ty = TY_ARR;
-  type->ptr_to = ptr_to;
-  type->array_size = array_size;
+// 型表を倍の大きさにして再配置する
+void grow_type_table() {
+  int cap = type_table_cap * 2;
+  Type **table = calloc(cap, sizeof(Type *));
+  for (int i = 0; i < type_table_cap; i++) {
+    Type *type = type_table[i];
+    while (type) {
+      Type *next = type->next;
+      int idx = type_hash(type->ty, type->ptr_to, type->array_size) & (cap - 1);
+      type->next = table[idx];
+      table[idx] = type;
+      type = next;
+    }
+  }
+  free(type_table);
+  type_table = table;
+  type_table_cap = cap;
+}
+
+// (種類, 指す型, 要素数) が一致する派生型を探し、なければ作って登録する
+Type *intern_type(TypeKind ty, Type *ptr_to, int array_size) {
+  if (!type_table) {
+    type_table_cap = 256;
+    type_table = calloc(type_table_cap, sizeof(Type *));
+  }
+  int idx = type_hash(ty, ptr_to, array_size) & (type_table_cap - 1);
+  for (Type *type = type_table[idx]; type; type = type->next)
+    if (type->ty == ty && type->ptr_to == ptr_to && type->array_size == array_size)
+      return type;
+  if (type_cnt >= type_table_cap) {
+    grow_type_table();
+    idx = type_hash(ty, ptr_to, array_size) & (type_table_cap - 1);
+  }
+  Type *type = alloc_type(ty, ptr_to, array_size);
+  type->next = type_table[idx];
+  type_table[idx] = type;
   return type;
 }
 
+// 基本型は種類ごとに一つだけ存在する
+Type *new_type(TypeKind ty) {
+  if (!basic_types[ty])
+    basic_types[ty] = alloc_type(ty, NULL, 0);
+  return basic_types[ty];
+}
+
+Type *new_type_ptr(Type *ptr_to) { return intern_type(TY_PTR, ptr_to, 1); }
+
+Type *new_type_arr(Type *ptr_to, int array_size) { return intern_type(TY_ARR, ptr_to, array_size); }
+
+// 関数の引数として渡された配列
+Type *new_type_argarr(Type *ptr_to, int array_size) { return intern_type(TY_ARGARR, ptr_to, array_size); }
+
+// 構造体の型は構造体ごとに一つだけ存在する
 Type *new_type_struct(Struct *struct_) {
-  Type *type = malloc(sizeof(Type));
-  type->ty = TY_STRUCT;
-  type->struct_ = struct_;
-  return type;
+  if (!struct_->type) {
+    struct_->type = alloc_type(TY_STRUCT, NULL, 0);
+    struct_->type->struct_ = struct_;
+  }
+  return struct_->type;
 }
 
-Node *new_node(NodeKind kind) {
-  Node *node = malloc(sizeof(Node));
+// ノードは固定長のページに確保し、32bitのノード番号で参照する。
+// ページは移動しないので、node_atで得たポインタはその後も有効なまま。
+// ノード番号0は「子ノードなし」を表す。
+Node *node_at(int idx) { return node_pages[idx >> 12] + (idx & 4095); }
+
+int new_node(NodeKind kind) {
+  // release_nodesの後は確保済みのページを使い回し、足りなくなったときだけページを足す
+  if (node_cnt >> 12 == node_page_cnt) {
+    node_pages = realloc(node_pages, sizeof(Node *) * (node_page_cnt + 1));
+    if (!node_pages)
+      error("realloc failed");
+    node_pages[node_page_cnt++] = arena_alloc(node_arena, sizeof(Node) * 4096);
+  }
+  int idx = node_cnt++;
+  Node *node = node_at(idx);
+  // ページは再利用するので、すべてのフィールドを初期化する
   node->kind = kind;
   node->endline = FALSE;
+  node->lhs = 0;
+  node->rhs = 0;
+  node->extra = 0;
   node->val = 0;
-  return node;
+  node->type = NULL;
+  node->sym = NULL;
+  return idx;
+}
+
+// 子ノード列の長さ
+int list_len(int list) { return node_list[list]; }
+
+// 子ノード列のi番目
+Node *list_at(int list, int i) { return node_at(node_list[list + 1 + i]); }
+
+// 子ノード列を作るために、作業領域へノード番号を積む
+void push_scratch(int idx) {
+  if (scratch_len == scratch_cap) {
+    scratch_cap = scratch_cap * 2 + 64;
+    node_scratch = realloc(node_scratch, sizeof(int) * scratch_cap);
+    if (!node_scratch)
+      error("realloc failed");
+  }
+  node_scratch[scratch_len++] = idx;
 }
 
-Node *new_num(int val) {
-  Node *node = new_node(ND_NUM);
+// 作業領域のmark以降に積んだノード番号を連続した子ノード列に移す。
+// 子ノード列は [長さ, 子ノード...] の形でnode_listに並ぶ。
+int make_list(int mark) {
+  int n = scratch_len - mark;
+  if (node_list_len + n + 1 > node_list_cap) {
+    node_list_cap = (node_list_len + n + 1) * 2;
+    node_list = realloc(node_list, sizeof(int) * node_list_cap);
+    if (!node_list)
+      error("realloc failed");
+  }
+  int list = node_list_len;
+  node_list[node_list_len++] = n;
+  for (int i = mark; i < scratch_len; i++)
+    node_list[node_list_len++] = node_scratch[i];
+  scratch_len = mark;
+  return list;
+}
+
+int new_num(int val) {
+  int idx = new_node(ND_NUM);
+  Node *node = node_at(idx);
   node->val = val;
   node->type = new_type(TY_INT);
-  return node;
+  return idx;
 }
 
-Node *new_deref(Node *lhs) {
-  Node *node = new_node(ND_DEREF);
+int new_deref(int lhs) {
+  int idx = new_node(ND_DEREF);
+  Node *node = node_at(idx);
   node->lhs = lhs;
-  node->type = lhs->type->ptr_to;
-  return node;
+  node->type = node_at(lhs)->type->ptr_to;
+  return idx;
 }
 
-Node *new_binary(NodeKind kind, Node *lhs, Node *rhs) {
-  Node *node = new_node(kind);
+int new_binary(NodeKind kind, int lhs, int rhs) {
+  int idx = new_node(kind);
+  Node *node = node_at(idx);
   node->lhs = lhs;
   node->rhs = rhs;
-  node->type = lhs->type;
-  return node;
+  node->type = node_at(lhs)->type;
+  return idx;
 }
 
-Node *function_definition(Token *tok, Type *type) {
+int function_definition(int tok, Type *type) {
   Function *fn = find_fn(tok);
   if (fn) {
-    // error_at(token->str, "duplicated function name: %.*s", tok->len, tok->str);
+    // error_at(tokens->str[token], "duplicated function name: %.*s", tokens->len[tok], tokens->str[tok]);
   } else {
-    fn = malloc(sizeof(Function));
+    fn = arena_alloc(symbol_arena, sizeof(Function));
     fn->next = functions;
     functions = fn;
+    hashmap_put(function_table, tokens->ident[tok], fn);
   }
-  fn->name = tok->str;
-  fn->len = tok->len;
-  fn->locals = malloc(sizeof(LVar));
-  fn->locals->offset = 0;
-  fn->locals->type = new_type(TY_NONE);
-  fn->locals->next = NULL;
+  fn->ident = tokens->ident[tok];
+  fn->name = tokens->str[tok];
+  fn->len = tokens->len[tok];
   fn->type = type;
   fn->offset = 0;
   Function *prev_fn = current_fn;
   current_fn = fn;
-  Node *node = new_node(ND_FUNCDEF);
-  node->fn = fn;
+  enter_scope();
+  int idx = new_node(ND_FUNCDEF);
+  Node *node = node_at(idx);
+  node->sym = fn;
+  int mark = scratch_len;
   if (!consume(")")) {
-    int n = 0;
     for (int i = 0; i < 6; i++) {
       type = consume_type();
-      Token *tok_lvar = consume_ident();
+      int tok_lvar = consume_ident();
       if (!tok_lvar) {
         error_at(consumed_ptr, "expected an identifier [in variable declaration]");
       }
@@ -304,79 +400,81 @@ Node *function_definition(Token *tok, Type *type) {
         expect("]", "after number", "array declaration");
       }
       if (type->ty == TY_ARR) {
-        type->ty = TY_ARGARR;
+        type = new_type_argarr(type->ptr_to, type->array_size);
       }
-      Node *nd_lvar = new_node(ND_LVAR);
-      node->args[i] = nd_lvar;
-      LVar *lvar = malloc(sizeof(LVar));
-      lvar->next = fn->locals;
-      lvar->name = tok_lvar->str;
-      lvar->len = tok_lvar->len;
+      int nd_lvar = new_node(ND_LVAR);
+      push_scratch(nd_lvar);
+      LVar *lvar = arena_alloc(local_arena, sizeof(LVar));
+      lvar->ident = tokens->ident[tok_lvar];
+      lvar->name = tokens->str[tok_lvar];
+      lvar->len = tokens->len[tok_lvar];
       if (is_ptr_or_arr(type)) {
-        lvar->offset = fn->locals->offset + 8;
+        lvar->offset = scope->offset + 8;
       } else {
-        lvar->offset = fn->locals->offset + get_sizeof(type);
+        lvar->offset = scope->offset + get_sizeof(type);
       }
+      scope->offset = lvar->offset;
       fn->offset = lvar->offset;
       lvar->type = type;
-      nd_lvar->var = lvar;
-      nd_lvar->type = type;
-      fn->locals = lvar;
-      n += 1;
+      node_at(nd_lvar)->sym = lvar;
+      node_at(nd_lvar)->type = type;
+      declare_lvar(lvar);
       if (!consume(","))
         break;
     }
-    node->val = n;
     expect(")", "after arguments", "function definition");
-  } else {
-    node->val = 0;
   }
-  if (!(token->kind == TK_RESERVED && !memcmp(token->str, "{", token->len))) {
+  node->extra = make_list(mark);
+  if (!equal_op(token, "{")) {
     node->kind = ND_EXTERN;
     expect(";", "after line", "function definition");
   } else {
     node->lhs = stmt();
   }
+  leave_scope();
   current_fn = prev_fn;
-  return node;
+  return idx;
 }
 
-Node *local_variable_declaration(Token *tok, Type *type) {
+int local_variable_declaration(int tok, Type *type) {
+  // 外側のスコープの変数はスコープ開始位置より下にあるので、隠すことができる
   LVar *lvar = find_lvar(tok);
-  if (lvar) {
-    error_at(tok->str, "duplicated variable name: %.*s [in variable declaration]", tok->len, tok->str);
+  if (lvar && lvar->offset > scope->base) {
+    error_at(tokens->str[tok], "duplicated variable name: %.*s [in variable declaration]", tokens->len[tok], tokens->str[tok]);
   }
-  Node *node = new_node(ND_VARDEC);
-  lvar = malloc(sizeof(LVar));
-  lvar->name = tok->str;
-  lvar->len = tok->len;
+  int idx = new_node(ND_VARDEC);
+  lvar = arena_alloc(local_arena, sizeof(LVar));
+  lvar->ident = tokens->ident[tok];
+  lvar->name = tokens->str[tok];
+  lvar->len = tokens->len[tok];
   Type *org_type = type;
   while (consume("[")) {
     type = new_type_arr(type, expect_number());
     expect("]", "after number", "array declaration");
   }
-  lvar->offset = current_fn->locals->offset + get_sizeof(type);
+  lvar->offset = scope->offset + get_sizeof(type);
+  scope->offset = lvar->offset;
   if (current_fn->offset < lvar->offset) {
     current_fn->offset = lvar->offset;
   }
-  node->var = lvar;
+  Node *node = node_at(idx);
+  node->sym = lvar;
   node->type = type;
   lvar->type = type;
-  lvar->next = current_fn->locals;
-  current_fn->locals = lvar;
+  declare_lvar(lvar);
   if (consume("=")) {
     if (consume("{")) {
       if (type->ty != TY_ARR) {
-        error_at(token->str, "array initializer is only allowed for array type [in variable declaration]");
+        error_at(tokens->str[token], "array initializer is only allowed for array type [in variable declaration]");
       }
-      Array *array = malloc(sizeof(Array));
+      Array *array = arena_alloc(symbol_arena, sizeof(Array));
       array->next = arrays;
       arrays = array;
       array->id = array_cnt++;
       array->byte = get_sizeof(org_type);
       array->val = NULL;
       int i = 0;
-      while (!(token->kind == TK_RESERVED && !memcmp(token->str, "}", token->len))) {
+      while (!equal_op(token, "}")) {
         array->val = realloc(array->val, array->byte * ++i);
         array->val[i - 1] = expect_number();
         if (!array->val)
@@ -387,43 +485,48 @@ Node *local_variable_declaration(Token *tok, Type *type) {
       }
       array->len = i;
       expect("}", "after array initializer", "variable declaration");
-      Node *arr = new_node(ND_ARRAY);
-      arr->type = type;
-      arr->id = array->id;
-      node = new_binary(ND_ASSIGN, node, arr);
+      int arr = new_node(ND_ARRAY);
+      node_at(arr)->type = type;
+      node_at(arr)->val = array->id;
+      idx = new_binary(ND_ASSIGN, idx, arr);
+      node = node_at(idx);
       node->type = type;
       node->val = TRUE;
     } else {
-      node = new_binary(ND_ASSIGN, node, expr());
+      idx = new_binary(ND_ASSIGN, idx, expr());
+      node = node_at(idx);
       node->type = type;
-      if (node->rhs->kind == ND_STRING && node->lhs->type->ty == TY_ARR) {
-        node->val = node->lhs->type->ptr_to->ty == TY_CHAR;
+      if (node_at(node->rhs)->kind == ND_STRING && type->ty == TY_ARR) {
+        node->val = type->ptr_to->ty == TY_CHAR;
       }
     }
   }
   node->endline = TRUE;
-  return node;
+  return idx;
 }
 
-Node *global_variable_declaration(Token *tok, Type *type) {
+int global_variable_declaration(int tok, Type *type) {
   LVar *lvar = find_gver(tok);
   if (lvar) {
-    error_at(token->str, "duplicated variable name: %.*s [in global variable declaration]", tok->len, tok->str);
+    error_at(tokens->str[token], "duplicated variable name: %.*s [in global variable declaration]", tokens->len[tok], tokens->str[tok]);
   }
-  Node *node = new_node(ND_GLBDEC);
-  lvar = malloc(sizeof(LVar));
-  lvar->name = tok->str;
-  lvar->len = tok->len;
+  int idx = new_node(ND_GLBDEC);
+  lvar = arena_alloc(symbol_arena, sizeof(LVar));
+  lvar->ident = tokens->ident[tok];
+  lvar->name = tokens->str[tok];
+  lvar->len = tokens->len[tok];
   while (consume("[")) {
     type = new_type_arr(type, expect_number());
     expect("]", "after number", "array declaration");
   }
-  node->var = lvar;
+  Node *node = node_at(idx);
+  node->sym = lvar;
   node->type = type;
   lvar->type = type;
   lvar->ext = FALSE;
   lvar->next = globals;
   globals = lvar;
+  hashmap_put(global_table, lvar->ident, lvar);
   if (consume("=")) {
     int sign = 1;
     if (consume("-")) {
@@ -436,61 +539,67 @@ Node *global_variable_declaration(Token *tok, Type *type) {
     lvar->offset = 0;
   }
   node->endline = TRUE;
-  return node;
+  return idx;
 }
 
-Node *extern_declaration(Token *tok, Type *type) {
+int extern_declaration(int tok, Type *type) {
   LVar *lvar = find_gver(tok);
-  Node *node = new_node(ND_EXTERN);
+  int idx = new_node(ND_EXTERN);
   if (lvar) {
-    return node;
+    return idx;
   }
-  lvar = malloc(sizeof(LVar));
-  lvar->name = tok->str;
-  lvar->len = tok->len;
+  lvar = arena_alloc(symbol_arena, sizeof(LVar));
+  lvar->ident = tokens->ident[tok];
+  lvar->name = tokens->str[tok];
+  lvar->len = tokens->len[tok];
   while (consume("[")) {
     type = new_type_arr(type, expect_number());
     expect("]", "after number", "extern declaration");
   }
-  node->var = lvar;
+  Node *node = node_at(idx);
+  node->sym = lvar;
   node->type = type;
   lvar->type = type;
   lvar->ext = TRUE;
   lvar->next = globals;
   globals = lvar;
+  hashmap_put(global_table, lvar->ident, lvar);
   node->endline = TRUE;
-  return node;
+  return idx;
 }
 
-Node *new_struct(Token *tok) {
-  Node *node = new_node(ND_STRUCT);
+int new_struct(int tok) {
+  int idx = new_node(ND_STRUCT);
   StructTag *struct_tag = find_struct_tag(tok);
   if (!struct_tag) {
-    error_at(tok->str, "unknown tag: %.*s [in struct declaration]", tok->len, tok->str);
+    error_at(tokens->str[tok], "unknown tag: %.*s [in struct declaration]", tokens->len[tok], tokens->str[tok]);
   }
   Struct *struct_ = struct_tag->main;
-  struct_->var = malloc(sizeof(LVar));
+  struct_->var = arena_alloc(symbol_arena, sizeof(LVar));
   struct_->var->next = NULL;
   struct_->var->type = new_type(TY_NONE);
+  struct_->members = new_hashmap(16);
   int offset = 0;
   expect("{", "before struct members", "struct");
-  while (token->kind != TK_EOF && !(token->kind == TK_RESERVED && !memcmp(token->str, "}", token->len))) {
+  while (tokens->kind[token] != TK_EOF && !equal_op(token, "}")) {
     Type *type = consume_type();
-    Token *member_tok = consume_ident();
+    int member_tok = consume_ident();
     if (!member_tok) {
-      error_at(token->str, "expected an identifier but got \"%.*s\" [in struct declaration]", token->len, token->str);
+      error_at(tokens->str[token], "expected an identifier but got \"%.*s\" [in struct declaration]", tokens->len[token], tokens->str[token]);
     }
     Type *org_type = type;
     while (consume("[")) {
       type = new_type_arr(type, expect_number());
       expect("]", "after number", "array declaration");
     }
-    LVar *member_var = malloc(sizeof(LVar));
-    member_var->name = member_tok->str;
-    member_var->len = member_tok->len;
+    LVar *member_var = arena_alloc(symbol_arena, sizeof(LVar));
+    member_var->ident = tokens->ident[member_tok];
+    member_var->name = tokens->str[member_tok];
+    member_var->len = tokens->len[member_tok];
     member_var->type = type;
     member_var->next = struct_->var;
     struct_->var = member_var;
+    hashmap_put(struct_->members, member_var->ident, member_var);
     int single_size = get_sizeof(org_type);
     if (offset % single_size != 0) {
       offset += single_size - (offset % single_size);
@@ -500,68 +609,63 @@ Node *new_struct(Token *tok) {
     if (consume(";")) {
       continue;
     } else {
-      error_at(token->str, "expected ';' after struct member declaration [in struct declaration]");
+      error_at(tokens->str[token], "expected ';' after struct member declaration [in struct declaration]");
     }
   }
   struct_->size = offset;
   expect("}", "after struct members", "struct");
   expect(";", "after struct definition", "struct");
+  Node *node = node_at(idx);
   node->type = new_type_struct(struct_);
   node->endline = TRUE;
-  return node;
+  return idx;
 }
 
-Node *stmt() {
+int stmt() {
+  int idx;
   Node *node;
-  Token *tok;
+  int tok;
   Type *type;
   int loop_id_prev;
+  int mark = scratch_len;
   if (consume("{")) {
-    node = new_node(ND_BLOCK);
-    LVar *var = current_fn->locals;
-    node->body = malloc(sizeof(Node *));
-    int i = 0;
-    while (!(token->kind == TK_RESERVED && !memcmp(token->str, "}", token->len))) {
-      node->body[i++] = stmt();
-      node->body = realloc(node->body, sizeof(Node *) * (i + 1));
-      if (!node->body)
-        error("realloc failed");
+    idx = new_node(ND_BLOCK);
+    enter_scope();
+    while (!equal_op(token, "}")) {
+      push_scratch(stmt());
     }
-    node->body[i] = new_node(ND_NONE);
-    current_fn->locals = var;
+    node_at(idx)->extra = make_list(mark);
+    leave_scope();
     expect("}", "after block", "block");
-  } else if (token->kind == TK_EXTERN) {
+  } else if (tokens->kind[token] == TK_PCH) {
+    // プリコンパイル済みヘッダ
+    load_pch(tokens->str[token]);
+    next_token();
+    idx = new_node(ND_NONE);
+  } else if (tokens->kind[token] == TK_EXTERN) {
     // extern宣言
-    token = token->next;
+    next_token();
     Type *ch_type = check_type();
     type = consume_type();
     tok = consume_ident();
     if (!tok) {
-      error_at(token->str, "expected an identifier but got \"%.*s\" [in extern declaration]", token->len, token->str);
+      error_at(tokens->str[token], "expected an identifier but got \"%.*s\" [in extern declaration]", tokens->len[token], tokens->str[token]);
     }
-    node = new_node(ND_BLOCK);
-    node->body = malloc(sizeof(Node *));
-    int i = 0;
-    node->body[i++] = extern_declaration(tok, type);
+    idx = new_node(ND_BLOCK);
+    push_scratch(extern_declaration(tok, type));
     while (consume(",")) {
       type = ch_type;
       while (consume("*")) {
-        Type *ptr = malloc(sizeof(Type));
-        ptr->ty = TY_PTR;
-        ptr->ptr_to = type;
-        type = ptr;
+        type = new_type_ptr(type);
       }
       tok = consume_ident();
       if (!tok) {
-        error_at(token->str, "expected an identifier but got \"%.*s\" [in variable declaration]", token->len,
-                 token->str);
+        error_at(tokens->str[token], "expected an identifier but got \"%.*s\" [in variable declaration]", tokens->len[token],
+                 tokens->str[token]);
       }
-      node->body[i++] = extern_declaration(tok, type);
-      node->body = realloc(node->body, sizeof(Node *) * (i + 1));
-      if (!node->body)
-        error("realloc failed");
+      push_scratch(extern_declaration(tok, type));
     }
-    node->body[i] = new_node(ND_NONE);
+    node_at(idx)->extra = make_list(mark);
     expect(";", "after line", "global variable declaration");
   } else if (is_type(token)) {
     // 変数宣言または関数定義
@@ -569,262 +673,258 @@ Node *stmt() {
     type = consume_type();
     tok = consume_ident();
     if (!tok) {
-      error_at(token->str, "expected an identifier but got \"%.*s\" [in variable declaration]", token->len, token->str);
+      error_at(tokens->str[token], "expected an identifier but got \"%.*s\" [in variable declaration]", tokens->len[token], tokens->str[token]);
     }
     if (consume("(")) {
       // 関数定義
       if (current_fn->next) {
-        error_at(token->str, "nested function is not supported [in function definition]");
+        error_at(tokens->str[token], "nested function is not supported [in function definition]");
       }
-      node = function_definition(tok, type);
+      idx = function_definition(tok, type);
     } else if (current_fn->next) {
       // ローカル変数宣言
-      node = new_node(ND_BLOCK);
-      node->body = malloc(sizeof(Node *));
-      int i = 0;
-      node->body[i++] = local_variable_declaration(tok, type);
+      idx = new_node(ND_BLOCK);
+      push_scratch(local_variable_declaration(tok, type));
       while (consume(",")) {
         type = ch_type;
         while (consume("*")) {
-          Type *ptr = malloc(sizeof(Type));
-          ptr->ty = TY_PTR;
-          ptr->ptr_to = type;
-          type = ptr;
+          type = new_type_ptr(type);
         }
         tok = consume_ident();
         if (!tok) {
-          error_at(token->str, "expected an identifier but got \"%.*s\" [in variable declaration]", token->len,
-                   token->str);
+          error_at(tokens->str[token], "expected an identifier but got \"%.*s\" [in variable declaration]", tokens->len[token],
+                   tokens->str[token]);
         }
-        node->body[i++] = local_variable_declaration(tok, type);
-        node->body = realloc(node->body, sizeof(Node *) * (i + 1));
-        if (!node->body)
-          error("realloc failed");
+        push_scratch(local_variable_declaration(tok, type));
       }
-      node->body[i] = new_node(ND_NONE);
+      node_at(idx)->extra = make_list(mark);
       expect(";", "after line", "local variable declaration");
     } else {
       // グローバル変数宣言
-      node = new_node(ND_BLOCK);
-      node->body = malloc(sizeof(Node *));
-      int i = 0;
-      node->body[i++] = global_variable_declaration(tok, type);
+      idx = new_node(ND_BLOCK);
+      push_scratch(global_variable_declaration(tok, type));
       while (consume(",")) {
         type = ch_type;
         while (consume("*")) {
-          Type *ptr = malloc(sizeof(Type));
-          ptr->ty = TY_PTR;
-          ptr->ptr_to = type;
-          type = ptr;
+          type = new_type_ptr(type);
         }
         tok = consume_ident();
         if (!tok) {
-          error_at(token->str, "expected an identifier but got \"%.*s\" [in variable declaration]", token->len,
-                   token->str);
+          error_at(tokens->str[token], "expected an identifier but got \"%.*s\" [in variable declaration]", tokens->len[token],
+                   tokens->str[token]);
         }
-        node->body[i++] = global_variable_declaration(tok, type);
-        node->body = realloc(node->body, sizeof(Node *) * (i + 1));
-        if (!node->body)
-          error("realloc failed");
+        push_scratch(global_variable_declaration(tok, type));
       }
-      node->body[i] = new_node(ND_NONE);
+      node_at(idx)->extra = make_list(mark);
       expect(";", "after line", "global variable declaration");
     }
-  } else if (token->kind == TK_STRUCT) {
-    token = token->next;
+  } else if (tokens->kind[token] == TK_STRUCT) {
+    next_token();
     tok = consume_ident();
     if (!tok) {
-      error_at(token->str, "expected an identifier but got \"%.*s\" [in struct definition]", token->len, token->str);
+      error_at(tokens->str[token], "expected an identifier but got \"%.*s\" [in struct definition]", tokens->len[token], tokens->str[token]);
     }
-    node = new_struct(tok);
-  } else if (token->kind == TK_TYPEDEF) {
-    token = token->next;
-    if (token->kind == TK_STRUCT) {
-      token = token->next;
-      node = new_node(ND_TYPEDEF);
-      Token *tok1 = consume_ident();
+    idx = new_struct(tok);
+  } else if (tokens->kind[token] == TK_TYPEDEF) {
+    next_token();
+    if (tokens->kind[token] == TK_STRUCT) {
+      next_token();
+      idx = new_node(ND_TYPEDEF);
+      int tok1 = consume_ident();
       if (!tok1) {
-        error_at(token->str, "expected an identifier but got \"%.*s\" [in typedef]", token->len, token->str);
+        error_at(tokens->str[token], "expected an identifier but got \"%.*s\" [in typedef]", tokens->len[token], tokens->str[token]);
       }
-      Token *tok2 = consume_ident();
+      int tok2 = consume_ident();
       if (!tok2) {
-        error_at(token->str, "expected an identifier but got \"%.*s\" [in typedef]", token->len, token->str);
+        error_at(tokens->str[token], "expected an identifier but got \"%.*s\" [in typedef]", tokens->len[token], tokens->str[token]);
       }
       if (find_struct_tag(tok1)) {
-        error_at(tok1->str, "duplicated tag name: %.*s [in typedef]", tok1->len, tok1->str);
+        error_at(tokens->str[tok1], "duplicated tag name: %.*s [in typedef]", tokens->len[tok1], tokens->str[tok1]);
       }
       if (find_struct(tok2)) {
-        error_at(tok2->str, "duplicated struct name: %.*s [in typedef]", tok2->len, tok2->str);
+        error_at(tokens->str[tok2], "duplicated struct name: %.*s [in typedef]", tokens->len[tok2], tokens->str[tok2]);
       }
-      Struct *var = malloc(sizeof(Struct));
-      var->name = tok2->str;
-      var->len = tok2->len;
+      Struct *var = arena_alloc(symbol_arena, sizeof(Struct));
+      var->name = tokens->str[tok2];
+      var->len = tokens->len[tok2];
       var->next = structs;
       structs = var;
-      StructTag *tag = malloc(sizeof(StructTag));
-      tag->name = tok1->str;
-      tag->len = tok1->len;
+      hashmap_put(struct_table, tokens->ident[tok2], var);
+      typedef_gen++;
+      StructTag *tag = arena_alloc(symbol_arena, sizeof(StructTag));
+      tag->name = tokens->str[tok1];
+      tag->len = tokens->len[tok1];
       tag->main = var;
       tag->next = struct_tags;
       struct_tags = tag;
-    } else if (token->kind == TK_ENUM) {
-      token = token->next;
-      node = new_node(ND_TYPEDEF);
+      hashmap_put(struct_tag_table, tokens->ident[tok1], tag);
+    } else if (tokens->kind[token] == TK_ENUM) {
+      next_token();
+      idx = new_node(ND_TYPEDEF);
       int offset = 0;
       expect("{", "before enum members", "enum");
-      while (token->kind != TK_EOF && !(token->kind == TK_RESERVED && !memcmp(token->str, "}", token->len))) {
-        Token *member_tok = consume_ident();
+      while (tokens->kind[token] != TK_EOF && !equal_op(token, "}")) {
+        int member_tok = consume_ident();
         if (!member_tok) {
-          error_at(token->str, "expected an identifier but got \"%.*s\" [in typedef]", token->len, token->str);
+          error_at(tokens->str[token], "expected an identifier but got \"%.*s\" [in typedef]", tokens->len[token], tokens->str[token]);
         }
-        LVar *member_var = malloc(sizeof(LVar));
-        member_var->name = member_tok->str;
-        member_var->len = member_tok->len;
+        LVar *member_var = arena_alloc(symbol_arena, sizeof(LVar));
+        member_var->ident = tokens->ident[member_tok];
+        member_var->name = tokens->str[member_tok];
+        member_var->len = tokens->len[member_tok];
         member_var->type = new_type(TY_INT);
         member_var->offset = offset;
         offset++;
         member_var->next = enum_members;
         enum_members = member_var;
+        hashmap_put(enum_member_table, member_var->ident, member_var);
         if (consume(",")) {
           continue;
         } else if (consume("}")) {
           break;
         } else {
-          error_at(token->str, "expected ',' after member declaration [in typedef]");
+          error_at(tokens->str[token], "expected ',' after member declaration [in typedef]");
         }
       }
       tok = consume_ident();
       if (!tok) {
-        error_at(token->str, "expected an identifier but got \"%.*s\" [in typedef]", token->len, token->str);
+        error_at(tokens->str[token], "expected an identifier but got \"%.*s\" [in typedef]", tokens->len[token], tokens->str[token]);
       } else if (find_enum(tok)) {
-        error_at(tok->str, "duplicated enum name: %.*s [in typedef]", tok->len, tok->str);
+        error_at(tokens->str[tok], "duplicated enum name: %.*s [in typedef]", tokens->len[tok], tokens->str[tok]);
       }
-      Enum *enum_ = malloc(sizeof(Enum));
-      enum_->name = tok->str;
-      enum_->len = tok->len;
+      Enum *enum_ = arena_alloc(symbol_arena, sizeof(Enum));
+      enum_->name = tokens->str[tok];
+      enum_->len = tokens->len[tok];
       enum_->next = enums;
       enums = enum_;
+      hashmap_put(enum_table, tokens->ident[tok], enum_);
+      typedef_gen++;
     } else {
-      error_at(token->str, "expected a struct but got \"%.*s\" [in typedef]", token->len, token->str);
+      error_at(tokens->str[token], "expected a struct but got \"%.*s\" [in typedef]", tokens->len[token], tokens->str[token]);
     }
-    node->endline = TRUE;
+    node_at(idx)->endline = TRUE;
     expect(";", "after line", "typedef");
-  } else if (token->kind == TK_IF) {
-    token = token->next;
-    node = new_node(ND_IF);
-    node->id = loop_cnt++;
+  } else if (tokens->kind[token] == TK_IF) {
+    next_token();
+    idx = new_node(ND_IF);
+    node = node_at(idx);
+    node->val = loop_cnt++;
     expect("(", "before condition", "if");
-    node->cond = expr();
-    node->cond->endline = FALSE;
+    node->lhs = expr();
+    node_at(node->lhs)->endline = FALSE;
     expect(")", "after equality", "if");
-    node->then = stmt();
-    if (token->kind == TK_ELSE) {
-      token = token->next;
-      node->els = stmt();
+    node->rhs = stmt();
+    if (tokens->kind[token] == TK_ELSE) {
+      next_token();
+      node->extra = stmt();
     } else {
-      node->els = NULL;
+      node->extra = 0;
     }
-  } else if (token->kind == TK_WHILE) {
-    token = token->next;
+  } else if (tokens->kind[token] == TK_WHILE) {
+    next_token();
     expect("(", "before condition", "while");
-    node = new_node(ND_WHILE);
-    node->id = loop_cnt++;
-    node->cond = expr();
-    node->cond->endline = FALSE;
+    idx = new_node(ND_WHILE);
+    node = node_at(idx);
+    node->val = loop_cnt++;
+    node->lhs = expr();
+    node_at(node->lhs)->endline = FALSE;
     expect(")", "after equality", "while");
     loop_id_prev = loop_id;
-    loop_id = node->id;
-    node->then = stmt();
+    loop_id = node->val;
+    node->rhs = stmt();
     loop_id = loop_id_prev;
-  } else if (token->kind == TK_DO) {
-    token = token->next;
-    node = new_node(ND_DOWHILE);
-    node->id = loop_cnt++;
-    node->then = stmt();
-    if (token->kind != TK_WHILE) {
-      error_at(token->str, "expected 'while' but got \"%.*s\" [in do-while statement]", token->len, token->str);
+  } else if (tokens->kind[token] == TK_DO) {
+    next_token();
+    idx = new_node(ND_DOWHILE);
+    node = node_at(idx);
+    node->val = loop_cnt++;
+    node->rhs = stmt();
+    if (tokens->kind[token] != TK_WHILE) {
+      error_at(tokens->str[token], "expected 'while' but got \"%.*s\" [in do-while statement]", tokens->len[token], tokens->str[token]);
     }
-    token = token->next;
+    next_token();
     expect("(", "before condition", "do-while");
-    node->cond = expr();
-    node->cond->endline = FALSE;
+    node->lhs = expr();
+    node_at(node->lhs)->endline = FALSE;
     expect(")", "after equality", "do-while");
-    loop_id_prev = loop_id;
-    loop_id = node->id;
-    loop_id = loop_id_prev;
     expect(";", "after line", "do-while");
     node->endline = TRUE;
-  } else if (token->kind == TK_FOR) {
-    int init;
-    token = token->next;
+  } else if (tokens->kind[token] == TK_FOR) {
+    next_token();
     expect("(", "before initialization", "for");
-    node = new_node(ND_FOR);
-    node->id = loop_cnt++;
+    int loop = new_node(ND_FOR);
+    node = node_at(loop);
+    node->val = loop_cnt++;
+    enter_scope();
+    int init = 0;
     if (consume(";")) {
-      node->init = new_node(ND_NONE);
-      node->init->endline = TRUE;
-      init = FALSE;
     } else if (is_type(token)) {
       type = consume_type();
       tok = consume_ident();
       if (!tok) {
-        error_at(token->str, "expected an identifier but got \"%.*s\" [in variable declaration]", token->len,
-                 token->str);
+        error_at(tokens->str[token], "expected an identifier but got \"%.*s\" [in variable declaration]", tokens->len[token],
+                 tokens->str[token]);
       }
-      node->init = local_variable_declaration(tok, type);
+      init = local_variable_declaration(tok, type);
       expect(";", "after initialization", "for");
-      node->init->endline = TRUE;
-      init = TRUE;
+      node_at(init)->endline = TRUE;
     } else {
-      node->init = expr();
+      init = expr();
       expect(";", "after initialization", "for");
-      node->init->endline = TRUE;
-      init = FALSE;
+      node_at(init)->endline = TRUE;
     }
     if (consume(";")) {
-      node->cond = new_num(1);
-      node->cond->endline = FALSE;
+      node->lhs = new_num(1);
     } else {
-      node->cond = expr();
-      node->cond->endline = FALSE;
+      node->lhs = expr();
+      node_at(node->lhs)->endline = FALSE;
       expect(";", "after condition", "for");
     }
     if (consume(")")) {
-      node->step = new_node(ND_NONE);
-      node->step->endline = TRUE;
+      node->extra = new_node(ND_NONE);
     } else {
-      node->step = expr();
-      node->step->endline = TRUE;
+      node->extra = expr();
       expect(")", "after step expression", "for");
     }
+    node_at(node->extra)->endline = TRUE;
     loop_id_prev = loop_id;
-    loop_id = node->id;
-    node->then = stmt();
+    loop_id = node->val;
+    node->rhs = stmt();
+    leave_scope();
+    loop_id = loop_id_prev;
     if (init) {
-      current_fn->locals = current_fn->locals->next;
+      // 初期化式はループの前に一度だけ評価するので、ループと並べたブロックにする
+      idx = new_node(ND_BLOCK);
+      push_scratch(init);
+      push_scratch(loop);
+      node_at(idx)->extra = make_list(mark);
+    } else {
+      idx = loop;
     }
-    loop_id = loop_id_prev;
-  } else if (token->kind == TK_BREAK) {
+  } else if (tokens->kind[token] == TK_BREAK) {
     if (loop_id == -1) {
-      error_at(token->str, "stray break statement [in break statement]");
+      error_at(tokens->str[token], "stray break statement [in break statement]");
     }
-    token = token->next;
+    next_token();
     expect(";", "after line", "break");
-    node = new_node(ND_BREAK);
+    idx = new_node(ND_BREAK);
+    node = node_at(idx);
     node->endline = TRUE;
-    node->id = loop_id;
-  } else if (token->kind == TK_CONTINUE) {
+    node->val = loop_id;
+  } else if (tokens->kind[token] == TK_CONTINUE) {
     if (loop_id == -1) {
-      error_at(token->str, "stray continue statement [in continue statement]");
+      error_at(tokens->str[token], "stray continue statement [in continue statement]");
     }
-    token = token->next;
+    next_token();
     expect(";", "after line", "continue");
-    node = new_node(ND_CONTINUE);
+    idx = new_node(ND_CONTINUE);
+    node = node_at(idx);
     node->endline = TRUE;
-    node->id = loop_id;
-  } else if (token->kind == TK_RETURN) {
-    token = token->next;
-    node = new_node(ND_RETURN);
+    node->val = loop_id;
+  } else if (tokens->kind[token] == TK_RETURN) {
+    next_token();
+    idx = new_node(ND_RETURN);
+    node = node_at(idx);
     if (consume(";")) {
       node->rhs = new_num(0);
     } else {
@@ -833,29 +933,28 @@ Node *stmt() {
     }
     node->endline = TRUE;
   } else {
-    node = expr();
+    idx = expr();
     expect(";", "after line", "expression");
-    node->endline = TRUE;
+    node_at(idx)->endline = TRUE;
   }
-  return node;
+  return idx;
 }
 
+// トップレベルの宣言を順に読み、子ノード列としてcodeに保存する
 void program() {
-  int i = 0;
-  code = NULL;
-  while (token->kind != TK_EOF) {
-    code = realloc(code, sizeof(Node *) * ++i);
-    code[i - 1] = stmt();
-    if (!code)
-      error("realloc failed");
+  int mark = scratch_len;
+  while (tokens->kind[token] != TK_EOF) {
+    push_scratch(stmt());
+    // 宣言を読み終えたら、そのトークンはもう参照しないので再利用する
+    recycle_tokens();
   }
-  code[i] = new_node(ND_NONE);
+  code = make_list(mark);
 }
 
-Node *expr() { return assign(); }
+int expr() { return assign(); }
 
-Node *assign() {
-  Node *node = logical_or();
+int assign() {
+  int node = logical_or();
   if (consume("=")) {
     node = new_binary(ND_ASSIGN, node, expr());
   } else if (consume("+=")) {
@@ -872,13 +971,12 @@ Node *assign() {
   return node;
 }
 
-Node *logical_or() {
-  Node *node = logical_and();
+int logical_or() {
+  int node = logical_and();
   for (;;) {
     if (consume("||")) {
       node = new_binary(ND_OR, node, logical_and());
-      node->type = node->lhs->type;
-      node->id = logical_cnt++;
+      node_at(node)->val = logical_cnt++;
     } else {
       break;
     }
@@ -886,13 +984,12 @@ Node *logical_or() {
   return node;
 }
 
-Node *logical_and() {
-  Node *node = bit_or();
+int logical_and() {
+  int node = bit_or();
   for (;;) {
     if (consume("&&")) {
       node = new_binary(ND_AND, node, bit_or());
-      node->type = node->lhs->type;
-      node->id = logical_cnt++;
+      node_at(node)->val = logical_cnt++;
     } else {
       break;
     }
@@ -900,12 +997,11 @@ Node *logical_and() {
   return node;
 }
 
-Node *bit_or() {
-  Node *node = bit_xor();
+int bit_or() {
+  int node = bit_xor();
   for (;;) {
     if (consume("|")) {
       node = new_binary(ND_BITOR, node, bit_xor());
-      node->type = node->lhs->type;
     } else {
       break;
     }
@@ -913,12 +1009,11 @@ Node *bit_or() {
   return node;
 }
 
-Node *bit_xor() {
-  Node *node = bit_and();
+int bit_xor() {
+  int node = bit_and();
   for (;;) {
     if (consume("^")) {
       node = new_binary(ND_BITXOR, node, bit_and());
-      node->type = node->lhs->type;
     } else {
       break;
     }
@@ -926,12 +1021,11 @@ Node *bit_xor() {
   return node;
 }
 
-Node *bit_and() {
-  Node *node = equality();
+int bit_and() {
+  int node = equality();
   for (;;) {
     if (consume("&")) {
       node = new_binary(ND_BITAND, node, equality());
-      node->type = node->lhs->type;
     } else {
       break;
     }
@@ -940,16 +1034,16 @@ Node *bit_and() {
 }
 
 // equality = relational ("==" relational | "!=" relational)*
-Node *equality() {
-  Node *node = relational();
+int equality() {
+  int node = relational();
 
   for (;;) {
     if (consume("==")) {
       node = new_binary(ND_EQ, node, relational());
-      node->type = new_type(TY_INT);
+      node_at(node)->type = new_type(TY_INT);
     } else if (consume("!=")) {
       node = new_binary(ND_NE, node, relational());
-      node->type = new_type(TY_INT);
+      node_at(node)->type = new_type(TY_INT);
     } else {
       break;
     }
@@ -958,22 +1052,22 @@ Node *equality() {
 }
 
 // relational = add ("<" add | "<=" add | ">" add | ">=" add)*
-Node *relational() {
-  Node *node = bit_shift();
+int relational() {
+  int node = bit_shift();
 
   for (;;) {
     if (consume("<")) {
       node = new_binary(ND_LT, node, bit_shift());
-      node->type = new_type(TY_INT);
+      node_at(node)->type = new_type(TY_INT);
     } else if (consume("<=")) {
       node = new_binary(ND_LE, node, bit_shift());
-      node->type = new_type(TY_INT);
+      node_at(node)->type = new_type(TY_INT);
     } else if (consume(">")) {
       node = new_binary(ND_LT, bit_shift(), node);
-      node->type = new_type(TY_INT);
+      node_at(node)->type = new_type(TY_INT);
     } else if (consume(">=")) {
       node = new_binary(ND_LE, bit_shift(), node);
-      node->type = new_type(TY_INT);
+      node_at(node)->type = new_type(TY_INT);
     } else {
       break;
     }
@@ -981,15 +1075,13 @@ Node *relational() {
   return node;
 }
 
-Node *bit_shift() {
-  Node *node = add();
+int bit_shift() {
+  int node = add();
   for (;;) {
     if (consume("<<")) {
       node = new_binary(ND_SHL, node, add());
-      node->type = node->lhs->type;
     } else if (consume(">>")) {
       node = new_binary(ND_SHR, node, add());
-      node->type = node->lhs->type;
     } else {
       break;
     }
@@ -999,67 +1091,69 @@ Node *bit_shift() {
 
 // ポインタ + 整数 または 整数 + ポインタ の場合に
 // 整数側を型サイズで乗算するラッパ
-Node *new_add(Node *lhs, Node *rhs, char *ptr) {
-  Node *node;
-  Node *mul_node;
+int new_add(int lhs, int rhs, char *ptr) {
+  int node;
+  int mul_node;
+  Type *lhs_type = node_at(lhs)->type;
+  Type *rhs_type = node_at(rhs)->type;
   // lhsがptr, rhsがptrなら
-  if (is_ptr_or_arr(lhs->type) && is_ptr_or_arr(rhs->type)) {
+  if (is_ptr_or_arr(lhs_type) && is_ptr_or_arr(rhs_type)) {
     error_at(ptr, "invalid operands to binary expression [in new_add]");
   }
   // lhsがptr, rhsがintなら
-  else if (is_ptr_or_arr(lhs->type) && is_number(rhs->type)) {
-    mul_node = new_binary(ND_MUL, rhs, new_num(get_sizeof(lhs->type->ptr_to)));
+  else if (is_ptr_or_arr(lhs_type) && is_number(rhs_type)) {
+    mul_node = new_binary(ND_MUL, rhs, new_num(get_sizeof(lhs_type->ptr_to)));
     node = new_binary(ND_ADD, lhs, mul_node);
-    node->type = lhs->type;
+    node_at(node)->type = lhs_type;
   }
   // lhsがint, rhsがptrなら
-  else if (is_number(lhs->type) && is_ptr_or_arr(rhs->type)) {
-    mul_node = new_binary(ND_MUL, lhs, new_num(get_sizeof(rhs->type->ptr_to)));
+  else if (is_number(lhs_type) && is_ptr_or_arr(rhs_type)) {
+    mul_node = new_binary(ND_MUL, lhs, new_num(get_sizeof(rhs_type->ptr_to)));
     node = new_binary(ND_ADD, mul_node, rhs);
-    node->type = rhs->type;
+    node_at(node)->type = rhs_type;
   }
   // それ以外は普通に演算
   else {
     node = new_binary(ND_ADD, lhs, rhs);
-    node->type = new_type(TY_INT);
+    node_at(node)->type = new_type(TY_INT);
   }
   return node;
 }
 
-Node *new_sub(Node *lhs, Node *rhs, char *ptr) {
-  Node *node;
-  Node *mul_node;
+int new_sub(int lhs, int rhs, char *ptr) {
+  int node;
+  int mul_node;
+  Type *lhs_type = node_at(lhs)->type;
+  Type *rhs_type = node_at(rhs)->type;
 
   // lhsがptr, rhsがptrなら
-  if (is_ptr_or_arr(lhs->type) && is_ptr_or_arr(rhs->type)) {
+  if (is_ptr_or_arr(lhs_type) && is_ptr_or_arr(rhs_type)) {
     node = new_binary(ND_SUB, lhs, rhs);
-    node->type = lhs->type;
-    node = new_binary(ND_DIV, node, new_num(get_sizeof(lhs->type->ptr_to)));
-    node->type = new_type(TY_INT);
+    node = new_binary(ND_DIV, node, new_num(get_sizeof(lhs_type->ptr_to)));
+    node_at(node)->type = new_type(TY_INT);
   }
   // lhsがint, rhsがptrなら
-  else if (is_number(lhs->type) && is_ptr_or_arr(rhs->type)) {
+  else if (is_number(lhs_type) && is_ptr_or_arr(rhs_type)) {
     error_at(ptr, "invalid operands to binary expression [in new_sub]");
   }
   // lhsがptr, rhsがintなら
-  else if (is_ptr_or_arr(lhs->type) && is_number(rhs->type)) {
-    mul_node = new_binary(ND_MUL, rhs, new_num(get_sizeof(lhs->type->ptr_to)));
+  else if (is_ptr_or_arr(lhs_type) && is_number(rhs_type)) {
+    mul_node = new_binary(ND_MUL, rhs, new_num(get_sizeof(lhs_type->ptr_to)));
     node = new_binary(ND_SUB, lhs, mul_node);
-    node->type = lhs->type;
   }
   // それ以外は普通に演算
   else {
     node = new_binary(ND_SUB, lhs, rhs);
-    node->type = new_type(TY_INT);
+    node_at(node)->type = new_type(TY_INT);
   }
   return node;
 }
 
 // add = mul ("+" mul | "-" mul)*
 // ポインタ演算を挟み込む
-Node *add() {
+int add() {
   char *consumed_ptr_prev;
-  Node *node = mul();
+  int node = mul();
   for (;;) {
     if (consume("+")) {
       consumed_ptr_prev = consumed_ptr;
@@ -1083,77 +1177,81 @@ Type *resolve_type_mul(Type *left, Type *right, char *ptr) {
 }
 
 // mul = unary ("*" unary | "/" unary)*
-Node *mul() {
+int mul() {
   char *consumed_ptr_prev;
-  Node *node = unary();
+  Node *node;
+  int idx = unary();
 
   for (;;) {
     if (consume("*")) {
       consumed_ptr_prev = consumed_ptr;
-      node = new_binary(ND_MUL, node, unary());
-      node->type = resolve_type_mul(node->lhs->type, node->rhs->type, consumed_ptr_prev);
+      idx = new_binary(ND_MUL, idx, unary());
     } else if (consume("/")) {
       consumed_ptr_prev = consumed_ptr;
-      node = new_binary(ND_DIV, node, unary());
-      node->type = resolve_type_mul(node->lhs->type, node->rhs->type, consumed_ptr_prev);
+      idx = new_binary(ND_DIV, idx, unary());
     } else if (consume("%")) {
       consumed_ptr_prev = consumed_ptr;
-      node = new_binary(ND_MOD, node, unary());
-      node->type = resolve_type_mul(node->lhs->type, node->rhs->type, consumed_ptr_prev);
+      idx = new_binary(ND_MOD, idx, unary());
     } else {
       break;
     }
+    node = node_at(idx);
+    node->type = resolve_type_mul(node_at(node->lhs)->type, node_at(node->rhs)->type, consumed_ptr_prev);
   }
-  return node;
+  return idx;
 }
 
 // unary = ("+" | "-")? unary
 //       | primary
-Node *unary() {
+int unary() {
+  int idx;
   Node *node;
-  if (token->kind == TK_SIZEOF) {
-    token = token->next;
-    return new_num(get_sizeof(unary()->type));
+  if (tokens->kind[token] == TK_SIZEOF) {
+    next_token();
+    return new_num(get_sizeof(node_at(unary())->type));
   }
   if (consume("+"))
     return increment_decrement();
   if (consume("-")) {
-    node = new_binary(ND_SUB, new_num(0), increment_decrement());
-    node->type = node->rhs->type;
-    return node;
+    idx = new_binary(ND_SUB, new_num(0), increment_decrement());
+    node = node_at(idx);
+    node->type = node_at(node->rhs)->type;
+    return idx;
   }
   if (consume("&")) {
-    node = new_node(ND_ADDR);
+    idx = new_node(ND_ADDR);
+    node = node_at(idx);
     node->lhs = unary();
-    node->type = new_type_ptr(node->lhs->type);
-    return node;
+    node->type = new_type_ptr(node_at(node->lhs)->type);
+    return idx;
   }
   if (consume("*")) {
     char *consumed_ptr_prev = consumed_ptr;
-    node = unary();
-    node = new_deref(node);
-    if (!is_ptr_or_arr(node->lhs->type)) {
+    idx = new_deref(unary());
+    if (!is_ptr_or_arr(node_at(node_at(idx)->lhs)->type)) {
       error_at(consumed_ptr_prev, "invalid pointer dereference");
     }
-    return node;
+    return idx;
   }
   if (consume("!")) {
-    node = new_node(ND_NOT);
+    idx = new_node(ND_NOT);
+    node = node_at(idx);
     node->lhs = unary();
-    node->type = node->lhs->type;
-    return node;
+    node->type = node_at(node->lhs)->type;
+    return idx;
   }
   if (consume("~")) {
-    node = new_node(ND_BITNOT);
+    idx = new_node(ND_BITNOT);
+    node = node_at(idx);
     node->lhs = unary();
-    node->type = node->lhs->type;
-    return node;
+    node->type = node_at(node->lhs)->type;
+    return idx;
   }
   return increment_decrement();
 }
 
-Node *increment_decrement() {
-  Node *node;
+int increment_decrement() {
+  int node;
   if (consume("++")) {
     node = access_member();
     return new_binary(ND_ASSIGN, node, new_add(node, new_num(1), consumed_ptr));
@@ -1171,68 +1269,70 @@ Node *increment_decrement() {
 }
 
 // Structure Reference and Array Indexing
-Node *access_member() {
-  Node *ptr;
-  Node *offset_node;
-  Token *tok;
+int access_member() {
+  int ptr;
+  int offset_node;
+  int tok;
   Struct *struct_;
   LVar *var;
+  Type *type;
   char *consumed_ptr_prev;
-  Token *prev_tok = token;
-  Node *node = primary();
+  int prev_tok = token;
+  int node = primary();
   for (;;) {
+    type = node_at(node)->type;
     if (consume("[")) {
       consumed_ptr_prev = consumed_ptr;
-      if (!is_ptr_or_arr(node->type)) {
+      if (!is_ptr_or_arr(type)) {
         error_at(consumed_ptr_prev, "invalid array access [in primary]");
       }
       node = new_add(node, expr(), consumed_ptr_prev);
       expect("]", "after number", "array access");
       node = new_deref(node);
     } else if (consume(".")) {
-      if (node->type->ty != TY_STRUCT) {
-        error_at(prev_tok->str, "%.*s is not a struct [in struct reference]", prev_tok->len, prev_tok->str);
+      if (type->ty != TY_STRUCT) {
+        error_at(tokens->str[prev_tok], "%.*s is not a struct [in struct reference]", tokens->len[prev_tok], tokens->str[prev_tok]);
       }
       tok = consume_ident();
       if (!tok) {
-        error_at(token->str, "expected an identifier but got \"%.*s\" [in struct reference]", token->len, token->str);
+        error_at(tokens->str[token], "expected an identifier but got \"%.*s\" [in struct reference]", tokens->len[token], tokens->str[token]);
       }
-      struct_ = node->type->struct_;
+      struct_ = type->struct_;
       if (!struct_) {
-        error_at(prev_tok->str, "unknown struct: %.*s [in struct reference]", prev_tok->len, prev_tok->str);
+        error_at(tokens->str[prev_tok], "unknown struct: %.*s [in struct reference]", tokens->len[prev_tok], tokens->str[prev_tok]);
       } else if (!struct_->size) {
-        error_at(prev_tok->str, "not initialized struct: %.*s [in struct reference]", prev_tok->len, prev_tok->str);
+        error_at(tokens->str[prev_tok], "not initialized struct: %.*s [in struct reference]", tokens->len[prev_tok], tokens->str[prev_tok]);
       }
       var = find_struct_member(struct_, tok);
       offset_node = new_num(var->offset);
       ptr = new_node(ND_ADDR);
-      ptr->lhs = node;
-      ptr->type = new_type_ptr(node->type);
+      node_at(ptr)->lhs = node;
+      node_at(ptr)->type = new_type_ptr(type);
       ptr = new_binary(ND_ADD, ptr, offset_node);
-      ptr->type = new_type_ptr(var->type);
+      node_at(ptr)->type = new_type_ptr(var->type);
       node = new_deref(ptr);
     } else if (consume("->")) {
-      if (node->type->ty != TY_PTR) {
-        error_at(prev_tok->str, "%.*s is not a pointer [in struct reference]", prev_tok->len, prev_tok->str);
+      if (type->ty != TY_PTR) {
+        error_at(tokens->str[prev_tok], "%.*s is not a pointer [in struct reference]", tokens->len[prev_tok], tokens->str[prev_tok]);
       }
-      if (node->type->ptr_to->ty != TY_STRUCT) {
-        error_at(prev_tok->str, "%.*s is not a pointer of a struct [in struct reference]", prev_tok->len,
-                 prev_tok->str);
+      if (type->ptr_to->ty != TY_STRUCT) {
+        error_at(tokens->str[prev_tok], "%.*s is not a pointer of a struct [in struct reference]", tokens->len[prev_tok],
+                 tokens->str[prev_tok]);
       }
       tok = consume_ident();
       if (!tok) {
-        error_at(token->str, "expected an identifier but got \"%.*s\" [in struct reference]", token->len, token->str);
+        error_at(tokens->str[token], "expected an identifier but got \"%.*s\" [in struct reference]", tokens->len[token], tokens->str[token]);
       }
-      struct_ = node->type->ptr_to->struct_;
+      struct_ = type->ptr_to->struct_;
       if (!struct_) {
-        error_at(prev_tok->str, "unknown struct: %.*s [in struct reference]", prev_tok->len, prev_tok->str);
+        error_at(tokens->str[prev_tok], "unknown struct: %.*s [in struct reference]", tokens->len[prev_tok], tokens->str[prev_tok]);
       } else if (!struct_->size) {
-        error_at(prev_tok->str, "not initialized struct: %.*s [in struct reference]", prev_tok->len, prev_tok->str);
+        error_at(tokens->str[prev_tok], "not initialized struct: %.*s [in struct reference]", tokens->len[prev_tok], tokens->str[prev_tok]);
       }
       var = find_struct_member(struct_, tok);
       offset_node = new_num(var->offset);
       ptr = new_binary(ND_ADD, node, offset_node);
-      ptr->type = new_type_ptr(var->type);
+      node_at(ptr)->type = new_type_ptr(var->type);
       node = new_deref(ptr);
     } else
       break;
@@ -1241,57 +1341,64 @@ Node *access_member() {
 }
 
 // primary = "(" expr ")" | num
-Node *primary() {
+int primary() {
+  int idx;
   Node *node;
-  Token *tok;
+  int tok;
   Type *type;
 
   // 括弧
   if (consume("(")) {
-    node = expr();
+    idx = expr();
     expect(")", "after expression", "primary");
-    return node;
+    return idx;
   }
 
   // 数値
-  if (token->kind == TK_NUM) {
+  if (tokens->kind[token] == TK_NUM) {
     return new_num(expect_number());
   }
 
   // 文字列
-  if (token->kind == TK_STRING) {
-    String *str = malloc(sizeof(String));
-    str->text = token->str;
-    str->len = token->len;
-    str->id = label_cnt++;
-    str->next = strings;
-    strings = str;
-    token = token->next;
-    node = new_node(ND_STRING);
-    node->id = str->id;
+  if (tokens->kind[token] == TK_STRING) {
+    // 同じ内容の文字列リテラルは一つのラベルを共有する
+    Ident *text = intern(tokens->str[token], tokens->len[token]);
+    String *str = hashmap_get(string_table, text);
+    if (!str) {
+      str = arena_alloc(symbol_arena, sizeof(String));
+      str->text = tokens->str[token];
+      str->len = tokens->len[token];
+      str->id = label_cnt++;
+      str->next = strings;
+      strings = str;
+      hashmap_put(string_table, text, str);
+    }
+    next_token();
+    idx = new_node(ND_STRING);
+    node = node_at(idx);
+    node->val = str->id;
     node->type = new_type_ptr(new_type(TY_CHAR));
-    return node;
+    return idx;
   }
 
   // 型
   type = consume_type();
   if (type) {
-    node = new_node(ND_TYPE);
-    node->type = type;
-    return node;
+    idx = new_node(ND_TYPE);
+    node_at(idx)->type = type;
+    return idx;
   }
 
   tok = consume_ident();
   if (!tok) {
-    error_at(token->str, "expected an identifier but got \"%.*s\" [in primary]", token->len, token->str);
-    return NULL;
+    error_at(tokens->str[token], "expected an identifier but got \"%.*s\" [in primary]", tokens->len[token], tokens->str[token]);
+    return 0;
   }
 
   // enumのメンバー
   LVar *member = find_enum_member(tok);
   if (member) {
-    node = new_num(member->offset);
-    return node;
+    return new_num(member->offset);
   }
 
   // 変数
@@ -1299,43 +1406,42 @@ Node *primary() {
     LVar *lvar = find_lvar(tok);
     LVar *gvar = find_gver(tok);
     if (lvar) {
-      node = new_node(ND_LVAR);
-      node->var = lvar;
+      idx = new_node(ND_LVAR);
+      node = node_at(idx);
+      node->sym = lvar;
       node->type = lvar->type;
     } else if (gvar) {
-      node = new_node(ND_GVAR);
-      node->var = gvar;
+      idx = new_node(ND_GVAR);
+      node = node_at(idx);
+      node->sym = gvar;
       node->type = gvar->type;
-
     } else {
-      error_at(tok->str, "undefined variable: %.*s [in primary]", tok->len, tok->str);
+      error_at(tokens->str[tok], "undefined variable: %.*s [in primary]", tokens->len[tok], tokens->str[tok]);
     }
-    return node;
+    return idx;
   }
 
   // 関数呼び出し
   else {
     Function *fn = find_fn(tok);
     if (!fn) {
-      error_at(tok->str, "undefined function: %.*s [in primary]", tok->len, tok->str);
+      error_at(tokens->str[tok], "undefined function: %.*s [in primary]", tokens->len[tok], tokens->str[tok]);
     }
-    node = new_node(ND_FUNCALL);
-    node->fn = fn;
-    node->id = loop_cnt++;
+    idx = new_node(ND_FUNCALL);
+    node = node_at(idx);
+    node->sym = fn;
+    node->val = loop_cnt++;
     node->type = fn->type;
+    int mark = scratch_len;
     if (!consume(")")) {
-      int n = 0;
       for (int i = 0; i < 6; i++) {
-        node->args[i] = expr();
-        n += 1;
+        push_scratch(expr());
         if (!consume(","))
           break;
       }
-      node->val = n;
       expect(")", "after arguments", "function call");
-    } else {
-      node->val = 0;
     }
-    return node;
+    node->extra = make_list(mark);
+    return idx;
   }
 }
@@ -0,0 +1,555 @@
+#include "lacc.h"
+
+extern int code;
+extern Function *functions;
+extern LVar *globals;
+extern Struct *structs;
+extern StructTag *struct_tags;
+extern Enum *enums;
+extern LVar *enum_members;
+extern String *filenames;
+extern HashMap *function_table;
+extern HashMap *global_table;
+extern HashMap *struct_table;
+extern HashMap *struct_tag_table;
+extern HashMap *enum_table;
+extern HashMap *enum_member_table;
+extern Arena *symbol_arena;
+extern int typedef_gen;
+extern int type_cnt;
+
+extern int TRUE;
+extern int FALSE;
+extern void *NULL;
+
+// プリコンパイル済みヘッダ (.pch) の形式。値はすべて32bitの整数。
+//   ヘッダ部: PCH_MAGIC, PCH_VERSION, 全体の大きさ, 各レコードの数 (PCH_DEPS ... PCH_FUNCS),
+//             文字列表の位置
+//   レコード: 依存ファイル (名前, 識別子), 構造体 (名前, タグ, 大きさ, メンバー数),
+//             型 (種類, 指す型, 要素数, 構造体), メンバー (名前, 型, オフセット),
+//             列挙型 (名前), 列挙子 (名前, 値), extern変数 (名前, 型), 関数 (名前, 戻り値の型)
+//   文字列表: '\0'で終わる名前を並べたもの。名前は (位置, 長さ) で参照する。
+// レコードは宣言された順に並べ、読み込むときも同じ順にリストの先頭へ積む。
+int PCH_MAGIC = 1212371020; // "LPCH"
+int PCH_VERSION = 1;
+int PCH_SIZE = 2;  // ファイル全体の大きさ
+int PCH_DEPS = 3;
+int PCH_STRUCTS = 4;
+int PCH_TYPES = 5;
+int PCH_MEMBERS = 6;
+int PCH_ENUMS = 7;
+int PCH_ENUM_MEMBERS = 8;
+int PCH_GLOBALS = 9;
+int PCH_FUNCS = 10;
+int PCH_STRTAB = 11;
+int PCH_HEADER_LEN = 12;
+
+ByteBuf *pch_strtab;
+int *pch_type_index; // 型の番号 (Type->id) からレコードの番号へ
+HashMap *pch_struct_index;
+int pch_type_cnt;
+
+// 名前を文字列表に加え、(位置, 長さ) を書き出す
+void pch_name(ByteBuf *buf, char *name, int len) {
+  buf_int32(buf, pch_strtab->len);
+  buf_int32(buf, len);
+  buf_mem(pch_strtab, name, len);
+  buf_byte(pch_strtab, 0);
+}
+
+int pch_struct(Struct *struct_) {
+  int *idx = hashmap_get(pch_struct_index, intern(struct_->name, struct_->len));
+  return *idx;
+}
+
+// 型のレコードを (まだなければ) 書き出してその番号を返す。指す型は先に書き出す。
+int pch_type(ByteBuf *buf, Type *type) {
+  if (pch_type_index[type->id] >= 0)
+    return pch_type_index[type->id];
+  int ptr_to = -1;
+  if (type->ptr_to)
+    ptr_to = pch_type(buf, type->ptr_to);
+  int struct_ = -1;
+  if (type->ty == TY_STRUCT)
+    struct_ = pch_struct(type->struct_);
+  buf_int32(buf, type->ty);
+  buf_int32(buf, ptr_to);
+  buf_int32(buf, type->array_size);
+  buf_int32(buf, struct_);
+  pch_type_index[type->id] = pch_type_cnt;
+  return pch_type_cnt++;
+}
+
+// 以下はリストを古い順の配列にして、その長さを*nに入れる。
+// どのリストも新しい順に並び、末尾は番兵なので含めない。
+void **struct_array(Struct *list, int *n) {
+  int len = 0;
+  for (Struct *s = list; s->next; s = s->next)
+    len++;
+  void **array = malloc(sizeof(void *) * (len + 1));
+  *n = len;
+  for (Struct *s = list; s->next; s = s->next)
+    array[--len] = s;
+  return array;
+}
+
+void **struct_tag_array(StructTag *list, int *n) {
+  int len = 0;
+  for (StructTag *tag = list; tag->next; tag = tag->next)
+    len++;
+  void **array = malloc(sizeof(void *) * (len + 1));
+  *n = len;
+  for (StructTag *tag = list; tag->next; tag = tag->next)
+    array[--len] = tag;
+  return array;
+}
+
+void **enum_array(Enum *list, int *n) {
+  int len = 0;
+  for (Enum *e = list; e->next; e = e->next)
+    len++;
+  void **array = malloc(sizeof(void *) * (len + 1));
+  *n = len;
+  for (Enum *e = list; e->next; e = e->next)
+    array[--len] = e;
+  return array;
+}
+
+void **var_array(LVar *list, int *n) {
+  int len = 0;
+  for (LVar *var = list; var->next; var = var->next)
+    len++;
+  void **array = malloc(sizeof(void *) * (len + 1));
+  *n = len;
+  for (LVar *var = list; var->next; var = var->next)
+    array[--len] = var;
+  return array;
+}
+
+void **function_array(Function *list, int *n) {
+  int len = 0;
+  for (Function *fn = list; fn->next; fn = fn->next)
+    len++;
+  void **array = malloc(sizeof(void *) * (len + 1));
+  *n = len;
+  for (Function *fn = list; fn->next; fn = fn->next)
+    array[--len] = fn;
+  return array;
+}
+
+// headerをパースし、宣言をプリコンパイル済みヘッダとしてoutputに書き出す
+void emit_pch(char *header, char *output) {
+  parse_file(header);
+
+  // 宣言だけのヘッダでなければならない
+  for (int i = 0; i < list_len(code); i++) {
+    Node *node = list_at(code, i);
+    if (node->kind == ND_FUNCDEF) {
+      Function *fn = node->sym;
+      error("cannot precompile %s: it defines function %.*s", header, fn->len, fn->name);
+    }
+  }
+  for (LVar *var = globals; var->next; var = var->next)
+    if (!var->ext)
+      error("cannot precompile %s: it defines variable %.*s", header, var->len, var->name);
+
+  pch_strtab = new_byte_buf();
+  pch_type_index = malloc(sizeof(int) * (type_cnt + 1));
+  for (int i = 0; i <= type_cnt; i++)
+    pch_type_index[i] = -1;
+  pch_type_cnt = 0;
+
+  // 各レコードは種類ごとに別の領域に書き出し、最後につなげる
+  ByteBuf *deps = new_byte_buf();
+  ByteBuf *struct_buf = new_byte_buf();
+  ByteBuf *types = new_byte_buf();
+  ByteBuf *members = new_byte_buf();
+  ByteBuf *enum_buf = new_byte_buf();
+  ByteBuf *member_buf = new_byte_buf();
+  ByteBuf *global_buf = new_byte_buf();
+  ByteBuf *func_buf = new_byte_buf();
+  int counts[8];
+
+  // 読み込んだファイルとその識別子。どれかが変われば使わずにパースし直す。
+  counts[0] = 0;
+  for (String *s = filenames; s; s = s->next) {
+    char *key = file_key(s->text);
+    if (!key)
+      error("cannot stat %s", s->text);
+    pch_name(deps, s->text, s->len);
+    pch_name(deps, key, strlen(key));
+    free(key);
+    counts[0]++;
+  }
+
+  int n;
+  void **array = struct_array(structs, &n);
+  void **tags = struct_tag_array(struct_tags, &n);
+  pch_struct_index = new_hashmap(64);
+  int *struct_ids = malloc(sizeof(int) * (n + 1));
+  for (int i = 0; i < n; i++) {
+    Struct *struct_ = array[i];
+    struct_ids[i] = i;
+    hashmap_put(pch_struct_index, intern(struct_->name, struct_->len), struct_ids + i);
+  }
+  // typedefでは構造体とタグが1組ずつ作られるので、タグも同じ順に並んでいる
+  for (int i = 0; i < n; i++) {
+    Struct *struct_ = array[i];
+    StructTag *tag = tags[i];
+    pch_name(struct_buf, struct_->name, struct_->len);
+    pch_name(struct_buf, tag->name, tag->len);
+    buf_int32(struct_buf, struct_->size);
+    if (!struct_->var) {
+      // 宣言だけで定義されていない構造体
+      buf_int32(struct_buf, -1);
+      continue;
+    }
+    int m;
+    void **vars = var_array(struct_->var, &m);
+    buf_int32(struct_buf, m);
+    for (int j = 0; j < m; j++) {
+      LVar *var = vars[j];
+      pch_name(members, var->name, var->len);
+      buf_int32(members, pch_type(types, var->type));
+      buf_int32(members, var->offset);
+    }
+    free(vars);
+  }
+  counts[1] = n;
+  free(array);
+  free(tags);
+
+  array = enum_array(enums, &n);
+  for (int i = 0; i < n; i++) {
+    Enum *enum_ = array[i];
+    pch_name(enum_buf, enum_->name, enum_->len);
+  }
+  counts[2] = n;
+  free(array);
+
+  array = var_array(enum_members, &n);
+  for (int i = 0; i < n; i++) {
+    LVar *var = array[i];
+    pch_name(member_buf, var->name, var->len);
+    buf_int32(member_buf, var->offset);
+  }
+  counts[3] = n;
+  free(array);
+
+  array = var_array(globals, &n);
+  for (int i = 0; i < n; i++) {
+    LVar *var = array[i];
+    pch_name(global_buf, var->name, var->len);
+    buf_int32(global_buf, pch_type(types, var->type));
+  }
+  counts[4] = n;
+  free(array);
+
+  array = function_array(functions, &n);
+  for (int i = 0; i < n; i++) {
+    Function *fn = array[i];
+    pch_name(func_buf, fn->name, fn->len);
+    buf_int32(func_buf, pch_type(types, fn->type));
+  }
+  counts[5] = n;
+  free(array);
+
+  ByteBuf *head = new_byte_buf();
+  int size = PCH_HEADER_LEN * 4 + deps->len + struct_buf->len + types->len + members->len + enum_buf->len +
+             member_buf->len + global_buf->len + func_buf->len;
+  buf_int32(head, PCH_MAGIC);
+  buf_int32(head, PCH_VERSION);
+  buf_int32(head, size + pch_strtab->len);
+  buf_int32(head, counts[0]);
+  buf_int32(head, counts[1]);
+  buf_int32(head, pch_type_cnt);
+  buf_int32(head, members->len / 16);
+  buf_int32(head, counts[2]);
+  buf_int32(head, counts[3]);
+  buf_int32(head, counts[4]);
+  buf_int32(head, counts[5]);
+  buf_int32(head, size);
+
+  open_output(output);
+  emit_mem(head->data, head->len);
+  emit_mem(deps->data, deps->len);
+  emit_mem(struct_buf->data, struct_buf->len);
+  emit_mem(types->data, types->len);
+  emit_mem(members->data, members->len);
+  emit_mem(enum_buf->data, enum_buf->len);
+  emit_mem(member_buf->data, member_buf->len);
+  emit_mem(global_buf->data, global_buf->len);
+  emit_mem(func_buf->data, func_buf->len);
+  emit_mem(pch_strtab->data, pch_strtab->len);
+  close_output();
+}
+
+// 種類kindのレコードが1つwidth個の整数なら、その整数の数を*wordsに足す。
+// レコードの数がファイルに収まらなければFALSEを返す。
+int pch_count_ok(int *head, int kind, int width, int size, int *words) {
+  int n = head[kind];
+  if (n < 0 || n > size / (width * 4))
+    return FALSE;
+  *words += n * width;
+  return TRUE;
+}
+
+// 名前の参照 (位置, 長さ) が文字列表に収まり、'\0'で終わっていればTRUE
+int pch_name_ok(int *rec, char *strtab, int strtab_len) {
+  if (rec[0] < 0 || rec[1] < 0 || rec[0] >= strtab_len || rec[1] >= strtab_len - rec[0])
+    return FALSE;
+  return strtab[rec[0] + rec[1]] == '\0';
+}
+
+// 型の番号がn個の型を指していればTRUE
+int pch_index_ok(int idx, int n) { return idx >= 0 && idx < n; }
+
+// 大きさsizeのプリコンパイル済みヘッダのレコードの数と、名前や型の参照をすべて確かめる。
+// load_pchはここで確かめた範囲だけを読むので、壊れたファイルでも領域の外を読まない。
+int pch_valid(char *data, int size) {
+  void *p = data;
+  int *head = p;
+  int words = PCH_HEADER_LEN;
+  if (!pch_count_ok(head, PCH_DEPS, 4, size, &words) || !pch_count_ok(head, PCH_STRUCTS, 6, size, &words) ||
+      !pch_count_ok(head, PCH_TYPES, 4, size, &words) || !pch_count_ok(head, PCH_MEMBERS, 4, size, &words) ||
+      !pch_count_ok(head, PCH_ENUMS, 2, size, &words) || !pch_count_ok(head, PCH_ENUM_MEMBERS, 3, size, &words) ||
+      !pch_count_ok(head, PCH_GLOBALS, 3, size, &words) || !pch_count_ok(head, PCH_FUNCS, 3, size, &words))
+    return FALSE;
+  // レコードの直後から文字列表が始まり、ファイルの終わりまで続く
+  if (head[PCH_STRTAB] != words * 4)
+    return FALSE;
+  char *strtab = data + head[PCH_STRTAB];
+  int strtab_len = size - head[PCH_STRTAB];
+  int *rec = head + PCH_HEADER_LEN;
+
+  for (int i = 0; i < head[PCH_DEPS]; i++) {
+    if (!pch_name_ok(rec, strtab, strtab_len) || !pch_name_ok(rec + 2, strtab, strtab_len))
+      return FALSE;
+    rec += 4;
+  }
+
+  int struct_cnt = head[PCH_STRUCTS];
+  int members = 0;
+  for (int i = 0; i < struct_cnt; i++) {
+    if (!pch_name_ok(rec, strtab, strtab_len) || !pch_name_ok(rec + 2, strtab, strtab_len) || rec[5] < -1)
+      return FALSE;
+    if (rec[5] > 0)
+      members += rec[5];
+    if (members > head[PCH_MEMBERS])
+      return FALSE;
+    rec += 6;
+  }
+  if (members != head[PCH_MEMBERS])
+    return FALSE;
+
+  // 型は指す型が先に並んでいなければならない
+  int n_types = head[PCH_TYPES];
+  for (int i = 0; i < n_types; i++) {
+    TypeKind ty = rec[0];
+    if (ty < TY_NONE || ty > TY_STRUCT)
+      return FALSE;
+    if (ty == TY_STRUCT && !pch_index_ok(rec[3], struct_cnt))
+      return FALSE;
+    if ((ty == TY_PTR || ty == TY_ARR || ty == TY_ARGARR) && !pch_index_ok(rec[1], i))
+      return FALSE;
+    rec += 4;
+  }
+
+  for (int i = 0; i < members; i++) {
+    if (!pch_name_ok(rec, strtab, strtab_len) || !pch_index_ok(rec[2], n_types))
+      return FALSE;
+    rec += 4;
+  }
+  for (int i = 0; i < head[PCH_ENUMS]; i++) {
+    if (!pch_name_ok(rec, strtab, strtab_len))
+      return FALSE;
+    rec += 2;
+  }
+  for (int i = 0; i < head[PCH_ENUM_MEMBERS]; i++) {
+    if (!pch_name_ok(rec, strtab, strtab_len))
+      return FALSE;
+    rec += 3;
+  }
+  for (int i = 0; i < head[PCH_GLOBALS] + head[PCH_FUNCS]; i++) {
+    if (!pch_name_ok(rec, strtab, strtab_len) || !pch_index_ok(rec[2], n_types))
+      return FALSE;
+    rec += 3;
+  }
+  return TRUE;
+}
+
+// nameに対応するプリコンパイル済みヘッダ (name.pch) があれば、その内容を返す。
+// 大きさやレコードが壊れているか、作ったときに読み込んだファイルがどれか変わっていれば
+// 使えないのでNULLを返す。そのときはヘッダをパースし直す。
+char *find_pch(char *name) {
+  int len = strlen(name);
+  char *path = arena_alloc(symbol_arena, len + 5);
+  memcpy(path, name, len);
+  memcpy(path + len, ".pch", 5);
+  int size = file_size(path);
+  if (size < PCH_HEADER_LEN * 4)
+    return NULL;
+  char *data = read_file(path);
+  void *p = data;
+  int *head = p;
+  if (head[0] != PCH_MAGIC || head[1] != PCH_VERSION || head[PCH_SIZE] != size || !pch_valid(data, size))
+    return NULL;
+  char *strtab = data + head[PCH_STRTAB];
+  int *rec = head + PCH_HEADER_LEN;
+  for (int i = 0; i < head[PCH_DEPS]; i++) {
+    char *key = file_key(strtab + rec[0]);
+    int same = key && !strcmp(key, strtab + rec[2]);
+    free(key);
+    if (!same)
+      return NULL;
+    rec += 4;
+  }
+
+  // 依存ファイルは#includeで読み込み済みとして扱う
+  rec = head + PCH_HEADER_LEN;
+  for (int i = 0; i < head[PCH_DEPS]; i++) {
+    String *file = arena_alloc(symbol_arena, sizeof(String));
+    file->text = strtab + rec[0];
+    file->len = rec[1];
+    file->next = filenames;
+    filenames = file;
+    rec += 4;
+  }
+  return data;
+}
+
+// find_pchで見つけたプリコンパイル済みヘッダの宣言を、パースしたときと同じように登録する
+void load_pch(char *data) {
+  void *p = data;
+  int *head = p;
+  char *strtab = data + head[PCH_STRTAB];
+  int *rec = head + PCH_HEADER_LEN + head[PCH_DEPS] * 4;
+
+  // 構造体とタグ。メンバーは型を作った後で登録する。
+  int struct_cnt = head[PCH_STRUCTS];
+  Struct **struct_list = malloc(sizeof(Struct *) * (struct_cnt + 1));
+  int *member_cnt = malloc(sizeof(int) * (struct_cnt + 1));
+  for (int i = 0; i < struct_cnt; i++) {
+    Struct *struct_ = arena_alloc(symbol_arena, sizeof(Struct));
+    struct_->name = strtab + rec[0];
+    struct_->len = rec[1];
+    struct_->size = rec[4];
+    struct_->next = structs;
+    structs = struct_;
+    hashmap_put(struct_table, intern(struct_->name, struct_->len), struct_);
+    StructTag *tag = arena_alloc(symbol_arena, sizeof(StructTag));
+    tag->name = strtab + rec[2];
+    tag->len = rec[3];
+    tag->main = struct_;
+    tag->next = struct_tags;
+    struct_tags = tag;
+    hashmap_put(struct_tag_table, intern(tag->name, tag->len), tag);
+    struct_list[i] = struct_;
+    member_cnt[i] = rec[5];
+    rec += 6;
+  }
+
+  // 型は指す型が先に並んでいる
+  int n_types = head[PCH_TYPES];
+  Type **types = malloc(sizeof(Type *) * (n_types + 1));
+  for (int i = 0; i < n_types; i++) {
+    TypeKind ty = rec[0];
+    if (ty == TY_STRUCT) {
+      types[i] = new_type_struct(struct_list[rec[3]]);
+    } else if (ty == TY_PTR) {
+      types[i] = new_type_ptr(types[rec[1]]);
+    } else if (ty == TY_ARR) {
+      types[i] = new_type_arr(types[rec[1]], rec[2]);
+    } else if (ty == TY_ARGARR) {
+      types[i] = new_type_argarr(types[rec[1]], rec[2]);
+    } else {
+      types[i] = new_type(ty);
+    }
+    rec += 4;
+  }
+
+  for (int i = 0; i < struct_cnt; i++) {
+    if (member_cnt[i] < 0)
+      continue;
+    Struct *struct_ = struct_list[i];
+    struct_->var = arena_alloc(symbol_arena, sizeof(LVar));
+    struct_->var->next = NULL;
+    struct_->var->type = new_type(TY_NONE);
+    struct_->members = new_hashmap(16);
+    for (int j = 0; j < member_cnt[i]; j++) {
+      LVar *var = arena_alloc(symbol_arena, sizeof(LVar));
+      var->name = strtab + rec[0];
+      var->len = rec[1];
+      var->ident = intern(var->name, var->len);
+      var->type = types[rec[2]];
+      var->offset = rec[3];
+      var->next = struct_->var;
+      struct_->var = var;
+      hashmap_put(struct_->members, var->ident, var);
+      rec += 4;
+    }
+  }
+
+  for (int i = 0; i < head[PCH_ENUMS]; i++) {
+    Enum *enum_ = arena_alloc(symbol_arena, sizeof(Enum));
+    enum_->name = strtab + rec[0];
+    enum_->len = rec[1];
+    enum_->next = enums;
+    enums = enum_;
+    hashmap_put(enum_table, intern(enum_->name, enum_->len), enum_);
+    rec += 2;
+  }
+
+  for (int i = 0; i < head[PCH_ENUM_MEMBERS]; i++) {
+    LVar *var = arena_alloc(symbol_arena, sizeof(LVar));
+    var->name = strtab + rec[0];
+    var->len = rec[1];
+    var->ident = intern(var->name, var->len);
+    var->type = new_type(TY_INT);
+    var->offset = rec[2];
+    var->next = enum_members;
+    enum_members = var;
+    hashmap_put(enum_member_table, var->ident, var);
+    rec += 3;
+  }
+
+  // extern宣言と関数の宣言は、すでにあれば登録し直さない
+  for (int i = 0; i < head[PCH_GLOBALS]; i++) {
+    Ident *ident = intern(strtab + rec[0], rec[1]);
+    if (!hashmap_get(global_table, ident)) {
+      LVar *var = arena_alloc(symbol_arena, sizeof(LVar));
+      var->ident = ident;
+      var->name = strtab + rec[0];
+      var->len = rec[1];
+      var->type = types[rec[2]];
+      var->ext = TRUE;
+      var->next = globals;
+      globals = var;
+      hashmap_put(global_table, ident, var);
+    }
+    rec += 3;
+  }
+
+  for (int i = 0; i < head[PCH_FUNCS]; i++) {
+    Ident *ident = intern(strtab + rec[0], rec[1]);
+    Function *fn = hashmap_get(function_table, ident);
+    if (!fn) {
+      fn = arena_alloc(symbol_arena, sizeof(Function));
+      fn->next = functions;
+      functions = fn;
+      hashmap_put(function_table, ident, fn);
+    }
+    fn->ident = ident;
+    fn->name = strtab + rec[0];
+    fn->len = rec[1];
+    fn->type = types[rec[2]];
+    fn->offset = 0;
+    rec += 3;
+  }
+
+  // 型名の解決結果のキャッシュを無効にする
+  typedef_gen++;
+  free(struct_list);
+  free(member_cnt);
+  free(types);
+}
@@ -0,0 +1,264 @@
+#include "lacc.h"
+
+extern Arena *local_arena;
+
+extern int TRUE;
+extern int FALSE;
+extern void *NULL;
+
+// 低水準IRの仮想レジスタを線形走査法で物理レジスタに割り付ける。
+// 物理レジスタの番号はx86-64の符号化の番号 (rax=0, rcx=1, ..., r15=15) を使う。
+// rax, rcx, rdx, r10, r11はコード生成が一時的に使うので割り付けない。
+// 割り付けられなかった仮想レジスタはフレーム上のスロットに置く。
+
+// 仮想レジスタの集合を表すビット列
+int *new_set(int words) { return arena_alloc(local_arena, sizeof(int) * words); }
+
+int set_has(int *set, int v) { return (set[v / 32] >> (v % 32)) & 1; }
+
+void set_add(int *set, int v) { set[v / 32] = set[v / 32] | (1 << (v % 32)); }
+
+// 関数の外から値が渡されないレジスタ。関数呼び出しをまたいで生きている値には使えない。
+int is_caller_saved(int reg) { return reg == 6 || reg == 7 || reg == 8 || reg == 9; }
+
+// 割り付けに使う順に並べた物理レジスタ (rsi, rdi, r8, r9, rbx, r12, r13, r14, r15)
+int alloc_reg_at(int i) {
+  if (i < 4)
+    return 6 + i;
+  if (i == 4)
+    return 3;
+  return 7 + i;
+}
+
+int ALLOC_REG_CNT = 9;
+
+// 値として読む仮想レジスタならTRUE。即値だけを持つ仮想レジスタは割り付けない。
+int is_vreg(IrFunc *f, int v) { return v && !f->const_def[v]; }
+
+// 各ブロックで、定義より前に読む仮想レジスタ (use) と定義する仮想レジスタ (def) を求める
+void block_use_def(IrFunc *f, Block *blk, int *use, int *def) {
+  for (Ins *ins = blk->first; ins; ins = ins->next) {
+    if (is_vreg(f, ins->a) && !set_has(def, ins->a))
+      set_add(use, ins->a);
+    if (is_vreg(f, ins->b) && !set_has(def, ins->b))
+      set_add(use, ins->b);
+    for (int i = 0; i < ins->nargs; i++)
+      if (is_vreg(f, ins->args[i]) && !set_has(def, ins->args[i]))
+        set_add(use, ins->args[i]);
+    if (is_vreg(f, ins->dst))
+      set_add(def, ins->dst);
+  }
+}
+
+// outにblkの入口で生きている集合を加える。変わったらTRUEを返す。
+int merge_live(int *out, Block *blk, int words) {
+  int changed = FALSE;
+  for (int i = 0; i < words; i++) {
+    int merged = out[i] | blk->live_in[i];
+    if (merged != out[i]) {
+      out[i] = merged;
+      changed = TRUE;
+    }
+  }
+  return changed;
+}
+
+// ブロックの出入口で生きている仮想レジスタを後ろ向きのデータフロー解析で求める
+void compute_liveness(IrFunc *f, int words) {
+  Block **blocks = arena_alloc(local_arena, sizeof(Block *) * f->block_cnt);
+  int **use = arena_alloc(local_arena, sizeof(int *) * f->block_cnt);
+  int **def = arena_alloc(local_arena, sizeof(int *) * f->block_cnt);
+  for (Block *blk = f->entry; blk; blk = blk->next) {
+    blocks[blk->id] = blk;
+    use[blk->id] = new_set(words);
+    def[blk->id] = new_set(words);
+    blk->live_in = new_set(words);
+    blk->live_out = new_set(words);
+    block_use_def(f, blk, use[blk->id], def[blk->id]);
+  }
+
+  int changed = TRUE;
+  while (changed) {
+    changed = FALSE;
+    for (int id = f->block_cnt - 1; id >= 0; id--) {
+      Block *blk = blocks[id];
+      Ins *last = blk->last;
+      if (last->op == IR_JMP || last->op == IR_BR)
+        if (merge_live(blk->live_out, last->then_blk, words))
+          changed = TRUE;
+      if (last->op == IR_BR)
+        if (merge_live(blk->live_out, last->else_blk, words))
+          changed = TRUE;
+      for (int i = 0; i < words; i++) {
+        int in = use[id][i] | (blk->live_out[i] & ~def[id][i]);
+        if (in != blk->live_in[i]) {
+          blk->live_in[i] = in;
+          changed = TRUE;
+        }
+      }
+    }
+  }
+}
+
+// 仮想レジスタの生存区間をposの範囲に広げる
+void extend_interval(int *start, int *end, int v, int pos) {
+  if (!start[v] || pos < start[v])
+    start[v] = pos;
+  if (pos > end[v])
+    end[v] = pos;
+}
+
+// 生きている区間が最も遠くまで続く割り付け済みの仮想レジスタを選ぶ。
+// callee_onlyならcallee-savedレジスタを持つものだけを選ぶ。
+int furthest_active(IrFunc *f, int *active, int active_cnt, int *end, int callee_only) {
+  int best = -1;
+  for (int i = 0; i < active_cnt; i++) {
+    if (callee_only && is_caller_saved(f->reg[active[i]]))
+      continue;
+    if (best < 0 || end[active[i]] > end[active[best]])
+      best = i;
+  }
+  return best;
+}
+
+void spill(IrFunc *f, int v) {
+  f->reg[v] = -1;
+  f->spill_size += 8;
+  f->slot[v] = f->frame_size + f->spill_size;
+}
+
+void alloc_registers(IrFunc *f) {
+  int n = f->vreg_cnt + 1;
+  int words = n / 32 + 1;
+  f->reg = arena_alloc(local_arena, sizeof(int) * n);
+  f->slot = arena_alloc(local_arena, sizeof(int) * n);
+  f->use_cnt = arena_alloc(local_arena, sizeof(int) * n);
+  f->const_def = arena_alloc(local_arena, sizeof(Ins *) * n);
+
+  // 命令に番号を振り、即値だけを代入される仮想レジスタと読まれる回数を調べる
+  int *def_cnt = arena_alloc(local_arena, sizeof(int) * n);
+  int pos = 2;
+  for (Block *blk = f->entry; blk; blk = blk->next) {
+    for (Ins *ins = blk->first; ins; ins = ins->next) {
+      ins->pos = pos;
+      pos += 2;
+      if (ins->dst) {
+        def_cnt[ins->dst]++;
+        if (ins->op == IR_IMM)
+          f->const_def[ins->dst] = ins;
+      }
+      if (ins->a)
+        f->use_cnt[ins->a]++;
+      if (ins->b)
+        f->use_cnt[ins->b]++;
+      for (int i = 0; i < ins->nargs; i++)
+        f->use_cnt[ins->args[i]]++;
+    }
+  }
+  for (int v = 1; v < n; v++)
+    if (def_cnt[v] != 1)
+      f->const_def[v] = NULL;
+
+  compute_liveness(f, words);
+
+  // 生存区間は命令の位置の範囲で近似する。
+  // ブロックの入口や出口で生きていれば、ブロックの前後まで区間を広げる。
+  // calls[p]は位置p以下にある関数呼び出しの数。
+  int *start = arena_alloc(local_arena, sizeof(int) * n);
+  int *end = arena_alloc(local_arena, sizeof(int) * n);
+  int *calls = arena_alloc(local_arena, sizeof(int) * (pos + 1));
+  for (Block *blk = f->entry; blk; blk = blk->next) {
+    for (Ins *ins = blk->first; ins; ins = ins->next) {
+      if (is_vreg(f, ins->a))
+        extend_interval(start, end, ins->a, ins->pos);
+      if (is_vreg(f, ins->b))
+        extend_interval(start, end, ins->b, ins->pos);
+      for (int i = 0; i < ins->nargs; i++)
+        if (is_vreg(f, ins->args[i]))
+          extend_interval(start, end, ins->args[i], ins->pos);
+      if (is_vreg(f, ins->dst))
+        extend_interval(start, end, ins->dst, ins->pos);
+      if (ins->op == IR_CALL)
+        calls[ins->pos] = 1;
+    }
+    for (int v = 1; v < n; v++) {
+      if (!blk->live_in[v / 32] && !blk->live_out[v / 32]) {
+        // 32個まとめて生きていなければ飛ばす
+        v += 31 - v % 32;
+        continue;
+      }
+      if (set_has(blk->live_in, v))
+        extend_interval(start, end, v, blk->first->pos - 1);
+      if (set_has(blk->live_out, v))
+        extend_interval(start, end, v, blk->last->pos + 1);
+    }
+  }
+  for (int p = 1; p <= pos; p++)
+    calls[p] += calls[p - 1];
+
+  // 区間を始まる位置の順に並べる
+  int *bucket = arena_alloc(local_arena, sizeof(int) * (pos + 2));
+  int *order = arena_alloc(local_arena, sizeof(int) * n);
+  for (int v = 1; v < n; v++)
+    if (start[v])
+      bucket[start[v] + 1]++;
+  for (int p = 1; p <= pos + 1; p++)
+    bucket[p] += bucket[p - 1];
+  int order_cnt = 0;
+  for (int v = 1; v < n; v++) {
+    if (start[v]) {
+      order[bucket[start[v]]++] = v;
+      order_cnt++;
+    }
+  }
+
+  int *active = arena_alloc(local_arena, sizeof(int) * (ALLOC_REG_CNT + 1));
+  int active_cnt = 0;
+  int *used = arena_alloc(local_arena, sizeof(int) * 16);
+  for (int i = 0; i < order_cnt; i++) {
+    int v = order[i];
+    if (!f->use_cnt[v]) {
+      // 読まれない値はどこにも置かない
+      f->reg[v] = -1;
+      continue;
+    }
+
+    // 区間が終わった仮想レジスタのレジスタを空ける
+    int k = 0;
+    for (int j = 0; j < active_cnt; j++) {
+      if (end[active[j]] <= start[v]) {
+        used[f->reg[active[j]]] = FALSE;
+      } else {
+        active[k++] = active[j];
+      }
+    }
+    active_cnt = k;
+
+    int crosses_call = calls[end[v] - 1] - calls[start[v]] > 0;
+    int reg = -1;
+    for (int j = 0; j < ALLOC_REG_CNT; j++) {
+      int r = alloc_reg_at(j);
+      if (!used[r] && !(crosses_call && is_caller_saved(r))) {
+        reg = r;
+        break;
+      }
+    }
+
+    if (reg < 0) {
+      // 空きがなければ、最も遠くまで生きる値をスピルする
+      int j = furthest_active(f, active, active_cnt, end, crosses_call);
+      if (j < 0 || end[active[j]] <= end[v]) {
+        spill(f, v);
+        continue;
+      }
+      reg = f->reg[active[j]];
+      spill(f, active[j]);
+      active[j] = active[--active_cnt];
+    }
+    f->reg[v] = reg;
+    used[reg] = TRUE;
+    active[active_cnt++] = v;
+    if (!is_caller_saved(reg))
+      f->saved_regs = f->saved_regs | (1 << reg);
+  }
+}
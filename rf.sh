@@ -1,3 +1,20 @@
-$1 $2 > ./tmp.s
-cc -o ./tmp ./tmp.s
-./tmp
+# 使い方: rf.sh コンパイラ ファイル [コンパイラへの引数...]
+# 引数に-cがあればオブジェクトファイルを作り、--runか--vmがあればその場で実行する
+compiler=$1
+src=$2
+shift 2
+case " $* " in
+*" --run "* | *" --vm "*)
+  $compiler "$@" $src
+  ;;
+*" -c "*)
+  $compiler "$@" -o ./tmp.o $src
+  cc -o ./tmp ./tmp.o
+  ./tmp
+  ;;
+*)
+  $compiler "$@" -o ./tmp.s $src
+  cc -o ./tmp ./tmp.s
+  ./tmp
+  ;;
+esac
@@ -0,0 +1,160 @@
+
+// 字句解析で長く続く部分 (空白, コメント, 文字列リテラル) を読み飛ばす関数。
+// SSE2/AVX2で16〜32バイトずつ調べ、使えない環境では1バイトずつ調べる。
+// lacc自身ではコンパイルできないので、extention.cと同じくホストのコンパイラでビルドする。
+
+#if defined(__x86_64__) && defined(__SSE2__)
+#include <immintrin.h>
+#define SCAN_SIMD 1
+#endif
+
+// 探す文字の集合
+enum {
+  SCAN_NONSPACE, // 空白以外
+  SCAN_LINE,     // '\n', '\0'
+  SCAN_SLASH,    // '/', '\0'
+  SCAN_STRING,   // '"', '\\', '\0'
+};
+
+static int is_space_byte(unsigned char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+
+static int match_byte(unsigned char c, int kind) {
+  switch (kind) {
+  case SCAN_NONSPACE:
+    return !is_space_byte(c);
+  case SCAN_LINE:
+    return c == '\n' || c == '\0';
+  case SCAN_SLASH:
+    return c == '/' || c == '\0';
+  default:
+    return c == '"' || c == '\\' || c == '\0';
+  }
+}
+
+#ifdef SCAN_SIMD
+
+// 16バイトのうち集合に含まれる文字の位置をビットで返す
+static inline unsigned match16(__m128i x, int kind) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i m;
+  switch (kind) {
+  case SCAN_NONSPACE: {
+    // ' ' か, '\t'〜'\r' (x - 9 が符号なしで4以下) なら空白
+    __m128i d = _mm_sub_epi8(x, _mm_set1_epi8('\t'));
+    __m128i ctrl = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(4)), d);
+    m = _mm_or_si128(ctrl, _mm_cmpeq_epi8(x, _mm_set1_epi8(' ')));
+    return ~(unsigned)_mm_movemask_epi8(m) & 0xFFFF;
+  }
+  case SCAN_LINE:
+    m = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(x, zero));
+    break;
+  case SCAN_SLASH:
+    m = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('/')), _mm_cmpeq_epi8(x, zero));
+    break;
+  default:
+    m = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('"')), _mm_cmpeq_epi8(x, _mm_set1_epi8('\\')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(x, zero));
+    break;
+  }
+  return (unsigned)_mm_movemask_epi8(m);
+}
+
+// 読み込みは常に境界に揃えて行うので、入力の終端を越えてページをまたぐことはない。
+// 揃えた位置からpまでの部分はマスクで取り除く。
+static char *find_sse2(char *p, int kind) {
+  unsigned long off = (unsigned long)p & 15;
+  char *b = p - off;
+  unsigned mask = match16(_mm_load_si128((__m128i *)b), kind) >> off;
+  if (mask)
+    return p + __builtin_ctz(mask);
+  for (;;) {
+    b += 16;
+    mask = match16(_mm_load_si128((__m128i *)b), kind);
+    if (mask)
+      return b + __builtin_ctz(mask);
+  }
+}
+
+__attribute__((target("avx2"))) static inline unsigned match32(__m256i x, int kind) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i m;
+  switch (kind) {
+  case SCAN_NONSPACE: {
+    __m256i d = _mm256_sub_epi8(x, _mm256_set1_epi8('\t'));
+    __m256i ctrl = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(4)), d);
+    m = _mm256_or_si256(ctrl, _mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')));
+    return ~(unsigned)_mm256_movemask_epi8(m);
+  }
+  case SCAN_LINE:
+    m = _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(x, zero));
+    break;
+  case SCAN_SLASH:
+    m = _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('/')), _mm256_cmpeq_epi8(x, zero));
+    break;
+  default:
+    m = _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('"')), _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\\')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, zero));
+    break;
+  }
+  return (unsigned)_mm256_movemask_epi8(m);
+}
+
+__attribute__((target("avx2"))) static char *find_avx2(char *p, int kind) {
+  unsigned long off = (unsigned long)p & 31;
+  char *b = p - off;
+  unsigned mask = match32(_mm256_load_si256((__m256i *)b), kind) >> off;
+  if (mask)
+    return p + __builtin_ctz(mask);
+  for (;;) {
+    b += 32;
+    mask = match32(_mm256_load_si256((__m256i *)b), kind);
+    if (mask)
+      return b + __builtin_ctz(mask);
+  }
+}
+
+static int use_avx2 = -1;
+
+static char *find_byte(char *p, int kind) {
+  // 短い並びが多いので、最初の数バイトは1バイトずつ調べる
+  for (int i = 0; i < 4; i++, p++)
+    if (match_byte(*p, kind))
+      return p;
+  if (use_avx2 < 0)
+    use_avx2 = __builtin_cpu_supports("avx2");
+  if (use_avx2)
+    return find_avx2(p, kind);
+  return find_sse2(p, kind);
+}
+
+#else
+
+static char *find_byte(char *p, int kind) {
+  while (!match_byte(*p, kind))
+    p++;
+  return p;
+}
+
+#endif
+
+// 空白でない最初の文字を返す
+char *skip_space(char *p) { return find_byte(p, SCAN_NONSPACE); }
+
+// 行末 ('\n' か '\0') を返す
+char *skip_line(char *p) { return find_byte(p, SCAN_LINE); }
+
+// 文字列リテラルの中で次に調べるべき文字 ('"', '\\', '\0') を返す
+char *scan_string(char *p) { return find_byte(p, SCAN_STRING); }
+
+// "/*" の直後から "*/" を探す。閉じられていなければNULLを返す。
+char *find_comment_end(char *p) {
+  if (!*p)
+    return 0;
+  for (char *s = p + 1;; s++) {
+    s = find_byte(s, SCAN_SLASH);
+    if (!*s)
+      return 0;
+    if (s[-1] == '*')
+      return s - 1;
+  }
+}
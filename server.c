@@ -0,0 +1,235 @@
+
+// 常駐してコンパイルの要求に答えるサーバー (--server) と、その要求を送るクライアント (--client)。
+// ソケットでファイル記述子を受け渡すので、extention.cと同じくホストのコンパイラでビルドする。
+//
+// クライアントは作業ディレクトリと引数を送り、標準入出力とエラー出力の記述子を一緒に渡す。
+// サーバーは要求ごとに子プロセスを作り、渡された記述子につないで通常のlaccと同じように実行し、
+// 終了コードを4バイトで返す。
+// 入力ファイルの先頭で読み込むヘッダはサーバー自身がパースしておき、子プロセスはその続きからパースする。
+
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+void error(char *fmt, ...);
+int main(int argc, char **argv);
+void warm_header(char *input);
+void drop_warm_header(void);
+
+extern jmp_buf *error_jmp;
+
+static int read_full(int fd, void *buf, int len) {
+  char *p = buf;
+  while (len > 0) {
+    int n = read(fd, p, len);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int write_full(int fd, void *buf, int len) {
+  char *p = buf;
+  while (len > 0) {
+    int n = write(fd, p, len);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static void socket_address(struct sockaddr_un *addr, char *path) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path))
+    error("socket path is too long: %s", path);
+  strcpy(addr->sun_path, path);
+}
+
+static int is_c_source(char *path) {
+  int len = strlen(path);
+  return len >= 2 && path[len - 2] == '.' && path[len - 1] == 'c';
+}
+
+// 要求を1つ受け取って子プロセスで実行する
+static void handle_request(int sock, int conn) {
+  // 先頭の4バイトと一緒に標準入出力とエラー出力の記述子を受け取る
+  int len;
+  int fds[3];
+  struct iovec iov = {&len, sizeof(len)};
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(fds))];
+  } ctl;
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl.buf;
+  msg.msg_controllen = sizeof(ctl.buf);
+  if (recvmsg(conn, &msg, MSG_WAITALL) != sizeof(len))
+    return;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+    return;
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+  if (len <= 0 || len > (1 << 24)) {
+    for (int i = 0; i < 3; i++)
+      close(fds[i]);
+    return;
+  }
+
+  // 作業ディレクトリと引数を'\0'で区切って並べたもの
+  char *payload = malloc(len + 1);
+  char **argv = malloc(sizeof(char *) * (len + 2));
+  int argc = 0;
+  int status = 1;
+  if (read_full(conn, payload, len))
+    goto done;
+  payload[len] = '\0';
+  argv[argc++] = "lacc";
+  for (char *p = payload + strlen(payload) + 1; p < payload + len; p += strlen(p) + 1)
+    argv[argc++] = p;
+  argv[argc] = NULL;
+  if (chdir(payload) == -1) {
+    dprintf(fds[2], "cannot change directory to %s\n", payload);
+    write_full(conn, &status, sizeof(status));
+    goto done;
+  }
+
+  // 最初の入力ファイルが読み込むヘッダをパースしておく。
+  // 失敗しても子プロセスが最初からパースし直してエラーを報告するので、ここでは捨てるだけにする。
+  jmp_buf jmp;
+  error_jmp = &jmp;
+  if (setjmp(jmp) == 0) {
+    for (int i = 1; i < argc; i++) {
+      if (is_c_source(argv[i]) && access(argv[i], R_OK) == 0) {
+        warm_header(argv[i]);
+        break;
+      }
+    }
+  } else {
+    drop_warm_header();
+  }
+  error_jmp = NULL;
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // 子プロセスは実行する孫プロセスを待って終了コードを返す
+    close(sock);
+    signal(SIGCHLD, SIG_DFL);
+    pid_t worker = fork();
+    if (worker == 0) {
+      close(conn);
+      for (int i = 0; i < 3; i++) {
+        dup2(fds[i], i);
+        close(fds[i]);
+      }
+      exit(main(argc, argv));
+    }
+    int st;
+    if (worker > 0 && waitpid(worker, &st, 0) == worker)
+      status = WIFEXITED(st) ? WEXITSTATUS(st) : 128 + WTERMSIG(st);
+    write_full(conn, &status, sizeof(status));
+    _exit(0);
+  }
+  if (pid < 0)
+    write_full(conn, &status, sizeof(status));
+
+done:
+  for (int i = 0; i < 3; i++)
+    close(fds[i]);
+  free(payload);
+  free(argv);
+}
+
+// pathにソケットを作って要求を待ち続ける
+int run_server(char *path) {
+  struct sockaddr_un addr;
+  socket_address(&addr, path);
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock == -1)
+    error("cannot create socket");
+  unlink(path);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    error("cannot bind %s", path);
+  if (listen(sock, 64) == -1)
+    error("cannot listen on %s", path);
+
+  // 要求ごとの子プロセスは待たずに回収させる
+  signal(SIGCHLD, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN);
+  for (;;) {
+    int conn = accept(sock, NULL, NULL);
+    if (conn == -1) {
+      if (errno == EINTR)
+        continue;
+      error("cannot accept on %s", path);
+    }
+    handle_request(sock, conn);
+    close(conn);
+  }
+}
+
+// pathのサーバーに引数を送ってコンパイルさせ、その終了コードを返す
+int run_client(char *path, int argc, char **argv) {
+  struct sockaddr_un addr;
+  socket_address(&addr, path);
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock == -1 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    error("cannot connect to %s", path);
+
+  char cwd[4096];
+  if (!getcwd(cwd, sizeof(cwd)))
+    error("cannot get the current directory");
+  int len = strlen(cwd) + 1;
+  for (int i = 0; i < argc; i++)
+    len += strlen(argv[i]) + 1;
+  char *payload = malloc(len);
+  char *p = stpcpy(payload, cwd) + 1;
+  for (int i = 0; i < argc; i++)
+    p = stpcpy(p, argv[i]) + 1;
+
+  int fds[3] = {0, 1, 2};
+  struct iovec iov = {&len, sizeof(len)};
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(fds))];
+  } ctl;
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl.buf;
+  msg.msg_controllen = sizeof(ctl.buf);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  if (sendmsg(sock, &msg, 0) != sizeof(len) || write_full(sock, payload, len))
+    error("cannot send the request to %s", path);
+  free(payload);
+
+  int status;
+  if (read_full(sock, &status, sizeof(status)))
+    error("lost connection to %s", path);
+  close(sock);
+  return status;
+}
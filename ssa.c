@@ -0,0 +1,429 @@
+#include "lacc.h"
+
+extern Arena *local_arena;
+
+extern int TRUE;
+extern int FALSE;
+extern void *NULL;
+
+// 低水準IRの制御フローグラフ, 支配木, SSA形式への変換とSSA形式からの復元
+
+int succ_cnt(Block *blk) {
+  IrOp op = blk->last->op;
+  if (op == IR_JMP)
+    return 1;
+  if (op == IR_BR)
+    return 2;
+  return 0;
+}
+
+Block *succ_at(Block *blk, int i) {
+  if (i == 0)
+    return blk->last->then_blk;
+  return blk->last->else_blk;
+}
+
+// 出力する順にブロックの番号を振り直す
+void renumber_blocks(IrFunc *f) {
+  int id = 0;
+  for (Block *blk = f->entry; blk; blk = blk->next) {
+    blk->id = id++;
+    f->last = blk;
+  }
+  f->block_cnt = id;
+}
+
+// 入口から辿れるブロックを深さ優先で探索して逆後順に並べ、先行ブロックを求める。
+// 辿れないブロック (returnやbreakの後のコードなど) は取り除く。
+void build_cfg(IrFunc *f) {
+  int n = f->block_cnt;
+  for (Block *blk = f->entry; blk; blk = blk->next) {
+    blk->rpo = -1;
+    blk->pred_cnt = 0;
+  }
+
+  Block **post = arena_alloc(local_arena, sizeof(Block *) * n);
+  Block **stack = arena_alloc(local_arena, sizeof(Block *) * n);
+  int *next = arena_alloc(local_arena, sizeof(int) * n);
+  int sp = 0;
+  int cnt = 0;
+  stack[sp++] = f->entry;
+  f->entry->rpo = 0;
+  while (sp) {
+    Block *blk = stack[sp - 1];
+    if (next[sp - 1] < succ_cnt(blk)) {
+      Block *succ = succ_at(blk, next[sp - 1]++);
+      if (succ->rpo < 0) {
+        succ->rpo = 0;
+        next[sp] = 0;
+        stack[sp++] = succ;
+      }
+    } else {
+      post[cnt++] = blk;
+      sp--;
+    }
+  }
+
+  f->rpo = arena_alloc(local_arena, sizeof(Block *) * cnt);
+  for (int i = 0; i < cnt; i++) {
+    f->rpo[i] = post[cnt - 1 - i];
+    f->rpo[i]->rpo = i;
+  }
+
+  // 辿れないブロックを取り除き、そこから来るphiの値も取り除く
+  Block *prev = f->entry;
+  for (Block *blk = f->entry->next; blk; blk = blk->next) {
+    if (blk->rpo < 0) {
+      prev->next = blk->next;
+    } else {
+      prev = blk;
+    }
+  }
+  renumber_blocks(f);
+  for (Block *blk = f->entry; blk; blk = blk->next) {
+    for (Ins *ins = blk->first; ins && ins->op == IR_PHI; ins = ins->next) {
+      int k = 0;
+      for (int i = 0; i < ins->nargs; i++) {
+        if (ins->phi_blks[i]->rpo >= 0) {
+          ins->args[k] = ins->args[i];
+          ins->phi_blks[k++] = ins->phi_blks[i];
+        }
+      }
+      ins->nargs = k;
+    }
+  }
+
+  for (Block *blk = f->entry; blk; blk = blk->next)
+    for (int i = 0; i < succ_cnt(blk); i++)
+      succ_at(blk, i)->pred_cnt++;
+  for (Block *blk = f->entry; blk; blk = blk->next) {
+    blk->preds = arena_alloc(local_arena, sizeof(Block *) * (blk->pred_cnt + 1));
+    blk->pred_cnt = 0;
+  }
+  for (Block *blk = f->entry; blk; blk = blk->next) {
+    for (int i = 0; i < succ_cnt(blk); i++) {
+      Block *succ = succ_at(blk, i);
+      succ->preds[succ->pred_cnt++] = blk;
+    }
+  }
+  f->cfg_valid = TRUE;
+}
+
+// 支配木で2つのブロックに共通する最も近い祖先
+Block *intersect(Block *a, Block *b) {
+  while (a != b) {
+    while (a->rpo > b->rpo)
+      a = a->idom;
+    while (b->rpo > a->rpo)
+      b = b->idom;
+  }
+  return a;
+}
+
+// Cooper, Harvey, Kennedyの反復法で支配木を求め、支配辺境を計算する
+void build_dom(IrFunc *f) {
+  if (!f->cfg_valid)
+    build_cfg(f);
+  for (Block *blk = f->entry; blk; blk = blk->next) {
+    blk->idom = NULL;
+    blk->dom_child = NULL;
+    blk->dom_sibling = NULL;
+    blk->df = NULL;
+  }
+  f->entry->idom = f->entry;
+
+  int changed = TRUE;
+  while (changed) {
+    changed = FALSE;
+    for (int i = 1; i < f->block_cnt; i++) {
+      Block *blk = f->rpo[i];
+      Block *idom = NULL;
+      for (int j = 0; j < blk->pred_cnt; j++) {
+        Block *pred = blk->preds[j];
+        if (!pred->idom)
+          continue;
+        if (idom) {
+          idom = intersect(pred, idom);
+        } else {
+          idom = pred;
+        }
+      }
+      if (blk->idom != idom) {
+        blk->idom = idom;
+        changed = TRUE;
+      }
+    }
+  }
+
+  for (int i = f->block_cnt - 1; i > 0; i--) {
+    Block *blk = f->rpo[i];
+    blk->dom_sibling = blk->idom->dom_child;
+    blk->idom->dom_child = blk;
+  }
+
+  // 合流するブロックは、各先行ブロックから直接の支配ブロックまでの支配辺境に入る
+  for (Block *blk = f->entry; blk; blk = blk->next) {
+    if (blk->pred_cnt < 2)
+      continue;
+    for (int j = 0; j < blk->pred_cnt; j++) {
+      Block *runner = blk->preds[j];
+      while (runner != blk->idom) {
+        if (!runner->df || runner->df->blk != blk) {
+          BlockList *df = arena_alloc(local_arena, sizeof(BlockList));
+          df->blk = blk;
+          df->next = runner->df;
+          runner->df = df;
+        }
+        runner = runner->idom;
+      }
+    }
+  }
+  f->dom_valid = TRUE;
+}
+
+// SSA形式に変換している関数の状態
+IrFunc *ssa_fn;
+int ssa_vreg_cnt;   // 変換前の仮想レジスタの数
+int *ssa_is_var;    // 複数回代入されるのでphiが必要な仮想レジスタならTRUE
+int *ssa_cur;       // 元の仮想レジスタの、いま見ている場所での名前
+int *ssa_log_var;   // 名前を付け替える前の値を戻すための記録
+int *ssa_log_val;
+int ssa_log_len;
+
+int ssa_name(int v) {
+  if (v && v < ssa_vreg_cnt && ssa_is_var[v])
+    return ssa_cur[v];
+  return v;
+}
+
+// 支配木を辿り、代入ごとに新しい名前を付けて、使う場所をその名前に置き換える
+void rename_block(Block *blk) {
+  int mark = ssa_log_len;
+  for (Ins *ins = blk->first; ins; ins = ins->next) {
+    int var = ins->dst;
+    if (ins->op == IR_PHI) {
+      var = ins->imm;
+    } else {
+      ins->a = ssa_name(ins->a);
+      ins->b = ssa_name(ins->b);
+      for (int i = 0; i < ins->nargs; i++)
+        ins->args[i] = ssa_name(ins->args[i]);
+    }
+    if (var && var < ssa_vreg_cnt && ssa_is_var[var]) {
+      ssa_log_var[ssa_log_len] = var;
+      ssa_log_val[ssa_log_len++] = ssa_cur[var];
+      ssa_cur[var] = ++ssa_fn->vreg_cnt;
+      ins->dst = ssa_cur[var];
+    }
+  }
+
+  for (int i = 0; i < succ_cnt(blk); i++) {
+    Block *succ = succ_at(blk, i);
+    for (Ins *phi = succ->first; phi->op == IR_PHI; phi = phi->next)
+      for (int j = 0; j < phi->nargs; j++)
+        if (phi->phi_blks[j] == blk)
+          phi->args[j] = ssa_cur[phi->imm];
+  }
+
+  for (Block *child = blk->dom_child; child; child = child->dom_sibling)
+    rename_block(child);
+
+  while (ssa_log_len > mark) {
+    ssa_log_len--;
+    ssa_cur[ssa_log_var[ssa_log_len]] = ssa_log_val[ssa_log_len];
+  }
+}
+
+// 複数回代入される仮想レジスタをSSA形式にする。
+// phiは、ブロックをまたいで使われる仮想レジスタにだけ、代入のあるブロックの反復支配辺境に置く。
+int build_ssa(IrFunc *f) {
+  if (!f->dom_valid)
+    build_dom(f);
+  int n = f->vreg_cnt + 1;
+  int *def_cnt = arena_alloc(local_arena, sizeof(int) * n);
+  int *is_global = arena_alloc(local_arena, sizeof(int) * n);
+  int *def_mark = arena_alloc(local_arena, sizeof(int) * n);
+  BlockList **def_blks = arena_alloc(local_arena, sizeof(BlockList *) * n);
+  for (Block *blk = f->entry; blk; blk = blk->next) {
+    for (Ins *ins = blk->first; ins; ins = ins->next) {
+      // このブロックで代入するより前に使えば、ほかのブロックから来た値を使う
+      if (ins->a && def_mark[ins->a] != blk->id + 1)
+        is_global[ins->a] = TRUE;
+      if (ins->b && def_mark[ins->b] != blk->id + 1)
+        is_global[ins->b] = TRUE;
+      for (int i = 0; i < ins->nargs; i++)
+        if (def_mark[ins->args[i]] != blk->id + 1)
+          is_global[ins->args[i]] = TRUE;
+      if (ins->dst) {
+        def_cnt[ins->dst]++;
+        def_mark[ins->dst] = blk->id + 1;
+        BlockList *def = arena_alloc(local_arena, sizeof(BlockList));
+        def->blk = blk;
+        def->next = def_blks[ins->dst];
+        def_blks[ins->dst] = def;
+      }
+    }
+  }
+
+  ssa_fn = f;
+  ssa_vreg_cnt = n;
+  ssa_is_var = arena_alloc(local_arena, sizeof(int) * n);
+  ssa_cur = arena_alloc(local_arena, sizeof(int) * n);
+  int var_cnt = 0;
+  int log_size = 0;
+  for (int v = 1; v < n; v++) {
+    ssa_cur[v] = v;
+    if (def_cnt[v] > 1) {
+      ssa_is_var[v] = TRUE;
+      var_cnt++;
+      log_size += def_cnt[v];
+    }
+  }
+  if (!var_cnt)
+    return FALSE;
+
+  int *has_phi = arena_alloc(local_arena, sizeof(int) * f->block_cnt);
+  int *in_work = arena_alloc(local_arena, sizeof(int) * f->block_cnt);
+  Block **work = arena_alloc(local_arena, sizeof(Block *) * f->block_cnt);
+  for (int v = 1; v < n; v++) {
+    if (!ssa_is_var[v] || !is_global[v])
+      continue;
+    int work_len = 0;
+    for (BlockList *def = def_blks[v]; def; def = def->next) {
+      if (in_work[def->blk->id] != v) {
+        in_work[def->blk->id] = v;
+        work[work_len++] = def->blk;
+      }
+    }
+    while (work_len) {
+      Block *blk = work[--work_len];
+      for (BlockList *df = blk->df; df; df = df->next) {
+        Block *join = df->blk;
+        if (has_phi[join->id] == v)
+          continue;
+        has_phi[join->id] = v;
+        Ins *phi = arena_alloc(local_arena, sizeof(Ins));
+        phi->op = IR_PHI;
+        phi->dst = v;
+        phi->imm = v;
+        phi->nargs = join->pred_cnt;
+        phi->args = arena_alloc(local_arena, sizeof(int) * join->pred_cnt);
+        phi->phi_blks = arena_alloc(local_arena, sizeof(Block *) * join->pred_cnt);
+        for (int i = 0; i < join->pred_cnt; i++)
+          phi->phi_blks[i] = join->preds[i];
+        phi->next = join->first;
+        join->first = phi;
+        log_size++;
+        if (in_work[join->id] != v) {
+          in_work[join->id] = v;
+          work[work_len++] = join;
+        }
+      }
+    }
+  }
+
+  ssa_log_var = arena_alloc(local_arena, sizeof(int) * log_size);
+  ssa_log_val = arena_alloc(local_arena, sizeof(int) * log_size);
+  ssa_log_len = 0;
+  rename_block(f->entry);
+  return FALSE;
+}
+
+Ins *new_move(int dst, int src) {
+  Ins *ins = arena_alloc(local_arena, sizeof(Ins));
+  ins->op = IR_MOV;
+  ins->dst = dst;
+  ins->a = src;
+  return ins;
+}
+
+// predからblkへ来たときのphiの値を、predの最後の飛び越しの直前でコピーする。
+// phi同士が互いの値を読んでも壊れないように、2つ以上あれば一時的な仮想レジスタを経由する。
+void insert_phi_copies(IrFunc *f, Block *blk, Block *pred, Block *at) {
+  Ins *head = NULL;
+  Ins *tail = NULL;
+  int phi_cnt = 0;
+  for (Ins *phi = blk->first; phi->op == IR_PHI; phi = phi->next)
+    phi_cnt++;
+  for (int pass = 0; pass < 2; pass++) {
+    for (Ins *phi = blk->first; phi->op == IR_PHI; phi = phi->next) {
+      int src = 0;
+      for (int j = 0; j < phi->nargs; j++)
+        if (phi->phi_blks[j] == pred)
+          src = phi->args[j];
+      Ins *copy;
+      if (phi_cnt == 1) {
+        if (pass)
+          continue;
+        copy = new_move(phi->dst, src);
+      } else if (!pass) {
+        // 1回目は一時的な仮想レジスタに読み、phiのimmにその番号を残しておく
+        phi->imm = ++f->vreg_cnt;
+        copy = new_move(phi->imm, src);
+      } else {
+        copy = new_move(phi->dst, phi->imm);
+      }
+      if (tail) {
+        tail->next = copy;
+      } else {
+        head = copy;
+      }
+      tail = copy;
+    }
+  }
+
+  tail->next = at->last;
+  if (at->first == at->last) {
+    at->first = head;
+  } else {
+    Ins *prev = at->first;
+    while (prev->next != at->last)
+      prev = prev->next;
+    prev->next = head;
+  }
+}
+
+// predからblkへの辺に空のブロックを挟む
+Block *split_edge(IrFunc *f, Block *pred, Block *blk) {
+  Block *mid = new_block();
+  Ins *jmp = arena_alloc(local_arena, sizeof(Ins));
+  jmp->op = IR_JMP;
+  jmp->then_blk = blk;
+  mid->first = jmp;
+  mid->last = jmp;
+  if (pred->last->then_blk == blk)
+    pred->last->then_blk = mid;
+  if (pred->last->else_blk == blk)
+    pred->last->else_blk = mid;
+  mid->next = pred->next;
+  pred->next = mid;
+  return mid;
+}
+
+// phiを先行ブロックでのコピーに置き換えてSSA形式から戻す。
+// 分岐から合流へ直接向かう辺には、コピーを置くブロックを挟む。
+int leave_ssa(IrFunc *f) {
+  if (!f->cfg_valid)
+    build_cfg(f);
+  int changed = FALSE;
+  Block *blk = f->entry;
+  while (blk) {
+    Block *next = blk->next;
+    if (blk->first->op == IR_PHI) {
+      for (int i = 0; i < blk->pred_cnt; i++) {
+        Block *pred = blk->preds[i];
+        Block *at = pred;
+        if (succ_cnt(pred) > 1) {
+          at = split_edge(f, pred, blk);
+          changed = TRUE;
+        }
+        insert_phi_copies(f, blk, pred, at);
+      }
+      while (blk->first->op == IR_PHI)
+        blk->first = blk->first->next;
+    }
+    blk = next;
+  }
+  renumber_blocks(f);
+  return changed;
+}
@@ -0,0 +1,178 @@
+
+#include "lacc.h"
+
+extern Scope *scope;
+extern HashMap *local_table;
+extern HashMap *ident_table;
+extern Arena *symbol_arena;
+extern HashEntry *free_entries;
+extern Scope *free_scopes;
+
+extern int TRUE;
+extern int FALSE;
+extern void *NULL;
+
+// 名前のハッシュ値を計算する (djb2, 24bitに丸めてオーバーフローを避ける)
+int hash_name(char *name, int len) {
+  int h = 5381;
+  for (int i = 0; i < len; i++)
+    h = (h * 33 + name[i]) & 16777215;
+  return h;
+}
+
+// capacityは2の冪でなければならない。
+// バケットもアリーナから確保し、コンパイルの終わりにまとめて解放する。
+HashMap *new_hashmap(int capacity) {
+  HashMap *map = arena_alloc(symbol_arena, sizeof(HashMap));
+  map->buckets = arena_alloc(symbol_arena, sizeof(HashEntry *) * capacity);
+  map->capacity = capacity;
+  map->count = 0;
+  return map;
+}
+
+// バケット数を倍にして再配置する。
+// 同じ名前のエントリは新しいものが先頭にある順序を保つ。
+void hashmap_grow(HashMap *map) {
+  int capacity = map->capacity * 2;
+  HashEntry **buckets = arena_alloc(symbol_arena, sizeof(HashEntry *) * capacity);
+  for (int i = 0; i < map->capacity; i++) {
+    // 古い順に並べ替えてから先頭に積むことで元の順序に戻す
+    HashEntry *rev = NULL;
+    HashEntry *entry = map->buckets[i];
+    while (entry) {
+      HashEntry *next = entry->next;
+      entry->next = rev;
+      rev = entry;
+      entry = next;
+    }
+    while (rev) {
+      HashEntry *next = rev->next;
+      int idx = rev->key->hash & (capacity - 1);
+      rev->next = buckets[idx];
+      buckets[idx] = rev;
+      rev = next;
+    }
+  }
+  map->buckets = buckets;
+  map->capacity = capacity;
+}
+
+// アトムで検索する。同じアトムのエントリが複数ある場合は最後に追加したものを返す。
+void *hashmap_get(HashMap *map, Ident *key) {
+  for (HashEntry *entry = map->buckets[key->hash & (map->capacity - 1)]; entry; entry = entry->next)
+    if (entry->key == key)
+      return entry->value;
+  return NULL;
+}
+
+// エントリを追加する。既存の同じアトムのエントリは削除されず、隠されるだけ。
+void hashmap_put(HashMap *map, Ident *key, void *value) {
+  if (map->count >= map->capacity)
+    hashmap_grow(map);
+  HashEntry *entry = free_entries;
+  if (entry) {
+    free_entries = entry->next;
+  } else {
+    entry = arena_alloc(symbol_arena, sizeof(HashEntry));
+  }
+  entry->key = key;
+  entry->value = value;
+  int idx = key->hash & (map->capacity - 1);
+  entry->next = map->buckets[idx];
+  map->buckets[idx] = entry;
+  map->count++;
+}
+
+// 最後に追加したエントリを削除し、隠されていたエントリを元に戻す。
+// 削除したエントリは次のhashmap_putで再利用する。
+void hashmap_pop(HashMap *map, Ident *key) {
+  HashEntry **link = &map->buckets[key->hash & (map->capacity - 1)];
+  for (HashEntry *entry = *link; entry; entry = entry->next) {
+    if (entry->key == key) {
+      *link = entry->next;
+      entry->next = free_entries;
+      free_entries = entry;
+      map->count--;
+      return;
+    }
+    link = &entry->next;
+  }
+}
+
+// 登録済みのアトムを探す。見つからなかった場合はNULLを返す。
+Ident *find_ident(char *name, int len) {
+  int hash = hash_name(name, len);
+  for (HashEntry *entry = ident_table->buckets[hash & (ident_table->capacity - 1)]; entry; entry = entry->next) {
+    Ident *ident = entry->key;
+    if (ident->hash == hash && ident->len == len && !memcmp(ident->name, name, len))
+      return ident;
+  }
+  return NULL;
+}
+
+Ident *new_ident(char *name, int len) {
+  Ident *ident = arena_alloc(symbol_arena, sizeof(Ident));
+  ident->name = name;
+  ident->len = len;
+  ident->hash = hash_name(name, len);
+  hashmap_put(ident_table, ident, ident);
+  return ident;
+}
+
+// 名前を登録して一意なアトムを返す。
+// 同じ綴りの名前には必ず同じアトムが返るので、以降の比較はポインタ比較で済む。
+// アトムは名前の領域をそのまま参照するので、nameは解放してはならない。
+Ident *intern(char *name, int len) {
+  Ident *ident = find_ident(name, len);
+  if (ident)
+    return ident;
+  return new_ident(name, len);
+}
+
+// internと同じだが、新しく登録するときは名前を複製する
+Ident *intern_copy(char *name, int len) {
+  Ident *ident = find_ident(name, len);
+  if (ident)
+    return ident;
+  char *copy = arena_alloc(symbol_arena, len + 1);
+  memcpy(copy, name, len);
+  return new_ident(copy, len);
+}
+
+// ブロックスコープに入る。
+// ローカル変数のスタック領域は外側のスコープの続きから確保される。
+void enter_scope() {
+  Scope *sc = free_scopes;
+  if (sc) {
+    free_scopes = sc->parent;
+  } else {
+    sc = arena_alloc(symbol_arena, sizeof(Scope));
+  }
+  sc->parent = scope;
+  sc->vars = NULL;
+  if (scope) {
+    sc->base = scope->offset;
+  } else {
+    sc->base = 0;
+  }
+  sc->offset = sc->base;
+  scope = sc;
+}
+
+// ブロックスコープを抜ける。
+// このスコープで宣言した変数を表から外すので、外側の同名変数が再び見えるようになる。
+void leave_scope() {
+  Scope *sc = scope;
+  for (LVar *var = sc->vars; var; var = var->next)
+    hashmap_pop(local_table, var->ident);
+  scope = sc->parent;
+  sc->parent = free_scopes;
+  free_scopes = sc;
+}
+
+// 現在のスコープにローカル変数を登録する
+void declare_lvar(LVar *lvar) {
+  lvar->next = scope->vars;
+  scope->vars = lvar;
+  hashmap_put(local_table, lvar->ident, lvar);
+}
@@ -1,80 +1,426 @@
-
 #include "lacc.h"
 
 extern char *user_input;
-extern Token *token;
+extern TokenBuf *tokens;
+extern int token;
 extern String *filenames;
 extern char *filename;
+extern Arena *symbol_arena;
 
 extern int TRUE;
 extern int FALSE;
 extern void *NULL;
 
-// Create a new token and add it as the next token of `cur`.
+// 隣接する文字列リテラルを連結するための領域。
+// 入力は読み込み専用でマップしているので、連結した内容はこちらに作る。
+int concat_tok = 0; // 連結中のトークン (0なら連結中でない)
+int concat_cap = 0;
+
+// 字句解析はパーサーがトークンを読み進めるたびに必要な分だけ行う。
+// lex_posは次に読む位置, lex_tokは最後に追加したトークンの番号。
+char *lex_pos;
+int lex_tok;
+
+// #includeで読み込み中のファイルを抜けたときに戻る位置
+typedef struct LexFrame LexFrame;
+struct LexFrame {
+  LexFrame *next;
+  char *input;    // 戻ったときのuser_input
+  char *pos;      // 戻ったときのlex_pos
+  char *filename; // 戻ったときのfilename
+};
+LexFrame *lex_stack;
+
+// 空のトークン列を作る。0番のトークンは「トークンなし」として予約する。
+TokenBuf *new_token_buf() {
+  TokenBuf *buf = calloc(1, sizeof(TokenBuf));
+  buf->cnt = 0;
+  buf->cap = 0;
+  buf->kind = NULL;
+  buf->len = NULL;
+  buf->val = NULL;
+  buf->str = NULL;
+  buf->ident = NULL;
+  tokens = buf;
+  concat_tok = 0;
+  new_token(TK_EOF, NULL, 0);
+  return buf;
+}
+
+// トークン列をまとめて解放する
+void free_token_buf(TokenBuf *buf) {
+  free(buf->kind);
+  free(buf->len);
+  free(buf->val);
+  free(buf->str);
+  free(buf->ident);
+  free(buf);
+}
+
+// 配列を倍の大きさにする
+void grow_token_buf(TokenBuf *buf) {
+  buf->cap = buf->cap * 2 + 1024;
+  buf->kind = realloc(buf->kind, sizeof(TokenKind) * buf->cap);
+  buf->len = realloc(buf->len, sizeof(int) * buf->cap);
+  buf->val = realloc(buf->val, sizeof(int) * buf->cap);
+  buf->str = realloc(buf->str, sizeof(char *) * buf->cap);
+  buf->ident = realloc(buf->ident, sizeof(Ident *) * buf->cap);
+  if (!buf->kind || !buf->len || !buf->val || !buf->str || !buf->ident)
+    error("realloc failed");
+}
+
+// トークン列の末尾にトークンを追加し、lex_tokをその番号にする
 void new_token(TokenKind kind, char *str, int len) {
-  Token *tok = malloc(sizeof(Token));
-  tok->kind = kind;
-  tok->str = str;
-  tok->len = len;
-  token->next = tok;
-  token = tok;
+  if (tokens->cnt == tokens->cap)
+    grow_token_buf(tokens);
+  lex_tok = tokens->cnt++;
+  tokens->kind[lex_tok] = kind;
+  tokens->len[lex_tok] = len;
+  tokens->val[lex_tok] = 0;
+  tokens->str[lex_tok] = str;
+  tokens->ident[lex_tok] = NULL;
 }
 
 int startswith(char *p, char *q) { return !memcmp(p, q, strlen(q)); }
 
-int is_alnum(char c) {
-  return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || ('0' <= c && c <= '9') || (c == '_');
+// 文字の種類。字句解析の分岐はこの表を一度引くだけで決まる。
+int char_class[256];
+
+// 記号の文字を1から始まる番号に対応させる表 (記号でなければ0)
+int punct_class[256];
+
+// 記号を読むDFAの遷移表。状態 * 32 + 記号の番号 で引き、0なら受理して終わる。
+// 状態0が開始状態で、それ以外の状態はすべて受理状態。
+int punct_dfa[2048];
+int punct_state_cnt;
+
+// キーワードの完全ハッシュ表。
+// ハッシュ関数 (先頭の文字 + 末尾の文字 * 5) & 31 はキーワードの集合に対して衝突しないように選んである。
+char *keyword_name[32];
+int keyword_len[32];
+TokenKind keyword_kind[32];
+TypeKind keyword_type[32];
+
+int keyword_hash(char *p, int len) { return (p[0] + p[len - 1] * 5) & 31; }
+
+void add_keyword(char *name, TokenKind kind, TypeKind ty) {
+  int len = strlen(name);
+  int h = keyword_hash(name, len);
+  if (keyword_name[h])
+    error("keyword hash collision: %s [in add_keyword]", name);
+  keyword_name[h] = name;
+  keyword_len[h] = len;
+  keyword_kind[h] = kind;
+  keyword_type[h] = ty;
 }
 
-// Tokenize `user_input` and returns new tokens.
-void tokenize() {
-  Token *token_cpy;
-  char *p = user_input;
-  char *q;
+// 識別子がキーワードならその種類を、そうでなければTK_IDENTを返す。
+// 候補はハッシュ値で一つに決まるので、比較は一回で済む。
+int lookup_keyword(char *p, int len) {
+  int h = keyword_hash(p, len);
+  if (keyword_len[h] == len && !memcmp(keyword_name[h], p, len))
+    return h;
+  return -1;
+}
 
-  while (*p) {
-    // Skip whitespace characters.
-    if (isspace(*p)) {
-      p++;
-      continue;
+void set_char_class(char *chars, int cls) {
+  for (int i = 0; chars[i]; i++)
+    char_class[chars[i]] = cls;
+}
+
+// 記号opを受理するようにDFAに遷移を追加する
+void add_punct(char *op) {
+  int state = 0;
+  for (int i = 0; op[i]; i++) {
+    int cls = punct_class[op[i]];
+    if (!punct_dfa[state * 32 + cls]) {
+      punct_dfa[state * 32 + cls] = ++punct_state_cnt;
     }
+    state = punct_dfa[state * 32 + cls];
+  }
+}
 
-    // 行コメントをスキップ
-    if (startswith(p, "//")) {
+// 字句解析に使う表を作る
+void init_lexer() {
+  for (int i = 0; i < 256; i++) {
+    char_class[i] = CH_OTHER;
+    punct_class[i] = 0;
+  }
+  set_char_class(" \t\n\f\r", CH_SPACE);
+  char_class[11] = CH_SPACE; // '\v'
+  set_char_class("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_", CH_ALPHA);
+  set_char_class("0123456789", CH_DIGIT);
+  set_char_class("+-*/()<>={}[];&|^~,%!.:#", CH_PUNCT);
+  set_char_class("'", CH_QUOTE);
+  set_char_class("\"", CH_DQUOTE);
+
+  char *puncts = "+-*/()<>={}[];&|^~,%!.:#";
+  for (int i = 0; puncts[i]; i++)
+    punct_class[puncts[i]] = i + 1;
+  for (int i = 0; i < 2048; i++)
+    punct_dfa[i] = 0;
+  punct_state_cnt = 0;
+  for (int i = 0; puncts[i]; i++) {
+    char op[2] = {0, 0};
+    op[0] = puncts[i];
+    add_punct(op);
+  }
+  add_punct("==");
+  add_punct("!=");
+  add_punct("<=");
+  add_punct(">=");
+  add_punct("&&");
+  add_punct("||");
+  add_punct("++");
+  add_punct("--");
+  add_punct("+=");
+  add_punct("-=");
+  add_punct("*=");
+  add_punct("/=");
+  add_punct("%=");
+  add_punct("->");
+  add_punct("<<");
+  add_punct(">>");
+  if (punct_state_cnt >= 64)
+    error("too many punctuator states [in init_lexer]");
+
+  for (int i = 0; i < 32; i++) {
+    keyword_name[i] = NULL;
+    keyword_len[i] = 0;
+  }
+  add_keyword("do", TK_DO, TY_NONE);
+  add_keyword("if", TK_IF, TY_NONE);
+  add_keyword("sizeof", TK_SIZEOF, TY_NONE);
+  add_keyword("else", TK_ELSE, TY_NONE);
+  add_keyword("return", TK_RETURN, TY_NONE);
+  add_keyword("extern", TK_EXTERN, TY_NONE);
+  add_keyword("enum", TK_ENUM, TY_NONE);
+  add_keyword("struct", TK_STRUCT, TY_NONE);
+  add_keyword("typedef", TK_TYPEDEF, TY_NONE);
+  add_keyword("while", TK_WHILE, TY_NONE);
+  add_keyword("for", TK_FOR, TY_NONE);
+  add_keyword("int", TK_TYPE, TY_INT);
+  add_keyword("char", TK_TYPE, TY_CHAR);
+  add_keyword("void", TK_TYPE, TY_VOID);
+  add_keyword("break", TK_BREAK, TY_NONE);
+  add_keyword("continue", TK_CONTINUE, TY_NONE);
+  add_keyword("include", TK_INCLUDE, TY_NONE);
+}
+
+// 直前の文字列リテラルのトークンにsを連結する
+void concat_string(char *s, int len) {
+  int cur = tokens->len[lex_tok];
+  if (concat_tok != lex_tok) {
+    // 最初の連結ではトークンの内容を新しい領域に移す
+    concat_cap = (cur + len) * 2;
+    char *buf = malloc(concat_cap);
+    memcpy(buf, tokens->str[lex_tok], cur);
+    tokens->str[lex_tok] = buf;
+    concat_tok = lex_tok;
+  } else if (cur + len > concat_cap) {
+    concat_cap = (cur + len) * 2;
+    tokens->str[lex_tok] = realloc(tokens->str[lex_tok], concat_cap);
+  }
+  if (!tokens->str[lex_tok])
+    error("out of memory [in concat_string]");
+  memcpy(tokens->str[lex_tok] + cur, s, len);
+  tokens->len[lex_tok] = cur + len;
+}
+
+// "#include" の後のファイル名を読み、そのファイルの先頭から字句解析を続ける。
+// ファイルの終わりに達したら、lex_stackに積んだ位置 (#includeの直後) に戻る。
+char *include_file(char *p) {
+  while (char_class[*p & 255] == CH_SPACE) {
+    p++;
+  }
+  if (*p != '"') {
+    error_at(p, "expected \" before \"include\"");
+  }
+  p++;
+  char *q = p;
+  while (*p != '"') {
+    if (*p == '\0') {
+      error_at(q - 1, "unclosed string literal [in tokenize]");
+    }
+    if (*p == '\\') {
       p += 2;
-      while (*p != '\n' && *p != '\0')
-        p++;
-      continue;
+    } else {
+      p++;
     }
+  }
+  char *name = arena_alloc(symbol_arena, p - q + 1);
+  memcpy(name, q, p - q);
+  name[p - q] = '\0';
+  p++;
+  for (String *s = filenames; s; s = s->next) {
+    if (!memcmp(s->text, name, strlen(name))) {
+      return p;
+    }
+  }
+  // プリコンパイル済みヘッダがあれば、パーサーがその宣言を読み込む
+  char *pch = find_pch(name);
+  if (pch) {
+    new_token(TK_PCH, pch, 0);
+    return p;
+  }
+  String *file = arena_alloc(symbol_arena, sizeof(String));
+  file->text = name;
+  file->len = strlen(name);
+  file->next = filenames;
+  filenames = file;
+
+  LexFrame *frame = arena_alloc(symbol_arena, sizeof(LexFrame));
+  frame->input = user_input;
+  frame->pos = p;
+  frame->filename = filename;
+  frame->next = lex_stack;
+  lex_stack = frame;
+  filename = name;
+  user_input = read_file(filename);
+  return user_input;
+}
+
+// "#"の後が "include" ならその直後の位置を、そうでなければNULLを返す
+char *match_include(char *p) {
+  while (char_class[*p & 255] == CH_SPACE)
+    p++;
+  if (memcmp(p, "include", 7))
+    return NULL;
+  int cls = char_class[p[7] & 255];
+  if (cls == CH_ALPHA || cls == CH_DIGIT)
+    return NULL;
+  return p + 7;
+}
+
+// user_inputの先頭から字句解析を始め、最初のトークンを読む
+void start_lexer() {
+  lex_pos = user_input;
+  lex_stack = NULL;
+  lex_token();
+}
 
-    // ブロックコメントをスキップ
-    if (startswith(p, "/*")) {
-      q = strstr(p + 2, "*/");
-      if (!q)
-        error_at(p, "unclosed block comment [in tokenize]");
-      p = q + 2;
+// パーサーが次のトークンに進む。まだ字句解析していなければここで読む。
+void next_token() {
+  token++;
+  if (token == tokens->cnt)
+    lex_token();
+}
+
+// 読み終えたトークンを捨て、先読みしたトークンを1番から詰め直す。
+// トップレベルの宣言ごとに呼ぶので、トークン列は一番大きな宣言の分しか大きくならない。
+void recycle_tokens() {
+  int n = tokens->cnt - token;
+  for (int i = 0; i < n; i++) {
+    tokens->kind[1 + i] = tokens->kind[token + i];
+    tokens->len[1 + i] = tokens->len[token + i];
+    tokens->val[1 + i] = tokens->val[token + i];
+    tokens->str[1 + i] = tokens->str[token + i];
+    tokens->ident[1 + i] = tokens->ident[token + i];
+  }
+  tokens->cnt = 1 + n;
+  token = 1;
+  lex_tok = tokens->cnt - 1;
+  concat_tok = 0;
+}
+
+// lex_posから字句解析を進め、トークンを1つ追加する。
+// 文字列リテラルは後に続く文字列リテラルと連結するので、その次のトークンまで読む。
+// 入力の終わりに達したらTK_EOFを追加する。
+void lex_token() {
+  char *p = lex_pos;
+  char *q;
+  int cls;
+  int start = tokens->cnt;
+
+  while (tokens->cnt == start || tokens->kind[lex_tok] == TK_STRING) {
+    if (!*p) {
+      // 読み込んだファイルの終わりなら#includeの直後に戻る
+      if (lex_stack) {
+        user_input = lex_stack->input;
+        filename = lex_stack->filename;
+        p = lex_stack->pos;
+        lex_stack = lex_stack->next;
+        continue;
+      }
+      new_token(TK_EOF, NULL, 0);
+      break;
+    }
+    cls = char_class[*p & 255];
+
+    // Skip whitespace characters.
+    // 2文字以上続く空白はまとめて読み飛ばす
+    if (cls == CH_SPACE) {
+      p++;
+      if (char_class[*p & 255] == CH_SPACE)
+        p = skip_space(p);
       continue;
     }
 
-    // Multi-letter punctuator
-    if (startswith(p, "==") || startswith(p, "!=") || startswith(p, "<=") || startswith(p, ">=") ||
-        startswith(p, "&&") || startswith(p, "||") || startswith(p, "++") || startswith(p, "--") ||
-        startswith(p, "+=") || startswith(p, "-=") || startswith(p, "*=") || startswith(p, "/=") ||
-        startswith(p, "%=") || startswith(p, "->") || startswith(p, "<<") || startswith(p, ">>")) {
-      new_token(TK_RESERVED, p, 2);
-      p += 2;
+    // 識別子を読んでからキーワードかどうかを調べる
+    if (cls == CH_ALPHA) {
+      int i = 1;
+      cls = char_class[p[i] & 255];
+      while (cls == CH_ALPHA || cls == CH_DIGIT) {
+        i++;
+        cls = char_class[p[i] & 255];
+      }
+      int kw = lookup_keyword(p, i);
+      if (kw < 0) {
+        new_token(TK_IDENT, p, i);
+        tokens->ident[lex_tok] = intern(p, i);
+      } else if (keyword_kind[kw] == TK_INCLUDE) {
+        error_at(p, "expected \"#\" before \"include\"");
+      } else {
+        new_token(keyword_kind[kw], p, i);
+        tokens->val[lex_tok] = keyword_type[kw];
+      }
+      p += i;
       continue;
     }
 
-    // Single-letter punctuator
-    if (strchr("+-*/()<>={}[];&|^~,%!.:#", *p)) {
-      token_cpy = token;
-      new_token(TK_RESERVED, p++, 1);
+    if (cls == CH_PUNCT) {
+      if (*p == '/') {
+        // 行コメントをスキップ
+        if (p[1] == '/') {
+          p = skip_line(p + 2);
+          continue;
+        }
+
+        // ブロックコメントをスキップ
+        if (p[1] == '*') {
+          q = find_comment_end(p + 2);
+          if (!q)
+            error_at(p, "unclosed block comment [in tokenize]");
+          p = q + 2;
+          continue;
+        }
+      }
+
+      if (*p == '#') {
+        q = match_include(p + 1);
+        if (q) {
+          p = include_file(q);
+          continue;
+        }
+      }
+
+      // 記号はDFAで最長一致させる
+      int state = punct_dfa[punct_class[*p & 255]];
+      int len = 1;
+      for (;;) {
+        int next = punct_dfa[state * 32 + punct_class[p[len] & 255]];
+        if (!next)
+          break;
+        state = next;
+        len++;
+      }
+      new_token(TK_RESERVED, p, len);
+      p += len;
       continue;
     }
 
     // char
-    if (*p == '\'') {
+    if (cls == CH_QUOTE) {
       q = p;
       int len;
       char val;
@@ -119,26 +465,25 @@ void tokenize() {
       p++;
 
       new_token(TK_NUM, q, len);
-      token->val = val;
+      tokens->val[lex_tok] = val;
       continue;
     }
 
-    if (*p == '"') {
+    if (cls == CH_DQUOTE) {
       p++;
       q = p;
-      while (*p != '"') {
+      for (;;) {
+        p = scan_string(p);
+        if (*p == '"')
+          break;
         if (*p == '\0') {
           error_at(q - 1, "unclosed string literal [in tokenize]");
         }
-        if (*p == '\\') {
-          p += 2;
-        } else {
-          p++;
-        }
+        // エスケープされた文字は読み飛ばす
+        p += 2;
       }
-      if (token->kind == TK_STRING) {
-        memcpy(token->str + token->len, q, p - q);
-        token->len += p - q;
+      if (tokens->kind[lex_tok] == TK_STRING) {
+        concat_string(q, p - q);
       } else {
         new_token(TK_STRING, q, p - q);
       }
@@ -147,189 +492,29 @@ void tokenize() {
     }
 
     // Integer literal
-    if (startswith(p, "0b")) {
-      new_token(TK_NUM, p, 0);
-      p += 2;
-      q = p;
-      token->val = strtol(p, &p, 2);
-      token->len = p - q + 2;
-      continue;
-    } else if (startswith(p, "0x")) {
-      p += 2;
-      q = p;
-      new_token(TK_NUM, p, 0);
-      token->val = strtol(p, &p, 16);
-      token->len = p - q + 2;
-      continue;
-    } else if (isdigit(*p)) {
-      new_token(TK_NUM, p, 0);
-      q = p;
-      token->val = strtol(p, &p, 10);
-      token->len = p - q;
-      continue;
-    }
-
-    if (startswith(p, "include") && !is_alnum(p[7])) {
-      if (!(token->kind == TK_RESERVED && !memcmp(token->str, "#", token->len))) {
-        error_at(token->str, "expected \"#\" before \"include\"");
-      }
-      token = token_cpy;
-      p += 7;
-      while (isspace(*p)) {
-        p++;
-      }
-      if (*p != '"') {
-        error_at(p, "expected \" before \"include\"");
-      }
-      p++;
-      q = p;
-      while (*p != '"') {
-        if (*p == '\0') {
-          error_at(q - 1, "unclosed string literal [in tokenize]");
-        }
-        if (*p == '\\') {
-          p += 2;
-        } else {
-          p++;
-        }
-      }
-      char *name = malloc(sizeof(char) * (p - q + 1));
-      memcpy(name, q, p - q);
-      name[p - q] = '\0';
-      p++;
-      int flag = 1;
-      for (String *s = filenames; s; s = s->next) {
-        if (!memcmp(s->text, name, strlen(name))) {
-          flag = 0;
-          break;
-        }
-      }
-      if (flag == 0) {
-        free(name);
-        continue;
-      }
-      filename = name;
-      filenames = malloc(sizeof(String));
-      filenames->text = filename;
-      filenames->len = strlen(filename);
-      filenames->next = NULL;
-      char *user_input_cpy = user_input;
-      user_input = read_file(filename);
-      tokenize();
-      user_input = user_input_cpy;
-      continue;
-    }
-
-    if (startswith(p, "do") && !is_alnum(p[2])) {
-      new_token(TK_DO, p, 2);
-      p += 2;
-      continue;
-    }
-
-    if (startswith(p, "if") && !is_alnum(p[2])) {
-      new_token(TK_IF, p, 2);
-      p += 2;
-      continue;
-    }
-
-    if (startswith(p, "sizeof") && !is_alnum(p[6])) {
-      new_token(TK_SIZEOF, p, 6);
-      p += 6;
-      continue;
-    }
-
-    if (startswith(p, "else") && !is_alnum(p[4])) {
-      new_token(TK_ELSE, p, 4);
-      p += 4;
-      continue;
-    }
-
-    if (startswith(p, "return") && !is_alnum(p[6])) {
-      new_token(TK_RETURN, p, 6);
-      p += 6;
-      continue;
-    }
-
-    if (startswith(p, "extern") && !is_alnum(p[6])) {
-      new_token(TK_EXTERN, p, 6);
-      p += 6;
-      continue;
-    }
-
-    if (startswith(p, "enum") && !is_alnum(p[4])) {
-      new_token(TK_ENUM, p, 4);
-      p += 4;
-      continue;
-    }
-
-    if (startswith(p, "struct") && !is_alnum(p[6])) {
-      new_token(TK_STRUCT, p, 6);
-      p += 6;
-      continue;
-    }
-
-    if (startswith(p, "typedef") && !is_alnum(p[7])) {
-      new_token(TK_TYPEDEF, p, 7);
-      p += 7;
-      continue;
-    }
-
-    if (startswith(p, "while") && !is_alnum(p[5])) {
-      new_token(TK_WHILE, p, 5);
-      p += 5;
-      continue;
-    }
-
-    if (startswith(p, "for") && !is_alnum(p[3])) {
-      new_token(TK_FOR, p, 3);
-      p += 3;
-      continue;
-    }
-
-    if (startswith(p, "int") && !is_alnum(p[3])) {
-      new_token(TK_TYPE, p, 3);
-      token->ty = TY_INT;
-      p += 3;
-      continue;
-    }
-
-    if (startswith(p, "char") && !is_alnum(p[4])) {
-      new_token(TK_TYPE, p, 4);
-      token->ty = TY_CHAR;
-      p += 4;
-      continue;
-    }
-
-    if (startswith(p, "void") && !is_alnum(p[4])) {
-      new_token(TK_TYPE, p, 4);
-      token->ty = TY_VOID;
-      p += 4;
-      continue;
-    }
-
-    if (startswith(p, "break") && !is_alnum(p[5])) {
-      new_token(TK_BREAK, p, 5);
-      p += 5;
-      continue;
-    }
-
-    if (startswith(p, "continue") && !is_alnum(p[8])) {
-      new_token(TK_CONTINUE, p, 8);
-      p += 8;
-      continue;
-    }
-
-    if (('a' <= *p && *p <= 'z') || ('A' <= *p && *p <= 'Z') || *p == '_') {
-      int i = 0;
-      while (('a' <= *(p + i) && *(p + i) <= 'z') || ('A' <= *(p + i) && *(p + i) <= 'Z') ||
-             ('0' <= *(p + i) && *(p + i) <= '9') || *(p + i) == '_') {
-        i++;
+    if (cls == CH_DIGIT) {
+      if (p[0] == '0' && p[1] == 'b') {
+        new_token(TK_NUM, p, 0);
+        p += 2;
+        q = p;
+        tokens->val[lex_tok] = strtol(p, &p, 2);
+        tokens->len[lex_tok] = p - q + 2;
+      } else if (p[0] == '0' && p[1] == 'x') {
+        p += 2;
+        q = p;
+        new_token(TK_NUM, p, 0);
+        tokens->val[lex_tok] = strtol(p, &p, 16);
+        tokens->len[lex_tok] = p - q + 2;
+      } else {
+        new_token(TK_NUM, p, 0);
+        q = p;
+        tokens->val[lex_tok] = strtol(p, &p, 10);
+        tokens->len[lex_tok] = p - q;
       }
-      new_token(TK_IDENT, p, i);
-      p += i;
       continue;
     }
 
     error_at(p, "invalid token [in tokenize]");
   }
+  lex_pos = p;
 }
@@ -514,6 +514,58 @@ int test76() { return '\n' + 1; /* 10 + 1 = 11 */ }
 /* ビット演算とシフトの優先順位確認 */
 int test77() { return 1 << 3 & 0b10110; }
 
+/* 内側のブロックで外側の変数を隠す */
+int test78() {
+  int a = 3;
+  int b = 0;
+  for (int i = 0; i < 2; i++) {
+    int a = 10;
+    b += a;
+  }
+  {
+    int a = 100;
+    b += a;
+  }
+  return a + b; /* 3 + 20 + 100 = 123 */
+}
+
+/* メンバのオフセットや添字の定数式の畳み込みと、実行されない分岐の除去 */
+int test79() {
+  STRUCT s[3];
+  int i = 1;
+  s[i - 1].b[1] = 4;
+  s[i + 1].a = 2 * 3 - 6;
+  s[0].b[i]++;
+  s[0].b[i * 1 + 0] += 10;
+  if (2 * 4 == 8) {
+    s[2].a += -(1 - 2);
+  } else {
+    s[2].a = 100;
+  }
+  while (1 < 0)
+    s[2].a = 200;
+  for (; 0;)
+    s[2].a = 300;
+  return s[0].b[1] + s[2].a * 10 + (0 && i) + (1 || i); /* 15 + 10 + 0 + 1 = 26 */
+}
+
+/* 定数による割り算と余り (2の累乗, それ以外, 負の数) と定数の掛け算 */
+int test80() {
+  int n = -47;
+  int m = 1000003;
+  int a = n / 7 + n % 7 + n / 8 + n % 8 + n / -3 + n % -3; /* -6 - 5 - 5 - 7 + 15 - 2 = -10 */
+  int b = m / 10000 + m % 10000 + m / 2 % 2;                /* 100 + 3 + 1 = 104 */
+  int c = n * 12 + n * 9 + n * 8;                           /* -1363 */
+  return a + b + c; /* -1269 */
+}
+
+/* ポインタの差は64bitのバイト数を要素の大きさで割る */
+int test81() {
+  STRUCT *p = calloc(1, 16);
+  int n = 200000000;
+  return (p + n) - p + (p + 3) - (p + 1); /* 200000000 + 2 */
+}
+
 void check(int result, int id, int ans) {
   if (result != ans) {
     printf("test%d failed (expected: %d / result: %d)\n", id, ans, result);
@@ -600,6 +652,10 @@ int main() {
   check(test75(), 75, 16);
   check(test76(), 76, 11);
   check(test77(), 77, 0);
+  check(test78(), 78, 123);
+  check(test79(), 79, 26);
+  check(test80(), 80, -1269);
+  check(test81(), 81, 200000002);
 
   if (failures == 0) {
     printf("\033[1;32mAll tests passed!\033[0m\n");
@@ -0,0 +1,269 @@
+
+// バイトコードのインタプリタ。
+// 命令ごとに処理の番地を並べた列に変換してから、各命令の末尾で次の命令へ直接飛ぶ (direct threading)。
+// 計算型gotoと関数ポインタを使うので、extention.cと同じくホストのコンパイラでビルドする。
+// lacc側とはOpCode (opcode.h) と、int, ポインタの配列だけを共有する。
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "opcode.h"
+
+void error(char *fmt, ...);
+
+// 各命令のオペランドの数
+static const int operand_cnt[OP_COUNT] = {
+    [OP_PUSH] = 1, [OP_LADDR] = 1, [OP_GADDR] = 1, [OP_COPY] = 1, [OP_JMP] = 1,  [OP_JZ] = 1,
+    [OP_JNZ] = 1,  [OP_CALL] = 2,  [OP_CALLX] = 2, [OP_ENTER] = 1, [OP_ARG] = 1,
+};
+
+enum {
+  VALUE_STACK_SIZE = 1 << 20,     // 値のスタックの要素数
+  FRAME_STACK_SIZE = 1 << 18,     // 呼び出しの深さ
+  LOCAL_STACK_SIZE = 64 << 20,    // ローカル変数の領域のバイト数
+};
+
+typedef struct {
+  intptr_t *ret; // 戻り先
+  char *fp;      // 呼び出し元のフレームポインタ
+  int64_t *sp;   // 呼び出し元の値のスタック
+} Frame;
+
+typedef int64_t (*ExternFn)(int64_t, ...);
+
+// 番地0から実行を始め、OP_HALTに達したときの戻り値を返す。
+// 番地0のOP_CALLに渡す引数としてargc, argvを積んでおく。
+int vm_run(int *code, int len, char **globals, char **externs, int argc, char **argv) {
+  static void *const labels[OP_COUNT] = {
+      [OP_HALT] = &&op_halt,     [OP_PUSH] = &&op_push,       [OP_POP] = &&op_pop,       [OP_DUP] = &&op_dup,
+      [OP_SWAP] = &&op_swap,     [OP_LADDR] = &&op_laddr,     [OP_GADDR] = &&op_gaddr,   [OP_LOAD1] = &&op_load1,
+      [OP_LOAD4] = &&op_load4,   [OP_LOAD8] = &&op_load8,     [OP_STORE1] = &&op_store1, [OP_STORE4] = &&op_store4,
+      [OP_STORE8] = &&op_store8, [OP_COPY] = &&op_copy,       [OP_ZEXT1] = &&op_zext1,   [OP_ZEXT4] = &&op_zext4,
+      [OP_NOT] = &&op_not,       [OP_BITNOT] = &&op_bitnot,   [OP_ADD] = &&op_add,       [OP_SUB] = &&op_sub,
+      [OP_MUL] = &&op_mul,       [OP_DIV] = &&op_div,         [OP_MOD] = &&op_mod,       [OP_EQ] = &&op_eq,
+      [OP_NE] = &&op_ne,         [OP_LT] = &&op_lt,           [OP_LE] = &&op_le,         [OP_AND] = &&op_and,
+      [OP_OR] = &&op_or,         [OP_XOR] = &&op_xor,         [OP_SHL] = &&op_shl,       [OP_SAR] = &&op_sar,
+      [OP_JMP] = &&op_jmp,       [OP_JZ] = &&op_jz,           [OP_JNZ] = &&op_jnz,       [OP_CALL] = &&op_call,
+      [OP_CALLX] = &&op_callx,   [OP_ENTER] = &&op_enter,     [OP_ARG] = &&op_arg,       [OP_RET] = &&op_ret,
+      [OP_RETV] = &&op_retv,     [OP_PUSHRET] = &&op_pushret,
+  };
+
+  // 命令を処理の番地に, 飛び先の番地を変換後の位置に置き換える
+  intptr_t *tc = malloc(sizeof(intptr_t) * (len + 1));
+  for (int i = 0; i < len;) {
+    int op = code[i];
+    if (op < 0 || op >= OP_COUNT)
+      error("invalid bytecode %d at %d", op, i);
+    tc[i] = (intptr_t)labels[op];
+    for (int j = 1; j <= operand_cnt[op]; j++)
+      tc[i + j] = code[i + j];
+    if (op == OP_JMP || op == OP_JZ || op == OP_JNZ || op == OP_CALL)
+      tc[i + 1] = (intptr_t)(tc + code[i + 1]);
+    i += 1 + operand_cnt[op];
+  }
+
+  int64_t *stack = malloc(sizeof(int64_t) * VALUE_STACK_SIZE);
+  int64_t *stack_end = stack + VALUE_STACK_SIZE - 64;
+  Frame *frames = malloc(sizeof(Frame) * FRAME_STACK_SIZE);
+  Frame *frame_end = frames + FRAME_STACK_SIZE;
+  char *locals = malloc(LOCAL_STACK_SIZE);
+  if (!tc || !stack || !frames || !locals)
+    error("out of memory [in vm_run]");
+
+  int64_t *sp = stack;   // 先頭の値 (stack[0]は使わない)
+  Frame *frame = frames; // 次に積む呼び出し情報
+  char *fp = locals + LOCAL_STACK_SIZE;
+  char *lsp = fp;        // ローカル変数の領域の先頭
+  int64_t args[6];
+  int64_t rax = 0;
+  intptr_t *pc = tc;
+
+  *++sp = argc;
+  *++sp = (int64_t)(intptr_t)argv;
+
+#define NEXT() goto *(void *)*pc++
+#define BINARY(expr)                                                                                                   \
+  do {                                                                                                                 \
+    int64_t b = *sp--;                                                                                                 \
+    int64_t a = *sp;                                                                                                   \
+    *sp = (expr);                                                                                                      \
+    NEXT();                                                                                                            \
+  } while (0)
+
+  NEXT();
+
+op_halt:
+  free(tc);
+  free(stack);
+  free(frames);
+  free(locals);
+  return (int)rax;
+op_push:
+  *++sp = *pc++;
+  NEXT();
+op_pop:
+  sp--;
+  NEXT();
+op_dup:
+  sp[1] = sp[0];
+  sp++;
+  NEXT();
+op_swap: {
+  int64_t t = sp[0];
+  sp[0] = sp[-1];
+  sp[-1] = t;
+  NEXT();
+}
+op_laddr:
+  *++sp = (int64_t)(intptr_t)(fp - *pc++);
+  NEXT();
+op_gaddr:
+  *++sp = (int64_t)(intptr_t)globals[*pc++];
+  NEXT();
+op_load1:
+  *sp = *(uint8_t *)(intptr_t)*sp;
+  NEXT();
+op_load4: {
+  int32_t v;
+  memcpy(&v, (void *)(intptr_t)*sp, 4);
+  *sp = v;
+  NEXT();
+}
+op_load8: {
+  int64_t v;
+  memcpy(&v, (void *)(intptr_t)*sp, 8);
+  *sp = v;
+  NEXT();
+}
+op_store1: {
+  int64_t v = *sp--;
+  *(uint8_t *)(intptr_t)*sp = (uint8_t)v;
+  *sp = v;
+  NEXT();
+}
+op_store4: {
+  int64_t v = *sp--;
+  int32_t w = (int32_t)v;
+  memcpy((void *)(intptr_t)*sp, &w, 4);
+  *sp = v;
+  NEXT();
+}
+op_store8: {
+  int64_t v = *sp--;
+  memcpy((void *)(intptr_t)*sp, &v, 8);
+  *sp = v;
+  NEXT();
+}
+op_copy: {
+  int64_t src = *sp--;
+  memcpy((void *)(intptr_t)*sp, (void *)(intptr_t)src, *pc++);
+  *sp = src;
+  NEXT();
+}
+op_zext1:
+  *sp = (uint8_t)*sp;
+  NEXT();
+op_zext4:
+  *sp = (uint32_t)*sp;
+  NEXT();
+op_not:
+  *sp = *sp == 0;
+  NEXT();
+op_bitnot:
+  *sp = ~*sp;
+  NEXT();
+op_add:
+  BINARY((int64_t)((uint64_t)a + (uint64_t)b));
+op_sub:
+  BINARY((int64_t)((uint64_t)a - (uint64_t)b));
+op_mul:
+  BINARY((int64_t)((uint64_t)a * (uint64_t)b));
+op_div:
+  BINARY(a / b);
+op_mod:
+  BINARY(a % b);
+op_eq:
+  BINARY(a == b);
+op_ne:
+  BINARY(a != b);
+op_lt:
+  BINARY(a < b);
+op_le:
+  BINARY(a <= b);
+op_and:
+  BINARY(a & b);
+op_or:
+  BINARY(a | b);
+op_xor:
+  BINARY(a ^ b);
+op_shl:
+  BINARY((int64_t)((uint64_t)a << (b & 63)));
+op_sar:
+  BINARY(a >> (b & 63));
+op_jmp:
+  pc = (intptr_t *)*pc;
+  NEXT();
+op_jz:
+  if (*sp-- == 0) {
+    pc = (intptr_t *)*pc;
+  } else {
+    pc++;
+  }
+  NEXT();
+op_jnz:
+  if (*sp-- != 0) {
+    pc = (intptr_t *)*pc;
+  } else {
+    pc++;
+  }
+  NEXT();
+op_call: {
+  intptr_t *target = (intptr_t *)pc[0];
+  int n = pc[1];
+  for (int i = n - 1; i >= 0; i--)
+    args[i] = *sp--;
+  if (frame == frame_end || sp >= stack_end)
+    error("stack overflow [in vm_run]");
+  frame->ret = pc + 2;
+  frame->fp = fp;
+  frame->sp = sp;
+  frame++;
+  fp = lsp;
+  pc = target;
+  NEXT();
+}
+op_callx: {
+  ExternFn fn = (ExternFn)externs[pc[0]];
+  int n = pc[1];
+  int64_t a[6] = {0, 0, 0, 0, 0, 0};
+  for (int i = n - 1; i >= 0; i--)
+    a[i] = *sp--;
+  rax = fn(a[0], a[1], a[2], a[3], a[4], a[5]);
+  pc += 2;
+  NEXT();
+}
+op_enter:
+  lsp = fp - *pc++;
+  if (lsp < locals)
+    error("stack overflow [in vm_run]");
+  NEXT();
+op_arg:
+  *++sp = args[*pc++];
+  NEXT();
+op_ret:
+  rax = *sp--;
+  goto leave;
+op_retv:
+  rax = 0;
+leave:
+  frame--;
+  lsp = fp;
+  fp = frame->fp;
+  sp = frame->sp;
+  pc = frame->ret;
+  NEXT();
+op_pushret:
+  *++sp = rax;
+  NEXT();
+}